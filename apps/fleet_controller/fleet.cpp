@@ -0,0 +1,225 @@
+/*
+ * The common t0 leaves every gateway the setup margin it reported on its
+ * status topic (or the slack for gateways that haven't reported one). If a
+ * gateway still rejects it, the request is withdrawn everywhere and sent
+ * again for the latest of the earliest start times the rejections named.
+ * Acks are collected until a deadline after the capture's end.
+ */
+
+#include <iostream>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <boost/format.hpp>
+#include "fleet.hpp"
+#include "request_parser.hpp"
+#include "topics.hpp"
+
+const int QOS = 1;
+
+// setup margin a gateway reported: the larger of its same-frequency and
+// retune quantiles, plus its clock offset quantile
+static double setup_margin(const Ack& ack)
+{
+    return std::max(ack.values[0], ack.values[2]) + ack.values[4];
+}
+
+static bool final_code(AckCode code, bool& ok)
+{
+    switch(code)
+    {
+        case AckCode::SAVED:
+        case AckCode::SWEEP_SAVED:
+            ok = true;
+            return true;
+        case AckCode::FAILED:
+        case AckCode::LATE:
+        case AckCode::ABORTED:
+        case AckCode::SWEEP_FAILED:
+        case AckCode::SWEEP_ABORTED:
+        case AckCode::PREEMPTED:
+            ok = false;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static std::string outcome_str(AckCode code)
+{
+    switch(code)
+    {
+        case AckCode::SAVED:         return "saved";
+        case AckCode::SWEEP_SAVED:   return "saved";
+        case AckCode::FAILED:        return "failed";
+        case AckCode::LATE:          return "late";
+        case AckCode::ABORTED:       return "aborted";
+        case AckCode::SWEEP_FAILED:  return "failed";
+        case AckCode::SWEEP_ABORTED: return "aborted";
+        case AckCode::PREEMPTED:     return "preempted";
+        default:                     return "?";
+    }
+}
+
+/*
+ * take acks until deadline (UTC seconds) or until done() holds. Setup
+ * reports update margins, acks for request id from the fleet update
+ * results. tsend is when the request was sent, tend when the capture ends
+ */
+template <typename Done>
+static void collect(ProtectedQ<RxAck>& acks, double deadline, const std::string& id,
+                    double tsend, double tend,
+                    std::map<std::string, double>& margins,
+                    std::map<std::string, GatewayResult>& results,
+                    Done done)
+{
+    RxAck rx;
+    while(done() == false)
+    {
+        const double left = deadline - systime_now_double();
+        if(left <= 0 || acks.popItemFor(rx, std::chrono::duration<double>(left)) == false)
+            break;
+        const Ack& ack = rx.ack;
+        if(ack.code == AckCode::SETUP && ack.values.size() >= 6 && margins.count(ack.client_id))
+        {
+            margins[ack.client_id] = setup_margin(ack);
+            continue;
+        }
+        auto it = results.find(ack.client_id);
+        if(it == results.end() || ack.name != id)
+            continue;
+        GatewayResult& r = it->second;
+        bool ok;
+        if(ack.code == AckCode::ACCEPTED || ack.code == AckCode::REJECTED)
+        {
+            r.answered = true;
+            r.accepted = (ack.code == AckCode::ACCEPTED);
+            r.reason = ack.reason;
+            r.earliest = ack.earliest;
+            r.accept_lat = rx.trecv - tsend;
+        }
+        else if(final_code(ack.code, ok))
+        {
+            r.done = true;
+            r.ok = ok;
+            r.outcome = outcome_str(ack.code);
+            r.done_lat = rx.trecv - tend;
+            r.file = ack.files.empty() ? "" : ack.files[0];
+        }
+    }
+}
+
+bool run_fleet(Transport *client, ProtectedQ<RxAck> *acks, const FleetParams& params, FleetOutcome& outcome)
+{
+    const std::vector<std::string>& gateways = params.gateways;
+    client->subscribe((params.addressed ? any_gateway_topic(params.resptopic) : params.resptopic) + BINARY_TOPIC_SUFFIX, QOS);
+    client->subscribe((params.addressed ? any_gateway_topic(params.stattopic) : params.stattopic) + BINARY_TOPIC_SUFFIX, QOS);
+
+    std::map<std::string, double> margins;
+    for(const auto& gw : gateways)
+        margins[gw] = params.slack;
+
+    // where a command for the fleet goes
+    std::vector<std::string> cmd_topics = {params.cmdtopic};
+    if(params.addressed && params.group.empty() == false)
+        cmd_topics = {group_topic(params.cmdtopic, params.group)};
+    else if(params.addressed)
+    {
+        cmd_topics.clear();
+        for(const auto& gw : gateways)
+            cmd_topics.push_back(gateway_topic(params.cmdtopic, gw));
+    }
+    // a command that can't be sent shows as gateways that don't answer
+    auto send = [&](const std::string& msg) {
+        for(const auto& top : cmd_topics)
+        {
+            try
+            {
+                client->publish(top, msg, QOS, false)->waitFor(std::chrono::seconds(1));
+            }
+            catch(const TransportError& e)
+            {
+                std::cerr << boost::format("[MQTTerror] sending to %s: %s") % top % e.what() << std::endl;
+            }
+        }
+    };
+
+    std::map<std::string, GatewayResult>& results = outcome.results;
+    results.clear();
+    auto never = []() { return false; };
+    if(params.listen > 0)
+        collect(*acks, systime_now_double() + params.listen, "", 0, 0, margins, results, never);
+
+    // earliest common start that leaves every gateway its margin, on a ms
+    double max_margin = 0;
+    for(const auto& m : margins)
+        max_margin = std::max(max_margin, m.second);
+    double t0 = std::ceil((systime_now_double() + params.lead + max_margin) * 1e3) / 1e3;
+
+    std::string id;
+    double tsend = 0, tend = 0;
+    for(unsigned attempt = 1; attempt <= params.attempts; attempt++)
+    {
+        id = (boost::format("%s-%u") % params.name % attempt).str();
+        const std::string msg = (boost::format("id=%s,t0=%.3lf,%s") % id % t0 % params.request).str();
+
+        // check it here rather than have every gateway reject it
+        ParsedRequest parsed;
+        ParseStatus status;
+        if(parse_request(msg, parsed, status) == false || parsed.kind != RequestKind::CAPTURE)
+        {
+            std::cerr << "invalid request '" << msg << "': "
+                      << (status.err != ParseError::NONE ? parse_error_str(status) : "not a capture or sweep") << std::endl;
+            return false;
+        }
+        tend = t0 + rx_request_duration(parsed.req);
+
+        results.clear();
+        for(const auto& gw : gateways)
+            results[gw] = GatewayResult();
+        std::cout << boost::format("[CTLdebug] %s: t0 %.3lf (%s) on %u gateways")
+                        % id % t0 % date_str(t0) % gateways.size() << std::endl;
+        tsend = systime_now_double();
+        send(msg);
+
+        collect(*acks, tsend + params.answer_timeout, id, tsend, tend, margins, results, [&]() {
+            for(const auto& r : results)
+                if(r.second.answered == false)
+                    return false;
+            return true;
+        });
+
+        // move to the latest start some gateway asked for, if all answered
+        // and every rejection named one
+        bool all_accepted = true, can_move = true;
+        double tnext = t0;
+        for(const auto& r : results)
+        {
+            all_accepted = all_accepted && r.second.accepted;
+            if(r.second.answered == false || (r.second.accepted == false && r.second.earliest <= 0))
+                can_move = false;
+            if(r.second.accepted == false)
+                tnext = std::max(tnext, r.second.earliest);
+        }
+        if(all_accepted || can_move == false || attempt == params.attempts)
+            break;
+
+        send("cancel=" + id);
+        t0 = std::ceil(tnext * 1e3) / 1e3;
+    }
+
+    // wait for the outcome of every capture that was accepted
+    collect(*acks, tend + params.deadline, id, tsend, tend, margins, results, [&]() {
+        for(const auto& r : results)
+            if(r.second.accepted && r.second.done == false)
+                return false;
+        return true;
+    });
+
+    outcome.id = id;
+    outcome.t0 = t0;
+    outcome.nok = 0;
+    for(const auto& r : results)
+        outcome.nok += (r.second.done && r.second.ok) ? 1 : 0;
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * Scheduling of one capture at a common t0 on a set of gateways, the part
+ * of the fleet controller that talks to them. It only needs a connected
+ * Transport, so it runs against a broker as well as a LoopbackBroker with
+ * gateways in the same process.
+ */
+
+#ifndef FLEET_HPP
+#define FLEET_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include "protected_queue.hpp"
+#include "transport.hpp"
+#include "ack_listener.hpp"
+
+// what became of the request on one gateway
+struct GatewayResult
+{
+    bool answered;
+    bool accepted;
+    std::string reason;     // of a rejection
+    double earliest;        // earliest start a rejection named, 0 if none
+    double accept_lat;      // seconds from sending the request to the accept/reject
+    bool done;
+    bool ok;
+    std::string outcome;    // final ack, e.g. saved or late
+    double done_lat;        // seconds from the end of the capture to the final ack
+    std::string file;
+};
+
+struct FleetParams
+{
+    std::vector<std::string> gateways;
+    std::string cmdtopic;       // the gateways' --subtop
+    std::string resptopic;      // their --pubtop
+    std::string stattopic;      // their --stattop
+    bool addressed;             // their --topics is addressed
+    std::string group;          // with addressed topics, send to this group instead of each gateway
+    std::string request;        // capture or sweep fields without id and t0
+    std::string name;           // request id prefix
+    double lead;                // s allowed for the request to reach the gateways
+    double listen;              // s to listen for setup reports before scheduling
+    double slack;               // setup margin of gateways that haven't reported one
+    unsigned attempts;          // times the request is sent before giving up on a common t0
+    double answer_timeout;      // s to wait for the gateways to accept or reject
+    double deadline;            // s after the capture's end to wait for the final acks
+};
+
+// the last attempt, and how each gateway did
+struct FleetOutcome
+{
+    std::string id;
+    double t0;
+    std::map<std::string, GatewayResult> results;
+    unsigned nok;           // gateways that saved their capture
+};
+
+/*
+ * subscribe client to the gateways' binary responses and status, whose
+ * acks the client's AckListener queues on acks, and run the request on the
+ * fleet. False if the request is not a valid capture or sweep
+ */
+bool run_fleet(Transport *client, ProtectedQ<RxAck> *acks, const FleetParams& params, FleetOutcome& outcome);
+
+#endif // FLEET_HPP
@@ -0,0 +1,106 @@
+/*
+ * Fleet controller. Schedules one capture on a named set of gateways
+ * running timed_rx_file_mqtt so that all of them start at the same t0,
+ * and reports how each of them did. How t0 is chosen is in fleet.cpp.
+ *
+ * Acks and status updates are read in the binary encoding, so the gateways
+ * have to run with --ackfmt binary or both. With --topics addressed the
+ * request goes to each gateway's own topic, or once to --group, and acks
+ * are taken from the per-gateway topics with a wildcard subscription.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+#include "fleet.hpp"
+
+namespace po = boost::program_options;
+
+int main(int argc, char* argv[])
+{
+    std::string mqtt_serv, client_id, gateway_list, topic_mode;
+    FleetParams params;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("mqttserv", po::value<std::string>(&mqtt_serv)->default_value("tcp://localhost:1883"), "mqtt server to connect")
+        ("id", po::value<std::string>(&client_id)->default_value("fleetctl"), "own ID used on MQTT")
+        ("gateways", po::value<std::string>(&gateway_list), "comma separated IDs of the gateways to capture with")
+        ("cmdtop", po::value<std::string>(&params.cmdtopic)->default_value("command"), "topic the gateways listen for requests on (their --subtop)")
+        ("resptop", po::value<std::string>(&params.resptopic)->default_value("response"), "topic the gateways respond on (their --pubtop)")
+        ("stattop", po::value<std::string>(&params.stattopic)->default_value("status"), "topic the gateways send status updates to (their --stattop)")
+        ("topics", po::value<std::string>(&topic_mode)->default_value("shared"), "topic layout of the gateways (their --topics): shared or addressed")
+        ("group", po::value<std::string>(&params.group)->default_value(""), "with addressed topics, send to this group of the gateways instead of each of them")
+        ("request", po::value<std::string>(&params.request), "capture or sweep fields without id and t0, e.g. fc=915e6,sps=1e6,n=1000000")
+        ("name", po::value<std::string>(&params.name)->default_value(""), "request id prefix (default fleet<time>)")
+        ("lead", po::value<double>(&params.lead)->default_value(1.0), "seconds allowed for the request to reach the gateways")
+        ("listen", po::value<double>(&params.listen)->default_value(0.0), "seconds to listen for setup reports before scheduling")
+        ("slack", po::value<double>(&params.slack)->default_value(0.6), "setup margin assumed for gateways that haven't reported one")
+        ("attempts", po::value<unsigned>(&params.attempts)->default_value(3), "times the request is sent before giving up on a common t0")
+        ("timeout", po::value<double>(&params.answer_timeout)->default_value(2.0), "seconds to wait for the gateways to accept or reject")
+        ("deadline", po::value<double>(&params.deadline)->default_value(5.0), "seconds after the capture's end to wait for the final acks")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help") || vm.count("gateways") == 0 || vm.count("request") == 0) {
+        std::cout << boost::format("fleet controller for timed_rx_file_mqtt gateways %s") % desc << std::endl;
+        return ~0;
+    }
+    po::notify(vm);
+    params.addressed = (topic_mode == "addressed");
+    if((params.addressed == false && topic_mode != "shared") || (params.group.empty() == false && params.addressed == false))
+    {
+        std::cerr << "topics has to be shared or addressed, and group needs addressed topics" << std::endl;
+        return ~0;
+    }
+
+    boost::split(params.gateways, gateway_list, boost::is_any_of(","), boost::token_compress_on);
+    params.gateways.erase(std::remove(params.gateways.begin(), params.gateways.end(), ""), params.gateways.end());
+    if(params.name.empty())
+        params.name = (boost::format("fleet%.0lf") % std::floor(systime_now_double())).str();
+
+    ProtectedQ<RxAck> acks;
+    AckListener listener(&acks);
+    std::unique_ptr<Transport> client;
+    try
+    {
+        client = connect_ack_client(mqtt_serv, client_id, &listener, std::chrono::seconds(10));
+    }
+    catch(const TransportError& e)
+    {
+        std::cerr << "[MQTTerror] Unable to connect to MQTT server: '" << mqtt_serv << "' " << e.what() << std::endl;
+        return ~0;
+    }
+
+    FleetOutcome fleet;
+    if(run_fleet(client.get(), &acks, params, fleet) == false)
+    {
+        client->disconnect();
+        return ~0;
+    }
+
+    std::cout << boost::format("%-20s %-22s %10s %-10s %10s  %s")
+                    % "gateway" % "admission" % "ack ms" % "outcome" % "done ms" % "file" << std::endl;
+    for(const auto& gw : params.gateways)
+    {
+        const GatewayResult& r = fleet.results[gw];
+        std::string adm = r.answered ? (r.accepted ? "accepted" : "rejected " + r.reason) : "no answer";
+        std::string lat = r.answered ? (boost::format("%.1lf") % (r.accept_lat * 1e3)).str() : "-";
+        std::string outcome = r.done ? r.outcome : (r.accepted ? "no answer" : "-");
+        std::string done = r.done ? (boost::format("%.1lf") % (r.done_lat * 1e3)).str() : "-";
+        std::cout << boost::format("%-20s %-22s %10s %-10s %10s  %s") % gw % adm % lat % outcome % done % r.file << std::endl;
+    }
+    std::cout << boost::format("%s: %u/%u gateways captured at %.3lf")
+                    % fleet.id % fleet.nok % params.gateways.size() % fleet.t0 << std::endl;
+
+    client->disconnect();
+    return (fleet.nok == params.gateways.size()) ? 0 : 1;
+}
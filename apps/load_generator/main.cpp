@@ -0,0 +1,304 @@
+/*
+ * Trigger load generator for a timed_rx_file_mqtt gateway. Sends a stream
+ * of capture requests at a target rate, with fixed or exponentially
+ * distributed (Poisson) spacing, matches the gateway's acks to them and
+ * reports how the gateway kept up: trigger-to-ack latency percentiles,
+ * rejections by reason, dropped and late requests.
+ *
+ * Running it at increasing --rate shows where the gateway saturates.
+ * Acks are read in the binary encoding, so the gateway has to run with
+ * --ackfmt binary or both. With --topics addressed requests go to the
+ * gateway's own topic and only its acks are subscribed to.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+#include "protected_queue.hpp"
+#include "request_parser.hpp"
+#include "ack_listener.hpp"
+#include "topics.hpp"
+
+namespace po = boost::program_options;
+
+const int QOS = 1;
+
+// one request that was sent
+struct Sent
+{
+    double tsend;
+    double tend;            // when the capture ends
+    bool answered;
+    bool done;
+};
+
+struct LoadStats
+{
+    unsigned long sent;
+    unsigned long send_errors;
+    unsigned long accepted;
+    std::map<std::string, unsigned long> rejected;  // by reason
+    unsigned long dropped;      // request queue overflow, not attributable
+    unsigned long invalid;
+    unsigned long saved;
+    unsigned long late;
+    unsigned long failed;       // failed, aborted or preempted
+    std::vector<double> ack_lat;    // send to accept/reject
+    std::vector<double> done_lat;   // capture end to final ack
+};
+
+static void percentiles(const std::string& what, std::vector<double>& v)
+{
+    if(v.empty())
+    {
+        std::cout << boost::format("%-12s none") % what << std::endl;
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    auto pct = [&](double p) { return v[std::min(v.size() - 1, size_t(p * v.size()))] * 1e3; };
+    std::cout << boost::format("%-12s p50 %8.1lf  p90 %8.1lf  p99 %8.1lf  max %8.1lf ms (%lu)")
+                    % what % pct(0.5) % pct(0.9) % pct(0.99) % (v.back() * 1e3) % v.size() << std::endl;
+}
+
+static void count_ack(const RxAck& rx, const std::string& gateway, const std::string& prefix,
+                      std::map<std::string, Sent>& sent, LoadStats& st)
+{
+    const Ack& ack = rx.ack;
+    if(ack.client_id != gateway)
+        return;
+    if(ack.code == AckCode::DROPPED)
+    {
+        st.dropped++;
+        return;
+    }
+    if(ack.code == AckCode::INVALID)
+    {
+        st.invalid++;
+        return;
+    }
+    if(ack.name.compare(0, prefix.size(), prefix) != 0)
+        return;
+    auto it = sent.find(ack.name);
+    if(it == sent.end())
+        return;
+    Sent& s = it->second;
+    switch(ack.code)
+    {
+        case AckCode::ACCEPTED:
+        case AckCode::REJECTED:
+            if(s.answered)
+                return;
+            s.answered = true;
+            st.ack_lat.push_back(rx.trecv - s.tsend);
+            if(ack.code == AckCode::ACCEPTED)
+                st.accepted++;
+            else
+            {
+                st.rejected[ack.reason]++;
+                s.done = true;
+            }
+            break;
+        case AckCode::SAVED:
+        case AckCode::SWEEP_SAVED:
+            st.saved++;
+            st.done_lat.push_back(rx.trecv - s.tend);
+            s.done = true;
+            break;
+        case AckCode::LATE:
+            st.late++;
+            s.done = true;
+            break;
+        case AckCode::FAILED:
+        case AckCode::ABORTED:
+        case AckCode::SWEEP_FAILED:
+        case AckCode::SWEEP_ABORTED:
+        case AckCode::PREEMPTED:
+            st.failed++;
+            s.done = true;
+            break;
+        default:
+            break;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string mqtt_serv, client_id, gateway, top_cmd, top_resp, topic_mode, request, fclist, dist, prefix;
+    double rate, run_time, lead, tail;
+    bool binary;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("mqttserv", po::value<std::string>(&mqtt_serv)->default_value("tcp://localhost:1883"), "mqtt server to connect")
+        ("id", po::value<std::string>(&client_id)->default_value("loadgen"), "own ID used on MQTT")
+        ("gateway", po::value<std::string>(&gateway), "ID of the gateway under test")
+        ("cmdtop", po::value<std::string>(&top_cmd)->default_value("command"), "topic the gateway listens for requests on (its --subtop)")
+        ("resptop", po::value<std::string>(&top_resp)->default_value("response"), "topic the gateway responds on (its --pubtop)")
+        ("topics", po::value<std::string>(&topic_mode)->default_value("shared"), "topic layout of the gateway (its --topics): shared or addressed")
+        ("request", po::value<std::string>(&request)->default_value("fc=915e6,sps=1e6,n=10000"), "capture fields without id and t0")
+        ("fcs", po::value<std::string>(&fclist)->default_value(""), "comma separated center frequencies to pick from at random, replacing fc")
+        ("rate", po::value<double>(&rate)->default_value(10), "requests per second")
+        ("dist", po::value<std::string>(&dist)->default_value("poisson"), "spacing of the requests: fixed or poisson")
+        ("duration", po::value<double>(&run_time)->default_value(10), "seconds to send requests for")
+        ("lead", po::value<double>(&lead)->default_value(1.0), "seconds from sending a request to its t0")
+        ("tail", po::value<double>(&tail)->default_value(3.0), "seconds to wait for acks after the last capture ended")
+        ("binary", po::bool_switch(&binary), "send requests in the binary encoding")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help") || vm.count("gateway") == 0) {
+        std::cout << boost::format("trigger load generator for a timed_rx_file_mqtt gateway %s") % desc << std::endl;
+        return ~0;
+    }
+    po::notify(vm);
+    if(rate <= 0 || (dist != "fixed" && dist != "poisson") || (topic_mode != "shared" && topic_mode != "addressed"))
+    {
+        std::cerr << "rate has to be positive, dist fixed or poisson and topics shared or addressed" << std::endl;
+        return ~0;
+    }
+    if(topic_mode == "addressed")
+    {
+        top_cmd = gateway_topic(top_cmd, gateway);
+        top_resp = gateway_topic(top_resp, gateway);
+    }
+
+    std::vector<double> fcs;
+    if(fclist.empty() == false)
+    {
+        std::vector<std::string> parts;
+        boost::split(parts, fclist, boost::is_any_of(","), boost::token_compress_on);
+        for(const auto& p : parts)
+            fcs.push_back(std::stod(p));
+    }
+    prefix = (boost::format("load%.0lf-") % std::floor(systime_now_double())).str();
+
+    ProtectedQ<RxAck> acks;
+    AckListener listener(&acks);
+    std::unique_ptr<Transport> client;
+    try
+    {
+        client = connect_ack_client(mqtt_serv, client_id, &listener, std::chrono::seconds(10));
+        client->subscribe(top_resp + BINARY_TOPIC_SUFFIX, QOS);
+    }
+    catch(const TransportError& e)
+    {
+        std::cerr << "[MQTTerror] Unable to connect to MQTT server: '" << mqtt_serv << "' " << e.what() << std::endl;
+        return ~0;
+    }
+
+    std::mt19937 rng(std::random_device{}());
+    std::exponential_distribution<double> gap(rate);
+    std::uniform_int_distribution<size_t> pick(0, fcs.empty() ? 0 : fcs.size() - 1);
+
+    std::map<std::string, Sent> sent;
+    LoadStats st = LoadStats();
+    std::vector<ParsedRequest> parsed(1);
+    std::string bin;
+    RxAck rx;
+    double last_end = 0;
+
+    using namespace std::chrono;
+    const steady_clock::time_point tstart = steady_clock::now();
+    const steady_clock::time_point tstop = tstart + duration_cast<steady_clock::duration>(duration<double>(run_time));
+    steady_clock::time_point tnext = tstart;
+    for(unsigned long seq = 0; tnext < tstop; seq++)
+    {
+        // count acks while waiting for the next send
+        while(acks.popItemFor(rx, tnext - steady_clock::now()))
+            count_ack(rx, gateway, prefix, sent, st);
+
+        const double tnow = systime_now_double();
+        const std::string id = prefix + std::to_string(seq);
+        std::string msg = (boost::format("id=%s,t0=%.6lf,%s") % id % (tnow + lead) % request).str();
+        if(fcs.empty() == false)
+        {
+            // the parser refuses duplicate keys, so drop the template's fc
+            std::vector<std::string> fields;
+            boost::split(fields, msg, boost::is_any_of(","));
+            fields.erase(std::remove_if(fields.begin(), fields.end(),
+                            [](const std::string& f) { return f.compare(0, 3, "fc=") == 0; }), fields.end());
+            msg = (boost::format("fc=%.0lf,") % fcs[pick(rng)]).str() + boost::algorithm::join(fields, ",");
+        }
+
+        ParseStatus status;
+        if(parse_request(msg, parsed[0], status) == false)
+        {
+            std::cerr << "invalid request '" << msg << "': " << parse_error_str(status) << std::endl;
+            return ~0;
+        }
+        const double tend = parsed[0].req.t0 + rx_request_duration(parsed[0].req);
+        last_end = std::max(last_end, tend);
+        sent[id] = Sent{tnow, tend, false, false};
+
+        try
+        {
+            if(binary)
+            {
+                bin.clear();
+                encode_requests(parsed, bin);
+                client->publish(top_cmd + BINARY_TOPIC_SUFFIX, bin, QOS, false);
+            }
+            else
+                client->publish(top_cmd, msg, QOS, false);
+            st.sent++;
+        }
+        catch(const TransportError& e)
+        {
+            st.send_errors++;
+        }
+
+        const double dt = (dist == "fixed") ? 1.0 / rate : gap(rng);
+        tnext += duration_cast<steady_clock::duration>(duration<double>(dt));
+    }
+    const double send_time = duration<double>(steady_clock::now() - tstart).count();
+
+    // collect the rest until every request is settled or the tail ran out
+    const double deadline = last_end + tail;
+    while(true)
+    {
+        bool settled = true;
+        for(const auto& s : sent)
+            settled = settled && s.second.done;
+        const double left = deadline - systime_now_double();
+        if(settled || left <= 0 || acks.popItemFor(rx, duration<double>(left)) == false)
+            break;
+        count_ack(rx, gateway, prefix, sent, st);
+    }
+
+    unsigned long unanswered = 0, unfinished = 0;
+    for(const auto& s : sent)
+    {
+        unanswered += s.second.answered ? 0 : 1;
+        unfinished += (s.second.answered && s.second.done == false) ? 1 : 0;
+    }
+    unsigned long nrejected = 0;
+    for(const auto& r : st.rejected)
+        nrejected += r.second;
+
+    std::cout << boost::format("sent %lu in %.1lf s (%.1lf/s, target %.1lf/s %s), %lu send errors")
+                    % st.sent % send_time % (st.sent / send_time) % rate % dist % st.send_errors << std::endl;
+    std::cout << boost::format("accepted %lu (%.1lf%%), rejected %lu (%.1lf%%), dropped %lu, invalid %lu, no answer %lu")
+                    % st.accepted % (100.0 * st.accepted / std::max(st.sent, 1ul))
+                    % nrejected % (100.0 * nrejected / std::max(st.sent, 1ul))
+                    % st.dropped % st.invalid % unanswered << std::endl;
+    for(const auto& r : st.rejected)
+        std::cout << boost::format("  rejected %-8s %lu") % r.first % r.second << std::endl;
+    std::cout << boost::format("saved %lu, late %lu (%.1lf%% of accepted), failed %lu, no outcome %lu")
+                    % st.saved % st.late % (100.0 * st.late / std::max(st.accepted, 1ul)) % st.failed % unfinished << std::endl;
+    percentiles("ack", st.ack_lat);
+    percentiles("done", st.done_lat);
+
+    client->disconnect();
+    return 0;
+}
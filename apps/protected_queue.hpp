@@ -2,45 +2,340 @@
 #define PROTECTED_Q_HPP
 
 #include <thread>
-#include <queue>
+#include <deque>
+#include <chrono>
+#include <utility>
+#include <functional>
+#include <mutex>
 #include <condition_variable>
 
+// what a bounded queue does with an item that arrives while it is full
+enum class QueueOverflow
+{
+    REJECT_NEWEST,  // refuse the new item
+    DROP_OLDEST,    // make room by dropping the oldest item
+    COALESCE        // merge items equal to a queued one, refuse the rest
+};
+
+// outcome of ProtectedQ::pushItem
+enum class QueuePush
+{
+    ADDED,
+    COALESCED,      // equal to a queued item, not added again
+    REJECTED,       // queue full
+    DROPPED_OLDEST, // added, the oldest item was dropped for it
+    CLOSED
+};
+
+// counters of a queue since the last ProtectedQ::takeStats call
+struct QueueStats
+{
+    size_t depth;                   // items queued now
+    size_t max_depth;
+    unsigned long long added;
+    unsigned long long rejected;
+    unsigned long long dropped;
+    unsigned long long coalesced;
+    unsigned long long taken;
+    double wait_sum;                // seconds items spent queued, over taken items
+    double wait_max;
+};
+
 template <typename T>
 class ProtectedQ
 {
     private:
-        std::queue<T> q;
+        typedef std::chrono::steady_clock clock;
+        struct Item
+        {
+            T val;
+            clock::time_point tin;
+
+            // val is built from args right in the deque
+            template <typename... Args>
+            Item(clock::time_point t, Args&&... args) : val(std::forward<Args>(args)...), tin(t)
+            {
+            }
+        };
+
+        std::deque<Item> q;
         std::condition_variable cond;
         mutable std::mutex m;
+        // set by close(). Nothing can be added afterwards and waiting
+        // consumers return once the queue is empty
+        bool closed;
+        // 0 for an unbounded queue
+        size_t capacity;
+        QueueOverflow policy;
+        // tells duplicates apart for QueueOverflow::COALESCE
+        std::function<bool(const T&, const T&)> same;
+        QueueStats st;
+
+        // take the front element, queue has to be non-empty and locked
+        void takeFront(T& val, clock::time_point tnow)
+        {
+            countWait(q.front(), tnow);
+            val = std::move(q.front().val);
+            q.pop_front();
+        }
+
+        void countWait(const Item& it, clock::time_point tnow)
+        {
+            const double wait = std::chrono::duration<double>(tnow - it.tin).count();
+            st.taken++;
+            st.wait_sum += wait;
+            if(wait > st.wait_max)
+                st.wait_max = wait;
+        }
+
+        bool full() const
+        {
+            return capacity > 0 && q.size() >= capacity;
+        }
+
+        // apply the overflow policy to the item just placed at the back of
+        // the queue, queue locked. evicted, if given, receives whatever did
+        // not end up in the queue
+        QueuePush settle(T* evicted)
+        {
+            QueuePush ret = QueuePush::ADDED;
+            if(policy == QueueOverflow::COALESCE && same)
+            {
+                const T& item = q.back().val;
+                for(auto it = q.begin(); it + 1 != q.end(); ++it)
+                {
+                    if(same(it->val, item))
+                    {
+                        q.pop_back();
+                        st.coalesced++;
+                        return QueuePush::COALESCED;
+                    }
+                }
+            }
+            if(capacity > 0 && q.size() > capacity)
+            {
+                if(policy != QueueOverflow::DROP_OLDEST)
+                {
+                    st.rejected++;
+                    if(evicted != nullptr)
+                        *evicted = std::move(q.back().val);
+                    q.pop_back();
+                    return QueuePush::REJECTED;
+                }
+                st.dropped++;
+                if(evicted != nullptr)
+                    *evicted = std::move(q.front().val);
+                q.pop_front();
+                ret = QueuePush::DROPPED_OLDEST;
+            }
+            st.added++;
+            if(q.size() > st.max_depth)
+                st.max_depth = q.size();
+            return ret;
+        }
+
+        // queue item, queue locked. evicted as for settle
+        QueuePush push(T&& item, T* evicted)
+        {
+            if(closed)
+                return QueuePush::CLOSED;
+            if(full() && policy == QueueOverflow::REJECT_NEWEST)
+            {
+                st.rejected++;
+                if(evicted != nullptr)
+                    *evicted = std::move(item);
+                return QueuePush::REJECTED;
+            }
+            q.emplace_back(clock::now(), std::move(item));
+            return settle(evicted);
+        }
+
+        // construct an item from args at the back of the queue, queue
+        // locked. A full REJECT_NEWEST queue refuses it before it is built
+        template <typename... Args>
+        QueuePush place(Args&&... args)
+        {
+            if(closed)
+                return QueuePush::CLOSED;
+            if(full() && policy == QueueOverflow::REJECT_NEWEST)
+            {
+                st.rejected++;
+                return QueuePush::REJECTED;
+            }
+            q.emplace_back(clock::now(), std::forward<Args>(args)...);
+            return settle(nullptr);
+        }
+
+        // move every item to the end of out, queue locked
+        template <class Container>
+        size_t takeAll(Container& out)
+        {
+            const clock::time_point tnow = clock::now();
+            const size_t n = q.size();
+            for(Item& it : q)
+            {
+                countWait(it, tnow);
+                out.push_back(std::move(it.val));
+            }
+            q.clear();
+            return n;
+        }
+
+        static bool queued(QueuePush r)
+        {
+            return r == QueuePush::ADDED || r == QueuePush::DROPPED_OLDEST || r == QueuePush::COALESCED;
+        }
 
     public:
         // the object calls (q(), cond() & m()) initialize all the members properly
-        ProtectedQ(): q(), cond(), m()
+        ProtectedQ(): q(), cond(), m(), closed(false), capacity(0),
+                      policy(QueueOverflow::REJECT_NEWEST), same(), st()
         {
             // constructor
         }
-        void addItem(T item)
+
+        // queue holding at most capacity items (0 for no limit), handling
+        // overflow according to policy. same compares items for
+        // QueueOverflow::COALESCE
+        ProtectedQ(size_t capacity, QueueOverflow policy,
+                   std::function<bool(const T&, const T&)> same = nullptr)
+            : q(), cond(), m(), closed(false), capacity(capacity),
+              policy(policy), same(std::move(same)), st()
+        {
+        }
+
+        // add item to the queue, applying the overflow policy. evicted, if
+        // given, receives the item that was rejected or dropped for it
+        QueuePush pushItem(T item, T* evicted = nullptr)
         {
-            // locks mutex in this code block
-            std::unique_lock<std::mutex> lock(m);
-            // add item to queue
-            q.push(item);
-            // notify thread waiting on condition
-            cond.notify_one();
+            QueuePush ret;
+            {
+                // locks mutex in this code block
+                std::unique_lock<std::mutex> lock(m);
+                ret = push(std::move(item), evicted);
+            }
+            // notify thread waiting on condition, after unlocking so it
+            // doesn't wake up just to block on the mutex
+            if(ret == QueuePush::ADDED || ret == QueuePush::DROPPED_OLDEST)
+                cond.notify_one();
+            return ret;
         }
 
+        // add item to the queue. Returns false if it was rejected or the
+        // queue was closed
+        bool addItem(T item)
+        {
+            return queued(pushItem(std::move(item)));
+        }
+
+        // construct an item in the queue from args, without moving it in.
+        // Returns false if it was rejected or the queue was closed
+        template <typename... Args>
+        bool emplaceItem(Args&&... args)
+        {
+            QueuePush ret;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                ret = place(std::forward<Args>(args)...);
+            }
+            if(ret == QueuePush::ADDED || ret == QueuePush::DROPPED_OLDEST)
+                cond.notify_one();
+            return queued(ret);
+        }
+
+        // wait for an item. Returns T() if the queue was closed and is empty
         T popItem()
+        {
+            T val = T();
+            popItem(val);
+            return val;
+        }
+
+        // wait for an item. Returns false if the queue was closed and is empty
+        bool popItem(T& val)
         {
             std::unique_lock<std::mutex> lock(m);
-            while(q.empty())
+            while(q.empty() && !closed)
             {
                 // release lock as long as the wait and reaquire it afterwards.
                 cond.wait(lock);
             }
-            T val = q.front(); // get the front element from queue
-            q.pop(); // remove the front element from queue
-            return val;
+            if(q.empty())
+                return false;
+            takeFront(val, clock::now());
+            return true;
+        }
+
+        // take an item if there is one, without waiting
+        bool tryPopItem(T& val)
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if(q.empty())
+                return false;
+            takeFront(val, clock::now());
+            return true;
+        }
+
+        // wait at most timeout for an item. Returns false if none showed up
+        template <class Rep, class Period>
+        bool popItemFor(T& val, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if(cond.wait_for(lock, timeout, [this]{ return !q.empty() || closed; }) == false || q.empty())
+                return false;
+            takeFront(val, clock::now());
+            return true;
+        }
+
+        // wait for at least one item and move everything queued to the end
+        // of out with a single lock. Returns the number of items taken, 0
+        // once the queue was closed and is empty
+        template <class Container>
+        size_t drainInto(Container& out)
+        {
+            std::unique_lock<std::mutex> lock(m);
+            while(q.empty() && !closed)
+                cond.wait(lock);
+            return takeAll(out);
+        }
+
+        // like drainInto, waiting at most timeout. Returns 0 if nothing
+        // showed up in time
+        template <class Container, class Rep, class Period>
+        size_t drainIntoFor(Container& out, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cond.wait_for(lock, timeout, [this]{ return !q.empty() || closed; });
+            return takeAll(out);
+        }
+
+        // counters since the last call, which starts a new interval
+        QueueStats takeStats()
+        {
+            std::unique_lock<std::mutex> lock(m);
+            QueueStats ret = st;
+            ret.depth = q.size();
+            st = QueueStats();
+            st.max_depth = q.size();
+            return ret;
+        }
+
+        // refuse new items and wake up every waiting consumer. Items already
+        // queued can still be taken
+        void close()
+        {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                closed = true;
+            }
+            cond.notify_all();
+        }
+
+        bool isClosed() const
+        {
+            std::unique_lock<std::mutex> lock(m);
+            return closed;
         }
 };
 
-#endif // PROTECTED_Q_HPP
\ No newline at end of file
+#endif // PROTECTED_Q_HPP
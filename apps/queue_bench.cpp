@@ -0,0 +1,92 @@
+/*
+ * Contention benchmark of ProtectedQ against the lock-free RingQ: producer
+ * threads push message sized strings as fast as they can and a single
+ * consumer pops them, like the request and response queues of
+ * timed_rx_file_mqtt.
+ */
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include "protected_queue.hpp"
+#include "ring_queue.hpp"
+#include "stopwatch.hpp"
+
+namespace po = boost::program_options;
+
+template <typename Q>
+static void run(const std::string& name, Q& q, unsigned nproducers, unsigned long nitems, size_t msglen)
+{
+    std::vector<std::thread> producers;
+    const unsigned long per_producer = nitems / nproducers;
+    const unsigned long total = per_producer * nproducers;
+    size_t nbytes = 0;
+
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
+    for(unsigned p = 0; p < nproducers; p++)
+    {
+        producers.emplace_back([&q, per_producer, msglen]() {
+            for(unsigned long i = 0; i < per_producer; i++)
+                q.addItem(std::string(msglen, 'a' + (i % 26)));
+        });
+    }
+    for(unsigned long i = 0; i < total; i++)
+        nbytes += q.popItem().size();
+    double secs = std::chrono::duration<double>(sw.passed()).count();
+    for(auto& t : producers)
+        t.join();
+
+    std::cout << boost::format("%-12s %u producer(s) %8.1lf ns/item %12.0lf items/s (%lu bytes)")
+                    % name
+                    % nproducers
+                    % (1e9 * secs / total)
+                    % (total / secs)
+                    % nbytes << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long nitems;
+    unsigned nproducers;
+    size_t capacity, msglen;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("items", po::value<unsigned long>(&nitems)->default_value(2000000), "items passed through each queue")
+        ("producers", po::value<unsigned>(&nproducers)->default_value(4), "producer threads for the multi-producer runs")
+        ("capacity", po::value<size_t>(&capacity)->default_value(1024), "RingQ capacity")
+        ("msglen", po::value<size_t>(&msglen)->default_value(64), "bytes per item")
+    ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    {
+        ProtectedQ<std::string> q;
+        run("ProtectedQ", q, 1, nitems, msglen);
+    }
+    {
+        RingQ<std::string> q(capacity);
+        run("RingQ spsc", q, 1, nitems, msglen);
+    }
+    {
+        ProtectedQ<std::string> q;
+        run("ProtectedQ", q, nproducers, nitems, msglen);
+    }
+    {
+        RingQ<std::string, true> q(capacity);
+        run("RingQ mpsc", q, nproducers, nitems, msglen);
+    }
+
+    return 0;
+}
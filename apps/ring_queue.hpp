@@ -0,0 +1,263 @@
+#ifndef RING_Q_HPP
+#define RING_Q_HPP
+
+/*
+ * Bounded lock-free queue with the same role as ProtectedQ, for a single
+ * consumer and one (MultiProducer = false) or several producers. Items are
+ * moved in and out of a fixed ring of slots, each with a sequence number
+ * telling whether it is free or holds an item for the current lap.
+ *
+ * Pushing and popping never take a lock. Only a consumer that finds the
+ * queue empty or a producer that finds it full sleeps, on a futex, and
+ * the other side only makes the wake syscall when someone is sleeping.
+ *
+ * Only the consumer may take items out, so there is no drop-oldest or
+ * coalescing on overflow. Queues that need those stay on ProtectedQ, RingQ
+ * is for per-buffer hand-offs such as the preview stage. close() works as
+ * for ProtectedQ.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <cstdint>
+#include <ctime>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word has to be a plain 32 bit integer");
+
+// tries before a blocking call goes to sleep: busy ones, then ones that
+// give the CPU to the other side first
+const int RINGQ_SPIN = 64;
+const int RINGQ_YIELD = 16;
+
+inline void ringq_futex_wait(std::atomic<uint32_t>* word, uint32_t expected, const struct timespec* timeout = nullptr)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+inline void ringq_futex_wake(std::atomic<uint32_t>* word, int nwaiters)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, nwaiters, nullptr, nullptr, 0);
+}
+
+template <typename T, bool MultiProducer = false>
+class RingQ
+{
+    private:
+        struct Slot
+        {
+            std::atomic<size_t> seq;
+            T val;
+        };
+
+        // a futex word bumped on changes the other side waits for, and the
+        // number of threads about to sleep or sleeping on it
+        struct Event
+        {
+            std::atomic<uint32_t> word;
+            std::atomic<uint32_t> waiters;
+        };
+
+        std::unique_ptr<Slot[]> slots;
+        const size_t mask;
+        // producers and consumer write their own cache line
+        alignas(64) std::atomic<size_t> tail;
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) Event not_empty;
+        alignas(64) Event not_full;
+        // set by close(). Nothing can be added afterwards and waiting
+        // threads return once they can't go on
+        std::atomic<bool> closed;
+
+        static size_t roundCapacity(size_t capacity)
+        {
+            size_t n = 2;
+            while(n < capacity)
+                n <<= 1;
+            return n;
+        }
+
+        void signal(Event& ev, int nwake)
+        {
+            // pairs with the fence in wait(): either the waiter sees the
+            // change to the queue or we see the waiter. A waiter that has
+            // not gone to sleep yet sees the bumped word and doesn't
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(ev.waiters.load(std::memory_order_relaxed) > 0)
+            {
+                ev.word.fetch_add(1, std::memory_order_release);
+                ringq_futex_wake(&ev.word, nwake);
+            }
+        }
+
+        // sleep on ev until ready() holds. Returns false if timeout ran out
+        template <typename Ready>
+        bool wait(Event& ev, Ready ready, const struct timespec* timeout = nullptr)
+        {
+            for(int i = 0; i < RINGQ_SPIN + RINGQ_YIELD; i++)
+            {
+                if(ready())
+                    return true;
+                if(i >= RINGQ_SPIN)
+                    std::this_thread::yield();
+            }
+            while(true)
+            {
+                const uint32_t word = ev.word.load(std::memory_order_acquire);
+                ev.waiters.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(ready())
+                {
+                    ev.waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+                ringq_futex_wait(&ev.word, word, timeout);
+                ev.waiters.fetch_sub(1, std::memory_order_relaxed);
+                if(ready())
+                    return true;
+                if(timeout != nullptr)
+                    return false;
+            }
+        }
+
+    public:
+        // capacity is rounded up to a power of two
+        explicit RingQ(size_t capacity)
+            : slots(new Slot[roundCapacity(capacity)]), mask(roundCapacity(capacity) - 1),
+              tail(0), head(0), not_empty(), not_full(), closed(false)
+        {
+            for(size_t i = 0; i <= mask; i++)
+                slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        RingQ(const RingQ&) = delete;
+        RingQ& operator=(const RingQ&) = delete;
+
+        size_t capacity() const { return mask + 1; }
+
+        // items currently queued, only a hint while others push or pop
+        size_t size() const
+        {
+            return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+        }
+
+        // add item unless the queue is full or closed. item is only moved
+        // from if it was added
+        bool tryAddItem(T& item)
+        {
+            if(closed.load(std::memory_order_acquire))
+                return false;
+            size_t pos = tail.load(std::memory_order_relaxed);
+            Slot* slot;
+            while(true)
+            {
+                slot = &slots[pos & mask];
+                const size_t seq = slot->seq.load(std::memory_order_acquire);
+                const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+                if(diff < 0)
+                    return false;   // slot still holds an item from the last lap
+                if(diff > 0)
+                {
+                    pos = tail.load(std::memory_order_relaxed);  // another producer took it
+                    continue;
+                }
+                if(MultiProducer == false)
+                {
+                    tail.store(pos + 1, std::memory_order_relaxed);
+                    break;
+                }
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            slot->val = std::move(item);
+            slot->seq.store(pos + 1, std::memory_order_release);
+            signal(not_empty, 1);
+            return true;
+        }
+
+        // take the oldest item unless the queue is empty. Consumer only
+        bool tryPopItem(T& val)
+        {
+            const size_t pos = head.load(std::memory_order_relaxed);
+            Slot& slot = slots[pos & mask];
+            if(slot.seq.load(std::memory_order_acquire) != pos + 1)
+                return false;
+            val = std::move(slot.val);
+            slot.seq.store(pos + mask + 1, std::memory_order_release);
+            head.store(pos + 1, std::memory_order_relaxed);
+            // producers blocked on a full queue are only woken once it is
+            // half empty, so they don't wake up for every single slot
+            if(tail.load(std::memory_order_relaxed) - (pos + 1) <= (mask + 1) / 2)
+                signal(not_full, MultiProducer ? INT_MAX : 1);
+            return true;
+        }
+
+        // add item, waiting for room if the queue is full. Returns false
+        // if the queue was closed
+        bool addItem(T item)
+        {
+            bool added = false;
+            wait(not_full, [&]{ return (added = tryAddItem(item)) || isClosed(); });
+            return added;
+        }
+
+        // take the oldest item, waiting for one if the queue is empty.
+        // Returns T() if the queue was closed and is empty
+        T popItem()
+        {
+            T val = T();
+            popItem(val);
+            return val;
+        }
+
+        // wait for an item. Returns false if the queue was closed and is empty
+        bool popItem(T& val)
+        {
+            bool got = false;
+            wait(not_empty, [&]{ return (got = tryPopItem(val)) || isClosed(); });
+            // what was added before close() is seen once closed is
+            return got || tryPopItem(val);
+        }
+
+        // wait at most timeout for an item. Returns false if none showed up
+        // or the queue was closed and is empty
+        template <class Rep, class Period>
+        bool popItemFor(T& val, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            using namespace std::chrono;
+            const auto tend = steady_clock::now() + timeout;
+            bool got = false;
+            while(true)
+            {
+                auto left = duration_cast<nanoseconds>(tend - steady_clock::now());
+                if(left.count() <= 0)
+                    return tryPopItem(val);
+                struct timespec ts;
+                ts.tv_sec = left.count() / 1000000000;
+                ts.tv_nsec = left.count() % 1000000000;
+                if(wait(not_empty, [&]{ return (got = tryPopItem(val)) || isClosed(); }, &ts))
+                    return got || tryPopItem(val);
+            }
+        }
+
+        // refuse new items and wake up every waiting thread. Items already
+        // queued can still be taken
+        void close()
+        {
+            closed.store(true, std::memory_order_release);
+            signal(not_empty, INT_MAX);
+            signal(not_full, INT_MAX);
+        }
+
+        bool isClosed() const
+        {
+            return closed.load(std::memory_order_acquire);
+        }
+};
+
+#endif // RING_Q_HPP
@@ -0,0 +1,175 @@
+/*
+ * Text form of the gateway responses
+ */
+
+#include <boost/format.hpp>
+#include "ack.hpp"
+#include "time_helper.hpp"
+
+Ack make_ack(AckCode code, const std::string& client_id)
+{
+    Ack ack;
+    ack.code = code;
+    ack.client_id = client_id;
+    ack.recurring = false;
+    ack.occurrence = -1;
+    ack.batch = -1;
+    ack.t0 = 0.0;
+    ack.earliest = 0.0;
+    ack.count = 0;
+    ack.stages = AckStages();
+    return ack;
+}
+
+// text inserted after the client id: empty for anonymous requests,
+// "req <id> " for named ones and "sched <name> [#<occurrence>] " for
+// schedules, preceded by "batch #<index> " for batch members
+static std::string ack_tag(const Ack& ack)
+{
+    std::string tag;
+    if(ack.batch >= 0)
+        tag = (boost::format("batch #%u ") % ack.batch).str();
+    if(ack.name.empty())
+        return tag;
+    if(ack.recurring == false)
+        return tag + (boost::format("req %s ") % ack.name).str();
+    if(ack.occurrence < 0)
+        return tag + (boost::format("sched %s ") % ack.name).str();
+    return tag + (boost::format("sched %s #%u ") % ack.name % ack.occurrence).str();
+}
+
+// the stages reached, " stages arrived <t> ... closed <t>"
+static std::string stages_str(const AckStages& st)
+{
+    const std::pair<const char*, double> stages[] = {
+        {"arrived", st.arrived}, {"dequeued", st.dequeued}, {"setup", st.setup_done},
+        {"first", st.first_sample}, {"last", st.last_sample}, {"closed", st.closed}};
+    std::string txt = " stages";
+    for(const auto& s : stages)
+    {
+        if(s.second != 0.0)
+            txt += (boost::format(" %s %.6lf") % s.first % s.second).str();
+    }
+    return txt;
+}
+
+static std::string ack_body(const Ack& ack)
+{
+    const std::string& id = ack.client_id;
+    switch(ack.code)
+    {
+        case AckCode::ACCEPTED:
+            if(ack.recurring)
+                return (boost::format("<%s %saccepted %u>") % id % ack_tag(ack) % ack.count).str();
+            return (boost::format("<%s %saccepted>") % id % ack_tag(ack)).str();
+        case AckCode::REJECTED:
+        {
+            std::string earliest = (ack.earliest > 0.0) ? (boost::format("%.6lf") % ack.earliest).str() : "none";
+            return (boost::format("<%s %srejected @%s %s earliest %s>")
+                        % id
+                        % ack_tag(ack)
+                        % date_str(ack.t0)
+                        % ack.reason
+                        % earliest).str();
+        }
+        case AckCode::INVALID:
+            return (boost::format("<%s invalid msg: %s>") % id % ack.reason).str();
+        case AckCode::BATCH_ACCEPTED:
+            return (boost::format("<%s batch accepted %u>") % id % ack.count).str();
+        case AckCode::BATCH_INVALID:
+            return (boost::format("<%s batch invalid #%u: %s>") % id % ack.batch % ack.reason).str();
+        case AckCode::CANCELLED:
+            return (boost::format("<%s %s cancelled>") % id % ack.name).str();
+        case AckCode::UNKNOWN:
+            return (boost::format("<%s %s unknown>") % id % ack.name).str();
+        case AckCode::PREEMPTED:
+            return (boost::format("<%s %spreempted by %s @%s>") % id % ack_tag(ack) % ack.by % date_str(ack.t0)).str();
+        case AckCode::LATE:
+            return (boost::format("<%s %shost late command @%s>") % id % ack_tag(ack) % date_str(ack.t0)).str();
+        case AckCode::SAVED:
+            return (boost::format("<%s %sreq saved %s>") % id % ack_tag(ack) % (ack.files.empty() ? "" : ack.files[0])).str();
+        case AckCode::FAILED:
+            if(ack.reason.empty() == false)
+                return (boost::format("<%s %sreq failed @ %s: %s>") % id % ack_tag(ack) % date_str(ack.t0) % ack.reason).str();
+            return (boost::format("<%s %sreq failed @ %s>") % id % ack_tag(ack) % date_str(ack.t0)).str();
+        case AckCode::ABORTED:
+            if(ack.files.empty() == false)
+                return (boost::format("<%s %saborted, kept %s>") % id % ack_tag(ack) % ack.files[0]).str();
+            return (boost::format("<%s %saborted @ %s>") % id % ack_tag(ack) % date_str(ack.t0)).str();
+        case AckCode::SWEEP_SAVED:
+        {
+            std::string txmsg = (boost::format("<%s %ssweep saved") % id % ack_tag(ack)).str();
+            for(const auto& f : ack.files)
+                txmsg += " " + f;
+            return txmsg + ">";
+        }
+        case AckCode::SWEEP_FAILED:
+            if(ack.reason.empty() == false)
+                return (boost::format("<%s %ssweep failed @ %s step %u: %s>") % id % ack_tag(ack) % date_str(ack.t0) % ack.count % ack.reason).str();
+            return (boost::format("<%s %ssweep failed @ %s step %u>") % id % ack_tag(ack) % date_str(ack.t0) % ack.count).str();
+        case AckCode::SWEEP_ABORTED:
+            return (boost::format("<%s %ssweep aborted @ %s step %u>") % id % ack_tag(ack) % date_str(ack.t0) % ack.count).str();
+        case AckCode::SCHED_DONE:
+            return (boost::format("<%s %sdone>") % id % ack_tag(ack)).str();
+        case AckCode::SETUP:
+            if(ack.values.size() < 6)
+                break;
+            return (boost::format("<%s setup same %.3lf (%u) retune %.3lf (%u) clock %.4lf (%u)>")
+                        % id
+                        % ack.values[0] % unsigned(ack.values[1])
+                        % ack.values[2] % unsigned(ack.values[3])
+                        % ack.values[4] % unsigned(ack.values[5])).str();
+        case AckCode::DROPPED:
+            return (boost::format("<%s dropped msg: %s>") % id % ack.reason).str();
+        case AckCode::QUEUE:
+            if(ack.values.size() < 8)
+                break;
+            return (boost::format("<%s queue %s depth %u (%u) in %u rejected %u dropped %u coalesced %u wait %.4lf (%.4lf)>")
+                        % id % ack.name
+                        % unsigned(ack.values[0]) % unsigned(ack.values[1])
+                        % unsigned(ack.values[2]) % unsigned(ack.values[3])
+                        % unsigned(ack.values[4]) % unsigned(ack.values[5])
+                        % ack.values[6] % ack.values[7]).str();
+        case AckCode::PUBLISH:
+            if(ack.values.size() < 6)
+                break;
+            return (boost::format("<%s publish acked %u retried %u failed %u latency %.4lf (%.4lf) backlog %u>")
+                        % id
+                        % unsigned(ack.values[0]) % unsigned(ack.values[1]) % unsigned(ack.values[2])
+                        % ack.values[3] % ack.values[4] % unsigned(ack.values[5])).str();
+        case AckCode::LINK:
+            if(ack.values.empty())
+                return (boost::format("<%s link %s>") % id % ack.reason).str();
+            return (boost::format("<%s link %s attempts %u down %.3lf>") % id % ack.reason % ack.count % ack.values[0]).str();
+        case AckCode::UPLOADED:
+            if(ack.files.empty() || ack.values.size() < 2)
+                break;
+            return (boost::format("<%s uploaded %s %.0lf bytes in %.3lf s>") % id % ack.files[0] % ack.values[0] % ack.values[1]).str();
+        case AckCode::UPLOAD_FAILED:
+            return (boost::format("<%s upload failed %s: %s>") % id % (ack.files.empty() ? "" : ack.files[0]) % ack.reason).str();
+        case AckCode::CAPTURE_STATS:
+        {
+            if(ack.files.empty() || ack.values.size() < 17)
+                break;
+            const std::vector<double>& v = ack.values;
+            std::string txmsg = (boost::format("<%s %scapture %s samples %.0lf/%.0lf in %.3lf s @ %.3lf Msps bytes %.0lf overflows %u"
+                                               " write p50 %.6lf p99 %.6lf max %.6lf"
+                                               " setup rate %.3lf tune %.3lf gain %.3lf bw %.3lf ant %.3lf lo %.3lf streamer %.3lf file %.3lf sizes")
+                        % id % ack_tag(ack) % ack.files[0] % v[1] % v[0] % v[2] % v[3] % v[4] % unsigned(v[5])
+                        % v[6] % v[7] % v[8]
+                        % v[9] % v[10] % v[11] % v[12] % v[13] % v[14] % v[15] % v[16]).str();
+            for(size_t i = 17; i + 1 < v.size(); i += 2)
+                txmsg += (boost::format(" %u:%u") % unsigned(v[i]) % unsigned(v[i + 1])).str();
+            return txmsg + ">";
+        }
+    }
+    return (boost::format("<%s ?>") % id).str();
+}
+
+std::string ack_text(const Ack& ack)
+{
+    std::string txt = ack_body(ack);
+    if(ack.stages.any())
+        txt.insert(txt.size() - 1, stages_str(ack.stages));
+    return txt;
+}
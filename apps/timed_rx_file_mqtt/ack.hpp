@@ -0,0 +1,104 @@
+/*
+ * Responses and status updates sent by the gateway. They are built as
+ * structured acks and only turned into text (or the binary encoding in
+ * wire_codec.hpp) by whoever publishes them.
+ */
+
+#ifndef ACK_HPP
+#define ACK_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * what an ack reports. The values are part of the binary encoding, so new
+ * codes go at the end
+ */
+enum class AckCode : uint8_t
+{
+    ACCEPTED = 1,   // named request or schedule admitted, count = occurrences
+    REJECTED,       // admission failed: reason, t0, earliest
+    INVALID,        // message could not be decoded: reason
+    BATCH_ACCEPTED, // count = requests in the batch
+    BATCH_INVALID,  // batch = member that could not be decoded, reason
+    CANCELLED,
+    UNKNOWN,        // cancel for a name that is not in the agenda
+    PREEMPTED,      // by = preempting request, t0 of the dropped occurrence
+    LATE,           // too late to set up by the time it was due
+    SAVED,          // files[0]
+    FAILED,
+    ABORTED,        // files[0] if the partial file was kept
+    SWEEP_SAVED,    // files, one per step
+    SWEEP_FAILED,   // count = steps saved
+    SWEEP_ABORTED,  // count = steps saved
+    SCHED_DONE,
+    SETUP,          // status: values = same, nsame, retune, nretune, clock, nclock
+    DROPPED,        // request queue overflowed, the message was not handled: reason
+    QUEUE,          // status: name = queue, values = depth, max depth, added,
+                    // rejected, dropped, coalesced, mean wait, max wait
+    PUBLISH,        // status: values = acked, retried, failed, mean latency,
+                    // max latency, backlog
+    LINK,           // status: reason = "connected" (count = attempts, values =
+                    // seconds disconnected) or "lost[: cause]"
+    UPLOADED,       // files[0] copied off, values = bytes, seconds
+    UPLOAD_FAILED,  // files[0] can't be uploaded: reason
+    CAPTURE_STATS   // telemetry: files[0] streamed from t0, values = requested,
+                    // received, seconds, Msps, bytes written, overflows, write
+                    // latency p50, p99, max, setup rate, tune, gain, bw, ant,
+                    // lo lock, streamer, file open, then pairs of samples per
+                    // recv call and number of calls
+};
+
+/*
+ * when a request went through each stage on its way to the response, 0 for
+ * stages it did not reach. Device times are those of the USRP time_spec,
+ * the others host (NTP) system time
+ */
+struct AckStages
+{
+    double arrived;             // request message received
+    double dequeued;            // taken out of the agenda by the USRP thread
+    double setup_done;          // device set up, stream command issued
+    double first_sample;        // device time of the first sample received
+    double last_sample;         // device time of the last sample received
+    double closed;              // capture file closed
+
+    bool any() const
+    {
+        return arrived != 0.0 || dequeued != 0.0 || setup_done != 0.0
+            || first_sample != 0.0 || last_sample != 0.0 || closed != 0.0;
+    }
+};
+
+struct Ack
+{
+    AckCode code;
+    std::string client_id;
+    std::string name;           // request id or schedule name, may be empty
+    bool recurring;             // name is a schedule
+    int occurrence;             // schedule occurrence, -1 if not about one
+    int batch;                  // index in a batch message, -1 if not in one
+    double t0;                  // start time the ack is about, 0 if none
+    double earliest;            // earliest feasible start, 0 if none
+    unsigned count;
+    std::string reason;
+    std::string by;
+    std::vector<std::string> files;
+    std::vector<double> values;
+    AckStages stages;
+};
+
+/*
+ * an ack with only the code and client id set
+ */
+Ack make_ack(AckCode code, const std::string& client_id);
+
+/*
+ * text form published for mosquitto_sub users, e.g. "<gw req a accepted>".
+ * Stages that were reached follow at the end, as in
+ * "<gw req a req saved f.dat stages arrived 1700000000.120000 ...>"
+ */
+std::string ack_text(const Ack& ack);
+
+#endif // ACK_HPP
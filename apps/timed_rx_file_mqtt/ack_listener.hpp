@@ -0,0 +1,71 @@
+/*
+ * Client side of the gateway's binary acks, for tools that talk to
+ * gateways: decodes every ack arriving on the subscribed topics and queues
+ * it with its arrival time. Subscribe to <topic> + BINARY_TOPIC_SUFFIX.
+ */
+
+#ifndef ACK_LISTENER_HPP
+#define ACK_LISTENER_HPP
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <chrono>
+#include "transport.hpp"
+#include "protected_queue.hpp"
+#include "wire_codec.hpp"
+#include "time_helper.hpp"
+
+// an ack and when it arrived (UTC seconds)
+struct RxAck
+{
+    double trecv;
+    Ack ack;
+};
+
+class AckListener : public TransportListener
+{
+    ProtectedQ<RxAck> *acks;
+
+    void connected() override {}
+
+    void connectFailed() override {}
+
+    // the tools run for a few seconds, a lost connection is reported and
+    // shows as missing acks rather than being reconnected
+    void connectionLost(const std::string& cause) override
+    {
+        std::cerr << "[MQTTerror] connection lost: " << cause << std::endl;
+    }
+
+    void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) override
+    {
+        RxAck rx;
+        rx.trecv = systime_now_double();
+        if(decode_ack(*payload, rx.ack))
+            acks->addItem(std::move(rx));
+    }
+
+public:
+    AckListener(ProtectedQ<RxAck> *acks) : acks(acks) {}
+};
+
+/*
+ * connect a client of the tools to server with a clean session, acks go to
+ * listener. Throws TransportError if it doesn't connect within timeout
+ */
+inline std::unique_ptr<Transport> connect_ack_client(const std::string& server, const std::string& client_id,
+                                                     AckListener *listener, std::chrono::milliseconds timeout)
+{
+    TransportOptions opts = TransportOptions();
+    opts.clean_session = true;
+    opts.keep_alive = 30;
+    std::unique_ptr<Transport> client = make_transport(server, client_id, opts);
+    client->setListener(listener);
+    TransportTokenPtr tok = client->connect();
+    if(tok->waitFor(timeout) == false || tok->returnCode() != 0 || client->isConnected() == false)
+        throw TransportError("no connection");
+    return client;
+}
+
+#endif // ACK_LISTENER_HPP
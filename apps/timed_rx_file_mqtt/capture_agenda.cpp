@@ -0,0 +1,418 @@
+/*
+ * Admission control and ordering of accepted captures
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include "capture_agenda.hpp"
+#include "time_helper.hpp"
+
+CaptureAgenda::CaptureAgenda(const AgendaLimits& limits)
+    : entries(), lim(limits), margin_same(limits.setup_margin), margin_retune(limits.setup_margin), last_fc(0.0),
+      inflight(false), inflight_name(), inflight_begin(0.0), inflight_end(0.0),
+      abort_flag(false), closed(false), cond(), m()
+{
+    // constructor
+}
+
+// most times earliestStart moves a request past an accepted occurrence
+// before it gives up on finding a start time
+static const unsigned MAX_START_MOVES = 1000;
+
+// index of the first occurrence of e from next on at or after t, e.count
+// if none, preempted or not. Occurrences are evenly spaced, so this does
+// not walk them
+static unsigned first_index_from(const AgendaEntry& e, double t)
+{
+    unsigned k = e.next;
+    if(e.period > 0.0 && t > e.occurrence(k))
+    {
+        const double kd = std::floor((t - e.req.t0) / e.period);
+        k = (kd >= double(e.count)) ? e.count : std::max(e.next, unsigned(kd));
+    }
+    while(k < e.count && e.occurrence(k) < t)
+        k++;
+    return k;
+}
+
+// same for the occurrences that still run
+static unsigned first_occurrence_from(const AgendaEntry& e, double t)
+{
+    return e.nextPending(first_index_from(e, t));
+}
+
+// e with only occurrence k, as reported when it is preempted
+static AgendaEntry single_occurrence(AgendaEntry& e, unsigned k)
+{
+    // not worth copying
+    std::set<unsigned> dropped;
+    dropped.swap(e.dropped);
+    AgendaEntry occ = e;
+    e.dropped.swap(dropped);
+    occ.next = k;
+    return occ;
+}
+
+// true if [tbegin, tend] overlaps the device time of an accepted occurrence.
+// tfree is then the end of the overlapping occurrence
+bool CaptureAgenda::conflicts(double tbegin, double tend, double& tfree) const
+{
+    if(inflight && tbegin < inflight_end && inflight_begin < tend)
+    {
+        tfree = inflight_end;
+        return true;
+    }
+    for(const auto& e : entries)
+    {
+        // only the occurrences ending after tbegin and starting before tend
+        const double dur = rx_request_duration(e.req);
+        unsigned k = first_occurrence_from(e, tbegin - dur - lim.end_margin);
+        for(; k < e.count && e.occurrence(k) - e.setup_margin < tend; k = e.nextPending(k + 1))
+        {
+            const double f = e.occurrence(k) + dur + lim.end_margin;
+            if(tbegin < f)
+            {
+                tfree = f;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// first start time from t on at which every occurrence of e fits in
+// between the accepted ones, or infinity if there is none within
+// MAX_START_MOVES moves. Start times only move forward
+double CaptureAgenda::earliestStart(const AgendaEntry& e, double t) const
+{
+    const double dur = rx_request_duration(e.req);
+    for(unsigned moves = 0; moves < MAX_START_MOVES; moves++)
+    {
+        bool moved = false;
+        for(unsigned k = 0; k < e.count && !moved; k++)
+        {
+            double tfree;
+            const double tk = t + k * e.period;
+            if(conflicts(tk - e.setup_margin, tk + dur + lim.end_margin, tfree))
+            {
+                t = tfree + e.setup_margin - k * e.period;
+                moved = true;
+            }
+        }
+        if(!moved)
+            return t;
+    }
+    return std::numeric_limits<double>::infinity();
+}
+
+// a request only needs the shorter setup margin if the device is already
+// tuned to its frequency, by whatever runs right before it
+double CaptureAgenda::marginFor(const AgendaEntry& e) const
+{
+    double prev_fc = last_fc;
+    double prev_t = 0.0;
+    for(const auto& other : entries)
+    {
+        // the last occurrence of other before e
+        unsigned k = first_index_from(other, e.req.t0);
+        while(k > other.next && other.dropped.count(k - 1))
+            k--;
+        if(k == other.next)
+            continue;
+        const double t = other.occurrence(k - 1);
+        if(t > prev_t)
+        {
+            prev_t = t;
+            prev_fc = other.req.fc[other.req.nsteps - 1];
+        }
+    }
+    return (prev_fc == e.req.fc[0]) ? margin_same : margin_retune;
+}
+
+void CaptureAgenda::setSetupMargins(double same, double retune)
+{
+    std::unique_lock<std::mutex> lock(m);
+    margin_same = same;
+    margin_retune = retune;
+}
+
+double CaptureAgenda::entryBytes(const AgendaEntry& e, unsigned noccurrences) const
+{
+    return double(noccurrences) * e.req.nsteps * double(e.req.nsamp) * lim.samp_size;
+}
+
+double CaptureAgenda::pendingBytes() const
+{
+    double total = 0.0;
+    for(const auto& e : entries)
+        total += entryBytes(e, e.remaining());
+    return total;
+}
+
+// name, storage bandwidth and disk space checks, which do not depend on
+// when the request runs
+bool CaptureAgenda::checkResources(const AgendaEntry& e, Admission& ret) const
+{
+    if(e.name.empty() == false)
+    {
+        // the running capture keeps its name until it ended, a cancel
+        // would stop it too
+        if(inflight && inflight_name == e.name)
+        {
+            ret.reason = "exists";
+            return false;
+        }
+        for(const auto& other : entries)
+        {
+            if(other.name == e.name)
+            {
+                ret.reason = "exists";
+                return false;
+            }
+        }
+    }
+
+    // storage has to keep up with the sample rate, no matter when
+    if(lim.disk_bw > 0.0 && e.req.sps * lim.samp_size > lim.disk_bw)
+    {
+        ret.reason = "diskbw";
+        return false;
+    }
+
+    // everything accepted so far has to fit on the storage alongside
+    boost::system::error_code ec;
+    boost::filesystem::space_info si = boost::filesystem::space(lim.storage_path, ec);
+    if(!ec && pendingBytes() + entryBytes(e, e.count) + lim.disk_reserve > double(si.available))
+    {
+        ret.reason = "disk";
+        return false;
+    }
+    return true;
+}
+
+// device time, including the setup needed before each occurrence
+bool CaptureAgenda::checkDeviceTime(const AgendaEntry& e, double tnow, Admission& ret) const
+{
+    const double tmin = std::max(e.req.t0, tnow + e.setup_margin);
+    const double tfeasible = earliestStart(e, tmin);
+    if(tfeasible > e.req.t0)
+    {
+        ret.reason = (e.req.t0 < tnow + e.setup_margin) ? "late" : "busy";
+        ret.earliest = std::isfinite(tfeasible) ? tfeasible : 0.0;
+        return false;
+    }
+    return true;
+}
+
+// take the occurrences that overlap with the device time of e out of the
+// agenda and append them to dropped. Returns true if the running one has to
+// be stopped too, its device time then counts as free from tnow on
+bool CaptureAgenda::dropOverlapping(const AgendaEntry& e, double tnow, std::vector<AgendaEntry>& dropped)
+{
+    bool stop = false;
+    const double dur = rx_request_duration(e.req);
+    for(unsigned k = 0; k < e.count; k++)
+    {
+        const double b = e.occurrence(k) - e.setup_margin;
+        const double f = e.occurrence(k) + dur + lim.end_margin;
+        if(inflight && !stop && abort_flag == false && b < inflight_end && inflight_begin < f)
+        {
+            stop = true;
+            inflight_end = tnow;
+        }
+        for(auto& other : entries)
+        {
+            const double odur = rx_request_duration(other.req);
+            unsigned j = first_occurrence_from(other, b - odur - lim.end_margin);
+            while(j < other.count && other.occurrence(j) - other.setup_margin < f)
+            {
+                if(b < other.occurrence(j) + odur + lim.end_margin)
+                {
+                    dropped.push_back(single_occurrence(other, j));
+                    other.dropped.insert(j);
+                }
+                j = other.nextPending(j + 1);
+            }
+        }
+    }
+
+    // next has to stay on an occurrence that runs
+    for(auto it = entries.begin(); it != entries.end(); )
+    {
+        it->next = it->nextPending(it->next);
+        it->dropped.erase(it->dropped.begin(), it->dropped.lower_bound(it->next));
+        if(it->next == it->count)
+            it = entries.erase(it);
+        else
+            it++;
+    }
+    return stop;
+}
+
+Admission CaptureAgenda::admit(const AgendaEntry& request, double tnow,
+                                bool preempt,
+                                std::vector<AgendaEntry> *preempted)
+{
+    std::unique_lock<std::mutex> lock(m);
+    Admission ret = {false, "", 0.0};
+    AgendaEntry e = request;
+    e.next = 0;
+    e.setup_margin = marginFor(e);
+
+    if(checkResources(e, ret) == false)
+        return ret;
+
+    // make room by dropping the occurrences that overlap with the request,
+    // unless it is too late to run anyway. That is only tried out on the
+    // agenda, and undone if the request does not fit even so
+    std::list<AgendaEntry> kept;
+    const double kept_inflight_end = inflight_end;
+    std::vector<AgendaEntry> dropped;
+    bool stop = false;
+    preempt = preempt && e.req.t0 >= tnow + e.setup_margin;
+    if(preempt)
+    {
+        kept = entries;
+        stop = dropOverlapping(e, tnow, dropped);
+    }
+
+    if(checkDeviceTime(e, tnow, ret) == false)
+    {
+        if(preempt)
+        {
+            entries.swap(kept);
+            inflight_end = kept_inflight_end;
+        }
+        return ret;
+    }
+
+    // the USRP thread reports the aborted occurrence itself
+    if(stop)
+        abort_flag = true;
+    if(preempted != nullptr)
+        preempted->insert(preempted->end(), dropped.begin(), dropped.end());
+    entries.push_back(e);
+    ret.ok = true;
+    // the new entry may be due before whatever the USRP thread waits for
+    cond.notify_all();
+    return ret;
+}
+
+Admission CaptureAgenda::admitGroup(const std::vector<AgendaEntry>& group, double tnow, size_t& failed)
+{
+    std::unique_lock<std::mutex> lock(m);
+    Admission ret = {false, "", 0.0};
+
+    // members are added as they pass, so later ones are checked against
+    // them, and taken out again if one does not fit
+    for(failed = 0; failed < group.size(); failed++)
+    {
+        AgendaEntry e = group[failed];
+        e.next = 0;
+        e.setup_margin = marginFor(e);
+        if(checkResources(e, ret) == false || checkDeviceTime(e, tnow, ret) == false)
+        {
+            for(size_t i = 0; i < failed; i++)
+                entries.pop_back();
+            return ret;
+        }
+        entries.push_back(e);
+    }
+
+    ret.ok = true;
+    cond.notify_all();
+    return ret;
+}
+
+bool CaptureAgenda::cancel(const std::string& name)
+{
+    std::unique_lock<std::mutex> lock(m);
+    bool found = false;
+    if(name.empty())
+        return false;
+    if(inflight && inflight_name == name)
+    {
+        abort_flag = true;
+        found = true;
+    }
+    for(auto it = entries.begin(); it != entries.end(); it++)
+    {
+        if(it->name == name)
+        {
+            entries.erase(it);
+            cond.notify_all();
+            found = true;
+            break;
+        }
+    }
+    return found;
+}
+
+bool CaptureAgenda::popNext(AgendaEntry& occ, double lead)
+{
+    std::unique_lock<std::mutex> lock(m);
+    std::list<AgendaEntry>::iterator first;
+    while(true)
+    {
+        if(closed)
+            return false;
+        first = entries.begin();
+        for(auto it = entries.begin(); it != entries.end(); it++)
+        {
+            if(it->occurrence(it->next) < first->occurrence(first->next))
+                first = it;
+        }
+        if(first == entries.end())
+        {
+            cond.wait(lock);
+            continue;
+        }
+        const double twake = first->occurrence(first->next) - first->setup_margin - lead;
+        if(systime_now_double() >= twake)
+            break;
+        // woken up early whenever the agenda changes
+        cond.wait_until(lock, double2timepoint<std::chrono::system_clock>(twake));
+    }
+
+    occ = *first;
+    occ.req.t0 = first->occurrence(first->next);
+    abort_flag = false;
+    inflight = true;
+    inflight_name = occ.name;
+    inflight_begin = occ.req.t0 - occ.setup_margin;
+    last_fc = occ.req.fc[occ.req.nsteps - 1];
+    inflight_end = occ.req.t0 + rx_request_duration(occ.req) + lim.end_margin;
+
+    first->next = first->nextPending(first->next + 1);
+    first->dropped.erase(first->dropped.begin(), first->dropped.lower_bound(first->next));
+    if(first->next == first->count)
+        entries.erase(first);
+    return true;
+}
+
+void CaptureAgenda::close()
+{
+    {
+        std::unique_lock<std::mutex> lock(m);
+        closed = true;
+        abort_flag = true;
+    }
+    cond.notify_all();
+}
+
+void CaptureAgenda::finished()
+{
+    std::unique_lock<std::mutex> lock(m);
+    inflight = false;
+}
+
+bool CaptureAgenda::deviceIdle(double tbegin, double tend) const
+{
+    std::unique_lock<std::mutex> lock(m);
+    double tfree;
+    return conflicts(tbegin, tend, tfree) == false;
+}
@@ -0,0 +1,152 @@
+/*
+ * Captures that were accepted but have not run yet. Requests are admitted
+ * against everything already accepted (device time, storage bandwidth and
+ * disk space) as soon as they arrive, and the USRP thread takes the
+ * occurrences out in start time order.
+ */
+
+#ifndef CAPTURE_AGENDA_HPP
+#define CAPTURE_AGENDA_HPP
+
+#include <string>
+#include <list>
+#include <set>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "rx_request.hpp"
+
+/*
+ * an accepted request. One-off captures are a schedule with a single
+ * occurrence, and only have a name if the client gave them an id
+ */
+struct AgendaEntry
+{
+    std::string name;   // id to cancel the entry with, may be empty
+    bool recurring;     // true for schedules
+    RxRequest req;      // req.t0 is the first occurrence
+    double period;
+    unsigned count;
+    unsigned next;      // index of the next occurrence to run
+    double setup_margin; // device time needed before each occurrence, set on admission
+    double tarrived;    // system time the request message was received
+    double tdequeued;   // system time the USRP thread took the occurrence, 0 before
+    std::set<unsigned> dropped; // occurrences after next that were preempted
+
+    double occurrence(unsigned k) const { return req.t0 + k * period; }
+    // first occurrence from k on that was not preempted, count if none
+    unsigned nextPending(unsigned k) const
+    {
+        while(k < count && dropped.count(k))
+            k++;
+        return k;
+    }
+    // occurrences still to run, including next
+    unsigned remaining() const { return count - next - dropped.size(); }
+};
+
+/*
+ * outcome of an admission check. earliest is the first start time at which
+ * the request would have been accepted, or 0 if moving it cannot help
+ */
+struct Admission
+{
+    bool ok;
+    std::string reason;
+    double earliest;
+};
+
+/*
+ * resources every admitted request is checked against
+ */
+struct AgendaLimits
+{
+    double setup_margin;        // initial setup margin needed before t0 (s)
+    double end_margin;          // uncertainty on when streaming ends (s)
+    double disk_bw;             // sustained storage write rate (B/s), 0 to skip
+    double disk_reserve;        // free space to leave on the storage (B)
+    size_t samp_size;           // bytes per stored sample
+    std::string storage_path;   // directory captures are written to
+};
+
+class CaptureAgenda
+{
+    private:
+        std::list<AgendaEntry> entries;
+        AgendaLimits lim;
+        // setup margins for requests that stay on the same frequency or
+        // retune, and the frequency the device was last tuned to
+        double margin_same;
+        double margin_retune;
+        double last_fc;
+        // device time taken by the occurrence the USRP thread is running
+        bool inflight;
+        std::string inflight_name;
+        double inflight_begin;
+        double inflight_end;
+        // set to make the USRP thread stop the occurrence it is running
+        std::atomic<bool> abort_flag;
+        // set by close(), nothing is handed out afterwards
+        bool closed;
+        std::condition_variable cond;
+        mutable std::mutex m;
+
+        bool conflicts(double tbegin, double tend, double& tfree) const;
+        double earliestStart(const AgendaEntry& e, double t) const;
+        double marginFor(const AgendaEntry& e) const;
+        // estimates in double, a product of request fields can exceed 64 bits
+        double pendingBytes() const;
+        double entryBytes(const AgendaEntry& e, unsigned noccurrences) const;
+        bool checkResources(const AgendaEntry& e, Admission& ret) const;
+        bool checkDeviceTime(const AgendaEntry& e, double tnow, Admission& ret) const;
+        bool dropOverlapping(const AgendaEntry& e, double tnow, std::vector<AgendaEntry>& dropped);
+
+    public:
+        CaptureAgenda(const AgendaLimits& limits);
+
+        // check a request against the accepted ones and keep it if it fits.
+        // With preempt, it is checked as if the occurrences standing in the
+        // way of its device time were not there. If it then fits, they are
+        // dropped (and stopped if running) and appended to preempted, one
+        // entry per occurrence with next set to its index
+        Admission admit(const AgendaEntry& e, double tnow,
+                        bool preempt = false,
+                        std::vector<AgendaEntry> *preempted = nullptr);
+
+        // admit all requests of a group or none of them. Members are checked
+        // in order, against the accepted entries and the members before
+        // them. On rejection, failed is the index of the member that did
+        // not fit
+        Admission admitGroup(const std::vector<AgendaEntry>& group, double tnow, size_t& failed);
+
+        // drop the remaining occurrences of a named entry and stop it if
+        // it is the one running
+        bool cancel(const std::string& name);
+
+        // block until the earliest pending occurrence is due to be set up,
+        // lead seconds before its setup margin, and take it out of the
+        // agenda. occ.req.t0 is the occurrence start and occ.next its index.
+        // Returns false once the agenda was closed
+        bool popNext(AgendaEntry& occ, double lead);
+
+        // stop the running occurrence and make popNext return false, for
+        // shutting down. Pending entries are kept but never run
+        void close();
+
+        // margins to use for requests admitted from now on
+        void setSetupMargins(double same, double retune);
+
+        // the occurrence taken by popNext released the device
+        void finished();
+
+        // true if no occurrence runs or is due (including its setup and
+        // end margins) between tbegin and tend, e.g. for background work
+        // that should stay out of the way of captures
+        bool deviceIdle(double tbegin, double tend) const;
+
+        // polled by the USRP thread while an occurrence runs. Reset by popNext
+        const std::atomic<bool>& abortFlag() const { return abort_flag; }
+};
+
+#endif // CAPTURE_AGENDA_HPP
@@ -0,0 +1,97 @@
+/*
+ * Consumers of the samples of a capture besides its file. The USRP thread
+ * hands every received buffer to each sink right after writing it, so a
+ * sink must never block: whatever it can't keep up with it drops.
+ *
+ * A sink can also lend the buffer the next recv() fills, and then gets its
+ * own buffer back in write() without a copy. The file and the other sinks
+ * read the samples from there.
+ */
+
+#ifndef CAPTURE_SINK_HPP
+#define CAPTURE_SINK_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * one capture, or one step of a sweep
+ */
+struct CaptureInfo
+{
+    std::string name;       // request id, may be empty
+    std::string file;
+    double t0;
+    double fc;
+    double sps;
+    unsigned long long nsamp;
+    std::string cpu_format; // short, float or double (complex)
+    size_t samp_size;       // bytes per sample
+};
+
+/*
+ * host sample types as sinks label them for other processes
+ */
+enum SampleFormat : uint8_t
+{
+    SAMPLE_SC16 = 1,    // complex<short>
+    SAMPLE_FC32,        // complex<float>
+    SAMPLE_FC64         // complex<double>
+};
+
+inline SampleFormat sample_format(const std::string& cpu_format)
+{
+    if(cpu_format == "double")
+        return SAMPLE_FC64;
+    if(cpu_format == "float")
+        return SAMPLE_FC32;
+    return SAMPLE_SC16;
+}
+
+// bytes per sample of a SampleFormat
+inline size_t sample_size(SampleFormat format)
+{
+    switch(format)
+    {
+        case SAMPLE_FC64: return 2 * sizeof(double);
+        case SAMPLE_FC32: return 2 * sizeof(float);
+        default:          return 2 * sizeof(short);
+    }
+}
+
+/*
+ * device time as uhd::time_spec_t keeps it: GPS time in a double is only
+ * good to a few hundred ns
+ */
+struct DeviceTime
+{
+    int64_t secs;
+    double frac;
+
+    double real() const { return double(secs) + frac; }
+};
+
+class CaptureSink
+{
+    public:
+        virtual ~CaptureSink() {}
+
+        // a capture starts streaming
+        virtual void begin(const CaptureInfo& info) = 0;
+
+        // nsamps samples received. index is the position of the first of
+        // them in the capture, tdev its device time
+        virtual void write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev) = 0;
+
+        // buffer of at least nbytes for the next recv(), valid until the
+        // next write() or end(). nullptr to get the samples in any buffer
+        virtual void* recvBuffer(size_t nbytes) { return nullptr; }
+
+        // the capture ended, ok if all samples were received
+        virtual void end(bool ok) = 0;
+};
+
+typedef std::vector<CaptureSink*> CaptureSinks;
+
+#endif // CAPTURE_SINK_HPP
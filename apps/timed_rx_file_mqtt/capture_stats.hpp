@@ -0,0 +1,32 @@
+/*
+ * Performance counters of one capture, or one step of a sweep, collected
+ * by the recv loop and published on the telemetry topic
+ */
+
+#ifndef CAPTURE_STATS_HPP
+#define CAPTURE_STATS_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+struct CaptureStats
+{
+    std::string file;
+    double t0;
+    unsigned long long requested;   // samples
+    unsigned long long received;
+    unsigned long long bytes;       // written to the file
+    double duration;                // s from t0 to the end of streaming
+    unsigned overflows;
+    std::vector<double> write_lat;  // s per file write
+    std::map<size_t, size_t> sizes; // samples returned by recv: number of calls
+    std::string error;              // receiver error that ended it, empty if none
+    // stage times for the response, 0 if not reached
+    double setup_done;              // system time the stream command was issued
+    double first_sample;            // device time of the first sample
+    double last_sample;             // device time of the last sample
+    double closed;                  // system time the file was closed
+};
+
+#endif // CAPTURE_STATS_HPP
@@ -0,0 +1,151 @@
+/*
+ * Throughput of the request and ack encodings: the key=value text parser
+ * against the sscanf format it replaced and the binary encoding, and text
+ * against binary acks. Runs without a USRP or broker.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include "request_parser.hpp"
+#include "wire_codec.hpp"
+#include "stopwatch.hpp"
+
+namespace po = boost::program_options;
+
+// the fixed order format used before the key=value parser
+static bool sscanf_parse(const std::string& rxmsg, RxRequest& req)
+{
+    char antc[32];
+    int n_decoded = std::sscanf(rxmsg.c_str(),
+    "fc=%lf,lo=%lf,sps=%lf,bw=%lf,g=%lf,t0=%lf,n=%llu,ant=%31[^,]",
+        &req.fc[0],
+        &req.lo,
+        &req.sps,
+        &req.bw,
+        &req.gain,
+        &req.t0,
+        &req.nsamp,
+        antc);
+    if(n_decoded != 8)
+        return false;
+    req.nsteps = 1;
+    req.ant = std::string(antc);
+    return true;
+}
+
+template <typename T, typename F>
+static void run(const std::string& name, const std::vector<T>& msgs, unsigned long iters, F op)
+{
+    unsigned long nok = 0;
+    size_t nbytes = 0;
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
+    for(unsigned long i = 0; i < iters; i++)
+        nok += op(msgs[i % msgs.size()], nbytes) ? 1 : 0;
+    double secs = std::chrono::duration<double>(sw.passed()).count();
+
+    std::cout << boost::format("%-12s %10.1lf ns/msg %12.0lf msgs/s %6.1lf B/msg (%lu/%lu ok)")
+                    % name
+                    % (1e9 * secs / iters)
+                    % (iters / secs)
+                    % (double(nbytes) / iters)
+                    % nok
+                    % iters << std::endl;
+}
+
+// binary form of each text message
+static std::vector<std::string> to_binary(const std::vector<std::string>& msgs)
+{
+    std::vector<std::string> out;
+    std::vector<ParsedRequest> parsed(1);
+    ParseStatus status;
+    for(const auto& m : msgs)
+    {
+        if(parse_request(m, parsed[0], status) == false)
+            throw std::runtime_error("bad benchmark message " + m);
+        out.emplace_back();
+        encode_requests(parsed, out.back());
+    }
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iters;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("iters", po::value<unsigned long>(&iters)->default_value(2000000), "messages per run")
+    ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    // same capture in the old field order, so both parsers accept it
+    const std::vector<std::string> capture = {
+        "fc=915e6,lo=1e6,sps=1e6,bw=1e6,g=30,t0=1700000000.5,n=2000000,ant=TX/RX",
+        "fc=433.92e6,lo=0,sps=2.5e6,bw=2e6,g=45.5,t0=1700000100,n=500000,ant=RX2",
+    };
+    // reordered, optional fields left out, sweeps and schedules
+    const std::vector<std::string> mixed = {
+        "t0=1700000000.5,fc=915e6,n=2000000,sps=1e6",
+        "sweep=902e6:908e6:914e6:920e6:926e6,sps=1e6,t0=1700000000,n=100000,dwell=0.2,g=20",
+        "sched=ism,period=60,count=100,fc=433.92e6,sps=2.5e6,t0=1700000100,n=500000,ant=RX2",
+        "id=burst7,fc=2.45e9,sps=10e6,bw=8e6,t0=1700000200,n=1000000",
+    };
+    const std::vector<std::string> capture_bin = to_binary(capture);
+    const std::vector<std::string> mixed_bin = to_binary(mixed);
+
+    // a typical mix of responses
+    std::vector<Ack> acks;
+    acks.push_back(make_ack(AckCode::SAVED, "gw-roof"));
+    acks.back().name = "burst7";
+    acks.back().t0 = 1700000200;
+    acks.back().files.push_back("/data/exp0_2450.000M_2023-11-14_22-16-40.000.dat");
+    acks.push_back(make_ack(AckCode::REJECTED, "gw-roof"));
+    acks.back().t0 = 1700000100;
+    acks.back().reason = "busy";
+    acks.back().earliest = 1700000105.25;
+    acks.push_back(make_ack(AckCode::ACCEPTED, "gw-roof"));
+    acks.back().name = "ism";
+    acks.back().recurring = true;
+    acks.back().count = 100;
+    std::vector<std::string> acks_bin;
+    for(const auto& a : acks)
+    {
+        acks_bin.emplace_back();
+        encode_ack(a, acks_bin.back());
+    }
+
+    RxRequest req;
+    ParsedRequest parsed;
+    std::vector<ParsedRequest> parsed_bin;
+    ParseStatus status;
+    size_t failed;
+    std::string out;
+    Ack ack;
+
+    std::cout << "requests" << std::endl;
+    run("sscanf", capture, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return sscanf_parse(m, req); });
+    run("text", capture, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return parse_request(m, parsed, status); });
+    run("binary", capture_bin, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return decode_requests(m, parsed_bin, status, failed); });
+    run("text-mixed", mixed, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return parse_request(m, parsed, status); });
+    run("binary-mixed", mixed_bin, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return decode_requests(m, parsed_bin, status, failed); });
+
+    std::cout << "acks" << std::endl;
+    run("text-enc", acks, iters, [&](const Ack& a, size_t& nb) { out = ack_text(a); nb += out.size(); return true; });
+    run("binary-enc", acks, iters, [&](const Ack& a, size_t& nb) { out.clear(); encode_ack(a, out); nb += out.size(); return true; });
+    run("binary-dec", acks_bin, iters, [&](const std::string& m, size_t& nb) { nb += m.size(); return decode_ack(m, ack); });
+
+    return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * Live sample stream to local clients
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "live_stream.hpp"
+
+const int LIVE_BACKLOG = 8;
+
+static void put_uint(std::string& out, uint64_t v, size_t nbytes)
+{
+    for(size_t i = 0; i < nbytes; i++)
+        out.push_back(char((v >> (8 * i)) & 0xff));
+}
+
+// the same into a header, returns the position after it
+static char* store_uint(char* p, uint64_t v, size_t nbytes)
+{
+    for(size_t i = 0; i < nbytes; i++)
+        *p++ = char((v >> (8 * i)) & 0xff);
+    return p;
+}
+
+static char* store_f64(char* p, double v)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(v));
+    return store_uint(p, bits, 8);
+}
+
+static void put_str(std::string& out, const std::string& v)
+{
+    const size_t len = std::min<size_t>(v.size(), 0xffff);
+    put_uint(out, len, 2);
+    out.append(v, 0, len);
+}
+
+LiveStream::LiveStream(const std::string& endpoint, int listen_fd, size_t max_queued)
+    : endpoint(endpoint), listen_fd(listen_fd), wake_fd{-1, -1}, max_queued(max_queued),
+      clients(), nclients(0), m(), begin_frame(),
+      info(), format(SAMPLE_SC16), active(false), next_index(0),
+      pool(), pool_next(0), lent(), dropped(0), stopping(false), sender()
+{
+    if(pipe2(wake_fd, O_NONBLOCK | O_CLOEXEC) != 0)
+        throw std::runtime_error(std::string("live stream pipe: ") + std::strerror(errno));
+    sender = std::thread(&LiveStream::run, this);
+}
+
+LiveStream::~LiveStream()
+{
+    stopping = true;
+    wake();
+    sender.join();
+    for(auto& c : clients)
+        ::close(c->fd);
+    ::close(listen_fd);
+    ::close(wake_fd[0]);
+    ::close(wake_fd[1]);
+    if(boost::algorithm::starts_with(endpoint, "unix:"))
+        ::unlink(endpoint.substr(5).c_str());
+}
+
+// the LIVE_HEADER_SIZE bytes at h
+void LiveStream::header(char* h, char kind, size_t payload, unsigned long long index,
+                        const DeviceTime& t, uint8_t flags) const
+{
+    *h++ = 'U';
+    *h++ = 'L';
+    *h++ = char(LIVE_VERSION);
+    *h++ = kind;
+    h = store_uint(h, payload, 4);
+    h = store_uint(h, index, 8);
+    h = store_uint(h, uint64_t(t.secs), 8);
+    h = store_f64(h, t.frac);
+    h = store_f64(h, info.sps);
+    h = store_f64(h, info.fc);
+    *h++ = char(format);
+    *h++ = char(flags);
+    h = store_uint(h, info.samp_size, 2);
+    store_uint(h, 0, 4);
+}
+
+void LiveStream::begin(const CaptureInfo& ci)
+{
+    info = ci;
+    format = sample_format(ci.cpu_format);
+    active = true;
+    next_index = 0;
+
+    dropped = 0;
+
+    std::string f(LIVE_HEADER_SIZE, '\0');
+    put_str(f, info.name);
+    put_str(f, info.file);
+    const double whole = std::floor(info.t0);
+    header(&f[0], 'B', f.size() - LIVE_HEADER_SIZE, info.nsamp, DeviceTime{int64_t(whole), info.t0 - whole}, 0);
+    queue(std::make_shared<const std::string>(std::move(f)), 'B');
+}
+
+// a pool buffer for a frame of nbytes samples. A new one while the pool
+// holds less than a client may have queued, nullptr if it ran dry
+LiveStream::Buffer LiveStream::takeBuffer(size_t nbytes)
+{
+    const size_t n = pool.size();
+    for(size_t k = 0; k < n; k++)
+    {
+        const size_t i = (pool_next + k) % n;
+        // no client or sender has it: only the USRP thread hands out
+        // references, so it stays free
+        if(pool[i].use_count() == 1)
+        {
+            // see the sender's last use of it before reusing it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            pool_next = (i + 1) % n;
+            pool[i]->resize(LIVE_HEADER_SIZE + nbytes);
+            return pool[i];
+        }
+    }
+    const size_t frame = LIVE_HEADER_SIZE + nbytes;
+    if(n * frame > max_queued + 2 * frame)
+        return nullptr;
+    pool.push_back(std::make_shared<std::string>(frame, '\0'));
+    pool_next = 0;
+    return pool.back();
+}
+
+void* LiveStream::recvBuffer(size_t nbytes)
+{
+    if(active == false || nclients == 0)
+    {
+        lent = nullptr;
+        return nullptr;
+    }
+    if(lent == nullptr || lent->size() < LIVE_HEADER_SIZE + nbytes)
+        lent = takeBuffer(nbytes);
+    return (lent == nullptr) ? nullptr : &(*lent)[LIVE_HEADER_SIZE];
+}
+
+void LiveStream::write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev)
+{
+    if(active == false || nsamps == 0)
+        return;
+    next_index = index + nsamps;
+    const size_t nbytes = nsamps * info.samp_size;
+    Buffer f;
+    if(lent != nullptr && samples == &(*lent)[LIVE_HEADER_SIZE])
+    {
+        // received in place
+        f = std::move(lent);
+        f->resize(LIVE_HEADER_SIZE + nbytes);
+    }
+    else
+    {
+        lent = nullptr;
+        if(nclients == 0)
+            return;
+        f = takeBuffer(nbytes);
+        if(f == nullptr)
+        {
+            dropped++;
+            return;
+        }
+        std::memcpy(&(*f)[LIVE_HEADER_SIZE], samples, nbytes);
+    }
+    header(&(*f)[0], 'S', nbytes, index, tdev, 0);
+    queue(f, 'S');
+}
+
+void LiveStream::end(bool ok)
+{
+    if(active == false)
+        return;
+    active = false;
+    lent = nullptr;
+    if(dropped > 0)
+        std::cerr << boost::format("[LIVEerror] %s: %llu frames not sent, the pool was dry") % info.file % dropped << std::endl;
+    std::string f(LIVE_HEADER_SIZE, '\0');
+    header(&f[0], 'E', 0, next_index, DeviceTime{0, 0.0}, ok ? LIVE_FLAG_COMPLETE : 0);
+    queue(std::make_shared<const std::string>(std::move(f)), 'E');
+}
+
+// the same frame for every client, marking those it doesn't fit any more.
+// Clients connecting later get the BEGIN of the capture until it ends
+void LiveStream::queue(const Frame& f, char kind)
+{
+    bool kick = false;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if(kind == 'B')
+            begin_frame = f;
+        else if(kind == 'E')
+            begin_frame = nullptr;
+        for(auto& c : clients)
+        {
+            if(c->slow)
+                continue;
+            if(c->queued + f->size() > max_queued)
+            {
+                c->slow = true;
+                kick = true;
+                continue;
+            }
+            kick = kick || c->frames.empty();
+            c->frames.push_back(f);
+            c->queued += f->size();
+        }
+    }
+    if(kick)
+        wake();
+}
+
+void LiveStream::wake()
+{
+    const char b = 0;
+    // a full pipe already wakes the sender up
+    if(::write(wake_fd[1], &b, 1) < 0 && errno != EAGAIN)
+        std::cerr << "[LIVEerror] wake: " << std::strerror(errno) << std::endl;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void LiveStream::run()
+{
+    std::vector<struct pollfd> fds;
+    while(stopping == false)
+    {
+        fds.clear();
+        fds.push_back({listen_fd, POLLIN, 0});
+        fds.push_back({wake_fd[0], POLLIN, 0});
+        {
+            std::lock_guard<std::mutex> lock(m);
+            for(auto& c : clients)
+                fds.push_back({c->fd, short(POLLIN | (c->frames.empty() ? 0 : POLLOUT)), 0});
+        }
+        if(poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            std::cerr << "[LIVEerror] poll: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            char buf[64];
+            while(::read(wake_fd[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        // clients only come and go on this thread, fds[i + 2] is clients[i]
+        for(size_t i = clients.size(); i-- > 0; )
+        {
+            Client& c = *clients[i];
+            const short ev = fds[i + 2].revents;
+            bool slow;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                slow = c.slow;
+            }
+            if(slow)
+            {
+                dropClient(i, "too slow");
+                continue;
+            }
+            // whatever a client sends is ignored, reading nothing means
+            // it closed
+            if(ev & (POLLIN | POLLHUP | POLLERR))
+            {
+                char buf[256];
+                const ssize_t n = ::recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                {
+                    dropClient(i, "closed");
+                    continue;
+                }
+            }
+            if(sendQueued(c) == false)
+                dropClient(i, "send failed");
+        }
+
+        if(fds[0].revents & POLLIN)
+            acceptClient();
+    }
+}
+
+void LiveStream::acceptClient()
+{
+    const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            std::cerr << "[LIVEerror] accept: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    std::unique_ptr<Client> c(new Client{fd, {}, 0, false, 0});
+    std::lock_guard<std::mutex> lock(m);
+    if(begin_frame != nullptr)
+    {
+        c->frames.push_back(begin_frame);
+        c->queued = begin_frame->size();
+    }
+    clients.push_back(std::move(c));
+    nclients = clients.size();
+    std::cout << boost::format("[LIVEdebug] client %d connected, %lu clients") % fd % clients.size() << std::endl;
+}
+
+// send what the socket takes without blocking. The USRP thread only adds
+// to the back of frames, so the front one is sent without holding m
+bool LiveStream::sendQueued(Client& c)
+{
+    while(true)
+    {
+        Frame f;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if(c.frames.empty())
+                return true;
+            f = c.frames.front();
+        }
+        const ssize_t n = ::send(c.fd, f->data() + c.sent, f->size() - c.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        c.sent += size_t(n);
+        if(c.sent < f->size())
+            continue;
+        c.sent = 0;
+        std::lock_guard<std::mutex> lock(m);
+        c.frames.pop_front();
+        c.queued -= f->size();
+    }
+}
+
+void LiveStream::dropClient(size_t i, const char* why)
+{
+    std::lock_guard<std::mutex> lock(m);
+    const int fd = clients[i]->fd;
+    std::cout << boost::format("[LIVEdebug] client %d dropped (%s) with %lu bytes queued")
+                    % fd % why % clients[i]->queued << std::endl;
+    ::close(fd);
+    clients.erase(clients.begin() + i);
+    nclients = clients.size();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+static int listen_tcp(const std::string& addr, const std::string& port)
+{
+    struct sockaddr_in sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    char* end = nullptr;
+    const unsigned long p = std::strtoul(port.c_str(), &end, 10);
+    if(port.empty() || *end != '\0' || p > 0xffff || inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1)
+    {
+        std::cerr << "[LIVEerror] invalid address " << addr << ":" << port << std::endl;
+        return -1;
+    }
+    sa.sin_port = htons(uint16_t(p));
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int on = 1;
+    if(fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+        || ::bind(fd, reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa)) != 0
+        || ::listen(fd, LIVE_BACKLOG) != 0)
+    {
+        std::cerr << boost::format("[LIVEerror] listening on %s:%s: %s") % addr % port % std::strerror(errno) << std::endl;
+        if(fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const std::string& path)
+{
+    struct sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if(path.empty() || path.size() >= sizeof(sa.sun_path))
+    {
+        std::cerr << "[LIVEerror] invalid socket path " << path << std::endl;
+        return -1;
+    }
+    std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+    // left over from a previous run
+    ::unlink(path.c_str());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0 || ::bind(fd, reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa)) != 0
+        || ::listen(fd, LIVE_BACKLOG) != 0)
+    {
+        std::cerr << boost::format("[LIVEerror] listening on %s: %s") % path % std::strerror(errno) << std::endl;
+        if(fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::unique_ptr<LiveStream> make_live_stream(const std::string& endpoint, size_t max_queued)
+{
+    int fd = -1;
+    if(boost::algorithm::starts_with(endpoint, "unix:"))
+        fd = listen_unix(endpoint.substr(5));
+    else if(boost::algorithm::starts_with(endpoint, "tcp:"))
+    {
+        const std::string rest = endpoint.substr(4);
+        const size_t colon = rest.rfind(':');
+        fd = (colon == std::string::npos) ? listen_tcp("127.0.0.1", rest)
+                                          : listen_tcp(rest.substr(0, colon), rest.substr(colon + 1));
+    }
+    if(fd < 0)
+        return nullptr;
+    std::cout << "[LIVEdebug] serving live samples on " << endpoint << std::endl;
+    return std::unique_ptr<LiveStream>(new LiveStream(endpoint, fd, max_queued));
+}
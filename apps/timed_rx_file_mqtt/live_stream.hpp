@@ -0,0 +1,122 @@
+/*
+ * Capture sink serving the samples of every capture live, while they are
+ * received, to local clients connected over TCP or a Unix socket.
+ *
+ * Clients only read. Every capture is sent as a BEGIN frame, SAMPLES frames
+ * as the buffers come in and an END frame, each a LIVE_HEADER_SIZE header
+ *   0   'U', 'L', LIVE_VERSION, kind ('B', 'S' or 'E')
+ *   4   u32 payload bytes following the header
+ *   8   u64 index of the first sample (S), samples requested (B) or
+ *       received (E)
+ *   16  i64 whole seconds and
+ *   24  f64 fractional seconds of the device time of the first sample (S)
+ *       or of t0 (B), 0 for E
+ *   32  f64 sample rate
+ *   40  f64 center frequency
+ *   48  u8 format (SampleFormat), u8 flags (E: LIVE_FLAG_COMPLETE if every
+ *       sample was received), u16 bytes per sample, u32 0
+ * numbers little endian. The payload of S is the samples as the host got
+ * them (interleaved I and Q, host byte order), that of B the request id
+ * and the file name, each a u16 length and its characters. A client
+ * connecting in the middle of a capture gets its BEGIN first, then the
+ * samples from where it joined; gaps in the index of S frames are samples
+ * it missed.
+ *
+ * The USRP thread only builds each frame once and queues it for every
+ * client; a thread of the stream does the sending. A client that lets more
+ * than its buffer pile up is disconnected instead of holding up recv().
+ *
+ * SAMPLES frames are built in buffers of a pool that grows to about
+ * max_queued bytes and is then reused, so the USRP thread doesn't allocate
+ * once it warmed up. While a client is connected the stream also lends
+ * recv() the next buffer, and the samples land right behind the header. A
+ * frame finding the pool dry, which takes clients being dropped for
+ * falling behind, is not sent to anyone.
+ */
+
+#ifndef LIVE_STREAM_HPP
+#define LIVE_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include "capture_sink.hpp"
+
+const uint8_t LIVE_VERSION = 1;
+const size_t LIVE_HEADER_SIZE = 56;
+const uint8_t LIVE_FLAG_COMPLETE = 1;
+
+class LiveStream : public CaptureSink
+{
+    private:
+        typedef std::shared_ptr<const std::string> Frame;
+        typedef std::shared_ptr<std::string> Buffer;
+
+        struct Client
+        {
+            int fd;
+            std::deque<Frame> frames;   // waiting to be sent, guarded by m
+            size_t queued;              // bytes in frames
+            bool slow;                  // went over its buffer, to be dropped
+            size_t sent;                // of the front frame, sender thread only
+        };
+
+        std::string endpoint;
+        int listen_fd;
+        int wake_fd[2];         // pipe waking the sender thread up
+        size_t max_queued;
+
+        // clients are only added and removed by the sender thread, under m
+        std::vector<std::unique_ptr<Client>> clients;
+        std::atomic<size_t> nclients;
+        std::mutex m;
+        Frame begin_frame;      // of the capture streaming, for late joiners
+
+        // USRP thread side
+        CaptureInfo info;
+        uint8_t format;
+        bool active;
+        unsigned long long next_index;  // sample after the last one received
+        // frame buffers, free when the pool holds the only reference
+        std::vector<Buffer> pool;
+        size_t pool_next;       // where to look for a free one first
+        Buffer lent;            // to recv(), until the next write() or end()
+        unsigned long long dropped;     // frames of the capture the pool was dry for
+
+        std::atomic<bool> stopping;
+        std::thread sender;
+
+        Buffer takeBuffer(size_t nbytes);
+        void queue(const Frame& f, char kind);
+        void wake();
+        void run();
+        void acceptClient();
+        bool sendQueued(Client& c);
+        void dropClient(size_t i, const char* why);
+        void header(char* h, char kind, size_t payload, unsigned long long index,
+                    const DeviceTime& t, uint8_t flags) const;
+
+    public:
+        // takes over a listening socket
+        LiveStream(const std::string& endpoint, int listen_fd, size_t max_queued);
+        ~LiveStream();
+
+        void begin(const CaptureInfo& info) override;
+        void write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev) override;
+        void* recvBuffer(size_t nbytes) override;
+        void end(bool ok) override;
+};
+
+/*
+ * listen on tcp:<port> (loopback only), tcp:<address>:<port> or
+ * unix:<path>. Clients that have more than max_queued bytes waiting are
+ * dropped. nullptr if endpoint is invalid or can't be listened on
+ */
+std::unique_ptr<LiveStream> make_live_stream(const std::string& endpoint, size_t max_queued);
+
+#endif // LIVE_STREAM_HPP
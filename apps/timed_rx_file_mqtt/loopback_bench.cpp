@@ -0,0 +1,238 @@
+/*
+ * Request and ack flow of the gateway end to end, with its MQTT and
+ * request threads talking to a client through an in-process LoopbackBroker
+ * instead of a real broker. No USRP is involved: requests are admitted into
+ * the agenda and answered, but never run.
+ *
+ * The broker can drop the gateway's connection or go offline a number of
+ * times during the run, which shows how long reconnects take and, with
+ * --persist, that QoS 1 requests and responses survive them.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include "protected_queue.hpp"
+#include "ops_helper.hpp"
+#include "wire_codec.hpp"
+#include "time_helper.hpp"
+#include "transport.hpp"
+#include "loopback_broker.hpp"
+
+namespace po = boost::program_options;
+
+const int QOS = 1;
+const std::string BENCH_BROKER = "bench";
+const std::string GATEWAY_ID = "gw";
+
+// client side: time from sending a request to its first response
+class BenchClient : public TransportListener
+{
+    private:
+        std::mutex m;
+        std::map<std::string, double> sent;     // request id: send time
+        std::vector<double> lat;
+        unsigned long accepted;
+        unsigned long rejected;
+        unsigned long other;
+
+        void connected() override {}
+        void connectFailed() override {}
+        void connectionLost(const std::string& cause) override {}
+
+        void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) override
+        {
+            Ack ack;
+            if(decode_ack(*payload, ack) == false)
+                return;
+            const double tnow = systime_now_double();
+            std::lock_guard<std::mutex> lock(m);
+            auto it = sent.find(ack.name);
+            if(it == sent.end())
+            {
+                other++;
+                return;
+            }
+            lat.push_back(tnow - it->second);
+            sent.erase(it);
+            if(ack.code == AckCode::ACCEPTED)
+                accepted++;
+            else
+                rejected++;
+        }
+
+    public:
+        BenchClient() : m(), sent(), lat(), accepted(0), rejected(0), other(0) {}
+
+        void sending(const std::string& id, double tsend)
+        {
+            std::lock_guard<std::mutex> lock(m);
+            sent[id] = tsend;
+        }
+
+        size_t unanswered()
+        {
+            std::lock_guard<std::mutex> lock(m);
+            return sent.size();
+        }
+
+        void report(unsigned long nsent)
+        {
+            std::lock_guard<std::mutex> lock(m);
+            std::cout << boost::format("sent %lu accepted %lu rejected %lu unanswered %lu other acks %lu")
+                            % nsent % accepted % rejected % sent.size() % other << std::endl;
+            if(lat.empty())
+                return;
+            std::sort(lat.begin(), lat.end());
+            auto pct = [&](double p) { return lat[std::min(lat.size() - 1, size_t(p * lat.size()))] * 1e3; };
+            std::cout << boost::format("latency p50 %.3lf  p90 %.3lf  p99 %.3lf  max %.3lf ms")
+                            % pct(0.5) % pct(0.9) % pct(0.99) % (lat.back() * 1e3) << std::endl;
+        }
+};
+
+int main(int argc, char* argv[])
+{
+    size_t nrequests, ndrops;
+    double rate, outage, tail;
+    std::string persist_dir;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("requests", po::value<size_t>(&nrequests)->default_value(2000), "requests to send")
+        ("rate", po::value<double>(&rate)->default_value(500), "requests per second")
+        ("drops", po::value<size_t>(&ndrops)->default_value(0), "times the broker drops the gateway's connection, spread over the run")
+        ("outage", po::value<double>(&outage)->default_value(0), "seconds the broker stays offline at each drop (0 to only drop the connection)")
+        ("persist", po::value<std::string>(&persist_dir)->default_value(""), "persistent session and outbox directory for the gateway (its --persistdir)")
+        ("tail", po::value<double>(&tail)->default_value(5), "seconds to wait for the last responses")
+        ("verbose", "keep the gateway's log output")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+        std::cout << boost::format("gateway request flow over an in-process broker %s") % desc << std::endl;
+        return ~0;
+    }
+    po::notify(vm);
+
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create(BENCH_BROKER);
+    const std::string server = LOOPBACK_SCHEME + BENCH_BROKER;
+
+    // the gateway's log would drown the report
+    std::ostringstream gateway_log;
+    std::streambuf *cout_buf = std::cout.rdbuf();
+    if(vm.count("verbose") == 0)
+        std::cout.rdbuf(gateway_log.rdbuf());
+
+    // gateway: MQTT and request threads as in timed_rx_file_mqtt
+    ProtectedQ<NetMsg> toNetwork;
+    ProtectedQ<NetRequest> fromNetwork;
+    struct MqttParams mqtt_params = {
+        .server = server,
+        .userid = GATEWAY_ID,
+        .pubtopic = "response",
+        .subtopics = {"command"},
+        .stattopic = "status",
+        .teltopic = "telemetry",
+        .prevtopic = "preview",
+        .text_acks = false,
+        .binary_acks = true,
+        .pub_window = 32,
+        .stats_period = 0,
+        .persist_dir = persist_dir
+    };
+    struct UsrpParams usrp_params = UsrpParams();
+    usrp_params.client_id = GATEWAY_ID;
+    usrp_params.tslack = 0.01;
+    usrp_params.ntpslack = 0.01;
+    usrp_params.datafmt = "short";
+    struct AgendaLimits agenda_limits = {
+        .setup_margin = 0.02,
+        .end_margin = 0.01,
+        .disk_bw = 0,
+        .disk_reserve = 0,
+        .samp_size = cpu_sample_size("short"),
+        .storage_path = "."
+    };
+    CaptureAgenda agenda(agenda_limits);
+    std::thread mqtt_thread(&mqtt_pubsub_ops, &mqtt_params, &toNetwork, &fromNetwork);
+    std::thread request_thread(&request_ops, &usrp_params, &agenda, &toNetwork, &fromNetwork);
+
+    // client
+    TransportOptions opts = TransportOptions();
+    opts.clean_session = false;
+    std::unique_ptr<Transport> client = make_transport(server, "bench-client", opts);
+    BenchClient bench;
+    client->setListener(&bench);
+    client->connect()->waitFor(std::chrono::seconds(1));
+    client->subscribe(mqtt_params.pubtopic + BINARY_TOPIC_SUFFIX, QOS);
+
+    // captures 0.1 s apart, far enough ahead to never come due
+    using namespace std::chrono;
+    const double t0 = systime_now_double() + 3600;
+    const steady_clock::time_point tstart = steady_clock::now();
+    const size_t drop_every = (ndrops > 0) ? nrequests / (ndrops + 1) : 0;
+    unsigned long nsent = 0;
+    unsigned long send_errors = 0;
+    for(size_t i = 0; i < nrequests; i++)
+    {
+        std::this_thread::sleep_until(tstart + duration_cast<steady_clock::duration>(duration<double>(i / rate)));
+        if(drop_every > 0 && i > 0 && i % drop_every == 0 && i / drop_every <= ndrops)
+        {
+            if(outage > 0)
+            {
+                broker->setOnline(false);
+                std::this_thread::sleep_for(duration<double>(outage));
+                broker->setOnline(true);
+                // the client is dropped too and reconnects right away
+                client->connect()->waitFor(seconds(1));
+                client->subscribe(mqtt_params.pubtopic + BINARY_TOPIC_SUFFIX, QOS);
+            }
+            else
+                broker->dropClient(GATEWAY_ID);
+        }
+        const std::string id = (boost::format("b%lu") % i).str();
+        const std::string msg = (boost::format("id=%s,t0=%.6lf,fc=915e6,sps=1e6,n=10000") % id % (t0 + i * 0.1)).str();
+        bench.sending(id, systime_now_double());
+        try
+        {
+            client->publish(mqtt_params.subtopics[0], msg, QOS, false);
+            nsent++;
+        }
+        catch(const TransportError& e)
+        {
+            send_errors++;
+        }
+    }
+    const double send_secs = duration<double>(steady_clock::now() - tstart).count();
+
+    const steady_clock::time_point deadline = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(tail));
+    while(bench.unanswered() > send_errors && steady_clock::now() < deadline)
+        std::this_thread::sleep_for(milliseconds(10));
+
+    // shut the gateway down like a signal would
+    fromNetwork.close();
+    agenda.close();
+    request_thread.join();
+    toNetwork.close();
+    mqtt_thread.join();
+    client->disconnect();
+    std::cout.rdbuf(cout_buf);
+
+    LoopbackStats st = broker->stats();
+    std::cout << boost::format("%lu requests in %.3lf s (%.1lf/s), %lu not sent")
+                    % nrequests % send_secs % (nrequests / send_secs) % send_errors << std::endl;
+    bench.report(nsent);
+    std::cout << boost::format("broker published %llu delivered %llu queued %llu dropped %llu connects %llu lost %llu")
+                    % st.published % st.delivered % st.queued % st.dropped % st.connects % st.lost << std::endl;
+    return 0;
+}
@@ -0,0 +1,401 @@
+/*
+ * In-process MQTT broker stand-in
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include "loopback_broker.hpp"
+#include "topics.hpp"
+
+// return code of a refused connect
+const int LOOPBACK_REFUSED = -1;
+
+class LoopbackToken : public TransportToken
+{
+    private:
+        mutable std::mutex m;
+        std::condition_variable cond;
+        bool done;
+        int rc;
+
+    public:
+        LoopbackToken() : m(), cond(), done(false), rc(0) {}
+
+        void complete(int ret)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                done = true;
+                rc = ret;
+            }
+            cond.notify_all();
+        }
+
+        bool waitFor(std::chrono::milliseconds timeout) override
+        {
+            std::unique_lock<std::mutex> lock(m);
+            return cond.wait_for(lock, timeout, [this]{ return done; });
+        }
+
+        bool isComplete() const override
+        {
+            std::lock_guard<std::mutex> lock(m);
+            return done;
+        }
+
+        int returnCode() const override
+        {
+            std::lock_guard<std::mutex> lock(m);
+            return rc;
+        }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+
+// brokers by name, for loop://<name>
+static std::mutex registry_m;
+
+static std::map<std::string, std::weak_ptr<LoopbackBroker>>& registry()
+{
+    static std::map<std::string, std::weak_ptr<LoopbackBroker>> brokers;
+    return brokers;
+}
+
+LoopbackBroker::LoopbackBroker(const std::string& name)
+    : name(name), sessions(), retained(), online(true), hold(false), held(), refuse(0), epochs(0), st(), m()
+{
+}
+
+LoopbackBroker::~LoopbackBroker()
+{
+    std::lock_guard<std::mutex> lock(registry_m);
+    auto it = registry().find(name);
+    if(it != registry().end() && it->second.expired())
+        registry().erase(it);
+}
+
+std::shared_ptr<LoopbackBroker> LoopbackBroker::create(const std::string& name)
+{
+    std::shared_ptr<LoopbackBroker> broker = std::make_shared<LoopbackBroker>(name);
+    std::lock_guard<std::mutex> lock(registry_m);
+    registry()[name] = broker;
+    return broker;
+}
+
+std::shared_ptr<LoopbackBroker> LoopbackBroker::find(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(registry_m);
+    auto it = registry().find(name);
+    return (it == registry().end()) ? nullptr : it->second.lock();
+}
+
+// hand a message to every session subscribed to its topic, once each
+void LoopbackBroker::route(const Delivery& d)
+{
+    for(auto& it : sessions)
+    {
+        Session& s = it.second;
+        if(std::any_of(s.filters.begin(), s.filters.end(),
+                       [&](const std::string& f){ return topic_matches(f, d.topic); }))
+            hand(s, d);
+    }
+}
+
+void LoopbackBroker::hand(Session& s, const Delivery& d)
+{
+    if(s.client != nullptr)
+    {
+        LoopbackTransport *client = s.client;
+        const unsigned long long ep = s.epoch;
+        client->post([client, ep, d]{ client->deliver(ep, d); });
+    }
+    else if(s.clean == false && d.qos > 0)
+    {
+        s.pending.push_back(d);
+        st.queued++;
+    }
+    else
+        st.dropped++;
+}
+
+// the broker ends a connection: the will goes out and the client hears it.
+// Publishes of the connection that were not acked yet are lost
+void LoopbackBroker::drop(Session& s, const std::string& cause)
+{
+    LoopbackTransport *client = s.client;
+    s.client = nullptr;
+    client->connected_flag = false;
+    for(auto it = held.begin(); it != held.end(); )
+    {
+        if(it->client_id == client->client_id)
+        {
+            it->tok->complete(LOOPBACK_REFUSED);
+            it = held.erase(it);
+        }
+        else
+            it++;
+    }
+    if(s.clean)
+    {
+        s.filters.clear();
+        s.pending.clear();
+    }
+    st.lost++;
+    if(s.will_topic.empty() == false)
+    {
+        st.published++;
+        route(Delivery{s.will_topic, std::make_shared<const std::string>(s.will_payload), 1});
+    }
+    client->post([client, cause]{
+        if(client->listener != nullptr)
+            client->listener->connectionLost(cause);
+    });
+}
+
+bool LoopbackBroker::attach(LoopbackTransport *client, const TransportOptions& opts)
+{
+    std::lock_guard<std::mutex> lock(m);
+    if(online == false)
+        return false;
+    Session& s = sessions[client->client_id];
+    if(s.client != nullptr && s.client != client)
+        drop(s, "session taken over");
+    if(opts.clean_session)
+    {
+        s.filters.clear();
+        s.pending.clear();
+    }
+    s.clean = opts.clean_session;
+    s.client = client;
+    s.epoch = ++epochs;
+    s.will_topic = opts.will_topic;
+    s.will_payload = opts.will_payload;
+    client->connected_flag = true;
+    st.connects++;
+
+    // what was kept for the session goes out after the connected() callback
+    std::deque<Delivery> pending;
+    pending.swap(s.pending);
+    for(const Delivery& d : pending)
+        hand(s, d);
+    return true;
+}
+
+void LoopbackBroker::detach(LoopbackTransport *client)
+{
+    std::lock_guard<std::mutex> lock(m);
+    auto it = sessions.find(client->client_id);
+    if(it == sessions.end() || it->second.client != client)
+        return;
+    Session& s = it->second;
+    s.client = nullptr;
+    client->connected_flag = false;
+    if(s.clean)
+        sessions.erase(it);
+}
+
+// route a publish and complete its token, which is when a broker acks
+// QoS 1, unless it is to be refused
+void LoopbackBroker::answer(Held& h)
+{
+    if(refuse > 0)
+    {
+        refuse--;
+        st.refused++;
+        h.tok->complete(LOOPBACK_REFUSED);
+        return;
+    }
+    if(h.retain && h.d.payload->empty())
+        retained.erase(h.d.topic);
+    else if(h.retain)
+        retained[h.d.topic] = h.d.payload;
+    route(h.d);
+    h.tok->complete(0);
+}
+
+bool LoopbackBroker::publish(LoopbackTransport *client, const std::string& topic, const std::string& payload, int qos, bool retain,
+                             std::shared_ptr<LoopbackToken> tok)
+{
+    std::lock_guard<std::mutex> lock(m);
+    auto it = sessions.find(client->client_id);
+    if(it == sessions.end() || it->second.client != client)
+        return false;
+    st.published++;
+    Held h{client->client_id, Delivery{topic, std::make_shared<const std::string>(payload), qos}, retain, tok};
+    if(hold)
+    {
+        held.push_back(std::move(h));
+        st.max_held = std::max(st.max_held, held.size());
+        return true;
+    }
+    answer(h);
+    return true;
+}
+
+bool LoopbackBroker::subscribe(LoopbackTransport *client, const std::string& filter)
+{
+    std::lock_guard<std::mutex> lock(m);
+    auto it = sessions.find(client->client_id);
+    if(it == sessions.end() || it->second.client != client)
+        return false;
+    Session& s = it->second;
+    st.subscribes++;
+    if(std::find(s.filters.begin(), s.filters.end(), filter) == s.filters.end())
+        s.filters.push_back(filter);
+    for(const auto& r : retained)
+    {
+        if(topic_matches(filter, r.first))
+            hand(s, Delivery{r.first, r.second, 1});
+    }
+    return true;
+}
+
+// a delivery is about to reach the client. If the connection it was meant
+// for dropped meanwhile, it is handled like a new one
+bool LoopbackBroker::accept(LoopbackTransport *client, unsigned long long ep, const Delivery& d)
+{
+    std::lock_guard<std::mutex> lock(m);
+    auto it = sessions.find(client->client_id);
+    if(it == sessions.end())
+    {
+        st.dropped++;
+        return false;
+    }
+    Session& s = it->second;
+    if(s.client == client && s.epoch == ep)
+    {
+        st.delivered++;
+        return true;
+    }
+    hand(s, d);
+    return false;
+}
+
+void LoopbackBroker::dropClient(const std::string& client_id)
+{
+    std::lock_guard<std::mutex> lock(m);
+    for(auto& it : sessions)
+    {
+        if((client_id.empty() || it.first == client_id) && it.second.client != nullptr)
+            drop(it.second, "dropped by broker");
+    }
+}
+
+void LoopbackBroker::setOnline(bool up)
+{
+    std::lock_guard<std::mutex> lock(m);
+    online = up;
+    if(up)
+        return;
+    for(auto& it : sessions)
+    {
+        if(it.second.client != nullptr)
+            drop(it.second, "broker offline");
+    }
+}
+
+void LoopbackBroker::holdAcks(bool on)
+{
+    std::lock_guard<std::mutex> lock(m);
+    hold = on;
+    if(on)
+        return;
+    for(Held& h : held)
+        answer(h);
+    held.clear();
+}
+
+void LoopbackBroker::refuseAcks(unsigned n)
+{
+    std::lock_guard<std::mutex> lock(m);
+    refuse = n;
+}
+
+LoopbackStats LoopbackBroker::stats() const
+{
+    std::lock_guard<std::mutex> lock(m);
+    LoopbackStats ret = st;
+    ret.held = held.size();
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+LoopbackTransport::LoopbackTransport(const std::string& broker_name, const std::string& client_id,
+                                     const TransportOptions& opts)
+    : broker_name(broker_name), client_id(client_id), opts(opts), listener(nullptr),
+      broker(), connected_flag(false), events(), callback_thread()
+{
+    callback_thread = std::thread(&LoopbackTransport::runCallbacks, this);
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+    if(currentBroker() != nullptr)
+        currentBroker()->detach(this);
+    events.close();
+    callback_thread.join();
+}
+
+void LoopbackTransport::runCallbacks()
+{
+    std::function<void()> ev;
+    while(events.popItem(ev))
+        ev();
+}
+
+TransportTokenPtr LoopbackTransport::connect()
+{
+    std::shared_ptr<LoopbackToken> tok = std::make_shared<LoopbackToken>();
+    post([this, tok]{ attempt(tok); });
+    return tok;
+}
+
+void LoopbackTransport::attempt(TransportTokenPtr tok)
+{
+    if(currentBroker() == nullptr)
+        std::atomic_store(&broker, LoopbackBroker::find(broker_name));
+    std::shared_ptr<LoopbackBroker> b = currentBroker();
+    LoopbackToken *ltok = static_cast<LoopbackToken*>(tok.get());
+    if(b != nullptr && b->attach(this, opts))
+    {
+        ltok->complete(0);
+        if(listener != nullptr)
+            listener->connected();
+    }
+    else
+    {
+        ltok->complete(LOOPBACK_REFUSED);
+        if(listener != nullptr)
+            listener->connectFailed();
+    }
+}
+
+void LoopbackTransport::deliver(unsigned long long ep, const LoopbackBroker::Delivery& d)
+{
+    if(currentBroker()->accept(this, ep, d) && listener != nullptr)
+        listener->messageArrived(d.topic, d.payload);
+}
+
+TransportTokenPtr LoopbackTransport::publish(const std::string& topic, const std::string& payload, int qos, bool retained)
+{
+    std::shared_ptr<LoopbackBroker> b = currentBroker();
+    std::shared_ptr<LoopbackToken> tok = std::make_shared<LoopbackToken>();
+    if(b == nullptr || b->publish(this, topic, payload, qos, retained, tok) == false)
+        throw TransportError("not connected");
+    return tok;
+}
+
+void LoopbackTransport::subscribe(const std::string& topic, int qos)
+{
+    std::shared_ptr<LoopbackBroker> b = currentBroker();
+    if(b == nullptr || b->subscribe(this, topic) == false)
+        throw TransportError("not connected");
+}
+
+void LoopbackTransport::disconnect()
+{
+    std::shared_ptr<LoopbackBroker> b = currentBroker();
+    if(b != nullptr)
+        b->detach(this);
+}
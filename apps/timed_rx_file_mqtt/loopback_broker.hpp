@@ -0,0 +1,175 @@
+/*
+ * MQTT broker stand-in living in the process, for running gateways and
+ * clients against each other without a broker installed. Clients reach it
+ * with make_transport("loop://<name>", ...) while the broker created under
+ * that name is alive.
+ *
+ * It keeps what the gateway relies on:
+ *  - QoS 1: messages for a persistent session (clean_session false) that
+ *    is disconnected, or that were still being handed to it when it
+ *    dropped, are kept and delivered once it is back. QoS 0 ones and those
+ *    for clean sessions are dropped
+ *  - retained messages, handed to every new matching subscription
+ *  - wills, published when a connection drops but not on disconnect()
+ * and lets a test drop connections or take the whole broker offline, and
+ * hold back or refuse its acks to publishes.
+ *
+ * Every client gets a thread of its own for its callbacks, in the order
+ * the broker produced them, like paho's callback thread.
+ */
+
+#ifndef LOOPBACK_BROKER_HPP
+#define LOOPBACK_BROKER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include "protected_queue.hpp"
+#include "transport.hpp"
+
+const std::string LOOPBACK_SCHEME = "loop://";
+
+struct LoopbackStats
+{
+    unsigned long long published;
+    unsigned long long delivered;
+    unsigned long long queued;      // kept for a disconnected persistent session
+    unsigned long long dropped;     // for nobody connected that could keep it
+    unsigned long long connects;
+    unsigned long long subscribes;
+    unsigned long long lost;        // connections dropped by the broker
+    unsigned long long refused;     // publishes answered with an error
+    size_t held;                    // publishes waiting for their ack now
+    size_t max_held;
+};
+
+class LoopbackTransport;
+class LoopbackToken;
+
+class LoopbackBroker
+{
+    private:
+        struct Delivery
+        {
+            std::string topic;
+            std::shared_ptr<const std::string> payload;
+            int qos;
+        };
+
+        struct Session
+        {
+            bool clean;
+            std::vector<std::string> filters;
+            std::deque<Delivery> pending;   // QoS 1 messages waiting for the client
+            LoopbackTransport *client;      // nullptr while disconnected
+            unsigned long long epoch;       // of the current connection
+            std::string will_topic;
+            std::string will_payload;
+        };
+
+        // a publish the broker has not answered yet
+        struct Held
+        {
+            std::string client_id;
+            Delivery d;
+            bool retain;
+            std::shared_ptr<LoopbackToken> tok;
+        };
+
+        std::string name;
+        std::map<std::string, Session> sessions;
+        std::map<std::string, std::shared_ptr<const std::string>> retained;
+        bool online;
+        bool hold;
+        std::deque<Held> held;
+        unsigned refuse;
+        unsigned long long epochs;
+        LoopbackStats st;
+        mutable std::mutex m;
+
+        void route(const Delivery& d);
+        void hand(Session& s, const Delivery& d);
+        void drop(Session& s, const std::string& cause);
+        void answer(Held& h);
+
+        // called by LoopbackTransport
+        bool attach(LoopbackTransport *client, const TransportOptions& opts);
+        void detach(LoopbackTransport *client);
+        bool publish(LoopbackTransport *client, const std::string& topic, const std::string& payload, int qos, bool retain,
+                     std::shared_ptr<LoopbackToken> tok);
+        bool subscribe(LoopbackTransport *client, const std::string& filter);
+        bool accept(LoopbackTransport *client, unsigned long long epoch, const Delivery& d);
+
+        friend class LoopbackTransport;
+
+    public:
+        explicit LoopbackBroker(const std::string& name);
+        ~LoopbackBroker();
+
+        // create a broker reachable as loop://<name> while it is held
+        static std::shared_ptr<LoopbackBroker> create(const std::string& name);
+
+        // the broker of that name, nullptr if there is none
+        static std::shared_ptr<LoopbackBroker> find(const std::string& name);
+
+        // drop the connection of a client, or of every client if client_id
+        // is empty. Wills are published and clients hear connectionLost
+        void dropClient(const std::string& client_id = "");
+
+        // while offline, connections are dropped and refused, as when a
+        // broker is down or unreachable
+        void setOnline(bool up);
+
+        // while held, publishes are taken but neither routed nor acked.
+        // Releasing answers the held ones in order
+        void holdAcks(bool on);
+
+        // answer the next n publishes with an error instead of routing them
+        void refuseAcks(unsigned n);
+
+        LoopbackStats stats() const;
+};
+
+/*
+ * Transport connecting to a LoopbackBroker
+ */
+class LoopbackTransport : public Transport
+{
+    private:
+        std::string broker_name;
+        std::string client_id;
+        TransportOptions opts;
+        TransportListener *listener;
+        std::shared_ptr<LoopbackBroker> broker;    // found on the first connect, atomic access
+        std::atomic<bool> connected_flag;
+        ProtectedQ<std::function<void()>> events;
+        std::thread callback_thread;
+
+        void post(std::function<void()> ev) { events.addItem(std::move(ev)); }
+        std::shared_ptr<LoopbackBroker> currentBroker() const { return std::atomic_load(&broker); }
+        void runCallbacks();
+        void attempt(TransportTokenPtr tok);
+        void deliver(unsigned long long ep, const LoopbackBroker::Delivery& d);
+
+        friend class LoopbackBroker;
+
+    public:
+        LoopbackTransport(const std::string& broker_name, const std::string& client_id, const TransportOptions& opts);
+        ~LoopbackTransport();
+
+        const std::string& clientId() const override { return client_id; }
+        void setListener(TransportListener *l) override { listener = l; }
+        TransportTokenPtr connect() override;
+        bool isConnected() const override { return connected_flag; }
+        TransportTokenPtr publish(const std::string& topic, const std::string& payload, int qos, bool retained) override;
+        void subscribe(const std::string& topic, int qos) override;
+        void disconnect() override;
+};
+
+#endif // LOOPBACK_BROKER_HPP
@@ -1,10 +1,19 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <algorithm>
+#include <csignal>
+#include <pthread.h>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
 #include "protected_queue.hpp"
 #include "ops_helper.hpp"
+#include "topics.hpp"
+#include "uploader.hpp"
+#include "live_stream.hpp"
+#include "shm_ring.hpp"
 
 #define RUN_MQTT 1
 #define RUN_USRP 1
@@ -22,9 +31,9 @@ void testThread(struct UsrpParams* params,
 
 int main(int argc, char* argv[])
 {
-    std::string usrp_args, mqtt_serv, client_id, top_pub, top_sub, file_prefix, wirefmt, datafmt, subdev;
-    size_t usrp_channel, samp_per_buf;
-    double slack_time, ntpslack;
+    std::string usrp_args, mqtt_serv, client_id, top_pub, top_sub, top_stat, top_tel, top_prev, topic_mode, groups, file_prefix, wirefmt, datafmt, subdev, partial, ackfmt, reqpolicy, persist_dir, upload_sink, live_endpoint, shm_name;
+    size_t usrp_channel, samp_per_buf, reqqueue, pub_window, upload_chunk, upload_window, live_buffer, shm_slots;
+    double slack_time, ntpslack, disk_bw, disk_reserve, setup_quantile, stats_period, upload_rate;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -34,14 +43,38 @@ int main(int argc, char* argv[])
         ("id", po::value<std::string>(&client_id)->default_value("tester"), "own ID used on MQTT and filenames")
         ("pubtop", po::value<std::string>(&top_pub)->default_value("response"), "topic to send responses/updates to")
         ("subtop", po::value<std::string>(&top_sub)->default_value("command"), "topic to listen for triggers")
+        ("stattop", po::value<std::string>(&top_stat)->default_value("status"), "topic to send gateway status updates to")
+        ("teltop", po::value<std::string>(&top_tel)->default_value("telemetry"), "topic to send the counters of every capture to")
+        ("prevtop", po::value<std::string>(&top_prev)->default_value("preview"), "topic to send capture previews to (binary, on <prevtop>/bin)")
+        ("topics", po::value<std::string>(&topic_mode)->default_value("shared"), "shared: every gateway uses the topics above, addressed: commands also on <subtop>/<id> and <subtop>/group/<group>, responses and status on <topic>/<id>")
+        ("groups", po::value<std::string>(&groups)->default_value(""), "comma separated groups to take commands for with --topics addressed")
+        ("ackfmt", po::value<std::string>(&ackfmt)->default_value("text"), "encoding of responses and status: text, binary (on <topic>/bin) or both")
         ("prefix", po::value<std::string>(&file_prefix)->default_value(""), "prefix for save files. Could include location")
         ("subdev", po::value<std::string>(&subdev), "subdevice specification")
         ("channel", po::value<size_t>(&usrp_channel)->default_value(0), "which channel to use")
-        ("slack", po::value<double>(&slack_time)->default_value(0.5), "additional slack for setup operations")
+        ("slack", po::value<double>(&slack_time)->default_value(0.5), "additional slack for setup operations, until enough setups were timed")
         ("ntpslack", po::value<double>(&ntpslack)->default_value(0.1), "slack allowed between NTP and GPS time")
+        ("setupq", po::value<double>(&setup_quantile)->default_value(0.95), "quantile of measured setup times used as setup margin")
         ("spb", po::value<size_t>(&samp_per_buf)->default_value(10000), "samples per buffer")
         ("wirefmt", po::value<std::string>(&wirefmt)->default_value("sc16"), "wire format (sc8 or sc16)")
         ("datafmt", po::value<std::string>(&datafmt)->default_value("short"), "sample type: double, float, or short")
+        ("diskbw", po::value<double>(&disk_bw)->default_value(0), "sustained write rate of the capture storage in MB/s (0 to not check)")
+        ("diskreserve", po::value<double>(&disk_reserve)->default_value(100), "free space in MB to keep on the capture storage")
+        ("partial", po::value<std::string>(&partial)->default_value("remove"), "what to do with the file of an aborted capture: keep or remove")
+        ("reqqueue", po::value<size_t>(&reqqueue)->default_value(64), "requests waiting to be handled before the overflow policy applies (0 for no limit)")
+        ("reqpolicy", po::value<std::string>(&reqpolicy)->default_value("reject"), "request queue overflow policy: reject (the newest), oldest (drop it) or coalesce (duplicates, reject the rest)")
+        ("persistdir", po::value<std::string>(&persist_dir)->default_value(""), "directory for a persistent MQTT session and the outbox of unpublished responses (empty for a clean session)")
+        ("pubwindow", po::value<size_t>(&pub_window)->default_value(32), "responses published but not yet acked by the broker at most")
+        ("statsperiod", po::value<double>(&stats_period)->default_value(10), "seconds between queue and publisher counters on the status topic (0 for none)")
+        ("upload", po::value<std::string>(&upload_sink)->default_value(""), "copy saved captures off in the background to mqtt:<topic> or dir:<path> (empty for no uploads)")
+        ("uploadchunk", po::value<size_t>(&upload_chunk)->default_value(256), "upload chunk size in kB")
+        ("uploadwindow", po::value<size_t>(&upload_window)->default_value(4), "upload chunks waiting for the sink to confirm them at most")
+        ("uploadrate", po::value<double>(&upload_rate)->default_value(2), "upload rate limit in MB/s (0 for none)")
+        ("preview", "publish a low-rate preview of every capture: magnitude envelope and IQ excerpt of its strongest part")
+        ("live", po::value<std::string>(&live_endpoint)->default_value(""), "serve the samples of every capture live on tcp:<port> (loopback), tcp:<address>:<port> or unix:<path> (empty for none)")
+        ("livebuf", po::value<size_t>(&live_buffer)->default_value(16), "MB a live stream client may fall behind before it is dropped")
+        ("shm", po::value<std::string>(&shm_name)->default_value(""), "publish the received buffers in the shared memory ring /dev/shm/<name> (empty for none)")
+        ("shmslots", po::value<size_t>(&shm_slots)->default_value(256), "buffers (of --spb samples) the shared memory ring holds")
         ("int-n", "tune USRP with integer-N tuning")
     ;
 
@@ -56,8 +89,67 @@ int main(int argc, char* argv[])
     }
     po::notify(vm);
 
-    ProtectedQ<std::string> toNetwork;
-    ProtectedQ<std::string> fromNetwork;
+    // with addressed topics the broker only forwards the commands meant for
+    // this gateway, and controllers tell gateways apart by topic
+    std::vector<std::string> sub_topics = {top_sub};
+    if(topic_mode == "addressed")
+    {
+        std::vector<std::string> group_list;
+        boost::split(group_list, groups, boost::is_any_of(","), boost::token_compress_on);
+        group_list.erase(std::remove(group_list.begin(), group_list.end(), ""), group_list.end());
+        for(const auto& name : group_list)
+        {
+            if(valid_topic_name(name) == false)
+            {
+                std::cerr << "invalid group name " << name << std::endl;
+                return ~0;
+            }
+        }
+        if(valid_topic_name(client_id) == false)
+        {
+            std::cerr << "id " << client_id << " can't be used as a topic level" << std::endl;
+            return ~0;
+        }
+        sub_topics.push_back(gateway_topic(top_sub, client_id));
+        for(const auto& name : group_list)
+            sub_topics.push_back(group_topic(top_sub, name));
+        top_pub = gateway_topic(top_pub, client_id);
+        top_stat = gateway_topic(top_stat, client_id);
+        top_tel = gateway_topic(top_tel, client_id);
+        top_prev = gateway_topic(top_prev, client_id);
+    }
+    else if(topic_mode != "shared")
+    {
+        std::cerr << "unknown topic layout " << topic_mode << std::endl;
+        return ~0;
+    }
+
+    QueueOverflow overflow;
+    if(reqpolicy == "reject")
+        overflow = QueueOverflow::REJECT_NEWEST;
+    else if(reqpolicy == "oldest")
+        overflow = QueueOverflow::DROP_OLDEST;
+    else if(reqpolicy == "coalesce")
+        overflow = QueueOverflow::COALESCE;
+    else
+    {
+        std::cerr << "unknown request queue policy " << reqpolicy << std::endl;
+        return ~0;
+    }
+
+    // not RingQs: the overflow policies look at and drop queued requests
+    // from the producer side, and toNetwork is drained in batches. Each
+    // carries a few messages per second, the lock is not what limits them
+    ProtectedQ<NetMsg> toNetwork;
+    ProtectedQ<NetRequest> fromNetwork(reqqueue, overflow, std::equal_to<NetRequest>());
+
+    // SIGINT and SIGTERM are only taken by the shutdown thread. They are
+    // blocked before any other thread is created so all of them inherit it
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
 
     // NOTE: USRP stuff runs in a different thread so has to be setup before
     // we perform blocking waits in the MQTT thread
@@ -77,33 +169,135 @@ int main(int argc, char* argv[])
         .intn_flag = (vm.count("int-n") > 0),
         .null = false,
         .subdev_flag = (vm.count("subdev") > 0),
-        .subdev = ((vm.count("subdev") > 0) ? subdev : "")
+        .subdev = ((vm.count("subdev") > 0) ? subdev : ""),
+        .keep_partial = (partial == "keep"),
+        .setup_quantile = setup_quantile,
+        .stats_period = stats_period,
+        .preview = (vm.count("preview") > 0)
     };
 
-    std::thread usrp_thread(&usrp_ops, &usrp_global_params, &toNetwork, &fromNetwork);
+    // captures are written next to the prefix
+    std::string storage_path = boost::filesystem::path(file_prefix).parent_path().string();
+
+    struct AgendaLimits agenda_limits = {
+        .setup_margin = ntpslack + slack_time,
+        .end_margin = ntpslack,
+        .disk_bw = disk_bw * 1e6,
+        .disk_reserve = disk_reserve * 1e6,
+        .samp_size = cpu_sample_size(datafmt),
+        .storage_path = (storage_path.empty() ? "." : storage_path)
+    };
+    CaptureAgenda agenda(agenda_limits);
+
+    // samples served to local processes while they are received
+    CaptureSinks sinks;
+    std::unique_ptr<LiveStream> live;
+    if(live_endpoint.empty() == false)
+    {
+        live = make_live_stream(live_endpoint, std::max<size_t>(live_buffer, 1) * 1000000);
+        if(live == nullptr)
+        {
+            std::cerr << "invalid live stream endpoint " << live_endpoint << std::endl;
+            return ~0;
+        }
+        sinks.push_back(live.get());
+    }
+    std::unique_ptr<ShmRing> ring;
+    if(shm_name.empty() == false)
+    {
+        ring = make_shm_ring(shm_name, shm_slots, samp_per_buf * cpu_sample_size(datafmt), datafmt);
+        if(ring == nullptr)
+        {
+            std::cerr << "could not create shared memory ring " << shm_name << std::endl;
+            return ~0;
+        }
+        // first, so recv() fills its slots in place
+        sinks.insert(sinks.begin(), ring.get());
+    }
+
+    // saved captures are copied off while the device is idle
+    std::unique_ptr<Uploader> uploader;
+    std::thread upload_thread;
+    if(upload_sink.empty() == false)
+    {
+        struct UploadParams upload_params = {
+            .sink = upload_sink,
+            .server = mqtt_serv,
+            .client_id = client_id,
+            .chunk_size = std::max<size_t>(upload_chunk, 1) * 1000,
+            .window = std::max<size_t>(upload_window, 1),
+            .rate = upload_rate * 1e6,
+            .capture_dir = agenda_limits.storage_path
+        };
+        std::unique_ptr<UploadSink> sink = make_upload_sink(upload_params);
+        if(sink == nullptr)
+        {
+            std::cerr << "invalid upload sink " << upload_sink << std::endl;
+            return ~0;
+        }
+        uploader.reset(new Uploader(upload_params, std::move(sink), &agenda, &toNetwork));
+        upload_thread = std::thread(&Uploader::run, uploader.get());
+    }
+
+    std::thread request_thread(&request_ops, &usrp_global_params, &agenda, &toNetwork, &fromNetwork);
+    std::thread usrp_thread(&usrp_ops, &usrp_global_params, &agenda, &toNetwork, uploader.get(), sinks);
     // std::thread usrp_thread(&testThread, &toNetwork, &fromNetwork);
 
     #endif // RUN_USRP==1
 
+    // on a signal, stop taking requests and stop the running capture. Once
+    // the request and USRP threads have queued their last responses, close
+    // toNetwork so the MQTT thread publishes them and disconnects
+    std::thread stop_thread([&]() {
+        int sig = 0;
+        sigwait(&stop_signals, &sig);
+        std::cout << boost::format("[debug] signal %d, shutting down") % sig << std::endl;
+        #if RUN_USRP==1
+        fromNetwork.close();
+        agenda.close();
+        request_thread.join();
+        usrp_thread.join();
+        if(uploader)
+        {
+            uploader->close();
+            upload_thread.join();
+        }
+        #endif // RUN_USRP==1
+        toNetwork.close();
+    });
+
     #if RUN_MQTT==1
 
     struct MqttParams mqtt_conn_params = {
         .server = mqtt_serv,
         .userid = client_id,
         .pubtopic = top_pub,
-        .subtopic = top_sub
+        .subtopics = sub_topics,
+        .stattopic = top_stat,
+        .teltopic = top_tel,
+        .prevtopic = top_prev,
+        .text_acks = (ackfmt != "binary"),
+        .binary_acks = (ackfmt == "binary" || ackfmt == "both"),
+        .pub_window = std::max<size_t>(pub_window, 1),
+        .stats_period = stats_period,
+        .persist_dir = persist_dir
     };
 
     std::cout << "MQTT server: " << mqtt_serv << std::endl;
     std::cout << "Client/Dev ID: " << client_id << std::endl;
     std::cout << "publish topic: " << top_pub << std::endl;
-    std::cout << "subscribe topic: " << top_sub << std::endl;
+    std::cout << "subscribe topics: " << boost::algorithm::join(sub_topics, ", ") << std::endl;
+    std::cout << "status topic: " << top_stat << std::endl;
+    std::cout << "telemetry topic: " << top_tel << std::endl;
+    if(vm.count("preview"))
+        std::cout << "preview topic: " << top_prev << BINARY_TOPIC_SUFFIX << std::endl;
+    std::cout << "ack format: " << ackfmt << std::endl;
 
     mqtt_pubsub_ops(&mqtt_conn_params, &toNetwork, &fromNetwork);
 
     #endif // RUN_MQTT==1
 
-    usrp_thread.join();
+    stop_thread.join();
 
     return 0;
 }
\ No newline at end of file
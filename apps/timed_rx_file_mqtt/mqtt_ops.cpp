@@ -15,14 +15,31 @@
 #include <cctype>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <deque>
+#include <iterator>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <mutex>
+#include <condition_variable>
 #include <boost/format.hpp>
-#include "mqtt/async_client.h"
+#include <boost/filesystem.hpp>
+#include "transport.hpp"
 #include "protected_queue.hpp"
 #include "ops_helper.hpp"
+#include "wire_codec.hpp"
+#include "outbox.hpp"
+#include "time_helper.hpp"
 
 const int	QOS = 1;
-const int	N_RETRY_ATTEMPTS = 5;
 const bool  NO_LOCAL = true;
+// reconnect attempts are spaced out exponentially between these, with
+// jitter so a fleet of gateways doesn't hit a restarted broker at once
+const std::chrono::milliseconds RECONNECT_MIN_DELAY(100);
+const std::chrono::milliseconds RECONNECT_MAX_DELAY(30000);
+// how long the first connection attempt is waited for before going on
+const std::chrono::seconds CONNECT_TIMEOUT(30);
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -32,153 +49,436 @@ const bool  NO_LOCAL = true;
  * the connection to the broker. If the connection is lost, it will attempt
  * to restore the connection and re-subscribe to the topic.
  */
-class CallbackHelper : public virtual mqtt::callback,
-					public virtual mqtt::iaction_listener
-
+class CallbackHelper : public TransportListener
 {
 	// Counter for the number of connection retries
 	int nretry_;
-	// The MQTT client
-	mqtt::async_client& cli_;
-	// Options to use if we need to reconnect
-	mqtt::connect_options& connOpts_;
+	// when the connection was lost, to report the downtime
+	std::chrono::steady_clock::time_point tlost_;
+	// reconnect delay jitter
+	std::mt19937 rng_;
+	// set by stop(), cuts a reconnect delay short and prevents further ones
+	bool stopping_;
+	std::mutex m_;
+	std::condition_variable cond_;
+	// The MQTT client, reconnected with the options it was made with
+	Transport& cli_;
 
 	std::string pubTopic;
-	std::string subTopic;
-	ProtectedQ<std::string> *fromNetQ;
-
-	// This deomonstrates manually reconnecting to the broker by calling
-	// connect() again. This is a possibility for an application that keeps
-	// a copy of it's original connect_options, or if the app wants to
-	// reconnect with different options.
-	// Another way this can be done manually, if using the same options, is
-	// to just call the async_client::reconnect() method.
+	std::vector<std::string> subTopics;
+	ProtectedQ<NetRequest> *fromNetQ;
+	ProtectedQ<NetMsg> *toNetQ;
+
+	// Reconnect manually by calling connect() again, the transport never
+	// retries on its own.
+	// Attempts never give up, so a broker restart doesn't take the gateway
+	// (and the capture it might be running) down.
 	void reconnect() {
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
-		try {
-			cli_.connect(connOpts_, nullptr, *this);
-		}
-		catch (const mqtt::exception& exc) {
-			std::cerr << "[MQTTError] " << exc.what() << std::endl;
-			exit(1);
+		while(true) {
+			std::chrono::milliseconds delay = backoff();
+			std::cout << boost::format("[MQTTdebug] reconnect attempt %d in %.3lf s")
+							% (nretry_ + 1) % (delay.count() / 1e3) << std::endl;
+			{
+				std::unique_lock<std::mutex> lock(m_);
+				if(cond_.wait_for(lock, delay, [this]{ return stopping_; }))
+					return;
+			}
+			try {
+				nretry_++;
+				cli_.connect();
+				return;
+			}
+			catch (const TransportError& exc) {
+				std::cerr << "[MQTTError] " << exc.what() << std::endl;
+			}
 		}
 	}
 
+	// capped exponential delay before the next attempt, with the upper
+	// half of it drawn at random
+	std::chrono::milliseconds backoff() {
+		double delay = RECONNECT_MIN_DELAY.count() * std::pow(2.0, std::min(nretry_, 20));
+		delay = std::min(delay, double(RECONNECT_MAX_DELAY.count()));
+		std::uniform_real_distribution<double> jitter(0.5, 1.0);
+		return std::chrono::milliseconds((long long)(delay * jitter(rng_)));
+	}
+
 	// Re-connection failure
-	void on_failure(const mqtt::token& tok) override {
+	void connectFailed() override {
 		std::cout << "[MQTTdebug] Connection attempt failed" << std::endl;
-		if (++nretry_ > N_RETRY_ATTEMPTS)
-			exit(1);
-		else
-			reconnect();
+		reconnect();
 	}
 
 	// (Re)connection success
-	// Either this or connected() can be used for callbacks.
-	void on_success(const mqtt::token& tok) override {}
-
-	// (Re)connection success
-	void connected(const std::string& cause) override {
+	void connected() override {
 		std::cout << "\n[MQTTdebug] Connection success" << std::endl;
-		std::string on_msg = (boost::format("<<<%s connected>>>") % cli_.get_client_id()).str();
-		cli_.publish(pubTopic, on_msg.c_str());
-		// // new but undocumented method found in the mqttpp_chat sample
-		// mqtt::topic topic { cli_, subTopic, QOS };
-		// auto subOpts = mqtt::subscribe_options(NO_LOCAL);
-		// topic.subscribe(subOpts);
-		
-		std::cout << "[MQTTdebug] Subscribing to topic " << subTopic << std::endl;
-		// method in the examples and documentation
-		cli_.subscribe(subTopic, QOS);
+		// the status goes out once the publisher notices the connection
+		Ack ack = make_ack(AckCode::LINK, cli_.clientId());
+		ack.reason = "connected";
+		ack.count = nretry_;
+		ack.values = {std::chrono::duration<double>(std::chrono::steady_clock::now() - tlost_).count()};
+		send_status(toNetQ, ack);
+		nretry_ = 0;
+		std::string on_msg = (boost::format("<<<%s connected>>>") % cli_.clientId()).str();
+		try {
+			cli_.publish(pubTopic, on_msg, QOS, false);
+			for(const std::string& subTopic : subTopics) {
+				std::cout << "[MQTTdebug] Subscribing to topic " << subTopic << std::endl;
+				cli_.subscribe(subTopic, QOS);
+				// binary encoded requests
+				cli_.subscribe(subTopic + BINARY_TOPIC_SUFFIX, QOS);
+			}
+		}
+		catch (const TransportError& exc) {
+			// lost again already, connectionLost() follows
+			std::cerr << "[MQTTError] " << exc.what() << std::endl;
+		}
 	}
 
 	// Callback for when the connection is lost.
 	// This will initiate the attempt to manually reconnect.
-	void connection_lost(const std::string& cause) override {
+	void connectionLost(const std::string& cause) override {
 		std::cout << "\n[MQTTdebug] Connection lost" << std::endl;
 		if (!cause.empty())
 			std::cout << "\tcause: " << cause << std::endl;
 
+		tlost_ = std::chrono::steady_clock::now();
+		Ack ack = make_ack(AckCode::LINK, cli_.clientId());
+		ack.reason = cause.empty() ? "lost" : "lost: " + cause;
+		send_status(toNetQ, ack);
+
 		std::cout << "[MQTTdebug] Reconnecting..." << std::endl;
 		nretry_ = 0;
 		reconnect();
 	}
 
-	// Note: commented for testing
 	// Callback for when a message arrives.
-	void message_arrived(mqtt::const_message_ptr msg) override
-	{
-		std::cout << "[MQTTdebug] Message arrived" << std::endl;
-		fromNetQ->addItem(msg->to_string());
-	}
-
-	void delivery_complete(mqtt::delivery_token_ptr token) override
+	void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) override
 	{
+		// decode right here, on a buffer shared with the message. Only
+		// requests that decoded are queued, the rest is answered at once
+		NetRequest rx;
+		rx.tarrived = systime_now_double();
+		rx.payload = std::move(payload);
+		rx.binary = is_binary_topic(topic);
+		Ack nack;
+		if(decode_net_request(rx, cli_.clientId(), nack) == false)
+		{
+			send_response(toNetQ, nack);
+			return;
+		}
 
+		// a full request queue is answered right away, for the message
+		// that did not get in or the oldest one dropped to make room
+		NetRequest evicted;
+		const double tarrived = rx.tarrived;
+		QueuePush ret = fromNetQ->pushItem(std::move(rx), &evicted);
+		if(ret == QueuePush::REJECTED || ret == QueuePush::DROPPED_OLDEST)
+		{
+			Ack ack = make_ack(AckCode::DROPPED, cli_.clientId());
+			ack.reason = (ret == QueuePush::REJECTED) ? "request queue full" : "request queue full, dropped for a newer one";
+			ack.stages.arrived = (ret == QueuePush::REJECTED) ? tarrived : evicted.tarrived;
+			send_response(toNetQ, ack);
+		}
+		else if(ret == QueuePush::COALESCED)
+			std::cout << "[MQTTdebug] duplicate of a queued message" << std::endl;
 	}
 
 public:
 	CallbackHelper(
-		mqtt::async_client& cli,
-		mqtt::connect_options& connOpts,
+		Transport& cli,
 		std::string publishTopic,
-		std::string subscribeTopic,
-		ProtectedQ<std::string> *fromNetwork)
-				: nretry_(0), cli_(cli), connOpts_(connOpts) {
+		std::vector<std::string> subscribeTopics,
+		ProtectedQ<NetRequest> *fromNetwork,
+		ProtectedQ<NetMsg> *toNetwork)
+				: nretry_(0), tlost_(std::chrono::steady_clock::now()),
+				  rng_(std::random_device()()), stopping_(false),
+				  cli_(cli) {
 					pubTopic = publishTopic;
-					subTopic = subscribeTopic;
+					subTopics = subscribeTopics;
 					fromNetQ = fromNetwork;
+					toNetQ = toNetwork;
 				}
+
+	// stop reconnecting, before disconnecting for good
+	void stop() {
+		{
+			std::unique_lock<std::mutex> lock(m_);
+			stopping_ = true;
+		}
+		cond_.notify_all();
+	}
 };
 
 /////////////////////////////////////////////////////////////////////////////
 
-static void mqtt_publisher(mqtt::async_client *client, std::string pubTopic, ProtectedQ<std::string> *toNetwork)
+// publishes the broker refused while connected are tried this many times.
+// Ones the client refuses to take are offered again PUBLISH_RETRY_DELAY later
+const int	PUBLISH_ATTEMPTS = 5;
+const std::chrono::milliseconds PUBLISH_POLL(20);
+const std::chrono::milliseconds PUBLISH_RETRY_DELAY(200);
+// how long queued responses may still take to go out when shutting down
+const std::chrono::seconds PUBLISH_DRAIN_TIMEOUT(5);
+
+// a message waiting to be published or waiting for the broker's ack
+struct Outgoing
+{
+	std::string topic;
+	std::string payload;
+	std::chrono::steady_clock::time_point tqueued;	// NetMsg::tqueued
+	int attempts;
+	TransportTokenPtr tok;
+	bool saved;		// has a copy in the outbox
+};
+
+// publisher counters since the last report on the status topic
+struct PublishStats
+{
+	unsigned long long acked;
+	unsigned long long retried;
+	unsigned long long failed;
+	double latency_sum;		// seconds from queueing to the broker's ack
+	double latency_max;
+};
+
+static void queue_outgoing(std::deque<Outgoing>& waiting, struct MqttParams *params, const NetMsg& msg)
+{
+	if(msg.channel == NetChannel::PREVIEW)
+	{
+		waiting.push_back(Outgoing{params->prevtopic + BINARY_TOPIC_SUFFIX, msg.payload, msg.tqueued, 0, nullptr, false});
+		return;
+	}
+	const std::string& topic = (msg.channel == NetChannel::STATUS) ? params->stattopic
+							 : (msg.channel == NetChannel::TELEMETRY) ? params->teltopic
+							 : params->pubtopic;
+	if(params->text_acks)
+		waiting.push_back(Outgoing{topic, msg.text, msg.tqueued, 0, nullptr, false});
+	if(params->binary_acks)
+	{
+		std::string bin;
+		encode_ack(msg.ack, bin);
+		waiting.push_back(Outgoing{topic + BINARY_TOPIC_SUFFIX, bin, msg.tqueued, 0, nullptr, false});
+	}
+}
+
+// copy the messages that aren't in the outbox yet to it
+static void save_outgoing(Outbox *outbox, std::deque<Outgoing>& msgs, size_t& nsaved)
 {
-	// when an element shows up on the relevant queue, publish it to a specific topic
-	std::string msgStr;
-	mqtt::topic top(*client, pubTopic, QOS);
+	for(Outgoing& o : msgs)
+	{
+		if(o.saved == false && outbox->append(o.topic, o.payload))
+		{
+			o.saved = true;
+			nsaved++;
+		}
+	}
+}
+
+// take the publishes the broker answered out of the window. Failed ones go
+// back to the front of waiting, unless they failed too often while connected.
+// nsaved counts the outbox messages still pending
+static void reap_outgoing(Transport *client, std::deque<Outgoing>& inflight,
+						std::deque<Outgoing>& waiting, PublishStats& st, size_t& nsaved)
+{
+	using namespace std::chrono;
+	const steady_clock::time_point tnow = steady_clock::now();
+	// retries go out again before anything newer, in their original order
+	std::deque<Outgoing> retry;
+	for(auto it = inflight.begin(); it != inflight.end(); )
+	{
+		if(it->tok->isComplete() == false)
+		{
+			it++;
+			continue;
+		}
+		if(it->tok->returnCode() == 0)
+		{
+			const double latency = duration<double>(tnow - it->tqueued).count();
+			st.acked++;
+			st.latency_sum += latency;
+			if(latency > st.latency_max)
+				st.latency_max = latency;
+			nsaved -= it->saved ? 1 : 0;
+		}
+		// attempts only count while connected, responses wait out disconnects
+		else if(client->isConnected() && ++it->attempts >= PUBLISH_ATTEMPTS)
+		{
+			st.failed++;
+			std::cerr << boost::format("[MQTTerror] giving up on publish to %s: %d")
+							% it->topic % it->tok->returnCode() << std::endl;
+			nsaved -= it->saved ? 1 : 0;
+		}
+		else
+		{
+			st.retried++;
+			it->tok = nullptr;
+			retry.push_back(std::move(*it));
+		}
+		it = inflight.erase(it);
+	}
+	waiting.insert(waiting.begin(), std::make_move_iterator(retry.begin()), std::make_move_iterator(retry.end()));
+}
+
+static void mqtt_publisher(Transport *client, struct MqttParams *params,
+							Outbox *outbox, ProtectedQ<NetMsg> *toNetwork)
+{
+	// when elements show up on the relevant queue, publish them to the
+	// topic of their channel, as text and/or binary, keeping at most
+	// pub_window publishes in flight. Everything queued meanwhile is taken
+	// at once, until the queue is closed and drained. While disconnected,
+	// pending messages are also kept in the outbox
+	using namespace std::chrono;
+	std::vector<NetMsg> msgs;
+	std::deque<Outgoing> waiting;
+	std::deque<Outgoing> inflight;
+	PublishStats st = PublishStats();
+	const steady_clock::duration stats_period = duration_cast<steady_clock::duration>(duration<double>(params->stats_period));
+	steady_clock::time_point next_stats = steady_clock::now() + stats_period;
+	steady_clock::time_point next_try = steady_clock::now();
+	steady_clock::time_point deadline = steady_clock::time_point::max();
+
+	// whatever the last run could not publish goes first
+	std::vector<std::pair<std::string, std::string>> saved;
+	size_t nsaved = outbox->load(saved);
+	for(const auto& rec : saved)
+		waiting.push_back(Outgoing{rec.first, rec.second, steady_clock::now(), 0, nullptr, true});
+	if(nsaved > 0)
+		std::cout << boost::format("[MQTTdebug] %lu messages from the outbox") % nsaved << std::endl;
+
 	while(true)
 	{
-		msgStr = toNetwork->popItem();
-		top.publish(msgStr);
+		// block on the queue only with nothing else to do
+		const bool idle = waiting.empty() && inflight.empty();
+		if(deadline == steady_clock::time_point::max())
+		{
+			steady_clock::duration wait = steady_clock::duration::zero();
+			if(idle)
+				wait = (params->stats_period > 0) ? next_stats - steady_clock::now() : duration_cast<steady_clock::duration>(hours(1));
+			if(toNetwork->drainIntoFor(msgs, wait) == 0 && toNetwork->isClosed())
+				deadline = steady_clock::now() + PUBLISH_DRAIN_TIMEOUT;
+			for(const NetMsg& msg : msgs)
+				queue_outgoing(waiting, params, msg);
+			msgs.clear();
+		}
+		else if(idle || steady_clock::now() >= deadline)
+		{
+			if(idle == false && outbox->enabled())
+			{
+				save_outgoing(outbox, waiting, nsaved);
+				save_outgoing(outbox, inflight, nsaved);
+				std::cout << boost::format("[MQTTdebug] %lu messages left in the outbox") % nsaved << std::endl;
+			}
+			else if(idle == false)
+				std::cerr << boost::format("[MQTTerror] %lu responses not published") % (waiting.size() + inflight.size()) << std::endl;
+			break;
+		}
+
+		// fill the window. While the client can't publish, wait a bit
+		while(waiting.empty() == false && inflight.size() < params->pub_window && steady_clock::now() >= next_try)
+		{
+			try
+			{
+				waiting.front().tok = client->publish(waiting.front().topic, waiting.front().payload, QOS, false);
+				inflight.push_back(std::move(waiting.front()));
+				waiting.pop_front();
+			}
+			catch(const TransportError& e)
+			{
+				next_try = steady_clock::now() + PUBLISH_RETRY_DELAY;
+			}
+		}
+
+		// wait for the oldest publish to be acked, or for the client to be
+		// able to publish again, then collect everything acked meanwhile
+		if(inflight.empty() == false)
+		{
+			inflight.front().tok->waitFor(PUBLISH_POLL);
+			reap_outgoing(client, inflight, waiting, st, nsaved);
+		}
+		else if(waiting.empty() == false)
+			std::this_thread::sleep_until(std::min(next_try, steady_clock::now() + PUBLISH_POLL));
+
+		// keep what can't go out on disk, and forget it once all of it did
+		if(outbox->enabled() && client->isConnected() == false)
+			save_outgoing(outbox, waiting, nsaved);
+		else if(nsaved == 0 && outbox->size() > 0)
+			outbox->clear();
+
+		if(params->stats_period > 0 && steady_clock::now() >= next_stats)
+		{
+			Ack ack = make_ack(AckCode::PUBLISH, params->userid);
+			ack.values = {double(st.acked), double(st.retried), double(st.failed),
+						  st.acked > 0 ? st.latency_sum / st.acked : 0.0, st.latency_max,
+						  double(waiting.size() + inflight.size())};
+			queue_outgoing(waiting, params, NetMsg{NetChannel::STATUS, ack, ack_text(ack), steady_clock::now()});
+			st = PublishStats();
+			next_stats = steady_clock::now() + stats_period;
+		}
 	}
 }
 
 void mqtt_pubsub_ops(
 					struct MqttParams *params,
-					ProtectedQ<std::string> *toNetwork,
-					ProtectedQ<std::string> *fromNetwork )
+					ProtectedQ<NetMsg> *toNetwork,
+					ProtectedQ<NetRequest> *fromNetwork )
 {
-	// create MQTT objects
-	mqtt::connect_options connOpts;
-	connOpts.set_keep_alive_interval(30);
-	connOpts.set_clean_session(true);
-	std::cout << "[MQTTdebug] connection timeout: " << connOpts.get_connect_timeout().count() << std::endl;
-
-	// create will message
-	auto lwt = mqtt::make_message(params->pubtopic, "<<<"+params->userid+" disconnected>>>", QOS, false);
-	connOpts.set_will_message(lwt);
-
-	mqtt::async_client client(params->server, params->userid);
-	CallbackHelper cb(client, connOpts,
-						params->pubtopic, params->subtopic, fromNetwork);
-	client.set_callback(cb);
-
-	// try connecting  to server and subscribing to topic
+	// with a persistent session the broker keeps the subscription and the
+	// QoS1 requests sent while we are away, and the client keeps the
+	// publishes in flight on disk
+	const bool persistent = (params->persist_dir.empty() == false);
+	TransportOptions opts;
+	opts.clean_session = (persistent == false);
+	opts.keep_alive = 30;
+	// will message
+	const std::string bye = "<<<"+params->userid+" disconnected>>>";
+	opts.will_topic = params->pubtopic;
+	opts.will_payload = bye;
+	opts.persist_dir = params->persist_dir;
+
+	std::string outbox_path;
+	if(persistent)
+	{
+		boost::filesystem::create_directories(params->persist_dir);
+		outbox_path = params->persist_dir + "/outbox-" + params->userid + ".dat";
+		std::cout << "[MQTTdebug] persistent session, state in " << params->persist_dir << std::endl;
+	}
+	Outbox outbox(outbox_path);
+
+	std::unique_ptr<Transport> client = make_transport(params->server, params->userid, opts);
+	CallbackHelper cb(*client, params->pubtopic, params->subtopics, fromNetwork, toNetwork);
+	client->setListener(&cb);
+
+	// try connecting  to server and subscribing to topic. If the server
+	// can't be reached, cb keeps trying in the background while responses
+	// wait in the publisher
+	TransportTokenPtr conntok;
 	try
 	{
 		std::cout << boost::format("[MQTTdebug] connecting to %s as %s") % params->server % params->userid << std::endl;
-		client.connect(connOpts, nullptr, cb)->wait();
+		conntok = client->connect();
 	}
-	catch(const mqtt::exception& e)
+	catch(const TransportError& e)
 	{
 		std::cerr << "\n[MQTTerror] Unable to connect to MQTT server: '"
 			<< params->server << "'" << std::endl;
 		exit(1);
 	}
+	if(conntok->waitFor(CONNECT_TIMEOUT) == false || conntok->returnCode() != 0)
+		std::cerr << "\n[MQTTerror] MQTT server '" << params->server << "' unreachable, retrying" << std::endl;
 
-	// setup publishing on topic
-	mqtt_publisher(&client, params->pubtopic, toNetwork);
-	
+	// setup publishing on topic, returns once toNetwork was closed
+	mqtt_publisher(client.get(), params, &outbox, toNetwork);
+
+	// the will message is only sent on unexpected disconnects
+	cb.stop();
+	try
+	{
+		std::cout << "[MQTTdebug] disconnecting" << std::endl;
+		client->publish(params->pubtopic, bye, QOS, false)->waitFor(CONNECT_TIMEOUT);
+		client->disconnect();
+	}
+	catch(const TransportError& e)
+	{
+		std::cerr << "[MQTTerror] " << e.what() << std::endl;
+	}
 }
@@ -7,7 +7,16 @@
 #define OPS_HELPER_HPP
 
 #include <string>
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <vector>
 #include "protected_queue.hpp"
+#include "rx_request.hpp"
+#include "capture_agenda.hpp"
+#include "ack.hpp"
+#include "request_parser.hpp"
+#include "capture_sink.hpp"
 
 /*
  * cnvenient struct to keep all the MQTT connection parameters
@@ -17,9 +26,98 @@ struct MqttParams
     std::string server;
     std::string userid;
     std::string pubtopic;
-    std::string subtopic;
+    std::vector<std::string> subtopics;    // command topics, see topics.hpp
+    std::string stattopic;
+    std::string teltopic;   // per capture telemetry
+    std::string prevtopic;  // capture previews, always binary on prevtopic + BINARY_TOPIC_SUFFIX
+    bool text_acks;     // publish acks and status as text on the topics above
+    bool binary_acks;   // and/or binary on the same topics + BINARY_TOPIC_SUFFIX
+    size_t pub_window;  // publishes waiting for the broker's ack at most
+    double stats_period;    // seconds between publisher counters on the status topic, 0 for none
+    std::string persist_dir;    // session state and outbox for a persistent session, empty for a clean one
 };
 
+/*
+ * outgoing message. The channel picks which of the MqttParams topics it is
+ * published to: responses to requests, gateway status, capture telemetry or
+ * capture previews. Previews are published as their payload, ack only names
+ * the capture
+ */
+enum class NetChannel { RESPONSE, STATUS, TELEMETRY, PREVIEW };
+
+struct NetMsg
+{
+    NetChannel channel;
+    Ack ack;
+    std::string text;   // ack_text(ack)
+    std::chrono::steady_clock::time_point tqueued;
+    std::string payload;    // encoded CapturePreview for NetChannel::PREVIEW
+};
+
+/*
+ * incoming message, decoded on the thread that received it. payload shares
+ * ownership of the buffer the message arrived in, parsed refers into it
+ */
+struct NetRequest
+{
+    std::shared_ptr<const std::string> payload;
+    bool binary;        // arrived on a BINARY_TOPIC_SUFFIX topic
+    bool batch;         // meant to carry more than one request
+    double tarrived;    // system time the message was received
+    std::vector<ParsedRequest> parsed;
+
+    // identical messages, e.g. a trigger sent twice, for QueueOverflow::COALESCE
+    bool operator==(const NetRequest& o) const { return binary == o.binary && *payload == *o.payload; }
+};
+
+/*
+ * decode rx.payload into rx.parsed. If that fails, nack is the response
+ * telling the sender why
+ */
+bool decode_net_request(NetRequest& rx, const std::string& client_id, Ack& nack);
+
+/*
+ * queue a response to a request for the MQTT thread and log it
+ */
+inline void send_response(ProtectedQ<NetMsg> *toNetwork, const Ack& ack)
+{
+    std::string txmsg = ack_text(ack);
+    std::cout << txmsg << std::endl;
+    toNetwork->addItem(NetMsg{NetChannel::RESPONSE, ack, txmsg, std::chrono::steady_clock::now()});
+}
+
+/*
+ * queue a gateway status update for the MQTT thread
+ */
+inline void send_status(ProtectedQ<NetMsg> *toNetwork, const Ack& ack)
+{
+    toNetwork->addItem(NetMsg{NetChannel::STATUS, ack, ack_text(ack), std::chrono::steady_clock::now()});
+}
+
+/*
+ * queue the counters of a capture for the MQTT thread
+ */
+inline void send_telemetry(ProtectedQ<NetMsg> *toNetwork, const Ack& ack)
+{
+    toNetwork->addItem(NetMsg{NetChannel::TELEMETRY, ack, ack_text(ack), std::chrono::steady_clock::now()});
+}
+
+/*
+ * queue a status update with the counters of a network queue
+ */
+template <typename T>
+inline void send_queue_stats(ProtectedQ<NetMsg> *toNetwork, const std::string& client_id,
+                             const std::string& name, ProtectedQ<T> *q)
+{
+    QueueStats st = q->takeStats();
+    Ack ack = make_ack(AckCode::QUEUE, client_id);
+    ack.name = name;
+    ack.values = {double(st.depth), double(st.max_depth), double(st.added),
+                  double(st.rejected), double(st.dropped), double(st.coalesced),
+                  st.taken > 0 ? st.wait_sum / st.taken : 0.0, st.wait_max};
+    send_status(toNetwork, ack);
+}
+
 /*
  * MQTT self-complete function that will pass received messages
  * to a protected queue and wait for messages on 
@@ -35,8 +133,8 @@ struct MqttParams
 
 void mqtt_pubsub_ops(
 					struct MqttParams *params,
-					ProtectedQ<std::string> *toNetwork,
-					ProtectedQ<std::string> *fromNetwork );
+					ProtectedQ<NetMsg> *toNetwork,
+					ProtectedQ<NetRequest> *fromNetwork );
 
 struct UsrpParams
 {
@@ -54,11 +152,45 @@ struct UsrpParams
     bool null;
     bool subdev_flag;
     std::string subdev;
+    bool keep_partial;
+    double setup_quantile;
+    double stats_period;    // seconds between queue counters on the status topic, 0 for none
+    bool preview;           // publish a preview of every capture
 };
 
+/*
+ * ack about an agenda entry, tagged with its name and, for schedules, the
+ * index of its next occurrence
+ */
+Ack entry_ack(AckCode code, const std::string& client_id, const AgendaEntry& e);
+
+/*
+ * bytes per sample for the host side sample type
+ */
+size_t cpu_sample_size(const std::string& datafmt);
+
+/*
+ * request thread: admits the requests decoded by the MQTT thread into the
+ * agenda, replying right away to anything that is not accepted
+ */
+void request_ops(
+            struct UsrpParams *params,
+            CaptureAgenda *agenda,
+            ProtectedQ<NetMsg> *toNetwork,
+            ProtectedQ<NetRequest> *fromNetwork);
+
+class Uploader;
+
+/*
+ * USRP thread: runs the admitted captures in the agenda. Saved captures
+ * are handed to uploader, if there is one. The samples also go to sinks
+ * (e.g. a live stream) and to a preview stage if params->preview is set
+ */
 void usrp_ops(
             struct UsrpParams *params,
-            ProtectedQ<std::string> *toNetwork,
-            ProtectedQ<std::string> *fromNetwork);
+            CaptureAgenda *agenda,
+            ProtectedQ<NetMsg> *toNetwork,
+            Uploader *uploader,
+            CaptureSinks sinks);
 
 #endif // OPS_HELPER_HPP
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include "outbox.hpp"
+
+Outbox::Outbox(const std::string& path)
+    : path(path), nrecords(0)
+{
+    std::vector<std::pair<std::string, std::string>> records;
+    nrecords = load(records);
+}
+
+static void write_field(std::ofstream& f, const std::string& s)
+{
+    const uint32_t len = s.size();
+    f.write(reinterpret_cast<const char*>(&len), sizeof(len));
+    f.write(s.data(), len);
+}
+
+static bool read_field(std::ifstream& f, std::string& s)
+{
+    uint32_t len;
+    if(!f.read(reinterpret_cast<char*>(&len), sizeof(len)))
+        return false;
+    s.resize(len);
+    return bool(f.read(&s[0], len));
+}
+
+bool Outbox::append(const std::string& topic, const std::string& payload)
+{
+    if(enabled() == false)
+        return false;
+    std::ofstream f(path, std::ios::binary | std::ios::app);
+    write_field(f, topic);
+    write_field(f, payload);
+    f.flush();
+    if(!f)
+    {
+        std::cerr << boost::format("[MQTTerror] could not write to outbox %s") % path << std::endl;
+        return false;
+    }
+    nrecords++;
+    return true;
+}
+
+size_t Outbox::load(std::vector<std::pair<std::string, std::string>>& out)
+{
+    if(enabled() == false || boost::filesystem::exists(path) == false)
+        return 0;
+    std::ifstream f(path, std::ios::binary);
+    size_t n = 0;
+    std::string topic, payload;
+    while(read_field(f, topic) && read_field(f, payload))
+    {
+        out.emplace_back(topic, payload);
+        n++;
+    }
+    return n;
+}
+
+void Outbox::clear()
+{
+    if(enabled() == false || nrecords == 0)
+        return;
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+    if(ec)
+        std::cerr << boost::format("[MQTTerror] could not clear outbox %s: %s") % path % ec.message() << std::endl;
+    nrecords = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * On-disk copy of the responses and status updates that could not be
+ * published because the broker was unreachable. They survive a restart of
+ * the gateway and go out once it is connected again.
+ *
+ * The file is a list of records
+ *   topic length (u32), topic, payload length (u32), payload
+ * with lengths in host byte order. It is only appended to while messages
+ * are pending and truncated once all of them were acked.
+ */
+
+#ifndef OUTBOX_HPP
+#define OUTBOX_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+
+class Outbox
+{
+    private:
+        std::string path;
+        // records written since the last clear()
+        size_t nrecords;
+
+    public:
+        // an empty path disables the outbox, nothing is saved or loaded
+        explicit Outbox(const std::string& path);
+
+        bool enabled() const { return path.empty() == false; }
+
+        // records in the file, e.g. left over from the last run
+        size_t size() const { return nrecords; }
+
+        // append a message. Returns false if it could not be written
+        bool append(const std::string& topic, const std::string& payload);
+
+        // read all records as (topic, payload). A truncated last record,
+        // from a crash while appending, is skipped
+        size_t load(std::vector<std::pair<std::string, std::string>>& out);
+
+        // forget all records
+        void clear();
+};
+
+#endif // OUTBOX_HPP
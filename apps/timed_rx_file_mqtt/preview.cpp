@@ -0,0 +1,216 @@
+/*
+ * Previews of captures, computed off the USRP thread
+ */
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <boost/format.hpp>
+#include "preview.hpp"
+
+PreviewStage::PreviewStage(const std::string& client_id, ProtectedQ<NetMsg> *toNetwork)
+    : client_id(client_id), toNetwork(toNetwork),
+      // room for every buffer of the pool and the BEGIN and END around them
+      filled(PREVIEW_POOL + 4), spare(PREVIEW_POOL), nbuffers(0),
+      active(false), samp_size(0), next_index(0), dropped_captures(0), worker(),
+      preview(), winfo(), scale(1.0), pos(0), point(0), point_pow(0.0), point_n(0),
+      point_burst(), burst_start(0), dec_acc(), dec_n(0), best_pow(-1.0)
+{
+    worker = std::thread(&PreviewStage::run, this);
+}
+
+PreviewStage::~PreviewStage()
+{
+    // the worker finishes what is queued
+    filled.close();
+    worker.join();
+}
+
+void PreviewStage::begin(const CaptureInfo& info)
+{
+    samp_size = info.samp_size;
+    next_index = 0;
+    // never wait for the worker here either, the capture goes unpreviewed
+    Block b{BlockKind::BEGIN, 0, 0, {}, info};
+    active = filled.tryAddItem(b);
+    if(active == false)
+        dropped_captures++;
+}
+
+void PreviewStage::write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime&)
+{
+    if(active == false || nsamps == 0)
+        return;
+    next_index = index + nsamps;
+
+    // a buffer from the pool, or a new one while the pool is not full.
+    // Otherwise the worker is behind and these samples are skipped, which
+    // it notices from the next index it gets
+    Block b;
+    if(spare.tryPopItem(b) == false)
+    {
+        if(nbuffers >= PREVIEW_POOL)
+            return;
+        nbuffers++;
+    }
+    b.kind = BlockKind::SAMPLES;
+    b.index = index;
+    b.nsamps = nsamps;
+    const char* p = static_cast<const char*>(samples);
+    b.bytes.assign(p, p + nsamps * samp_size);
+    if(filled.tryAddItem(b) == false)
+        nbuffers--;
+}
+
+void PreviewStage::end(bool)
+{
+    if(active == false)
+        return;
+    active = false;
+    // without its END the worker drops the preview at the next BEGIN
+    Block b{BlockKind::END, next_index, 0, {}, CaptureInfo()};
+    if(filled.tryAddItem(b) == false)
+        dropped_captures++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+void PreviewStage::run()
+{
+    bool previewing = false;
+    Block b;
+    while(filled.popItem(b))
+    {
+        switch(b.kind)
+        {
+            case BlockKind::BEGIN:
+                startPreview(b.info);
+                previewing = true;
+                break;
+            case BlockKind::SAMPLES:
+                if(previewing)
+                {
+                    if(winfo.cpu_format == "double")
+                        addSamples(reinterpret_cast<const std::complex<double>*>(b.bytes.data()), b.nsamps, b.index);
+                    else if(winfo.cpu_format == "float")
+                        addSamples(reinterpret_cast<const std::complex<float>*>(b.bytes.data()), b.nsamps, b.index);
+                    else if(winfo.cpu_format == "short")
+                        addSamples(reinterpret_cast<const std::complex<short>*>(b.bytes.data()), b.nsamps, b.index);
+                }
+                // back to the USRP thread, the pool never holds more
+                // buffers than spare has room for
+                spare.tryAddItem(b);
+                break;
+            case BlockKind::END:
+                if(previewing)
+                    finishPreview(b.index);
+                previewing = false;
+                break;
+        }
+    }
+}
+
+void PreviewStage::startPreview(const CaptureInfo& info)
+{
+    winfo = info;
+    scale = (info.cpu_format == "short") ? 32768.0 : 1.0;
+
+    preview = CapturePreview();
+    preview.client_id = client_id;
+    preview.name = info.name;
+    preview.file = info.file;
+    preview.t0 = info.t0;
+    preview.fc = info.fc;
+    preview.sps = info.sps;
+    preview.nsamp = info.nsamp;
+    const unsigned long long nsamp = std::max(info.nsamp, 1ULL);
+    preview.env_step = uint32_t((nsamp + PREVIEW_POINTS - 1) / PREVIEW_POINTS);
+    preview.envelope.assign((nsamp + preview.env_step - 1) / preview.env_step, -1.0f);
+    preview.burst_decim = uint32_t((preview.env_step + PREVIEW_BURST_LEN - 1) / PREVIEW_BURST_LEN);
+    preview.dropped = 0;
+
+    pos = 0;
+    point = 0;
+    point_pow = 0.0;
+    point_n = 0;
+    point_burst.clear();
+    burst_start = 0;
+    dec_acc = 0.0;
+    dec_n = 0;
+    best_pow = -1.0;
+}
+
+template <typename T>
+void PreviewStage::addSamples(const std::complex<T>* samples, size_t n, unsigned long long index)
+{
+    if(index > pos)
+    {
+        // samples skipped by write(): the point they were in ends early
+        preview.dropped += index - pos;
+        finishPoint();
+        pos = index;
+    }
+    const double inv = 1.0 / scale;
+    for(size_t i = 0; i < n; i++, pos++)
+    {
+        const size_t p = size_t(pos / preview.env_step);
+        if(p >= preview.envelope.size())
+        {
+            pos += n - i;
+            break;
+        }
+        if(p != point)
+            finishPoint();
+        if(point_n == 0)
+        {
+            point = p;
+            burst_start = pos;
+        }
+        const std::complex<double> x(double(samples[i].real()) * inv, double(samples[i].imag()) * inv);
+        point_pow += std::norm(x);
+        point_n++;
+        dec_acc += x;
+        if(++dec_n == preview.burst_decim)
+        {
+            dec_acc /= double(dec_n);
+            point_burst.push_back(float(dec_acc.real()));
+            point_burst.push_back(float(dec_acc.imag()));
+            dec_acc = 0.0;
+            dec_n = 0;
+        }
+    }
+}
+
+void PreviewStage::finishPoint()
+{
+    if(point_n > 0)
+    {
+        const double pow = point_pow / point_n;
+        preview.envelope[point] = float(std::sqrt(pow));
+        if(pow > best_pow && point_burst.empty() == false)
+        {
+            best_pow = pow;
+            preview.burst_index = burst_start;
+            preview.burst.swap(point_burst);
+        }
+    }
+    point_pow = 0.0;
+    point_n = 0;
+    point_burst.clear();
+    dec_acc = 0.0;
+    dec_n = 0;
+}
+
+void PreviewStage::finishPreview(unsigned long long received)
+{
+    finishPoint();
+    if(received > pos)
+        preview.dropped += received - pos;
+
+    NetMsg msg{NetChannel::PREVIEW, Ack(), "", std::chrono::steady_clock::now(), ""};
+    msg.ack.name = preview.name;
+    encode_preview(preview, msg.payload);
+    toNetwork->addItem(std::move(msg));
+    std::cout << boost::format("[UHDdebug] preview of %s: %u points, %u dropped samples, %u captures not previewed so far")
+        % preview.file % preview.envelope.size() % preview.dropped % dropped_captures.load() << std::endl;
+}
@@ -0,0 +1,93 @@
+/*
+ * Capture sink computing a CapturePreview (wire_codec.hpp) of every
+ * capture while it streams, published on the preview topic once the
+ * capture ends.
+ *
+ * The USRP thread only copies each buffer into a spare one of a fixed pool
+ * and hands it to a worker thread through a RingQ; the envelope and burst
+ * excerpt are computed there. If the worker falls behind and the pool
+ * runs dry, buffers are skipped and counted in the preview instead of
+ * holding up recv(). A capture whose start or end can't be handed over
+ * either is not previewed at all and counted in droppedCaptures().
+ */
+
+#ifndef PREVIEW_HPP
+#define PREVIEW_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <complex>
+#include "ring_queue.hpp"
+#include "protected_queue.hpp"
+#include "capture_sink.hpp"
+#include "wire_codec.hpp"
+#include "ops_helper.hpp"
+
+// envelope points and complex samples in the burst excerpt, at most
+const size_t PREVIEW_POINTS = 512;
+const size_t PREVIEW_BURST_LEN = 1024;
+// buffers in the pool between the USRP thread and the worker
+const size_t PREVIEW_POOL = 64;
+
+class PreviewStage : public CaptureSink
+{
+    private:
+        enum class BlockKind { BEGIN, SAMPLES, END };
+        struct Block
+        {
+            BlockKind kind;
+            unsigned long long index;
+            size_t nsamps;
+            std::vector<char> bytes;
+            CaptureInfo info;   // for BEGIN
+        };
+
+        std::string client_id;
+        ProtectedQ<NetMsg> *toNetwork;
+        RingQ<Block> filled;    // USRP thread to worker
+        RingQ<Block> spare;     // worker back to the USRP thread
+        size_t nbuffers;        // allocated so far, up to PREVIEW_POOL
+        // USRP thread side: a capture is streaming, and the sample after
+        // the last one written
+        bool active;
+        size_t samp_size;
+        unsigned long long next_index;
+        std::atomic<unsigned long long> dropped_captures;
+        std::thread worker;
+
+        // worker state for the capture being previewed
+        CapturePreview preview;
+        CaptureInfo winfo;
+        double scale;               // full scale of the sample type
+        unsigned long long pos;     // next sample expected
+        size_t point;               // envelope point being summed
+        double point_pow;
+        size_t point_n;
+        std::vector<float> point_burst;     // decimated samples of the point
+        unsigned long long burst_start;     // sample point_burst starts at
+        std::complex<double> dec_acc;
+        size_t dec_n;
+        double best_pow;
+
+        void run();
+        void startPreview(const CaptureInfo& info);
+        template <typename T>
+        void addSamples(const std::complex<T>* samples, size_t n, unsigned long long index);
+        void finishPoint();
+        void finishPreview(unsigned long long received);
+
+    public:
+        PreviewStage(const std::string& client_id, ProtectedQ<NetMsg> *toNetwork);
+        ~PreviewStage();
+
+        void begin(const CaptureInfo& info) override;
+        void write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev) override;
+        void end(bool ok) override;
+
+        // captures left out because the worker was too far behind
+        unsigned long long droppedCaptures() const { return dropped_captures.load(); }
+};
+
+#endif // PREVIEW_HPP
@@ -0,0 +1,251 @@
+/*
+ *  Request thread. Decodes the messages received over MQTT and admits them
+ *  into the capture agenda as they arrive, so conflicting requests are
+ *  rejected right away instead of after the capture ahead of them finished.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <boost/format.hpp>
+#include "ops_helper.hpp"
+#include "time_helper.hpp"
+#include "request_parser.hpp"
+#include "wire_codec.hpp"
+
+// fill in an agenda entry from a decoded capture or schedule request.
+// Returns false for schedules whose occurrences do not fit their period
+static bool make_agenda_entry(const ParsedRequest& p, double tarrived, AgendaEntry& e, double setup_slack)
+{
+    e.req = p.req;
+    e.req.ant = std::string(p.ant);
+    e.name = std::string(p.name);
+    e.recurring = (p.kind == RequestKind::SCHEDULE);
+    e.period = e.recurring ? p.period : 0.0;
+    e.count = e.recurring ? p.count : 1;
+    e.next = 0;
+    e.tarrived = tarrived;
+    e.tdequeued = 0.0;
+    // every occurrence is set up from scratch, so it has to finish with
+    // enough time left for the next one to be set up
+    return !e.recurring || (rx_request_duration(e.req) + setup_slack < e.period);
+}
+
+Ack entry_ack(AckCode code, const std::string& client_id, const AgendaEntry& e)
+{
+    Ack ack = make_ack(code, client_id);
+    ack.name = e.name;
+    ack.recurring = e.recurring;
+    ack.occurrence = e.recurring ? int(e.next) : -1;
+    ack.t0 = e.req.t0;
+    ack.stages.arrived = e.tarrived;
+    ack.stages.dequeued = e.tdequeued;
+    return ack;
+}
+
+size_t cpu_sample_size(const std::string& datafmt)
+{
+    if(datafmt == "double")
+        return 2 * sizeof(double);
+    if(datafmt == "float")
+        return 2 * sizeof(float);
+    return 2 * sizeof(short);
+}
+
+// response for a request that did not pass admission
+static Ack rejection_ack(
+    const std::string& client_id,
+    const AgendaEntry& e,
+    const Admission& adm)
+{
+    Ack ack = entry_ack(AckCode::REJECTED, client_id, e);
+    ack.reason = adm.reason;
+    ack.earliest = adm.earliest;
+    return ack;
+}
+
+bool decode_net_request(NetRequest& rx, const std::string& client_id, Ack& nack)
+{
+    ParseStatus status;
+    size_t failed = 0;
+    bool ok;
+    const std::string& msg = *rx.payload;
+    if(rx.binary)
+    {
+        rx.batch = is_binary_batch(msg);
+        ok = decode_requests(msg, rx.parsed, status, failed);
+    }
+    else
+    {
+        rx.batch = is_batch(msg);
+        if(rx.batch)
+            ok = parse_batch(msg, rx.parsed, status, failed);
+        else
+        {
+            rx.parsed.resize(1);
+            ok = parse_request(msg, rx.parsed[0], status);
+        }
+    }
+    if(ok == false)
+    {
+        nack = make_ack(rx.batch ? AckCode::BATCH_INVALID : AckCode::INVALID, client_id);
+        nack.batch = rx.batch ? int(failed) : -1;
+        nack.reason = parse_error_str(status);
+        nack.stages.arrived = rx.tarrived;
+    }
+    return ok;
+}
+
+// admit all requests of a batch message together, and build the single
+// response that covers them
+static Ack handle_batch(
+    struct UsrpParams* params,
+    CaptureAgenda *agenda,
+    const NetRequest& rx)
+{
+    const std::vector<ParsedRequest>& parsed = rx.parsed;
+    std::vector<AgendaEntry> group(parsed.size());
+    for(size_t i = 0; i < parsed.size(); i++)
+    {
+        if(make_agenda_entry(parsed[i], rx.tarrived, group[i], params->ntpslack + params->tslack) == false)
+        {
+            Ack ack = make_ack(AckCode::BATCH_INVALID, params->client_id);
+            ack.batch = i;
+            ack.reason = "'period' shorter than capture";
+            ack.stages.arrived = rx.tarrived;
+            return ack;
+        }
+    }
+
+    size_t failed;
+    Admission adm = agenda->admitGroup(group, systime_now_double(), failed);
+    if(adm.ok == false)
+    {
+        Ack ack = rejection_ack(params->client_id, group[failed], adm);
+        ack.batch = failed;
+        return ack;
+    }
+    Ack ack = make_ack(AckCode::BATCH_ACCEPTED, params->client_id);
+    ack.count = group.size();
+    ack.stages.arrived = rx.tarrived;
+    return ack;
+}
+
+// act on a single decoded request. Returns false if it needs no response
+static bool handle_request(
+    struct UsrpParams* params,
+    CaptureAgenda *agenda,
+    ProtectedQ<NetMsg> *toNetwork,
+    const ParsedRequest& parsed,
+    double tarrived,
+    Ack& ack)
+{
+    AgendaEntry e;
+
+    // cancelling a running capture is reported by the USRP thread once
+    // it stopped streaming
+    if(parsed.kind == RequestKind::CANCEL)
+    {
+        std::string name(parsed.name);
+        ack = make_ack(agenda->cancel(name) ? AckCode::CANCELLED : AckCode::UNKNOWN, params->client_id);
+        ack.name = name;
+        ack.stages.arrived = tarrived;
+        return true;
+    }
+    if(make_agenda_entry(parsed, tarrived, e, params->ntpslack + params->tslack) == false)
+    {
+        ack = make_ack(AckCode::INVALID, params->client_id);
+        ack.reason = "'period' shorter than capture";
+        ack.stages.arrived = tarrived;
+        return true;
+    }
+
+    // schedules are kept until all their occurrences ran or are cancelled
+    if(e.recurring)
+    {
+        Admission adm = agenda->admit(e, systime_now_double());
+        ack = adm.ok ? entry_ack(AckCode::ACCEPTED, params->client_id, e) : rejection_ack(params->client_id, e, adm);
+        ack.occurrence = -1;
+        ack.count = adm.ok ? e.count : 0;
+        return true;
+    }
+
+    // named one-off requests can be cancelled by their id. Preempting
+    // ones drop (and stop) whatever is in the way of their device time
+    if(!e.name.empty())
+    {
+        std::vector<AgendaEntry> preempted;
+        Admission adm = agenda->admit(e, systime_now_double(), parsed.preempt, &preempted);
+        for(const auto& p : preempted)
+        {
+            Ack pack = entry_ack(AckCode::PREEMPTED, params->client_id, p);
+            pack.by = e.name;
+            pack.t0 = p.occurrence(p.next);
+            send_response(toNetwork, pack);
+        }
+        ack = adm.ok ? entry_ack(AckCode::ACCEPTED, params->client_id, e) : rejection_ack(params->client_id, e, adm);
+        return true;
+    }
+
+    Admission adm = agenda->admit(e, systime_now_double());
+    // accepted one-off captures are only acked once they ran
+    if(adm.ok)
+        return false;
+    ack = rejection_ack(params->client_id, e, adm);
+    return true;
+}
+
+void request_ops(
+                struct UsrpParams* params,
+                CaptureAgenda *agenda,
+                ProtectedQ<NetMsg> *toNetwork,
+                ProtectedQ<NetRequest> *fromNetwork)
+{
+    using namespace std::chrono;
+    std::vector<NetRequest> pending;
+    const duration<double> stats_period(params->stats_period);
+    steady_clock::time_point next_stats = steady_clock::now() + duration_cast<steady_clock::duration>(stats_period);
+    std::cout << "[REQdebug] request thread created" << std::endl;
+
+    // take everything that queued up while the last requests were handled
+    // in one go, waking up for the queue counters when they are due.
+    // Nothing is left once the queue was closed and drained
+    while(true)
+    {
+        if(params->stats_period > 0)
+        {
+            if(steady_clock::now() >= next_stats)
+            {
+                send_queue_stats(toNetwork, params->client_id, "requests", fromNetwork);
+                send_queue_stats(toNetwork, params->client_id, "responses", toNetwork);
+                next_stats = steady_clock::now() + duration_cast<steady_clock::duration>(stats_period);
+            }
+            if(fromNetwork->drainIntoFor(pending, next_stats - steady_clock::now()) == 0)
+            {
+                if(fromNetwork->isClosed())
+                    break;
+                continue;
+            }
+        }
+        else if(fromNetwork->drainInto(pending) == 0)
+            break;
+
+        std::cout << boost::format("[REQdebug] %lu request(s) recvd") % pending.size() << std::endl;
+
+        // messages were decoded on arrival, only admission is left
+        for(const NetRequest& rx : pending)
+        {
+            Ack ack;
+            // a batch is accepted or rejected as a whole
+            if(rx.batch)
+                ack = handle_batch(params, agenda, rx);
+            else if(handle_request(params, agenda, toNetwork, rx.parsed[0], rx.tarrived, ack) == false)
+                continue;
+            send_response(toNetwork, ack);
+        }
+        pending.clear();
+    }
+
+    std::cout << "[REQdebug] request thread done" << std::endl;
+}
@@ -0,0 +1,350 @@
+/*
+ * Order independent key=value request parser built on std::from_chars
+ */
+
+#include <charconv>
+#include <cmath>
+#include <boost/format.hpp>
+#include "request_parser.hpp"
+
+// time between the end of a sweep step and the start of the next one that
+// the frontend needs to retune and settle
+const double SWEEP_RETUNE_GUARD = 0.005;
+
+static const std::string_view key_names[KEY_UNKNOWN] = {
+    "fc", "sweep", "lo", "sps", "bw", "g", "t0", "n", "ant", "dwell",
+    "id", "preempt", "sched", "period", "count", "cancel"
+};
+
+std::string_view request_key_name(RequestKey k)
+{
+    return (k < KEY_UNKNOWN) ? key_names[k] : std::string_view("?");
+}
+
+static RequestKey lookup_key(std::string_view key)
+{
+    for(unsigned k = 0; k < KEY_UNKNOWN; k++)
+    {
+        if(key_names[k] == key)
+            return RequestKey(k);
+    }
+    return KEY_UNKNOWN;
+}
+
+static bool fail(ParseStatus& status, ParseError err, size_t pos, std::string_view key)
+{
+    status.err = err;
+    status.pos = pos;
+    status.key = key;
+    return false;
+}
+
+// the whole value has to be a number
+template <typename T>
+static bool parse_number(std::string_view val, T& out)
+{
+    if(val.empty())
+        return false;
+    auto res = std::from_chars(val.data(), val.data() + val.size(), out);
+    return (res.ec == std::errc()) && (res.ptr == val.data() + val.size());
+}
+
+static bool parse_freq_list(std::string_view val, RxRequest& req, ParseError& err)
+{
+    req.nsteps = 0;
+    while(true)
+    {
+        size_t sep = val.find(':');
+        if(req.nsteps == MAX_SWEEP_STEPS)
+        {
+            err = ParseError::TOO_MANY_STEPS;
+            return false;
+        }
+        if(parse_number(val.substr(0, sep), req.fc[req.nsteps++]) == false)
+        {
+            err = ParseError::BAD_VALUE;
+            return false;
+        }
+        if(sep == std::string_view::npos)
+            return true;
+        val.remove_prefix(sep + 1);
+    }
+}
+
+void init_request(ParsedRequest& out)
+{
+    out.kind = RequestKind::CAPTURE;
+    out.name = std::string_view();
+    out.preempt = false;
+    out.period = 0.0;
+    out.count = 1;
+    out.ant = std::string_view();
+    out.req.nsteps = 0;
+    out.req.lo = 0.0;
+    out.req.bw = 0.0;
+    out.req.gain = 0.0;
+    out.req.dwell = 0.0;
+    out.req.set_bw = false;
+    out.req.set_gain = false;
+}
+
+// the first number of a request that is nan or infinite, KEY_UNKNOWN if
+// there is none. Keys that were not given hold finite defaults
+static RequestKey non_finite_key(const ParsedRequest& out, unsigned seen)
+{
+    for(size_t i = 0; i < out.req.nsteps; i++)
+    {
+        if(std::isfinite(out.req.fc[i]) == false)
+            return (seen & KEY_BIT(KEY_SWEEP)) ? KEY_SWEEP : KEY_FC;
+    }
+    const std::pair<RequestKey, double> values[] = {
+        {KEY_LO, out.req.lo}, {KEY_SPS, out.req.sps}, {KEY_BW, out.req.bw}, {KEY_G, out.req.gain},
+        {KEY_T0, out.req.t0}, {KEY_DWELL, out.req.dwell}, {KEY_PERIOD, out.period}};
+    for(const auto& v : values)
+    {
+        if((seen & KEY_BIT(v.first)) && std::isfinite(v.second) == false)
+            return v.first;
+    }
+    return KEY_UNKNOWN;
+}
+
+bool validate_request(ParsedRequest& out, unsigned seen, const size_t keypos[KEY_UNKNOWN], ParseStatus& status)
+{
+    // cancel stands on its own
+    if(seen & KEY_BIT(KEY_CANCEL))
+    {
+        if(seen != KEY_BIT(KEY_CANCEL))
+            return fail(status, ParseError::CONFLICT, keypos[KEY_CANCEL], "cancel");
+        out.kind = RequestKind::CANCEL;
+        return true;
+    }
+
+    // from_chars takes "nan" and "inf", and so does the binary encoding.
+    // None of them can be compared against, let alone waited for
+    const RequestKey bad = non_finite_key(out, seen);
+    if(bad != KEY_UNKNOWN)
+        return fail(status, ParseError::BAD_VALUE, keypos[bad], request_key_name(bad));
+
+    // a request has at most one name
+    const unsigned names = seen & (KEY_BIT(KEY_ID) | KEY_BIT(KEY_PREEMPT) | KEY_BIT(KEY_SCHED));
+    if(names & (names - 1))
+        return fail(status, ParseError::CONFLICT, 0, "id/preempt/sched");
+
+    const unsigned sched_keys = KEY_BIT(KEY_SCHED) | KEY_BIT(KEY_PERIOD) | KEY_BIT(KEY_COUNT);
+    if(seen & sched_keys)
+    {
+        if((seen & sched_keys) != sched_keys)
+        {
+            RequestKey missing = !(seen & KEY_BIT(KEY_SCHED)) ? KEY_SCHED : (!(seen & KEY_BIT(KEY_PERIOD)) ? KEY_PERIOD : KEY_COUNT);
+            static const std::string_view sched_names[] = {"sched", "period", "count"};
+            return fail(status, ParseError::MISSING_KEY, 0, sched_names[missing - KEY_SCHED]);
+        }
+        out.kind = RequestKind::SCHEDULE;
+        if(out.count == 0 || out.count > MAX_SCHEDULE_COUNT)
+            return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_COUNT], "count");
+        if(out.period <= 0.0)
+            return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_PERIOD], "period");
+    }
+
+    // capture parameters
+    const bool sweep = (seen & KEY_BIT(KEY_SWEEP)) != 0;
+    if((seen & KEY_BIT(KEY_FC)) && sweep)
+        return fail(status, ParseError::CONFLICT, keypos[KEY_SWEEP], "fc/sweep");
+    if(!(seen & KEY_BIT(KEY_FC)) && !sweep)
+        return fail(status, ParseError::MISSING_KEY, 0, "fc");
+    if(!(seen & KEY_BIT(KEY_SPS)))
+        return fail(status, ParseError::MISSING_KEY, 0, "sps");
+    if(!(seen & KEY_BIT(KEY_T0)))
+        return fail(status, ParseError::MISSING_KEY, 0, "t0");
+    if(!(seen & KEY_BIT(KEY_N)))
+        return fail(status, ParseError::MISSING_KEY, 0, "n");
+    if(sweep && !(seen & KEY_BIT(KEY_DWELL)))
+        return fail(status, ParseError::MISSING_KEY, 0, "dwell");
+    if(!sweep && (seen & KEY_BIT(KEY_DWELL)))
+        return fail(status, ParseError::CONFLICT, keypos[KEY_DWELL], "dwell");
+
+    if(out.req.sps <= 0.0)
+        return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_SPS], "sps");
+    if(out.req.nsamp == 0)
+        return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_N], "n");
+    // every step has to fit in its dwell time with room to retune
+    if(sweep && double(out.req.nsamp) / out.req.sps + SWEEP_RETUNE_GUARD > out.req.dwell)
+        return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_DWELL], "dwell");
+    // so is the last occurrence of a schedule, not only its period
+    if(out.kind == RequestKind::SCHEDULE && std::isfinite(out.req.t0 + (out.count - 1) * out.period) == false)
+        return fail(status, ParseError::OUT_OF_RANGE, keypos[KEY_PERIOD], "period");
+
+    return true;
+}
+
+bool parse_request(std::string_view msg, ParsedRequest& out, ParseStatus& status)
+{
+    unsigned seen = 0;
+    size_t keypos[KEY_UNKNOWN] = {0};
+
+    status.err = ParseError::NONE;
+    status.pos = 0;
+    status.key = std::string_view();
+
+    // mosquitto_pub and friends may leave a line ending on the payload
+    while(!msg.empty() && (msg.back() == '\n' || msg.back() == '\r' || msg.back() == ' '))
+        msg.remove_suffix(1);
+    if(msg.empty())
+        return fail(status, ParseError::EMPTY, 0, std::string_view());
+
+    init_request(out);
+
+    size_t pos = 0;
+    while(pos <= msg.size())
+    {
+        size_t end = msg.find(',', pos);
+        if(end == std::string_view::npos)
+            end = msg.size();
+        std::string_view field = msg.substr(pos, end - pos);
+
+        size_t eq = field.find('=');
+        if(field.empty() || eq == std::string_view::npos || eq == 0)
+            return fail(status, ParseError::SYNTAX, pos, field.substr(0, eq));
+        std::string_view key = field.substr(0, eq);
+        std::string_view val = field.substr(eq + 1);
+
+        RequestKey k = lookup_key(key);
+        if(k == KEY_UNKNOWN)
+            return fail(status, ParseError::UNKNOWN_KEY, pos, key);
+        if(seen & KEY_BIT(k))
+            return fail(status, ParseError::DUPLICATE_KEY, pos, key);
+        seen |= KEY_BIT(k);
+        keypos[k] = pos;
+
+        bool ok = true;
+        ParseError err = ParseError::BAD_VALUE;
+        switch(k)
+        {
+            case KEY_FC:
+                out.req.nsteps = 1;
+                ok = parse_number(val, out.req.fc[0]);
+                break;
+            case KEY_SWEEP:
+                ok = parse_freq_list(val, out.req, err);
+                break;
+            case KEY_LO:
+                ok = parse_number(val, out.req.lo);
+                break;
+            case KEY_SPS:
+                ok = parse_number(val, out.req.sps);
+                break;
+            case KEY_BW:
+                out.req.set_bw = true;
+                ok = parse_number(val, out.req.bw);
+                break;
+            case KEY_G:
+                out.req.set_gain = true;
+                ok = parse_number(val, out.req.gain);
+                break;
+            case KEY_T0:
+                ok = parse_number(val, out.req.t0);
+                break;
+            case KEY_N:
+                ok = parse_number(val, out.req.nsamp);
+                break;
+            case KEY_DWELL:
+                ok = parse_number(val, out.req.dwell);
+                break;
+            case KEY_PERIOD:
+                ok = parse_number(val, out.period);
+                break;
+            case KEY_COUNT:
+                ok = parse_number(val, out.count);
+                break;
+            case KEY_ANT:
+            case KEY_ID:
+            case KEY_PREEMPT:
+            case KEY_SCHED:
+            case KEY_CANCEL:
+                if(val.size() > MAX_FIELD_LEN)
+                {
+                    ok = false;
+                    err = ParseError::TOO_LONG;
+                } else
+                {
+                    ok = !val.empty();
+                }
+                if(k == KEY_ANT)
+                    out.ant = val;
+                else
+                    out.name = val;
+                out.preempt = out.preempt || (k == KEY_PREEMPT);
+                break;
+            default:
+                break;
+        }
+        if(ok == false)
+            return fail(status, err, pos + eq + 1, key);
+
+        pos = end + 1;
+    }
+
+    return validate_request(out, seen, keypos, status);
+}
+
+bool parse_batch(std::string_view msg, std::vector<ParsedRequest>& out, ParseStatus& status, size_t& failed)
+{
+    // a separator at the very end does not start another request
+    while(!msg.empty() && (msg.back() == '\n' || msg.back() == '\r' || msg.back() == ' ' || msg.back() == BATCH_SEPARATOR))
+        msg.remove_suffix(1);
+
+    out.clear();
+    failed = 0;
+    while(true)
+    {
+        size_t sep = msg.find(BATCH_SEPARATOR);
+        if(out.size() == MAX_BATCH_SIZE)
+            return fail(status, ParseError::TOO_MANY_REQUESTS, 0, std::string_view());
+
+        out.emplace_back();
+        if(parse_request(msg.substr(0, sep), out.back(), status) == false)
+            return false;
+        if(out.back().kind == RequestKind::CANCEL)
+            return fail(status, ParseError::CONFLICT, 0, "cancel");
+        if(out.back().preempt)
+            return fail(status, ParseError::CONFLICT, 0, "preempt");
+
+        if(sep == std::string_view::npos)
+            return true;
+        msg.remove_prefix(sep + 1);
+        failed++;
+    }
+}
+
+std::string parse_error_str(const ParseStatus& status)
+{
+    const std::string key(status.key);
+    switch(status.err)
+    {
+        case ParseError::NONE:
+            return "ok";
+        case ParseError::EMPTY:
+            return "empty message";
+        case ParseError::SYNTAX:
+            return (boost::format("malformed field @%u") % status.pos).str();
+        case ParseError::UNKNOWN_KEY:
+            return (boost::format("unknown key '%s' @%u") % key % status.pos).str();
+        case ParseError::DUPLICATE_KEY:
+            return (boost::format("duplicate key '%s' @%u") % key % status.pos).str();
+        case ParseError::BAD_VALUE:
+            return (boost::format("bad value for '%s' @%u") % key % status.pos).str();
+        case ParseError::TOO_LONG:
+            return (boost::format("'%s' longer than %u chars @%u") % key % MAX_FIELD_LEN % status.pos).str();
+        case ParseError::TOO_MANY_STEPS:
+            return (boost::format("more than %u sweep steps @%u") % MAX_SWEEP_STEPS % status.pos).str();
+        case ParseError::MISSING_KEY:
+            return (boost::format("missing '%s'") % key).str();
+        case ParseError::CONFLICT:
+            return (boost::format("conflicting '%s'") % key).str();
+        case ParseError::OUT_OF_RANGE:
+            return (boost::format("'%s' out of range") % key).str();
+        case ParseError::TOO_MANY_REQUESTS:
+            return (boost::format("more than %u requests in batch") % MAX_BATCH_SIZE).str();
+    }
+    return "unknown error";
+}
@@ -0,0 +1,158 @@
+/*
+ * Parser for the key=value request messages received on the command topic.
+ * Fields are separated by ',' and may come in any order. The parser works
+ * on a view of the MQTT payload and does not allocate: strings in the
+ * result (names and antenna) are views into the payload.
+ *
+ * Keys:
+ *   fc, sweep           center frequency, or ':' separated list (one required)
+ *   sps, t0, n          sample rate, start time, samples per step (required)
+ *   dwell               time between sweep steps (required for sweeps)
+ *   lo                  LO offset (optional, default 0)
+ *   bw, g               IF bandwidth and gain (optional, unchanged if absent)
+ *   ant                 antenna (optional, unchanged if absent)
+ *   id, preempt         name of a one-off request, preempt also makes room
+ *   sched, period, count  name, period and occurrences of a schedule
+ *   cancel              name of a request to cancel (no other keys)
+ *
+ * A message may also carry a batch of capture and schedule requests
+ * separated by ';', which are admitted as a group.
+ */
+
+#ifndef REQUEST_PARSER_HPP
+#define REQUEST_PARSER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "rx_request.hpp"
+
+/*
+ * longest name or antenna accepted
+ */
+const size_t MAX_FIELD_LEN = 31;
+
+/*
+ * separator and maximum number of requests in a batch message
+ */
+const char BATCH_SEPARATOR = ';';
+const size_t MAX_BATCH_SIZE = 64;
+
+/*
+ * most occurrences a schedule may have. Admission walks the occurrences of
+ * a new schedule under the agenda lock, so this bounds how long it takes
+ */
+const unsigned MAX_SCHEDULE_COUNT = 10000;
+
+enum class RequestKind { CAPTURE, SCHEDULE, CANCEL };
+
+/*
+ * request keys. The binary encoding uses the same numbering for its field
+ * types, so new keys go at the end
+ */
+enum RequestKey
+{
+    KEY_FC,
+    KEY_SWEEP,
+    KEY_LO,
+    KEY_SPS,
+    KEY_BW,
+    KEY_G,
+    KEY_T0,
+    KEY_N,
+    KEY_ANT,
+    KEY_DWELL,
+    KEY_ID,
+    KEY_PREEMPT,
+    KEY_SCHED,
+    KEY_PERIOD,
+    KEY_COUNT,
+    KEY_CANCEL,
+    KEY_UNKNOWN
+};
+
+#define KEY_BIT(k) (1u << (k))
+
+std::string_view request_key_name(RequestKey k);
+
+/*
+ * a decoded message. req.ant is not filled in by the parser, the antenna
+ * is in ant (empty if not given)
+ */
+struct ParsedRequest
+{
+    RequestKind kind;
+    std::string_view name;  // value of id, preempt, sched or cancel
+    bool preempt;
+    double period;
+    unsigned count;
+    std::string_view ant;
+    RxRequest req;
+};
+
+enum class ParseError
+{
+    NONE,
+    EMPTY,          // no fields at all
+    SYNTAX,         // field without =, empty field or truncated binary field
+    UNKNOWN_KEY,
+    DUPLICATE_KEY,
+    BAD_VALUE,      // value is not a valid number/list for its key
+    TOO_LONG,       // name or antenna longer than MAX_FIELD_LEN
+    TOO_MANY_STEPS, // sweep with more than MAX_SWEEP_STEPS frequencies
+    MISSING_KEY,
+    CONFLICT,       // keys that cannot be used together
+    OUT_OF_RANGE,   // values that parse but cannot be captured
+    TOO_MANY_REQUESTS // batch with more than MAX_BATCH_SIZE requests
+};
+
+/*
+ * where and why parsing failed. pos is the byte offset of the offending
+ * field in the message, key the key it was reported for
+ */
+struct ParseStatus
+{
+    ParseError err;
+    size_t pos;
+    std::string_view key;
+};
+
+/*
+ * reset the optional fields of a request to their defaults
+ */
+void init_request(ParsedRequest& out);
+
+/*
+ * checks shared by every encoding once all fields are decoded, including
+ * that every number is finite. seen has KEY_BIT set for every key present,
+ * keypos holds their offsets
+ */
+bool validate_request(ParsedRequest& out, unsigned seen, const size_t keypos[KEY_UNKNOWN], ParseStatus& status);
+
+/*
+ * decode a message. Returns false and fills in status if it is not a valid
+ * request
+ */
+bool parse_request(std::string_view msg, ParsedRequest& out, ParseStatus& status);
+
+/*
+ * true if the message is a batch of requests
+ */
+inline bool is_batch(std::string_view msg)
+{
+    return msg.find(BATCH_SEPARATOR) != std::string_view::npos;
+}
+
+/*
+ * decode every request of a batch into out. cancel and preempt cannot be
+ * part of a batch. Returns false on the first request that does not
+ * decode, failed is then its index and pos in status is relative to it
+ */
+bool parse_batch(std::string_view msg, std::vector<ParsedRequest>& out, ParseStatus& status, size_t& failed);
+
+/*
+ * human readable description of a parse failure, for responses
+ */
+std::string parse_error_str(const ParseStatus& status);
+
+#endif // REQUEST_PARSER_HPP
@@ -0,0 +1,47 @@
+/*
+ * Decoded capture requests as they are passed from the request thread to
+ * the USRP thread
+ */
+
+#ifndef RX_REQUEST_HPP
+#define RX_REQUEST_HPP
+
+#include <string>
+
+/*
+ * upper bound on the number of frequencies a single sweep request may list
+ */
+const size_t MAX_SWEEP_STEPS = 128;
+
+/*
+ * a decoded capture request. A plain capture is treated as a sweep with a
+ * single step, in which case dwell is unused. Gain and bandwidth are only
+ * applied if their flag is set, an empty antenna keeps the current one
+ */
+struct RxRequest
+{
+    size_t nsteps;
+    double fc[MAX_SWEEP_STEPS];
+    double lo;
+    double sps;
+    double bw;
+    double gain;
+    bool set_bw;
+    bool set_gain;
+    double t0;
+    double dwell;
+    unsigned long long nsamp;
+    std::string ant;
+};
+
+/*
+ * how long a decoded request keeps the device busy once it starts streaming
+ */
+inline double rx_request_duration(const RxRequest& req)
+{
+    if(req.nsteps > 1)
+        return (req.nsteps - 1) * req.dwell + double(req.nsamp) / req.sps;
+    return double(req.nsamp) / req.sps;
+}
+
+#endif // RX_REQUEST_HPP
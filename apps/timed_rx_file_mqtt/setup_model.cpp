@@ -0,0 +1,80 @@
+/*
+ * Quantile based setup latency model
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <boost/format.hpp>
+#include "setup_model.hpp"
+
+// number of recent samples kept per key
+const size_t MODEL_WINDOW = 100;
+// samples needed before the model replaces the fixed margins
+const size_t MODEL_MIN_SAMPLES = 10;
+// added on top of the quantile to cover timing jitter of the host
+const double MODEL_GUARD = 0.02;
+
+SetupModel::SetupModel(double quantile, double fallback_setup, double fallback_clock)
+    : same(), retune(), clock(), quantile(quantile), fallback_setup(fallback_setup), fallback_clock(fallback_clock)
+{
+    // constructor
+}
+
+static void push_window(std::deque<double>& window, double val)
+{
+    window.push_back(val);
+    if(window.size() > MODEL_WINDOW)
+        window.pop_front();
+}
+
+void SetupModel::addSetup(bool retuned, const SetupTimings& t)
+{
+    push_window(retuned ? retune : same, t.total());
+}
+
+void SetupModel::addClockOffset(double offset)
+{
+    push_window(clock, std::abs(offset));
+}
+
+double SetupModel::estimate(const std::deque<double>& window, double fallback) const
+{
+    if(window.size() < MODEL_MIN_SAMPLES)
+        return fallback;
+    std::vector<double> sorted(window.begin(), window.end());
+    size_t k = std::min(sorted.size() - 1, size_t(std::ceil(quantile * sorted.size())) - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+    return sorted[k] + MODEL_GUARD;
+}
+
+double SetupModel::setupEstimate(bool retuned) const
+{
+    // a request that keeps the frequency never needs more than one that
+    // retunes, so fall back on the retune estimate while it has more data
+    if(retuned)
+        return estimate(retune, fallback_setup);
+    if(same.size() < MODEL_MIN_SAMPLES)
+        return estimate(retune, fallback_setup);
+    return estimate(same, fallback_setup);
+}
+
+double SetupModel::clockEstimate() const
+{
+    return estimate(clock, fallback_clock);
+}
+
+std::string SetupModel::str() const
+{
+    return (boost::format("same %.3lf (%u) retune %.3lf (%u) clock %.4lf (%u)")
+                % setupEstimate(false) % same.size()
+                % setupEstimate(true) % retune.size()
+                % clockEstimate() % clock.size()).str();
+}
+
+std::vector<double> SetupModel::values() const
+{
+    return {setupEstimate(false), double(same.size()),
+            setupEstimate(true), double(retune.size()),
+            clockEstimate(), double(clock.size())};
+}
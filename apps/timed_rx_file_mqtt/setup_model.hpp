@@ -0,0 +1,71 @@
+/*
+ * Setup latency model of the USRP. Every request records how long each of
+ * its setup phases took. The model keeps the recent setup times, separately
+ * for requests that retuned and ones that stayed on the same frequency, and
+ * turns a high quantile of them into the setup margin used by admission
+ * control. Until enough requests were seen, the fixed --slack/--ntpslack
+ * values are used instead.
+ */
+
+#ifndef SETUP_MODEL_HPP
+#define SETUP_MODEL_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+ * time spent in each setup phase of a request (s)
+ */
+struct SetupTimings
+{
+    double rate;
+    double tune;
+    double gain;
+    double bw;
+    double ant;
+    double lo_lock;
+    double streamer;
+    double file_open;
+
+    double total() const { return rate + tune + gain + bw + ant + lo_lock + streamer + file_open; }
+};
+
+class SetupModel
+{
+    private:
+        std::deque<double> same;
+        std::deque<double> retune;
+        std::deque<double> clock;
+        double quantile;
+        double fallback_setup;
+        double fallback_clock;
+
+        double estimate(const std::deque<double>& window, double fallback) const;
+
+    public:
+        SetupModel(double quantile, double fallback_setup, double fallback_clock);
+
+        void addSetup(bool retuned, const SetupTimings& t);
+
+        // offset between USRP time and host NTP time seen at a sync check
+        void addClockOffset(double offset);
+
+        // setup time needed before t0, excluding clock uncertainty
+        double setupEstimate(bool retuned) const;
+
+        // bound on the offset between USRP time and host NTP time
+        double clockEstimate() const;
+
+        // total margin a request needs before its t0
+        double margin(bool retuned) const { return setupEstimate(retuned) + clockEstimate(); }
+
+        // current estimates, for the log
+        std::string str() const;
+
+        // current estimates and the number of samples behind them, for the
+        // status topic: same, nsame, retune, nretune, clock, nclock
+        std::vector<double> values() const;
+};
+
+#endif // SETUP_MODEL_HPP
@@ -0,0 +1,141 @@
+/*
+ * Follows the shared memory ring of a timed_rx_file_mqtt gateway (--shm)
+ * the way a local consumer would, and prints a line for every capture: the
+ * samples it saw, the blocks it lost to the writer lapping it or to torn
+ * reads, and their mean power. Shows whether a consumer doing that much
+ * work per block keeps up with the gateway.
+ */
+
+#include <iostream>
+#include <string>
+#include <complex>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include "shm_ring.hpp"
+#include "time_helper.hpp"
+
+namespace po = boost::program_options;
+
+// what was seen of one capture
+struct Seen
+{
+    uint64_t capture;
+    std::string name;
+    double fc;
+    unsigned long long nsamps;
+    unsigned long long lost;    // blocks
+    unsigned long long torn;    // blocks overwritten while in use
+    double power;               // sum of |x|^2, full scale 1
+};
+
+template <typename samp_type>
+static double block_power(const void* samples, size_t nsamps, double scale)
+{
+    const samp_type* p = static_cast<const samp_type*>(samples);
+    double sum = 0;
+    for(size_t i = 0; i < nsamps; i++)
+    {
+        const double re = double(p[i].real()) * scale, im = double(p[i].imag()) * scale;
+        sum += re * re + im * im;
+    }
+    return sum;
+}
+
+static double power(uint8_t format, const void* samples, size_t nsamps)
+{
+    switch(format)
+    {
+        case SAMPLE_FC64: return block_power<std::complex<double>>(samples, nsamps, 1.0);
+        case SAMPLE_FC32: return block_power<std::complex<float>>(samples, nsamps, 1.0);
+        default:          return block_power<std::complex<short>>(samples, nsamps, 1.0 / 32768);
+    }
+}
+
+static void print_capture(const Seen& s, uint32_t flags)
+{
+    const double db = (s.nsamps > 0 && s.power > 0) ? 10 * std::log10(s.power / s.nsamps) : -INFINITY;
+    std::cout << boost::format("[SHMdebug] capture %lu %s at %.6lf MHz: %llu samples%s, %llu blocks lost, %llu torn, %.1lf dBFS")
+                    % s.capture % (s.name.empty() ? "-" : s.name) % (s.fc / 1e6) % s.nsamps
+                    % ((flags & SHM_COMPLETE) ? "" : " (incomplete)") % s.lost % s.torn % db << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string name;
+    double run_time, poll_ms;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help", "help message")
+        ("shm", po::value<std::string>(&name)->default_value("usrp_rx"), "name of the gateway's ring (its --shm)")
+        ("duration", po::value<double>(&run_time)->default_value(0), "seconds to follow the ring for, 0 for ever")
+        ("poll", po::value<double>(&poll_ms)->default_value(1), "ms to sleep when no block is waiting")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+        std::cout << boost::format("follows the shared memory ring of a timed_rx_file_mqtt gateway %s") % desc << std::endl;
+        return ~0;
+    }
+    po::notify(vm);
+
+    std::unique_ptr<ShmRingReader> reader = ShmRingReader::open(name);
+    if(reader == nullptr)
+    {
+        std::cerr << "[SHMerror] no ring /" << name << ", is the gateway running with --shm?" << std::endl;
+        return ~0;
+    }
+    const ShmRingHeader& hdr = reader->header();
+    std::cout << boost::format("[SHMdebug] ring /%s: %u slots of %u bytes") % name % hdr.nslots % hdr.slot_bytes << std::endl;
+
+    const double tend = systime_now_double() + run_time;
+    const auto poll = std::chrono::duration<double, std::milli>(poll_ms);
+    Seen seen = Seen();
+    bool in_capture = false;
+    ShmBlock b;
+    while(run_time <= 0 || systime_now_double() < tend)
+    {
+        const unsigned long long lost = reader->lost();
+        if(reader->next(b) == false)
+        {
+            std::this_thread::sleep_for(poll);
+            continue;
+        }
+        seen.lost += reader->lost() - lost;
+        if(b.flags & SHM_FIRST)
+        {
+            seen = Seen();
+            seen.capture = b.capture;
+            seen.fc = b.fc;
+            uint64_t current;
+            CaptureInfo info;
+            if(reader->currentCapture(current, info) && current == b.capture)
+                seen.name = info.name;
+            in_capture = true;
+        }
+        else if(b.flags & SHM_LAST)
+        {
+            if(in_capture && b.capture == seen.capture)
+                print_capture(seen, b.flags);
+            in_capture = false;
+        }
+        else if(in_capture && b.capture == seen.capture)
+        {
+            const double p = power(hdr.format, b.samples, b.nsamps);
+            // the samples may have changed under us, leave them out then
+            if(reader->stillValid(b))
+            {
+                seen.power += p;
+                seen.nsamps += b.nsamps;
+            }
+            else
+                seen.torn++;
+        }
+    }
+    std::cout << boost::format("[SHMdebug] %llu blocks lost in all") % reader->lost() << std::endl;
+    return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Shared memory ring of received buffers
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <new>
+#include <boost/format.hpp>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_ring.hpp"
+
+const size_t SHM_ALIGN = 64;
+
+static void copy_str(char* dst, size_t size, const std::string& src)
+{
+    const size_t n = std::min(src.size(), size - 1);
+    std::memcpy(dst, src.data(), n);
+    dst[n] = '\0';
+}
+
+// time of the sample offset samples after t
+static DeviceTime advance(const DeviceTime& t, size_t offset, double sps)
+{
+    const double frac = t.frac + offset / sps;
+    const double whole = std::floor(frac);
+    return DeviceTime{t.secs + int64_t(whole), frac - whole};
+}
+
+ShmRing::ShmRing(const std::string& name, char* base, size_t size)
+    : name(name), base(base), size(size), hdr(reinterpret_cast<ShmRingHeader*>(base)),
+      info(), capture(0), seq(0), claimed(false), active(false), next_index(0)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    // readers keep their mapping, new ones can't open it any more
+    munmap(base, size);
+    shm_unlink(("/" + name).c_str());
+}
+
+ShmSlotHeader* ShmRing::slot(uint64_t s) const
+{
+    const size_t stride = SHM_SLOT_HEADER_SIZE + hdr->slot_bytes;
+    return reinterpret_cast<ShmSlotHeader*>(base + SHM_HEADER_SIZE + (s % hdr->nslots) * stride);
+}
+
+char* ShmRing::slotData(uint64_t s) const
+{
+    return reinterpret_cast<char*>(slot(s)) + SHM_SLOT_HEADER_SIZE;
+}
+
+// readers that still look at the block in the slot will see it went
+void ShmRing::claim()
+{
+    slot(seq)->seq.store(SHM_WRITING, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    claimed = true;
+}
+
+void ShmRing::commit(size_t nsamps, unsigned long long index, const DeviceTime& t, uint32_t flags)
+{
+    ShmSlotHeader* sh = slot(seq);
+    sh->capture = capture;
+    sh->index = index;
+    sh->secs = t.secs;
+    sh->frac = t.frac;
+    sh->fc = info.fc;
+    sh->sps = info.sps;
+    sh->nsamps = uint32_t(nsamps);
+    sh->flags = flags;
+    sh->seq.store(seq, std::memory_order_release);
+    hdr->next_seq.store(seq + 1, std::memory_order_release);
+    seq++;
+    claimed = false;
+}
+
+void ShmRing::begin(const CaptureInfo& ci)
+{
+    info = ci;
+    active = true;
+    next_index = 0;
+    capture++;
+
+    const uint64_t iseq = hdr->info_seq.load(std::memory_order_relaxed);
+    hdr->info_seq.store(iseq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    hdr->capture = capture;
+    hdr->t0 = info.t0;
+    hdr->fc = info.fc;
+    hdr->sps = info.sps;
+    hdr->nsamp = info.nsamp;
+    copy_str(hdr->name, sizeof(hdr->name), info.name);
+    copy_str(hdr->file, sizeof(hdr->file), info.file);
+    hdr->info_seq.store(iseq + 2, std::memory_order_release);
+
+    if(claimed == false)
+        claim();
+    const double whole = std::floor(info.t0);
+    commit(0, 0, DeviceTime{int64_t(whole), info.t0 - whole}, SHM_FIRST);
+}
+
+void* ShmRing::recvBuffer(size_t nbytes)
+{
+    if(active == false || nbytes > hdr->slot_bytes)
+        return nullptr;
+    if(claimed == false)
+        claim();
+    return slotData(seq);
+}
+
+void ShmRing::write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev)
+{
+    if(active == false || nsamps == 0)
+        return;
+    next_index = index + nsamps;
+    if(claimed == false)
+        claim();
+    // received in place
+    if(samples == slotData(seq) && nsamps * info.samp_size <= hdr->slot_bytes)
+    {
+        commit(nsamps, index, tdev, 0);
+        return;
+    }
+    // from another buffer, over as many slots as it takes
+    const size_t per_slot = hdr->slot_bytes / info.samp_size;
+    const char* p = static_cast<const char*>(samples);
+    for(size_t done = 0; done < nsamps; )
+    {
+        if(claimed == false)
+            claim();
+        const size_t n = std::min(per_slot, nsamps - done);
+        std::memcpy(slotData(seq), p + done * info.samp_size, n * info.samp_size);
+        commit(n, index + done, advance(tdev, done, info.sps), 0);
+        done += n;
+    }
+}
+
+void ShmRing::end(bool ok)
+{
+    if(active == false)
+        return;
+    active = false;
+    if(claimed == false)
+        claim();
+    commit(0, next_index, DeviceTime{0, 0.0}, SHM_LAST | (ok ? SHM_COMPLETE : 0));
+}
+
+std::unique_ptr<ShmRing> make_shm_ring(const std::string& name, size_t nslots, size_t slot_bytes,
+                                       const std::string& cpu_format)
+{
+    if(name.empty() || name.find('/') != std::string::npos || nslots == 0 || slot_bytes == 0)
+    {
+        std::cerr << "[SHMerror] invalid ring " << name << std::endl;
+        return nullptr;
+    }
+    slot_bytes = (slot_bytes + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+    const size_t size = SHM_HEADER_SIZE + nslots * (SHM_SLOT_HEADER_SIZE + slot_bytes);
+    const std::string path = "/" + name;
+
+    // a ring left over by an earlier run goes, its readers keep their copy
+    shm_unlink(path.c_str());
+    const int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0)
+    {
+        std::cerr << boost::format("[SHMerror] creating %s: %s") % path % std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    void* base = MAP_FAILED;
+    if(ftruncate(fd, off_t(size)) == 0)
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        std::cerr << boost::format("[SHMerror] mapping %lu bytes of %s: %s") % size % path % std::strerror(err) << std::endl;
+        shm_unlink(path.c_str());
+        return nullptr;
+    }
+
+    char* p = static_cast<char*>(base);
+    ShmRingHeader* hdr = new (p) ShmRingHeader();
+    hdr->version = SHM_VERSION;
+    hdr->nslots = uint32_t(nslots);
+    hdr->slot_bytes = uint32_t(slot_bytes);
+    hdr->format = sample_format(cpu_format);
+    hdr->samp_size = uint16_t(sample_size(sample_format(cpu_format)));
+    hdr->next_seq.store(0);
+    hdr->info_seq.store(0);
+    for(size_t i = 0; i < nslots; i++)
+    {
+        ShmSlotHeader* sh = new (p + SHM_HEADER_SIZE + i * (SHM_SLOT_HEADER_SIZE + slot_bytes)) ShmSlotHeader();
+        sh->seq.store(SHM_WRITING);
+    }
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(hdr->magic, "ULRB", 4);
+
+    std::cout << boost::format("[SHMdebug] ring %s: %lu slots of %lu bytes") % path % nslots % slot_bytes << std::endl;
+    return std::unique_ptr<ShmRing>(new ShmRing(name, p, size));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+ShmRingReader::ShmRingReader(const char* base, size_t size)
+    : base(base), size(size), hdr(reinterpret_cast<const ShmRingHeader*>(base)),
+      seq(hdr->next_seq.load(std::memory_order_acquire)), nlost(0)
+{
+}
+
+ShmRingReader::~ShmRingReader()
+{
+    munmap(const_cast<char*>(base), size);
+}
+
+std::unique_ptr<ShmRingReader> ShmRingReader::open(const std::string& name)
+{
+    const int fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+    if(fd < 0)
+        return nullptr;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && size_t(st.st_size) >= SHM_HEADER_SIZE)
+        base = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return nullptr;
+
+    const ShmRingHeader* hdr = static_cast<const ShmRingHeader*>(base);
+    const size_t size = size_t(st.st_size);
+    if(std::memcmp(hdr->magic, "ULRB", 4) != 0 || hdr->version != SHM_VERSION
+        || size < SHM_HEADER_SIZE + size_t(hdr->nslots) * (SHM_SLOT_HEADER_SIZE + hdr->slot_bytes))
+    {
+        munmap(base, size);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRingReader>(new ShmRingReader(static_cast<const char*>(base), size));
+}
+
+bool ShmRingReader::currentCapture(uint64_t& capture, CaptureInfo& info) const
+{
+    while(true)
+    {
+        const uint64_t s1 = hdr->info_seq.load(std::memory_order_acquire);
+        if(s1 == 0)
+            return false;
+        if(s1 % 2 == 1)
+            continue;
+        capture = hdr->capture;
+        info.t0 = hdr->t0;
+        info.fc = hdr->fc;
+        info.sps = hdr->sps;
+        info.nsamp = hdr->nsamp;
+        info.samp_size = hdr->samp_size;
+        info.name.assign(hdr->name, strnlen(hdr->name, sizeof(hdr->name)));
+        info.file.assign(hdr->file, strnlen(hdr->file, sizeof(hdr->file)));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(hdr->info_seq.load(std::memory_order_relaxed) == s1)
+            return true;
+    }
+}
+
+bool ShmRingReader::next(ShmBlock& b)
+{
+    const size_t stride = SHM_SLOT_HEADER_SIZE + hdr->slot_bytes;
+    while(true)
+    {
+        const uint64_t published = hdr->next_seq.load(std::memory_order_acquire);
+        if(seq >= published)
+            return false;
+        // lapped: only the last nslots blocks can still be there
+        if(published - seq > hdr->nslots)
+        {
+            nlost += published - hdr->nslots - seq;
+            seq = published - hdr->nslots;
+        }
+        const char* p = base + SHM_HEADER_SIZE + (seq % hdr->nslots) * stride;
+        const ShmSlotHeader* sh = reinterpret_cast<const ShmSlotHeader*>(p);
+        const uint64_t s1 = sh->seq.load(std::memory_order_acquire);
+        b.seq = seq;
+        b.capture = sh->capture;
+        b.index = sh->index;
+        b.t = DeviceTime{sh->secs, sh->frac};
+        b.fc = sh->fc;
+        b.sps = sh->sps;
+        b.nsamps = sh->nsamps;
+        b.flags = sh->flags;
+        b.samples = p + SHM_SLOT_HEADER_SIZE;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t s2 = sh->seq.load(std::memory_order_relaxed);
+        seq++;
+        if(s1 == b.seq && s2 == b.seq)
+            return true;
+        // overwritten meanwhile
+        nlost++;
+    }
+}
+
+bool ShmRingReader::stillValid(const ShmBlock& b) const
+{
+    const size_t stride = SHM_SLOT_HEADER_SIZE + hdr->slot_bytes;
+    const ShmSlotHeader* sh = reinterpret_cast<const ShmSlotHeader*>(base + SHM_HEADER_SIZE + (b.seq % hdr->nslots) * stride);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sh->seq.load(std::memory_order_relaxed) == b.seq;
+}
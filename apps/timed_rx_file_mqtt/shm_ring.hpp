@@ -0,0 +1,179 @@
+/*
+ * Capture sink publishing the received buffers in a named POSIX shared
+ * memory ring (/dev/shm/<name>), for local consumers such as decoders or a
+ * spectrum monitor. Any number of readers map it read-only and follow
+ * along; the gateway never waits for them, a reader that falls more than
+ * the ring behind loses the blocks it was lapped on.
+ *
+ * The ring lends its next slot to recv(), so the samples land there
+ * directly and the capture file is written from the slot: nothing is copied
+ * for the ring on the USRP thread.
+ *
+ * Layout, in host byte order:
+ *   ShmRingHeader, SHM_HEADER_SIZE bytes
+ *   nslots slots of SHM_SLOT_HEADER_SIZE + slot_bytes, each a ShmSlotHeader
+ *   followed by the samples of the block
+ * Every capture is a block with SHM_FIRST and no samples, its sample
+ * blocks, and a block with SHM_LAST (and SHM_COMPLETE if all samples were
+ * received) and no samples, whose index is the number of samples received.
+ * Blocks have consecutive sequence numbers from
+ * 0, block s is in slot s % nslots.
+ *
+ * Slots are seqlocked: the writer sets seq to SHM_WRITING before it
+ * touches a slot and to the block's sequence number once done, and a
+ * reader re-checks seq after using the samples in place (ShmRingReader).
+ */
+
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "capture_sink.hpp"
+
+const uint32_t SHM_VERSION = 1;
+const size_t SHM_HEADER_SIZE = 4096;
+const size_t SHM_SLOT_HEADER_SIZE = 64;
+const uint64_t SHM_WRITING = ~0ULL;
+
+// ShmSlotHeader::flags
+const uint32_t SHM_FIRST = 1;
+const uint32_t SHM_LAST = 2;
+const uint32_t SHM_COMPLETE = 4;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs address-free 64 bit atomics");
+
+struct ShmRingHeader
+{
+    char magic[4];                  // "ULRB"
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_bytes;            // for samples, a multiple of 64
+    uint8_t format;                 // SampleFormat
+    uint8_t reserved;
+    uint16_t samp_size;             // bytes per sample
+    uint32_t reserved2;
+    std::atomic<uint64_t> next_seq; // blocks published so far
+    // the capture streaming, seqlocked by info_seq (odd while written)
+    std::atomic<uint64_t> info_seq;
+    uint64_t capture;               // counted from 1, as in ShmSlotHeader
+    double t0;
+    double fc;
+    double sps;
+    uint64_t nsamp;
+    char name[64];                  // request id, 0 terminated
+    char file[256];
+};
+
+struct ShmSlotHeader
+{
+    std::atomic<uint64_t> seq;      // of the block in the slot, or SHM_WRITING
+    uint64_t capture;
+    uint64_t index;                 // of the first sample in the capture
+    int64_t secs;                   // device time of the first sample
+    double frac;
+    double fc;
+    double sps;
+    uint32_t nsamps;
+    uint32_t flags;
+};
+
+static_assert(sizeof(ShmRingHeader) <= SHM_HEADER_SIZE, "ring header too large");
+static_assert(sizeof(ShmSlotHeader) == SHM_SLOT_HEADER_SIZE, "slot header size");
+
+class ShmRing : public CaptureSink
+{
+    private:
+        std::string name;
+        char* base;
+        size_t size;
+        ShmRingHeader* hdr;
+
+        // USRP thread side
+        CaptureInfo info;
+        uint64_t capture;
+        uint64_t seq;               // next block
+        bool claimed;               // its slot is marked SHM_WRITING
+        bool active;
+        unsigned long long next_index;  // sample after the last one received
+
+        ShmSlotHeader* slot(uint64_t s) const;
+        char* slotData(uint64_t s) const;
+        void claim();
+        void commit(size_t nsamps, unsigned long long index, const DeviceTime& t, uint32_t flags);
+
+    public:
+        ShmRing(const std::string& name, char* base, size_t size);
+        ~ShmRing();
+
+        void begin(const CaptureInfo& info) override;
+        void write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev) override;
+        void* recvBuffer(size_t nbytes) override;
+        void end(bool ok) override;
+};
+
+/*
+ * create the ring /dev/shm/<name> with nslots slots of slot_bytes (rounded
+ * up to a multiple of 64) for samples of cpu_format. It is removed when the
+ * ring is destroyed. nullptr if it can't be created
+ */
+std::unique_ptr<ShmRing> make_shm_ring(const std::string& name, size_t nslots, size_t slot_bytes,
+                                       const std::string& cpu_format);
+
+/*
+ * a block as a reader sees it: a copy of its slot header and a pointer to
+ * the samples in the ring
+ */
+struct ShmBlock
+{
+    uint64_t seq;
+    uint64_t capture;
+    unsigned long long index;
+    DeviceTime t;
+    double fc;
+    double sps;
+    size_t nsamps;
+    uint32_t flags;
+    const void* samples;
+};
+
+/*
+ * follows a ring read-only, from the first block published after it was
+ * opened
+ */
+class ShmRingReader
+{
+    private:
+        const char* base;
+        size_t size;
+        const ShmRingHeader* hdr;
+        uint64_t seq;               // next block to read
+        unsigned long long nlost;
+
+    public:
+        ShmRingReader(const char* base, size_t size);
+        ~ShmRingReader();
+
+        // nullptr if there is no ring of that name
+        static std::unique_ptr<ShmRingReader> open(const std::string& name);
+
+        const ShmRingHeader& header() const { return *hdr; }
+
+        // the capture streaming or streamed last, false if there was none
+        bool currentCapture(uint64_t& capture, CaptureInfo& info) const;
+
+        // the next block, false if it isn't published yet. Blocks the
+        // writer lapped the reader on are skipped and counted in lost()
+        bool next(ShmBlock& b);
+
+        // true if the samples of b were not overwritten by the time they
+        // were used: call after using them, and drop what was computed
+        // from them otherwise
+        bool stillValid(const ShmBlock& b) const;
+
+        unsigned long long lost() const { return nlost; }
+};
+
+#endif // SHM_RING_HPP
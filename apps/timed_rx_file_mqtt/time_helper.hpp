@@ -0,0 +1,44 @@
+/*
+ * Conversions between system clock time points and the double UTC seconds
+ * used in requests and by the USRP time spec. Shared by the request and
+ * USRP threads
+ */
+
+#ifndef TIME_HELPER_HPP
+#define TIME_HELPER_HPP
+
+#include <chrono>
+#include <string>
+#include "date.h"
+
+template <typename Clock>
+std::chrono::time_point<Clock, std::chrono::duration<double>> double2timepoint(double t)
+{
+    // converts double to duration with double internal type
+    std::chrono::duration<double> d(t);
+    // creates a time point for a particular clock from the previously computed duration
+    return std::chrono::time_point<Clock, std::chrono::duration<double>>(d); 
+}
+
+template <typename Clock>
+double timepoint2double(std::chrono::time_point<Clock> tp)
+{
+    // converts duration to a double value
+    std::chrono::duration<double> ddouble = tp.time_since_epoch();
+    return ddouble.count();
+}
+
+// current system (NTP) time as double UTC seconds
+inline double systime_now_double()
+{
+    return timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
+}
+
+// date string with ms precision used in filenames and responses
+inline std::string date_str(double t)
+{
+    const auto tp = double2timepoint<std::chrono::system_clock>(t);
+    return date::format("%F_%H-%M-%S", std::chrono::time_point_cast<std::chrono::milliseconds>(tp));
+}
+
+#endif // TIME_HELPER_HPP
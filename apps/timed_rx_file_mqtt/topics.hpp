@@ -0,0 +1,81 @@
+/*
+ * Topic layout of addressed gateways (--topics addressed). Every gateway
+ * listens on
+ *   <subtop>                   commands for the whole fleet
+ *   <subtop>/<id>              commands for this gateway only
+ *   <subtop>/group/<group>     commands for each group it is in
+ * and answers on <pubtop>/<id> and <stattop>/<id>, so the broker only
+ * hands a gateway the commands meant for it and a controller picks the
+ * gateways it hears from with <pubtop>/+ or exact topics. Binary messages
+ * add BINARY_TOPIC_SUFFIX to any of these.
+ */
+
+#ifndef TOPICS_HPP
+#define TOPICS_HPP
+
+#include <string>
+#include "wire_codec.hpp"
+
+const std::string GROUP_TOPIC_LEVEL = "group";
+
+// topic of one gateway below base
+inline std::string gateway_topic(const std::string& base, const std::string& id)
+{
+    return base + "/" + id;
+}
+
+// topic of a group of gateways below base
+inline std::string group_topic(const std::string& base, const std::string& group)
+{
+    return base + "/" + GROUP_TOPIC_LEVEL + "/" + group;
+}
+
+// subscription matching the topic of every gateway below base
+inline std::string any_gateway_topic(const std::string& base)
+{
+    return base + "/+";
+}
+
+/*
+ * true if name can be a gateway id or group in a topic: a single level
+ * without wildcards, that can't be mistaken for the binary suffix or the
+ * group level
+ */
+inline bool valid_topic_name(const std::string& name)
+{
+    return name.empty() == false
+        && name.find_first_of("/+#") == std::string::npos
+        && "/" + name != BINARY_TOPIC_SUFFIX
+        && name != GROUP_TOPIC_LEVEL;
+}
+
+/*
+ * true if topic matches the subscription filter, with + for one level and
+ * a trailing # for any number of them
+ */
+inline bool topic_matches(const std::string& filter, const std::string& topic)
+{
+    size_t i = 0, j = 0;
+    while(i < filter.size())
+    {
+        if(filter[i] == '#')
+            return true;
+        if(filter[i] == '+')
+        {
+            while(j < topic.size() && topic[j] != '/')
+                j++;
+            i++;
+            continue;
+        }
+        // a/# also matches a
+        if(j == topic.size() && filter.compare(i, std::string::npos, "/#") == 0)
+            return true;
+        if(j >= topic.size() || filter[i] != topic[j])
+            return false;
+        i++;
+        j++;
+    }
+    return j == topic.size();
+}
+
+#endif // TOPICS_HPP
@@ -0,0 +1,150 @@
+/*
+ * MQTT transport over paho, and the choice between it and the loopback
+ */
+
+#include <boost/algorithm/string/predicate.hpp>
+#include "mqtt/async_client.h"
+#include "transport.hpp"
+#include "loopback_broker.hpp"
+
+class PahoToken : public TransportToken
+{
+    private:
+        mqtt::token_ptr tok;
+
+    public:
+        explicit PahoToken(mqtt::token_ptr tok) : tok(tok) {}
+
+        bool waitFor(std::chrono::milliseconds timeout) override
+        {
+            try
+            {
+                return tok->wait_for(timeout);
+            }
+            catch(const mqtt::exception& e)
+            {
+                // failed, which completes it too
+                return true;
+            }
+        }
+
+        bool isComplete() const override { return tok->is_complete(); }
+
+        int returnCode() const override { return tok->get_return_code(); }
+};
+
+class PahoTransport : public Transport,
+                      public virtual mqtt::callback,
+                      public virtual mqtt::iaction_listener
+{
+    private:
+        std::string client_id;
+        mqtt::async_client client;
+        mqtt::connect_options conn_opts;
+        TransportListener *listener;
+
+        void on_failure(const mqtt::token& tok) override
+        {
+            if(listener != nullptr)
+                listener->connectFailed();
+        }
+
+        // success is reported through connected()
+        void on_success(const mqtt::token& tok) override {}
+
+        void connected(const std::string& cause) override
+        {
+            if(listener != nullptr)
+                listener->connected();
+        }
+
+        void connection_lost(const std::string& cause) override
+        {
+            if(listener != nullptr)
+                listener->connectionLost(cause);
+        }
+
+        void message_arrived(mqtt::const_message_ptr msg) override
+        {
+            if(listener != nullptr)
+                listener->messageArrived(msg->get_topic(), std::shared_ptr<const std::string>(msg, &msg->get_payload_str()));
+        }
+
+        void delivery_complete(mqtt::delivery_token_ptr token) override {}
+
+    public:
+        PahoTransport(const std::string& server, const std::string& client_id, const TransportOptions& opts)
+            : client_id(client_id),
+              client(opts.persist_dir.empty() ? mqtt::async_client(server, client_id)
+                                              : mqtt::async_client(server, client_id, opts.persist_dir)),
+              conn_opts(), listener(nullptr)
+        {
+            conn_opts.set_keep_alive_interval(opts.keep_alive);
+            conn_opts.set_clean_session(opts.clean_session);
+            if(opts.will_topic.empty() == false)
+                conn_opts.set_will_message(mqtt::make_message(opts.will_topic, opts.will_payload, 1, false));
+            client.set_callback(*this);
+        }
+
+        const std::string& clientId() const override { return client_id; }
+
+        void setListener(TransportListener *l) override { listener = l; }
+
+        TransportTokenPtr connect() override
+        {
+            try
+            {
+                return std::make_shared<PahoToken>(client.connect(conn_opts, nullptr, *this));
+            }
+            catch(const mqtt::exception& e)
+            {
+                throw TransportError(e.what());
+            }
+        }
+
+        bool isConnected() const override { return client.is_connected(); }
+
+        TransportTokenPtr publish(const std::string& topic, const std::string& payload, int qos, bool retained) override
+        {
+            try
+            {
+                return std::make_shared<PahoToken>(client.publish(mqtt::make_message(topic, payload, qos, retained)));
+            }
+            catch(const mqtt::exception& e)
+            {
+                throw TransportError(e.what());
+            }
+        }
+
+        void subscribe(const std::string& topic, int qos) override
+        {
+            try
+            {
+                client.subscribe(topic, qos);
+            }
+            catch(const mqtt::exception& e)
+            {
+                throw TransportError(e.what());
+            }
+        }
+
+        void disconnect() override
+        {
+            try
+            {
+                client.disconnect()->wait();
+            }
+            catch(const mqtt::exception& e)
+            {
+                throw TransportError(e.what());
+            }
+        }
+};
+
+std::unique_ptr<Transport> make_transport(const std::string& server, const std::string& client_id,
+                                          const TransportOptions& opts)
+{
+    if(boost::algorithm::starts_with(server, LOOPBACK_SCHEME))
+        return std::unique_ptr<Transport>(new LoopbackTransport(server.substr(LOOPBACK_SCHEME.size()), client_id, opts));
+    return std::unique_ptr<Transport>(new PahoTransport(server, client_id, opts));
+}
@@ -0,0 +1,108 @@
+/*
+ * The few MQTT client operations the gateway needs, behind an interface so
+ * they can run against a real broker (paho, any tcp:// or ssl:// server)
+ * or against a LoopbackBroker in the same process (loop://<name>, see
+ * loopback_broker.hpp), e.g. to benchmark request and ack flows and
+ * reconnects on a machine without a broker.
+ *
+ * As with paho, connects are asynchronous, and the listener is called on a
+ * thread of the transport: it may publish and subscribe, and may block for
+ * a while (e.g. to back off before reconnecting) without holding up other
+ * clients.
+ */
+
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+
+/*
+ * thrown when the client can't take an operation right now, e.g. a publish
+ * while disconnected
+ */
+class TransportError : public std::runtime_error
+{
+    public:
+        explicit TransportError(const std::string& what) : std::runtime_error(what) {}
+};
+
+/*
+ * outcome of a connect or a publish, once the broker answered
+ */
+class TransportToken
+{
+    public:
+        virtual ~TransportToken() {}
+
+        // wait at most timeout, true once complete
+        virtual bool waitFor(std::chrono::milliseconds timeout) = 0;
+        virtual bool isComplete() const = 0;
+
+        // 0 if it succeeded. Only meaningful once complete
+        virtual int returnCode() const = 0;
+};
+
+typedef std::shared_ptr<TransportToken> TransportTokenPtr;
+
+class TransportListener
+{
+    public:
+        virtual ~TransportListener() {}
+
+        // a connect() succeeded. Subscriptions of a clean session are gone
+        virtual void connected() = 0;
+
+        // a connect() failed
+        virtual void connectFailed() = 0;
+
+        // an established connection dropped. Nothing is retried by the
+        // transport, the listener decides when to connect() again
+        virtual void connectionLost(const std::string& cause) = 0;
+
+        // payload is shared with the transport's buffer, no copy is made
+        virtual void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) = 0;
+};
+
+struct TransportOptions
+{
+    bool clean_session;
+    int keep_alive;             // s
+    std::string will_topic;     // published by the broker if the connection drops, empty for none
+    std::string will_payload;
+    std::string persist_dir;    // client state of a persistent session, empty for none
+};
+
+class Transport
+{
+    public:
+        virtual ~Transport() {}
+
+        virtual const std::string& clientId() const = 0;
+
+        // set before the first connect()
+        virtual void setListener(TransportListener *listener) = 0;
+
+        // start connecting. The listener hears how it went
+        virtual TransportTokenPtr connect() = 0;
+
+        virtual bool isConnected() const = 0;
+
+        virtual TransportTokenPtr publish(const std::string& topic, const std::string& payload, int qos, bool retained) = 0;
+
+        virtual void subscribe(const std::string& topic, int qos) = 0;
+
+        // disconnect for good, the will is not published
+        virtual void disconnect() = 0;
+};
+
+/*
+ * transport for a server URI: loop://<name> for the LoopbackBroker of that
+ * name, anything else goes to paho
+ */
+std::unique_ptr<Transport> make_transport(const std::string& server, const std::string& client_id,
+                                          const TransportOptions& opts);
+
+#endif // TRANSPORT_HPP
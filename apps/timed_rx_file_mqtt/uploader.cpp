@@ -0,0 +1,412 @@
+/*
+ * Background upload of finished captures
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include "mqtt/async_client.h"
+#include "uploader.hpp"
+#include "time_helper.hpp"
+
+const int UPLOAD_QOS = 1;
+// device time that has to be free before another chunk is read (s)
+const double UPLOAD_GUARD = 2.0;
+const std::chrono::milliseconds UPLOAD_POLL(100);
+// pause after the sink failed or refused a chunk, and between connection
+// attempts of the mqtt sink
+const std::chrono::seconds UPLOAD_RETRY_DELAY(2);
+
+/////////////////////////////////////////////////////////////////////////////
+
+/*
+ * chunks published on a topic over a connection of its own, so uploads
+ * don't hold up responses in the gateway's publish window
+ */
+class MqttUploadSink : public UploadSink
+{
+    private:
+        mqtt::async_client client;
+        mqtt::connect_options opts;
+        std::string topic;
+        mqtt::token_ptr conntok;
+        std::chrono::steady_clock::time_point next_connect;
+        std::deque<mqtt::delivery_token_ptr> inflight;
+        std::string buf;
+
+        // start connecting if not connected, at most every UPLOAD_RETRY_DELAY
+        bool connected()
+        {
+            using namespace std::chrono;
+            if(client.is_connected())
+                return true;
+            if((conntok == nullptr || conntok->is_complete()) && steady_clock::now() >= next_connect)
+            {
+                next_connect = steady_clock::now() + UPLOAD_RETRY_DELAY;
+                try
+                {
+                    conntok = client.connect(opts);
+                }
+                catch(const mqtt::exception& e)
+                {
+                    std::cerr << "[UPLerror] " << e.what() << std::endl;
+                }
+            }
+            return false;
+        }
+
+    public:
+        MqttUploadSink(const std::string& server, const std::string& client_id, const std::string& topic)
+            : client(server, client_id + "-upload"), opts(), topic(topic), conntok(),
+              next_connect(std::chrono::steady_clock::now()), inflight(), buf()
+        {
+            opts.set_clean_session(true);
+            opts.set_keep_alive_interval(30);
+            connected();
+        }
+
+        ~MqttUploadSink()
+        {
+            try
+            {
+                if(client.is_connected())
+                    client.disconnect()->wait();
+            }
+            catch(const mqtt::exception& e)
+            {
+                std::cerr << "[UPLerror] " << e.what() << std::endl;
+            }
+        }
+
+        bool post(const UploadChunk& chunk) override
+        {
+            if(connected() == false)
+                return false;
+            buf.clear();
+            encode_chunk(chunk, buf);
+            try
+            {
+                inflight.push_back(client.publish(mqtt::make_message(topic, buf, UPLOAD_QOS, false)));
+            }
+            catch(const mqtt::exception& e)
+            {
+                return false;
+            }
+            return true;
+        }
+
+        size_t poll(std::chrono::milliseconds timeout, bool& failed) override
+        {
+            failed = false;
+            if(inflight.empty())
+            {
+                connected();
+                return 0;
+            }
+            try
+            {
+                inflight.front()->wait_for(timeout);
+            }
+            catch(const mqtt::exception& e)
+            {
+                // failed, handled below
+            }
+            size_t n = 0;
+            while(inflight.empty() == false && inflight.front()->is_complete())
+            {
+                if(inflight.front()->get_return_code() != 0)
+                {
+                    failed = true;
+                    break;
+                }
+                inflight.pop_front();
+                n++;
+            }
+            // whatever was in flight when the connection dropped is sent again
+            if(failed || (inflight.empty() == false && client.is_connected() == false))
+            {
+                failed = true;
+                inflight.clear();
+            }
+            return n;
+        }
+};
+
+/*
+ * chunks written into place in a directory, e.g. a mounted share, as a
+ * stand-in for an HTTP endpoint taking ranged PUTs. A file is written as
+ * <name>.part and renamed once its last chunk is in
+ */
+class DirUploadSink : public UploadSink
+{
+    private:
+        std::string dir;
+        size_t nconfirmed;
+        bool failed_;
+
+    public:
+        explicit DirUploadSink(const std::string& dir) : dir(dir), nconfirmed(0), failed_(false) {}
+
+        bool post(const UploadChunk& chunk) override
+        {
+            if(failed_)
+                return false;
+            const std::string part = dir + "/" + chunk.file + ".part";
+            std::fstream out(part, std::ios::in | std::ios::out | std::ios::binary);
+            if(out.is_open() == false)
+                out.open(part, std::ios::out | std::ios::binary);
+            out.seekp(chunk.offset);
+            out.write(chunk.data.data(), chunk.data.size());
+            out.close();
+            bool ok = (out.fail() == false);
+            if(ok && chunk.last())
+                ok = (std::rename(part.c_str(), (dir + "/" + chunk.file).c_str()) == 0);
+            if(ok)
+                nconfirmed++;
+            else
+            {
+                std::cerr << "[UPLerror] could not write " << part << std::endl;
+                failed_ = true;
+            }
+            return true;
+        }
+
+        size_t poll(std::chrono::milliseconds timeout, bool& failed) override
+        {
+            const size_t n = nconfirmed;
+            failed = failed_;
+            nconfirmed = 0;
+            failed_ = false;
+            return n;
+        }
+};
+
+std::unique_ptr<UploadSink> make_upload_sink(const UploadParams& params)
+{
+    if(boost::algorithm::starts_with(params.sink, "mqtt:") && params.sink.size() > 5)
+        return std::unique_ptr<UploadSink>(new MqttUploadSink(params.server, params.client_id, params.sink.substr(5)));
+    if(boost::algorithm::starts_with(params.sink, "dir:") && params.sink.size() > 4)
+    {
+        const std::string dir = params.sink.substr(4);
+        try
+        {
+            boost::filesystem::create_directories(dir);
+        }
+        catch(const boost::filesystem::filesystem_error& e)
+        {
+            std::cerr << "[UPLerror] " << e.what() << std::endl;
+            return nullptr;
+        }
+        return std::unique_ptr<UploadSink>(new DirUploadSink(dir));
+    }
+    return nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// confirmed offset of an upload, 0 if it has not started
+static uint64_t load_offset(const std::string& file)
+{
+    std::ifstream in(file + UPLOAD_STATE_SUFFIX);
+    uint64_t offset = 0;
+    if(in.is_open() && (in >> offset))
+        return offset;
+    return 0;
+}
+
+// replace the state file as a whole, so a crash leaves the old or new offset
+static void save_offset(const std::string& file, uint64_t offset)
+{
+    const std::string state = file + UPLOAD_STATE_SUFFIX;
+    {
+        std::ofstream out(state + ".tmp", std::ofstream::trunc);
+        out << offset << std::endl;
+    }
+    std::rename((state + ".tmp").c_str(), state.c_str());
+}
+
+Uploader::Uploader(const UploadParams& params, std::unique_ptr<UploadSink> sink,
+                   CaptureAgenda *agenda, ProtectedQ<NetMsg> *toNetwork)
+    : params(params), sink(std::move(sink)), agenda(agenda), toNetwork(toNetwork),
+      files(), budget(double(params.chunk_size)), trefill(std::chrono::steady_clock::now())
+{
+    // uploads the last run did not finish go first, oldest capture first
+    namespace fs = boost::filesystem;
+    std::vector<std::string> unfinished;
+    try
+    {
+        for(const auto& entry : fs::directory_iterator(params.capture_dir))
+        {
+            const std::string path = entry.path().string();
+            if(boost::algorithm::ends_with(path, UPLOAD_STATE_SUFFIX))
+                unfinished.push_back(path.substr(0, path.size() - UPLOAD_STATE_SUFFIX.size()));
+        }
+    }
+    catch(const fs::filesystem_error& e)
+    {
+        std::cerr << "[UPLerror] " << e.what() << std::endl;
+    }
+    std::sort(unfinished.begin(), unfinished.end());
+    for(const auto& file : unfinished)
+    {
+        std::cout << "[UPLdebug] resuming upload of " << file << std::endl;
+        files.addItem(file);
+    }
+}
+
+void Uploader::add(const std::string& file)
+{
+    save_offset(file, 0);
+    files.addItem(file);
+}
+
+void Uploader::close()
+{
+    files.close();
+}
+
+// wait until the device has no capture coming up and the rate limit allows
+// nbytes more. Returns false once the uploader was closed
+bool Uploader::waitTurn(size_t nbytes)
+{
+    using namespace std::chrono;
+    bool waited = false;
+    while(files.isClosed() == false)
+    {
+        const double tnow = systime_now_double();
+        if(agenda->deviceIdle(tnow, tnow + UPLOAD_GUARD) == false)
+        {
+            if(waited == false)
+                std::cout << "[UPLdebug] paused for a capture" << std::endl;
+            waited = true;
+            std::this_thread::sleep_for(UPLOAD_POLL);
+            continue;
+        }
+        if(params.rate <= 0)
+            return true;
+        const steady_clock::time_point t = steady_clock::now();
+        budget = std::min(budget + params.rate * duration<double>(t - trefill).count(),
+                          double(std::max(nbytes, params.chunk_size)));
+        trefill = t;
+        if(budget >= nbytes)
+        {
+            budget -= nbytes;
+            return true;
+        }
+        std::this_thread::sleep_for(std::min<steady_clock::duration>(UPLOAD_POLL,
+                    duration_cast<steady_clock::duration>(duration<double>((nbytes - budget) / params.rate))));
+    }
+    return false;
+}
+
+// upload one file from its confirmed offset. Returns false if the uploader
+// was closed before it was done
+bool Uploader::upload(const std::string& file)
+{
+    using namespace std::chrono;
+    Ack ack = make_ack(AckCode::UPLOAD_FAILED, params.client_id);
+    ack.files.push_back(file);
+
+    std::ifstream in(file, std::ifstream::binary | std::ifstream::ate);
+    const uint64_t size = in.is_open() ? uint64_t(in.tellg()) : 0;
+    if(size == 0)
+    {
+        ack.reason = in.is_open() ? "empty file" : "can't open file";
+        send_response(toNetwork, ack);
+        std::remove((file + UPLOAD_STATE_SUFFIX).c_str());
+        return true;
+    }
+
+    uint64_t confirmed = load_offset(file);
+    if(confirmed > size)
+        confirmed = 0;
+    uint64_t next = confirmed;
+    // lengths of the chunks posted and not confirmed yet, in order
+    std::deque<size_t> inflight;
+    std::string data;
+    UploadChunk chunk;
+    chunk.file = boost::filesystem::path(file).filename().string();
+    chunk.size = size;
+    const steady_clock::time_point tstart = steady_clock::now();
+    std::cout << boost::format("[UPLdebug] uploading %s from %lu of %lu bytes") % file % confirmed % size << std::endl;
+
+    while(confirmed < size)
+    {
+        // keep the window full while the device is free
+        bool refused = false;
+        while(inflight.size() < params.window && next < size && refused == false)
+        {
+            const size_t len = size_t(std::min<uint64_t>(params.chunk_size, size - next));
+            if(waitTurn(len) == false)
+                break;
+            data.resize(len);
+            in.seekg(next);
+            if(in.read(&data[0], len).fail())
+            {
+                ack.reason = "read error";
+                send_response(toNetwork, ack);
+                std::remove((file + UPLOAD_STATE_SUFFIX).c_str());
+                return true;
+            }
+            chunk.offset = next;
+            chunk.data = data;
+            refused = (sink->post(chunk) == false);
+            if(refused == false)
+            {
+                inflight.push_back(len);
+                next += len;
+            }
+        }
+
+        bool failed = false;
+        size_t n = sink->poll(UPLOAD_POLL, failed);
+        if(n > 0)
+        {
+            for(; n > 0 && inflight.empty() == false; n--)
+            {
+                confirmed += inflight.front();
+                inflight.pop_front();
+            }
+            save_offset(file, confirmed);
+        }
+        if(failed)
+        {
+            // send everything after the confirmed offset again
+            std::cout << boost::format("[UPLdebug] sink failed, resending %s from %lu") % file % confirmed << std::endl;
+            inflight.clear();
+            next = confirmed;
+        }
+        if(files.isClosed())
+        {
+            std::cout << boost::format("[UPLdebug] stopped %s at %lu of %lu bytes") % file % confirmed % size << std::endl;
+            return false;
+        }
+        if((failed || refused) && inflight.empty())
+            std::this_thread::sleep_for(UPLOAD_RETRY_DELAY);
+    }
+
+    std::remove((file + UPLOAD_STATE_SUFFIX).c_str());
+    ack.code = AckCode::UPLOADED;
+    ack.values = {double(size), duration<double>(steady_clock::now() - tstart).count()};
+    send_response(toNetwork, ack);
+    return true;
+}
+
+void Uploader::run()
+{
+    std::string file;
+    std::cout << "[UPLdebug] upload thread created" << std::endl;
+    while(files.isClosed() == false && files.popItem(file))
+    {
+        if(upload(file) == false)
+            break;
+    }
+    std::cout << "[UPLdebug] upload thread done" << std::endl;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copies finished captures off the gateway in the background. Files are
+ * read in chunks and handed to a sink, an MQTT topic (chunks in the
+ * encoding of wire_codec.hpp) or a directory, with a bounded number of
+ * chunks waiting for the sink to confirm them.
+ *
+ * Uploads stay out of the way of captures: chunks are only read while the
+ * agenda has no device time booked for the next UPLOAD_GUARD seconds, and
+ * at most at the configured rate. The confirmed offset of every file is
+ * kept next to it in <file>.upload, so uploads left by a restart or a sink
+ * outage resume where they stopped.
+ */
+
+#ifndef UPLOADER_HPP
+#define UPLOADER_HPP
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include "protected_queue.hpp"
+#include "capture_agenda.hpp"
+#include "wire_codec.hpp"
+#include "ops_helper.hpp"
+
+const std::string UPLOAD_STATE_SUFFIX = ".upload";
+
+struct UploadParams
+{
+    std::string sink;       // mqtt:<topic> or dir:<path>, empty for no uploads
+    std::string server;     // broker and client id of the gateway, for an mqtt sink
+    std::string client_id;
+    size_t chunk_size;      // bytes per chunk
+    size_t window;          // chunks handed to the sink but not confirmed at most
+    double rate;            // B/s, 0 for no limit
+    std::string capture_dir;    // searched for unfinished uploads on start
+};
+
+/*
+ * where chunks go. Chunks are confirmed in the order they were posted
+ */
+class UploadSink
+{
+    public:
+        virtual ~UploadSink() {}
+
+        // start sending a chunk. Returns false if the sink can't take it
+        // right now, e.g. while disconnected
+        virtual bool post(const UploadChunk& chunk) = 0;
+
+        // wait at most timeout for the oldest posted chunk and return how
+        // many were confirmed since the last call. If one failed, failed is
+        // set and every chunk posted after it is forgotten too
+        virtual size_t poll(std::chrono::milliseconds timeout, bool& failed) = 0;
+};
+
+/*
+ * sink for a --upload spec, nullptr if the spec is not valid
+ */
+std::unique_ptr<UploadSink> make_upload_sink(const UploadParams& params);
+
+class Uploader
+{
+    private:
+        UploadParams params;
+        std::unique_ptr<UploadSink> sink;
+        CaptureAgenda *agenda;
+        ProtectedQ<NetMsg> *toNetwork;
+        ProtectedQ<std::string> files;
+        // token bucket for the rate limit, in bytes
+        double budget;
+        std::chrono::steady_clock::time_point trefill;
+
+        bool waitTurn(size_t nbytes);
+        bool upload(const std::string& file);
+
+    public:
+        // unfinished uploads in params.capture_dir are queued right away
+        Uploader(const UploadParams& params, std::unique_ptr<UploadSink> sink,
+                 CaptureAgenda *agenda, ProtectedQ<NetMsg> *toNetwork);
+
+        // queue a finished capture. It is remembered on disk until uploaded
+        void add(const std::string& file);
+
+        // upload thread: takes queued files one at a time until close()
+        void run();
+
+        // stop uploading. The file being uploaded keeps its confirmed offset
+        void close();
+};
+
+#endif // UPLOADER_HPP
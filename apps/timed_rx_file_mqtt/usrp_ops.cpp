@@ -15,25 +15,19 @@
 #include <cstdio>
 #include <thread>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <cmath>
 #include "ops_helper.hpp"
-#include "date.h"
-
-template <typename Clock>
-std::chrono::time_point<Clock, std::chrono::duration<double>> double2timepoint(double t)
-{
-    // converts double to duration with double internal type
-    std::chrono::duration<double> d(t);
-    // creates a time point for a particular clock from the previously computed duration
-    return std::chrono::time_point<Clock, std::chrono::duration<double>>(d); 
-}
-
-template <typename Clock>
-double timepoint2double(std::chrono::time_point<Clock> tp)
-{
-    // converts duration to a double value
-    std::chrono::duration<double> ddouble = tp.time_since_epoch();
-    return ddouble.count();
-}
+#include "time_helper.hpp"
+#include "setup_model.hpp"
+#include "uploader.hpp"
+#include "preview.hpp"
+#include "capture_stats.hpp"
+#include "usrp_recv.hpp"
 
 // return a string in s.uuuuuu format for the provided time spec
 const std::string timespec_str(uhd::time_spec_t t)
@@ -41,14 +35,6 @@ const std::string timespec_str(uhd::time_spec_t t)
     return str(boost::format("%.06f") % t.get_real_secs());
 }
 
-const std::string systime_str(std::chrono::system_clock::time_point t)
-{
-    using namespace std::chrono;
-    auto sec = duration_cast<seconds>(t.time_since_epoch()).count();
-    auto usec = duration_cast<microseconds>(t.time_since_epoch()).count() % 1000000;
-    return (boost::format("%u.%06u") % sec % usec).str();
-}
-
 typedef std::function<uhd::sensor_value_t(const std::string&)> get_sensor_fn_t;
 bool check_locked_sensor(std::vector<std::string> sensor_names,
     const char* sensor_name,
@@ -144,157 +130,6 @@ uhd::usrp::multi_usrp::sptr create_device(
     return usrp;
 }
 
-template <typename samp_type>
-bool timed_recv_to_file(uhd::usrp::multi_usrp::sptr usrp,
-    const std::string& cpu_format,
-    const std::string& wire_format,
-    const size_t& channel,
-    const std::string& file,
-    size_t samps_per_buff,
-    unsigned long long num_requested_samples,
-    double t0,
-    double timeout,
-    bool bw_summary             = false,
-    bool stats                  = false,
-    bool null                   = false,
-    bool enable_size_map        = false)
-{
-    unsigned long long num_total_samps = 0;
-    // create a receive streamer
-    uhd::stream_args_t stream_args(cpu_format, wire_format);
-    std::vector<size_t> channel_nums;
-    channel_nums.push_back(channel);
-    stream_args.channels             = channel_nums;
-    uhd::rx_streamer::sptr rx_stream = usrp->get_rx_stream(stream_args);
-
-    // meta-data will be filled in by recv()
-    uhd::rx_metadata_t md;
-    std::ofstream outfile;
-    if (not null)
-    {
-        outfile.open(file.c_str(), std::ofstream::binary);
-        // sometimes opening the file can fail if the file system sees
-        // weird characters. Explicitly fail if this happens
-        if(outfile.is_open() == false)
-        {
-            std::cerr << boost::format("Could not open/create file %s") % file <<std::endl;
-            return false;
-        }
-    }
-    std::vector<samp_type> buff(samps_per_buff);
-
-    // setup streaming
-    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
-    stream_cmd.num_samps  = size_t(num_requested_samples);
-    stream_cmd.stream_now = false;
-    stream_cmd.time_spec  = uhd::time_spec_t(t0);
-    rx_stream->issue_stream_cmd(stream_cmd);
-
-    typedef std::map<size_t, size_t> SizeMap;
-    SizeMap mapSizes;
-    const auto start_time = double2timepoint<std::chrono::system_clock> (t0);
-    const auto stop_time = start_time + std::chrono::duration<double>(timeout);
-    const double stop_time_double = t0 + timeout;
-
-    // Track time and samps between updating the BW summary
-    auto last_update                     = start_time;
-    unsigned long long last_update_samps = 0;
-
-    // calculate timeout of first recv call
-    auto now = std::chrono::system_clock::now();
-    auto tnow_double = timepoint2double<std::chrono::system_clock>(now);
-    double recv_to = stop_time_double - tnow_double;
-
-
-    std::cout << boost::format("[UHDdebug][%s] requesting capture at %.06lf") % systime_str(now) % t0<< std::endl;
-
-    // Run this loop until either time expired (if a duration was given), until
-    // the requested number of samples were collected (if such a number was
-    // given), or until Ctrl-C was pressed.
-    while (num_requested_samples != num_total_samps)
-    {
-        now = std::chrono::system_clock::now();
-
-        size_t num_rx_samps =
-            rx_stream->recv(&buff.front(), buff.size(), md, recv_to, enable_size_map);
-
-        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)
-        {
-            std::cout << boost::format("Timeout while streaming") << std::endl;
-            break;
-        }
-        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW)
-        {
-            std::cerr<< boost::format("Could not sustain write rate of %fMB/s\n") % (usrp->get_rx_rate(channel) * sizeof(samp_type) / 1e6);
-            break;
-        }
-        if(md.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND)
-        {
-            std::cout << "Late command!" << std::endl;
-            break;
-        }
-        if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
-            std::string error = str(boost::format("Receiver error: %s") % md.strerror());
-            throw std::runtime_error(error);
-        }
-
-        if (enable_size_map) {
-            SizeMap::iterator it = mapSizes.find(num_rx_samps);
-            if (it == mapSizes.end())
-                mapSizes[num_rx_samps] = 0;
-            mapSizes[num_rx_samps] += 1;
-        }
-
-        num_total_samps += num_rx_samps;
-
-        if (outfile.is_open()) {
-            outfile.write((const char*)&buff.front(), num_rx_samps * sizeof(samp_type));
-        }
-
-        if (bw_summary) {
-            last_update_samps += num_rx_samps;
-            const auto time_since_last_update = now - last_update;
-            if (time_since_last_update > std::chrono::seconds(1)) {
-                const double time_since_last_update_s =
-                    std::chrono::duration<double>(time_since_last_update).count();
-                const double rate = double(last_update_samps) / time_since_last_update_s;
-                std::cout << "\t" << (rate / 1e6) << " Msps" << std::endl;
-                last_update_samps = 0;
-                last_update       = now;
-            }
-        }
-        now = std::chrono::system_clock::now();
-        tnow_double = timepoint2double<std::chrono::system_clock>(now);
-        // remaining time in transaction is timeoput for subsequent requests
-        recv_to = stop_time_double - tnow_double;
-    }
-    const auto actual_stop_time = std::chrono::system_clock::now();
-
-    stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
-    rx_stream->issue_stream_cmd(stream_cmd);
-
-    if (outfile.is_open()) {
-        outfile.close();
-    }
-
-    if (stats) {
-        const double actual_duration_seconds =
-            std::chrono::duration<float>(actual_stop_time - start_time).count();
-        const double rate = (double)num_total_samps / actual_duration_seconds;
-        std::cout << boost::format("[UHDdebug] Received %d samples in %f sec @ %.6lf Msps") % num_total_samps % actual_duration_seconds % (rate/1e6) << std::endl;
-        
-        if (enable_size_map) {
-            std::cout << std::endl;
-            std::cout << "[UHDdebug] Packet size map (bytes: count)" << std::endl;
-            for (SizeMap::iterator it = mapSizes.begin(); it != mapSizes.end(); it++)
-                std::cout << it->first << ":\t" << it->second << std::endl;
-        }
-    }
-
-    return (num_total_samps == num_requested_samples);
-}
-
-
 void set_sample_rate(uhd::usrp::multi_usrp::sptr usrp, double rate, size_t channel)
 {
     // set the sample rate
@@ -363,22 +198,38 @@ bool process_rx_request(
     const std::string wire_format,
     size_t samps_per_buff,
     double setup_time,
+    const std::atomic<bool>& abort,
+    bool keep_partial,
+    SetupTimings& timings,
+    const CaptureSinks& sinks,
+    const CaptureInfo& info,
+    CaptureStats& cstats,
     bool use_intn_flag               = false,
     bool bw_summary_flag             = false,
     bool stats_flag                  = false,
     bool null_flag                   = false,
     bool enable_size_map_flag        = false)
 {
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
     set_sample_rate(usrp, rate, channel);    
+    timings.rate = LAP_SECS(sw);
     set_fc(usrp, channel, freq, lo_offset, use_intn_flag);
+    timings.tune = LAP_SECS(sw);
     if(set_gain_flag)
         set_gain(usrp, channel, gain);
+    timings.gain = LAP_SECS(sw);
     if(set_bw_flag)
         set_ifbw(usrp, channel, bw);
-    usrp->set_rx_antenna(ant, channel);
+    timings.bw = LAP_SECS(sw);
+    // an empty antenna keeps the current one
+    if(!ant.empty())
+        usrp->set_rx_antenna(ant, channel);
+    timings.ant = LAP_SECS(sw);
 
     // check Ref and LO Lock detect
     check_lo_lock(usrp, channel, setup_time);
+    timings.lo_lock = LAP_SECS(sw);
     double timeout = to_slack + double(num_requested_samples)/rate;  // timeout per call
     #define timed_recv_to_file_args(format) \
         (usrp,                  \
@@ -390,6 +241,11 @@ bool process_rx_request(
          num_requested_samples, \
          t0,                    \
          timeout,               \
+         abort,                 \
+         timings,               \
+         sinks,                 \
+         info,                  \
+         cstats,                \
          bw_summary_flag,            \
          stats_flag,                 \
          null_flag,                  \
@@ -406,7 +262,11 @@ bool process_rx_request(
     else
         throw std::runtime_error("Unknown type " + cpu_format);
 
-    if (ret == false)
+    if (ret == false && abort && keep_partial)
+    {
+        std::cout << "[UHDdebug] Keeping partial file " << file << std::endl;
+    }
+    else if (ret == false)
     {  
         std::cout << "[UHDdebug] USRP rx error. Removing file " << file << std::endl;
         std::remove(file.c_str());
@@ -415,12 +275,90 @@ bool process_rx_request(
     return ret;
 }
 
-bool ntp_usrp_synced(uhd::usrp::multi_usrp::sptr usrp, double tThresh)
+size_t process_sweep_request(
+    uhd::usrp::multi_usrp::sptr usrp,
+    const size_t channel,
+    const RxRequest& req,
+    const std::vector<std::string>& files,
+    double to_slack,
+    const std::string cpu_format,
+    const std::string wire_format,
+    size_t samps_per_buff,
+    double setup_time,
+    const std::atomic<bool>& abort,
+    bool keep_partial,
+    SetupTimings& timings,
+    const CaptureSinks& sinks,
+    const CaptureInfo& info,
+    std::vector<CaptureStats>& step_stats,
+    bool use_intn_flag               = false,
+    bool stats_flag                  = false)
+{
+    // the first step is tuned (and lock-checked) like a regular capture,
+    // the remaining ones are retuned with timed commands during the sweep
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
+    set_sample_rate(usrp, req.sps, channel);
+    timings.rate = LAP_SECS(sw);
+    set_fc(usrp, channel, req.fc[0], req.lo, use_intn_flag);
+    timings.tune = LAP_SECS(sw);
+    if(req.set_gain)
+        set_gain(usrp, channel, req.gain);
+    timings.gain = LAP_SECS(sw);
+    if(req.set_bw)
+        set_ifbw(usrp, channel, req.bw);
+    timings.bw = LAP_SECS(sw);
+    if(!req.ant.empty())
+        usrp->set_rx_antenna(req.ant, channel);
+    timings.ant = LAP_SECS(sw);
+    check_lo_lock(usrp, channel, setup_time);
+    timings.lo_lock = LAP_SECS(sw);
+
+    #define timed_sweep_to_files_args(format) \
+        (usrp,                  \
+         format,                \
+         wire_format,           \
+         channel,               \
+         files,                 \
+         samps_per_buff,        \
+         req.nsamp,             \
+         req.fc,                \
+         req.lo,                \
+         req.sps,               \
+         req.t0,                \
+         req.dwell,             \
+         to_slack,              \
+         use_intn_flag,         \
+         abort,                 \
+         keep_partial,          \
+         timings,               \
+         sinks,                 \
+         info,                  \
+         step_stats,            \
+         stats_flag)
+
+    if (cpu_format == "double")
+        return timed_sweep_to_files<std::complex<double>> timed_sweep_to_files_args("fc64");
+    else if (cpu_format == "float")
+        return timed_sweep_to_files<std::complex<float>> timed_sweep_to_files_args("fc32");
+    else if (cpu_format == "short")
+        return timed_sweep_to_files<std::complex<short>> timed_sweep_to_files_args("sc16");
+    else
+        throw std::runtime_error("Unknown type " + cpu_format);
+}
+
+// offset of USRP time from ntp system time
+double usrp_ntp_offset(uhd::usrp::multi_usrp::sptr usrp)
 {
-    // return true if ntp system tme and USRP system time are close enough
     double tusrp = usrp->get_time_now().get_real_secs();
     double tsys = timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
-    return (abs(tusrp - tsys) <= tThresh);
+    return tusrp - tsys;
+}
+
+bool ntp_usrp_synced(uhd::usrp::multi_usrp::sptr usrp, double tThresh)
+{
+    // return true if ntp system tme and USRP system time are close enough
+    return (std::abs(usrp_ntp_offset(usrp)) <= tThresh);
 }
 
 // for a given time point, find the exact time point of the next second.
@@ -493,18 +431,228 @@ void sync_usrp_ntp(uhd::usrp::multi_usrp::sptr usrp, double sync_slack)
     std::cout << boost::format("[UHDdebug][%s] synced usrp time: %.6lf") % systime_str(std::chrono::system_clock::now()) % timespec_str(usrp->get_time_now()) << std::endl;
 }
 
+// filename for a capture at frequency fc starting at time t
+std::string rx_filename_str(const std::string& prefix, double fc, double t)
+{
+    return (boost::format("%s%.3lfM_%s.dat")
+                    % prefix
+                    % (fc/1e6)
+                    % date_str(t)
+                    ).str();
+}
+
+// quantile q of xs, 0 if there are none. Reorders xs
+static double quantile_of(std::vector<double>& xs, double q)
+{
+    if (xs.empty())
+        return 0.0;
+    size_t k = std::min(xs.size() - 1, size_t(q * xs.size()));
+    std::nth_element(xs.begin(), xs.begin() + k, xs.end());
+    return xs[k];
+}
+
+// publish the counters of a capture on the telemetry topic, see
+// AckCode::CAPTURE_STATS for the layout of the values
+static void send_capture_stats(ProtectedQ<NetMsg> *toNetwork, struct UsrpParams* params,
+                               const AgendaEntry& occ, CaptureStats& cstats, const SetupTimings& timings)
+{
+    Ack ack = entry_ack(AckCode::CAPTURE_STATS, params->client_id, occ);
+    ack.t0 = cstats.t0;
+    ack.files.push_back(cstats.file);
+    const double msps = (cstats.duration > 0.0) ? cstats.received / cstats.duration / 1e6 : 0.0;
+    const double write_max = cstats.write_lat.empty() ? 0.0 : *std::max_element(cstats.write_lat.begin(), cstats.write_lat.end());
+    ack.values = {double(cstats.requested), double(cstats.received), cstats.duration, msps,
+                  double(cstats.bytes), double(cstats.overflows),
+                  quantile_of(cstats.write_lat, 0.5), quantile_of(cstats.write_lat, 0.99), write_max,
+                  timings.rate, timings.tune, timings.gain, timings.bw, timings.ant,
+                  timings.lo_lock, timings.streamer, timings.file_open};
+    for (const auto& it : cstats.sizes)
+    {
+        ack.values.push_back(double(it.first));
+        ack.values.push_back(double(it.second));
+    }
+    send_telemetry(toNetwork, ack);
+}
+
+// stage times of a capture, or of a sweep from its first to its last step,
+// for the response about occ
+static void set_capture_stages(Ack& ack, const CaptureStats& first, const CaptureStats& last)
+{
+    ack.stages.setup_done = first.setup_done;
+    ack.stages.first_sample = first.first_sample;
+    ack.stages.last_sample = last.last_sample;
+    ack.stages.closed = last.closed;
+}
+
+// run an occurrence taken from the agenda on the device and report the
+// outcome, tagged with the entry it belongs to. abort stops the capture early.
+// The samples also go to sinks while they are written, and the counters of
+// each capture to the telemetry topic.
+// Returns false if the device was not set up, otherwise timings holds the
+// time taken by each setup phase
+bool execute_rx_request(
+    uhd::usrp::multi_usrp::sptr usrp,
+    struct UsrpParams* params,
+    const AgendaEntry& occ,
+    const std::atomic<bool>& abort,
+    SetupTimings& timings,
+    ProtectedQ<NetMsg> *toNetwork,
+    Uploader *uploader,
+    const CaptureSinks& sinks)
+{
+    const RxRequest& req = occ.req;
+    timings = SetupTimings();
+    CaptureInfo info{occ.name, "", req.t0, req.fc[0], req.sps, req.nsamp, params->datafmt, 0};
+
+    // Check if the request was too late
+    double tnow_double = timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
+    // in the worst case, NTP time lags GPS PPS and setup takes as long as
+    // the margin the request was admitted with
+    // error on: tnow + setup_margin > tstart
+    if((tnow_double + occ.setup_margin) > req.t0)
+    {
+        send_response(toNetwork, entry_ack(AckCode::LATE, params->client_id, occ));
+        return false;
+    }
+
+    if(req.nsteps > 1)
+    {
+        std::vector<std::string> rx_filenames;
+        for(size_t i = 0; i < req.nsteps; i++)
+            rx_filenames.push_back(rx_filename_str(params->file_prefix, req.fc[i], req.t0 + i * req.dwell));
+
+        std::vector<CaptureStats> step_stats;
+        size_t nsaved = process_sweep_request(
+                    usrp,
+                    params->channel,
+                    req,
+                    rx_filenames,
+                    params->ntpslack,
+                    params->datafmt,
+                    params->wirefmt,
+                    params->spb,
+                    params->tslack,
+                    abort,
+                    params->keep_partial,
+                    timings,
+                    sinks,
+                    info,
+                    step_stats,
+                    params->intn_flag,
+                    true);
+        // the device was set up once, for the first step
+        for(size_t i = 0; i < step_stats.size(); i++)
+            send_capture_stats(toNetwork, params, occ, step_stats[i], (i == 0) ? timings : SetupTimings());
+
+        Ack ack = entry_ack(AckCode::SWEEP_FAILED, params->client_id, occ);
+        ack.count = nsaved;
+        if(step_stats.empty() == false)
+            set_capture_stages(ack, step_stats.front(), step_stats.back());
+        if(abort)
+        {
+            ack.code = AckCode::SWEEP_ABORTED;
+        }
+        else if(nsaved == req.nsteps)
+        {
+            ack.code = AckCode::SWEEP_SAVED;
+            ack.count = 0;
+            ack.files = rx_filenames;
+        }
+        else if(step_stats.empty() == false)
+            ack.reason = step_stats.back().error;
+        send_response(toNetwork, ack);
+        if(uploader != nullptr && ack.code == AckCode::SWEEP_SAVED)
+        {
+            for(const auto& f : rx_filenames)
+                uploader->add(f);
+        }
+        return true;
+    }
+
+    std::string rx_filename = rx_filename_str(params->file_prefix, req.fc[0], req.t0);
+    info.file = rx_filename;
+    CaptureStats cstats;
+
+    bool ret = process_rx_request(
+                usrp,
+                params->channel,
+                req.ant,
+                rx_filename,
+                req.fc[0],
+                req.lo,
+                req.sps,
+                req.set_gain,
+                req.gain,
+                req.set_bw,
+                req.bw,
+                req.t0,
+                req.nsamp,
+                params->ntpslack,
+                params->datafmt,
+                params->wirefmt,
+                params->spb,
+                params->tslack,
+                abort,
+                params->keep_partial,
+                timings,
+                sinks,
+                info,
+                cstats,
+                params->intn_flag,
+                true,
+                true,
+                false,
+                false);
+    send_capture_stats(toNetwork, params, occ, cstats, timings);
+
+    Ack ack = entry_ack(AckCode::FAILED, params->client_id, occ);
+    set_capture_stages(ack, cstats, cstats);
+    if(abort)
+    {
+        ack.code = AckCode::ABORTED;
+        if(params->keep_partial)
+            ack.files.push_back(rx_filename);
+    }
+    else if(ret)
+    {
+        ack.code = AckCode::SAVED;
+        ack.files.push_back(rx_filename);
+    }
+    else
+        ack.reason = cstats.error;
+    send_response(toNetwork, ack);
+    if(uploader != nullptr && ack.code == AckCode::SAVED)
+        uploader->add(rx_filename);
+    return true;
+}
+
+// how much earlier than the late-command bound the USRP thread takes the
+// next occurrence out of the agenda and starts setting up
+const double SETUP_WAKE_MARGIN = 0.1;
+
 void usrp_ops(
                 struct UsrpParams* params,
-                ProtectedQ<std::string> *toNetwork,
-                ProtectedQ<std::string> *fromNetwork)
+                CaptureAgenda *agenda,
+                ProtectedQ<NetMsg> *toNetwork,
+                Uploader *uploader,
+                CaptureSinks sinks)
 {
-    size_t n_samples;
-    double fc, lo_off, sps, ifbw, gain, tstart;
-    char antc[32];
-    int n_decoded;
+    AgendaEntry occ;
+    SetupTimings timings;
+    SetupModel model(params->setup_quantile, params->tslack, params->ntpslack);
+    // frequency the device is tuned to, to tell which requests retune
+    double tuned_fc = 0.0;
 
     std::cout << "[UHDdebug] USRP thread created" << std::endl;
 
+    // consumers of the samples besides the capture files
+    std::unique_ptr<PreviewStage> preview;
+    if(params->preview)
+    {
+        preview.reset(new PreviewStage(params->client_id, toNetwork));
+        sinks.push_back(preview.get());
+    }
+
     uhd::usrp::multi_usrp::sptr usrp = create_device(
         params->args,
         params->clkref,
@@ -517,94 +665,62 @@ void usrp_ops(
         // double check that're we are within the time sync bound for
         // every processed operation
         sync_usrp_ntp(usrp, params->ntpslack);
+        model.addClockOffset(usrp_ntp_offset(usrp));
 
         std::cout << "[UHDdebug] ===== waiting for request =====" << std::endl;
 
-        // wait for new request
-        std::string rxmsg = fromNetwork->popItem();
-        std::cout << "[UHDdebug] request recvd" << std::endl;
-
-        // parse request
-        n_decoded = std::sscanf(rxmsg.c_str(),
-        "fc=%lf,lo=%lf,sps=%lf,bw=%lf,g=%lf,t0=%lf,n=%zu,ant=%[^,]",
-            &fc,
-            &lo_off,
-            &sps,
-            &ifbw,
-            &gain,
-            &tstart,
-            &n_samples,
-            antc);
-        
-        // check if request is valid, if not, start loop from the top
-        // validity is based on format
-        if(n_decoded != 8)
+        // requests were parsed and admitted by the request thread. Wait for
+        // the earliest one to be due for setup. The agenda is closed when
+        // shutting down
+        if(agenda->popNext(occ, SETUP_WAKE_MARGIN) == false)
+            break;
+        occ.tdequeued = systime_now_double();
+        std::cout << "[UHDdebug] request due" << std::endl;
+
+        bool ran = false;
+        try
         {
-            std::string txmsg = str(boost::format("<%s invalid msg>") % params->client_id);
-            toNetwork->addItem(txmsg);
-            std::cout << txmsg << std::endl;
-            continue;
+            ran = execute_rx_request(usrp, params, occ, agenda->abortFlag(), timings, toNetwork, uploader, sinks);
         }
-
-        // TODO: parse all request parameters
-        const auto trequest = double2timepoint<std::chrono::system_clock>(tstart);
-        const auto datestr = date::format("%F_%H-%M-%S", std::chrono::time_point_cast<std::chrono::milliseconds>(trequest));
-        std::string rx_filename = (boost::format("%s%.3lfM_%s.dat")
-                        % params->file_prefix
-                        % (fc/1e6)
-                        % datestr
-                        ).str();
-
-        // Check if the request was too late
-        double tnow_double = timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
-        // in the worst case, NTP time lags GPS PPS and setup takes max slack time
-        // error on: tnow + ntp_error + slack_time > tstart
-        if((tnow_double + params->ntpslack + params->tslack) > tstart)
+        catch(const std::exception& e)
         {
-            std::string txmsg = (boost::format("<%s host late command @%s>") % params->client_id % datestr).str();
-            toNetwork->addItem(txmsg);
-            std::cout << txmsg << std::endl;
-            continue;
+            // e.g. the device failing a setting. Receiver errors while
+            // streaming don't get here, the recv loops stop on them. Only
+            // this occurrence failed, the ones after it still run
+            std::cerr << boost::format("[UHDerror] %s") % e.what() << std::endl;
+            for(CaptureSink* sink : sinks)
+                sink->end(false);
+            Ack ack = entry_ack((occ.req.nsteps > 1) ? AckCode::SWEEP_FAILED : AckCode::FAILED, params->client_id, occ);
+            ack.count = 0;
+            ack.reason = e.what();
+            send_response(toNetwork, ack);
         }
+        agenda->finished();
 
-        bool ret = process_rx_request(
-                    usrp,
-                    params->channel,
-                    std::string(antc),
-                    rx_filename,
-                    fc,
-                    lo_off,
-                    sps,
-                    true,
-                    gain,
-                    true,
-                    ifbw,
-                    tstart,
-                    n_samples,
-                    params->ntpslack,
-                    params->datafmt,
-                    params->wirefmt,
-                    params->spb,
-                    params->tslack,
-                    params->intn_flag,
-                    true,
-                    true,
-                    false,
-                    false);
-
-        if(ret)
+        // learn from the setup of this request and let admission control
+        // use the updated margins from now on
+        if(ran)
         {
-            std::string txmsg = (boost::format("<%s req saved %s>") % params->client_id % rx_filename).str();
-            toNetwork->addItem(txmsg);
-            std::cout << txmsg << std::endl;
-        } else
-        {
-            std::string txmsg = (boost::format("<%s req failed @ %s>") % params->client_id % datestr).str();
-            toNetwork->addItem(txmsg);
-            std::cout << txmsg << std::endl;
+            model.addSetup(occ.req.fc[0] != tuned_fc, timings);
+            tuned_fc = occ.req.fc[occ.req.nsteps - 1];
+            agenda->setSetupMargins(model.margin(false), model.margin(true));
+            std::cout << boost::format("[UHDdebug] setup rate %.3lf tune %.3lf gain %.3lf bw %.3lf ant %.3lf lo %.3lf streamer %.3lf file %.3lf")
+                            % timings.rate % timings.tune % timings.gain % timings.bw % timings.ant
+                            % timings.lo_lock % timings.streamer % timings.file_open << std::endl;
+            std::cout << "[UHDdebug] setup model " << model.str() << std::endl;
+            Ack status = make_ack(AckCode::SETUP, params->client_id);
+            status.values = model.values();
+            send_status(toNetwork, status);
         }
-        
 
+        if(occ.recurring && occ.nextPending(occ.next + 1) == occ.count)
+        {
+            Ack ack = entry_ack(AckCode::SCHED_DONE, params->client_id, occ);
+            ack.occurrence = -1;
+            ack.t0 = 0.0;
+            send_response(toNetwork, ack);
+        }
     }
 
+    std::cout << "[UHDdebug] USRP thread done" << std::endl;
 }
\ No newline at end of file
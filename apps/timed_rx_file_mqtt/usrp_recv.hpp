@@ -0,0 +1,472 @@
+/*
+ * The recv loops of timed_rx_file_mqtt: one capture to a file, and a sweep
+ * to a file per step. They only use the device for its streamer and, in a
+ * sweep, for timed retunes, so Device is a multi_usrp::sptr or anything
+ * that behaves like one (the tests use a streamer that plays back a
+ * script of buffers and errors).
+ *
+ * Whatever ends a capture early, the stream is stopped and drained before
+ * returning so the next one starts on a clean streamer.
+ */
+
+#ifndef USRP_RECV_HPP
+#define USRP_RECV_HPP
+
+#include <uhd/types/metadata.hpp>
+#include <uhd/types/stream_cmd.hpp>
+#include <uhd/types/tune_request.hpp>
+#include <uhd/stream.hpp>
+#include <boost/format.hpp>
+#include <iostream>
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include "time_helper.hpp"
+#include "setup_model.hpp"
+#include "stopwatch.hpp"
+#include "capture_sink.hpp"
+#include "capture_stats.hpp"
+
+// seconds of the current lap of a setup stopwatch
+#define LAP_SECS(sw) (std::chrono::duration<double>((sw).lap()).count())
+
+inline const std::string systime_str(std::chrono::system_clock::time_point t)
+{
+    using namespace std::chrono;
+    auto sec = duration_cast<seconds>(t.time_since_epoch()).count();
+    auto usec = duration_cast<microseconds>(t.time_since_epoch()).count() % 1000000;
+    return (boost::format("%u.%06u") % sec % usec).str();
+}
+
+// write latencies reserved before a capture, enough for most without
+// growing, and not so many that a long capture allocates them all up front
+const size_t WRITE_LAT_RESERVE = 4096;
+
+// longest a recv call blocks before the abort flag is checked again
+const double ABORT_POLL_INTERVAL = 0.1;
+
+// buffer the next recv fills: lent by the first sink that takes the
+// samples in place (e.g. a shared memory ring), buff otherwise
+template <typename samp_type>
+static samp_type* recv_buffer(const CaptureSinks& sinks, std::vector<samp_type>& buff)
+{
+    for (CaptureSink* sink : sinks)
+    {
+        void* p = sink->recvBuffer(buff.size() * sizeof(samp_type));
+        if (p != nullptr)
+            return static_cast<samp_type*>(p);
+    }
+    return &buff.front();
+}
+
+// device times of the first and last sample received so far, from the
+// time_spec of a buffer of nsamps samples
+static void note_sample_times(CaptureStats& cstats, const uhd::time_spec_t& tbuf, size_t nsamps, double rate)
+{
+    if (nsamps == 0)
+        return;
+    const double t = tbuf.get_real_secs();
+    if (cstats.first_sample == 0.0)
+        cstats.first_sample = t;
+    cstats.last_sample = t + (nsamps - 1) / rate;
+}
+
+template <typename samp_type, typename Device>
+bool timed_recv_to_file(Device usrp,
+    const std::string& cpu_format,
+    const std::string& wire_format,
+    const size_t& channel,
+    const std::string& file,
+    size_t samps_per_buff,
+    unsigned long long num_requested_samples,
+    double t0,
+    double timeout,
+    const std::atomic<bool>& abort,
+    SetupTimings& timings,
+    const CaptureSinks& sinks,
+    CaptureInfo info,
+    CaptureStats& cstats,
+    bool bw_summary             = false,
+    bool stats                  = false,
+    bool null                   = false,
+    bool enable_size_map        = false)
+{
+    unsigned long long num_total_samps = 0;
+    cstats = CaptureStats();
+    cstats.file = file;
+    cstats.t0 = t0;
+    cstats.requested = num_requested_samples;
+    cstats.write_lat.reserve(size_t(std::min<unsigned long long>(num_requested_samples / samps_per_buff + 1, WRITE_LAT_RESERVE)));
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
+    // create a receive streamer
+    uhd::stream_args_t stream_args(cpu_format, wire_format);
+    std::vector<size_t> channel_nums;
+    channel_nums.push_back(channel);
+    stream_args.channels             = channel_nums;
+    auto rx_stream = usrp->get_rx_stream(stream_args);
+    timings.streamer = LAP_SECS(sw);
+
+    // meta-data will be filled in by recv()
+    uhd::rx_metadata_t md;
+    std::ofstream outfile;
+    if (not null)
+    {
+        outfile.open(file.c_str(), std::ofstream::binary);
+        // sometimes opening the file can fail if the file system sees
+        // weird characters. Explicitly fail if this happens
+        if(outfile.is_open() == false)
+        {
+            std::cerr << boost::format("Could not open/create file %s") % file <<std::endl;
+            return false;
+        }
+    }
+    timings.file_open = LAP_SECS(sw);
+    std::vector<samp_type> buff(samps_per_buff);
+
+    // setup streaming
+    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
+    stream_cmd.num_samps  = size_t(num_requested_samples);
+    stream_cmd.stream_now = false;
+    stream_cmd.time_spec  = uhd::time_spec_t(t0);
+    rx_stream->issue_stream_cmd(stream_cmd);
+    cstats.setup_done = systime_now_double();
+
+    const auto start_time = double2timepoint<std::chrono::system_clock> (t0);
+    const auto stop_time = start_time + std::chrono::duration<double>(timeout);
+    const double stop_time_double = t0 + timeout;
+
+    // Track time and samps between updating the BW summary
+    auto last_update                     = start_time;
+    unsigned long long last_update_samps = 0;
+
+    // calculate timeout of first recv call
+    auto now = std::chrono::system_clock::now();
+    auto tnow_double = timepoint2double<std::chrono::system_clock>(now);
+    double recv_to = stop_time_double - tnow_double;
+
+
+    std::cout << boost::format("[UHDdebug][%s] requesting capture at %.06lf") % systime_str(now) % t0<< std::endl;
+
+    info.samp_size = sizeof(samp_type);
+    for (CaptureSink* sink : sinks)
+        sink->begin(info);
+
+    // Run this loop until either time expired (if a duration was given), until
+    // the requested number of samples were collected (if such a number was
+    // given), or until Ctrl-C was pressed.
+    while (num_requested_samples != num_total_samps)
+    {
+        if (abort)
+        {
+            std::cout << "[UHDdebug] capture aborted" << std::endl;
+            break;
+        }
+        now = std::chrono::system_clock::now();
+
+        // wake up regularly to check for aborts, also while waiting for t0
+        samp_type* rxbuf = recv_buffer(sinks, buff);
+        size_t num_rx_samps =
+            rx_stream->recv(rxbuf, buff.size(), md, std::min(recv_to, ABORT_POLL_INTERVAL), enable_size_map);
+
+        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)
+        {
+            if (recv_to > ABORT_POLL_INTERVAL)
+            {
+                recv_to = stop_time_double - timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
+                continue;
+            }
+            std::cout << boost::format("Timeout while streaming") << std::endl;
+            break;
+        }
+        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW)
+        {
+            std::cerr<< boost::format("Could not sustain write rate of %fMB/s\n") % (usrp->get_rx_rate(channel) * sizeof(samp_type) / 1e6);
+            cstats.overflows++;
+            break;
+        }
+        if(md.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND)
+        {
+            std::cout << "Late command!" << std::endl;
+            break;
+        }
+        if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+            cstats.error = str(boost::format("Receiver error: %s") % md.strerror());
+            std::cerr << boost::format("[UHDerror] %s") % cstats.error << std::endl;
+            break;
+        }
+
+        cstats.sizes[num_rx_samps] += 1;
+        note_sample_times(cstats, md.time_spec, num_rx_samps, info.sps);
+
+        if (outfile.is_open()) {
+            const auto twrite = std::chrono::steady_clock::now();
+            outfile.write((const char*)rxbuf, num_rx_samps * sizeof(samp_type));
+            cstats.write_lat.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - twrite).count());
+            cstats.bytes += num_rx_samps * sizeof(samp_type);
+        }
+        for (CaptureSink* sink : sinks)
+            sink->write(rxbuf, num_rx_samps, num_total_samps,
+                            DeviceTime{md.time_spec.get_full_secs(), md.time_spec.get_frac_secs()});
+
+        num_total_samps += num_rx_samps;
+
+        if (bw_summary) {
+            last_update_samps += num_rx_samps;
+            const auto time_since_last_update = now - last_update;
+            if (time_since_last_update > std::chrono::seconds(1)) {
+                const double time_since_last_update_s =
+                    std::chrono::duration<double>(time_since_last_update).count();
+                const double rate = double(last_update_samps) / time_since_last_update_s;
+                std::cout << "\t" << (rate / 1e6) << " Msps" << std::endl;
+                last_update_samps = 0;
+                last_update       = now;
+            }
+        }
+        now = std::chrono::system_clock::now();
+        tnow_double = timepoint2double<std::chrono::system_clock>(now);
+        // remaining time in transaction is timeoput for subsequent requests
+        recv_to = stop_time_double - tnow_double;
+    }
+    const auto actual_stop_time = std::chrono::system_clock::now();
+
+    stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
+    if (num_total_samps != num_requested_samples)
+    {
+        // aborted or failed: stop right away and drop whatever was still
+        // in flight so the device is clean for the next request
+        stream_cmd.stream_now = true;
+        rx_stream->issue_stream_cmd(stream_cmd);
+        while (rx_stream->recv(&buff.front(), buff.size(), md, ABORT_POLL_INTERVAL) > 0) {}
+    } else
+    {
+        rx_stream->issue_stream_cmd(stream_cmd);
+    }
+
+    if (outfile.is_open()) {
+        outfile.close();
+    }
+    cstats.closed = systime_now_double();
+    for (CaptureSink* sink : sinks)
+        sink->end(num_total_samps == num_requested_samples);
+
+    cstats.received = num_total_samps;
+    cstats.duration = std::chrono::duration<double>(actual_stop_time - start_time).count();
+    if (stats) {
+        const double rate = (double)num_total_samps / cstats.duration;
+        std::cout << boost::format("[UHDdebug] Received %d samples in %f sec @ %.6lf Msps") % num_total_samps % cstats.duration % (rate/1e6) << std::endl;
+        
+        if (enable_size_map) {
+            std::cout << std::endl;
+            std::cout << "[UHDdebug] Packet size map (bytes: count)" << std::endl;
+            for (const auto& it : cstats.sizes)
+                std::cout << it.first << ":\t" << it.second << std::endl;
+        }
+    }
+
+    return (num_total_samps == num_requested_samples);
+}
+
+// Record a frequency sweep as one timed-command sequence on a single streamer.
+// Step i starts at t0 + i*dwell. The retune for a step is issued as a timed
+// command right after the previous step stops streaming, and the stream command
+// of the next step is always queued one step ahead, so the device never waits
+// on the host between steps. Returns the number of steps saved.
+template <typename samp_type, typename Device>
+size_t timed_sweep_to_files(Device usrp,
+    const std::string& cpu_format,
+    const std::string& wire_format,
+    const size_t& channel,
+    const std::vector<std::string>& files,
+    size_t samps_per_buff,
+    unsigned long long num_requested_samples,
+    const double *freqs,
+    double lo_offset,
+    double rate,
+    double t0,
+    double dwell,
+    double to_slack,
+    bool use_intn,
+    const std::atomic<bool>& abort,
+    bool keep_partial,
+    SetupTimings& timings,
+    const CaptureSinks& sinks,
+    CaptureInfo info,
+    std::vector<CaptureStats>& step_stats,
+    bool stats                  = false)
+{
+    const size_t nsteps = files.size();
+    step_stats.clear();
+    const double capture_len = double(num_requested_samples) / rate;
+    Stopwatch<std::chrono::steady_clock> sw;
+    sw.start();
+
+    // create a receive streamer
+    uhd::stream_args_t stream_args(cpu_format, wire_format);
+    std::vector<size_t> channel_nums;
+    channel_nums.push_back(channel);
+    stream_args.channels             = channel_nums;
+    auto rx_stream = usrp->get_rx_stream(stream_args);
+    timings.streamer = LAP_SECS(sw);
+
+    uhd::rx_metadata_t md;
+    std::vector<samp_type> buff(samps_per_buff);
+    std::vector<double> tissued(nsteps, 0.0);
+
+    // queue the (timed) retune and stream command for a step
+    auto issue_step = [&](size_t step)
+    {
+        const double tstep = t0 + step * dwell;
+        if (step > 0)
+        {
+            uhd::tune_request_t tune_request(freqs[step], lo_offset);
+            if (use_intn)
+            {
+                tune_request.args = uhd::device_addr_t("mode_n=integer");
+            }
+            usrp->set_command_time(uhd::time_spec_t(tstep - dwell + capture_len));
+            usrp->set_rx_freq(tune_request, channel);
+            usrp->clear_command_time();
+        }
+        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
+        stream_cmd.num_samps  = size_t(num_requested_samples);
+        stream_cmd.stream_now = false;
+        stream_cmd.time_spec  = uhd::time_spec_t(tstep);
+        rx_stream->issue_stream_cmd(stream_cmd);
+        tissued[step] = systime_now_double();
+    };
+
+    std::cout << boost::format("[UHDdebug][%s] requesting %u step sweep at %.06lf") % systime_str(std::chrono::system_clock::now()) % nsteps % t0 << std::endl;
+
+    issue_step(0);
+    size_t nsaved = 0;
+    for (size_t step = 0; step < nsteps && !abort; step++)
+    {
+        // queue the next step before draining this one
+        if (step + 1 < nsteps)
+            issue_step(step + 1);
+
+        std::ofstream outfile(files[step].c_str(), std::ofstream::binary);
+        if (outfile.is_open() == false)
+        {
+            std::cerr << boost::format("Could not open/create file %s") % files[step] << std::endl;
+            break;
+        }
+        // later files are opened while the sweep is already running
+        if (step == 0)
+            timings.file_open = LAP_SECS(sw);
+
+        const double stop_time_double = t0 + step * dwell + capture_len + to_slack;
+        unsigned long long num_total_samps = 0;
+        bool step_error = false;
+        // every step is a capture of its own for the sinks and telemetry
+        step_stats.push_back(CaptureStats());
+        CaptureStats& cstats = step_stats.back();
+        cstats.file = files[step];
+        cstats.t0 = t0 + step * dwell;
+        cstats.requested = num_requested_samples;
+        cstats.write_lat.reserve(size_t(std::min<unsigned long long>(num_requested_samples / samps_per_buff + 1, WRITE_LAT_RESERVE)));
+        cstats.setup_done = tissued[step];
+        info.file = files[step];
+        info.fc = freqs[step];
+        info.t0 = t0 + step * dwell;
+        info.samp_size = sizeof(samp_type);
+        for (CaptureSink* sink : sinks)
+            sink->begin(info);
+        while (num_requested_samples != num_total_samps)
+        {
+            if (abort)
+            {
+                std::cout << "[UHDdebug] sweep aborted" << std::endl;
+                step_error = true;
+                break;
+            }
+            double recv_to = stop_time_double - timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now());
+            // never read past the end of this step into the next one
+            size_t nreq = size_t(std::min<unsigned long long>(buff.size(), num_requested_samples - num_total_samps));
+            samp_type* rxbuf = recv_buffer(sinks, buff);
+            size_t num_rx_samps =
+                rx_stream->recv(rxbuf, nreq, md, std::min(recv_to, ABORT_POLL_INTERVAL));
+
+            if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT)
+            {
+                if (recv_to > ABORT_POLL_INTERVAL)
+                    continue;
+                std::cout << boost::format("Timeout while streaming") << std::endl;
+                step_error = true;
+                break;
+            }
+            if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW)
+            {
+                std::cerr<< boost::format("Could not sustain write rate of %fMB/s\n") % (rate * sizeof(samp_type) / 1e6);
+                cstats.overflows++;
+                step_error = true;
+                break;
+            }
+            if(md.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND)
+            {
+                std::cout << "Late command!" << std::endl;
+                step_error = true;
+                break;
+            }
+            if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+                cstats.error = str(boost::format("Receiver error: %s") % md.strerror());
+                std::cerr << boost::format("[UHDerror] %s") % cstats.error << std::endl;
+                step_error = true;
+                break;
+            }
+
+            cstats.sizes[num_rx_samps] += 1;
+            note_sample_times(cstats, md.time_spec, num_rx_samps, rate);
+            const auto twrite = std::chrono::steady_clock::now();
+            outfile.write((const char*)rxbuf, num_rx_samps * sizeof(samp_type));
+            cstats.write_lat.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - twrite).count());
+            cstats.bytes += num_rx_samps * sizeof(samp_type);
+            for (CaptureSink* sink : sinks)
+                sink->write(rxbuf, num_rx_samps, num_total_samps,
+                            DeviceTime{md.time_spec.get_full_secs(), md.time_spec.get_frac_secs()});
+            num_total_samps += num_rx_samps;
+        }
+        outfile.close();
+        cstats.closed = systime_now_double();
+        cstats.received = num_total_samps;
+        cstats.duration = timepoint2double<std::chrono::system_clock>(std::chrono::system_clock::now()) - cstats.t0;
+        for (CaptureSink* sink : sinks)
+            sink->end(step_error == false);
+
+        if (step_error)
+        {
+            if (abort && keep_partial)
+            {
+                std::cout << "[UHDdebug] Keeping partial file " << files[step] << std::endl;
+            } else
+            {
+                std::cout << "[UHDdebug] USRP rx error. Removing file " << files[step] << std::endl;
+                std::remove(files[step].c_str());
+            }
+            break;
+        }
+        if (stats)
+        {
+            std::cout << boost::format("[UHDdebug] sweep step %u: %d samples at %f MHz") % step % num_total_samps % (freqs[step] / 1e6) << std::endl;
+        }
+        nsaved++;
+    }
+
+    uhd::stream_cmd_t stop_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+    rx_stream->issue_stream_cmd(stop_cmd);
+    // a sweep that ended early still has the next step's stream command
+    // queued, drop what it brings in
+    if (nsaved < nsteps)
+    {
+        while (rx_stream->recv(&buff.front(), buff.size(), md, ABORT_POLL_INTERVAL) > 0) {}
+    }
+
+    return nsaved;
+}
+
+#endif // USRP_RECV_HPP
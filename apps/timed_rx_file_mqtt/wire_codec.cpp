@@ -0,0 +1,504 @@
+/*
+ * Binary request and ack encoding
+ */
+
+#include <cstring>
+#include <algorithm>
+#include "wire_codec.hpp"
+
+const size_t WIRE_FIELD_HEADER_LEN = 3;
+const size_t WIRE_MAX_FIELD_LEN = 0xffff;
+
+static void put_uint(std::string& out, uint64_t v, size_t nbytes)
+{
+    for(size_t i = 0; i < nbytes; i++)
+        out.push_back(char((v >> (8 * i)) & 0xff));
+}
+
+static uint64_t get_uint(const char* p, size_t nbytes)
+{
+    uint64_t v = 0;
+    for(size_t i = 0; i < nbytes; i++)
+        v |= uint64_t(uint8_t(p[i])) << (8 * i);
+    return v;
+}
+
+static double get_f64(const char* p)
+{
+    uint64_t bits = get_uint(p, 8);
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static void put_field_header(std::string& out, uint8_t type, size_t len)
+{
+    out.push_back(char(type));
+    put_uint(out, len, 2);
+}
+
+static void put_f64s(std::string& out, uint8_t type, const double* v, size_t n)
+{
+    put_field_header(out, type, 8 * n);
+    for(size_t i = 0; i < n; i++)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &v[i], sizeof(bits));
+        put_uint(out, bits, 8);
+    }
+}
+
+static void put_f64(std::string& out, uint8_t type, double v)
+{
+    put_f64s(out, type, &v, 1);
+}
+
+static void put_u32(std::string& out, uint8_t type, uint32_t v)
+{
+    put_field_header(out, type, 4);
+    put_uint(out, v, 4);
+}
+
+static void put_str(std::string& out, uint8_t type, std::string_view v)
+{
+    v = v.substr(0, WIRE_MAX_FIELD_LEN);
+    put_field_header(out, type, v.size());
+    out.append(v.data(), v.size());
+}
+
+static void put_f32s(std::string& out, uint8_t type, const std::vector<float>& v)
+{
+    const size_t n = std::min(v.size(), WIRE_MAX_FIELD_LEN / 4);
+    put_field_header(out, type, 4 * n);
+    for(size_t i = 0; i < n; i++)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &v[i], sizeof(bits));
+        put_uint(out, bits, 4);
+    }
+}
+
+static void put_u64(std::string& out, uint8_t type, uint64_t v)
+{
+    put_field_header(out, type, 8);
+    put_uint(out, v, 8);
+}
+
+static void get_f32s(const char* p, size_t len, std::vector<float>& v)
+{
+    v.resize(len / 4);
+    for(size_t i = 0; i < v.size(); i++)
+    {
+        uint32_t bits = uint32_t(get_uint(p + 4 * i, 4));
+        std::memcpy(&v[i], &bits, sizeof(bits));
+    }
+}
+
+static bool wire_fail(ParseStatus& status, ParseError err, size_t pos, std::string_view key)
+{
+    status.err = err;
+    status.pos = pos;
+    status.key = key;
+    return false;
+}
+
+// where the f64 valued keys are stored, nullptr for other keys
+static double* f64_field(ParsedRequest& r, RequestKey k)
+{
+    switch(k)
+    {
+        case KEY_FC:        return &r.req.fc[0];
+        case KEY_LO:        return &r.req.lo;
+        case KEY_SPS:       return &r.req.sps;
+        case KEY_BW:        return &r.req.bw;
+        case KEY_G:         return &r.req.gain;
+        case KEY_T0:        return &r.req.t0;
+        case KEY_DWELL:     return &r.req.dwell;
+        case KEY_PERIOD:    return &r.period;
+        default:            return nullptr;
+    }
+}
+
+// decode one field of a request. val is the field value
+static bool decode_request_field(RequestKey k, std::string_view val, ParsedRequest& r, ParseError& err)
+{
+    err = ParseError::BAD_VALUE;
+    double* f = f64_field(r, k);
+    if(f != nullptr)
+    {
+        if(val.size() != 8)
+            return false;
+        *f = get_f64(val.data());
+        r.req.nsteps = (k == KEY_FC) ? 1 : r.req.nsteps;
+        r.req.set_bw = r.req.set_bw || (k == KEY_BW);
+        r.req.set_gain = r.req.set_gain || (k == KEY_G);
+        return true;
+    }
+
+    switch(k)
+    {
+        case KEY_SWEEP:
+            if(val.empty() || val.size() % 8 != 0)
+                return false;
+            if(val.size() / 8 > MAX_SWEEP_STEPS)
+            {
+                err = ParseError::TOO_MANY_STEPS;
+                return false;
+            }
+            r.req.nsteps = val.size() / 8;
+            for(size_t i = 0; i < r.req.nsteps; i++)
+                r.req.fc[i] = get_f64(val.data() + 8 * i);
+            return true;
+        case KEY_N:
+            if(val.size() != 8)
+                return false;
+            r.req.nsamp = get_uint(val.data(), 8);
+            return true;
+        case KEY_COUNT:
+            if(val.size() != 4)
+                return false;
+            r.count = unsigned(get_uint(val.data(), 4));
+            return true;
+        default:
+            // names and antenna
+            if(val.size() > MAX_FIELD_LEN)
+            {
+                err = ParseError::TOO_LONG;
+                return false;
+            }
+            if(val.empty())
+                return false;
+            if(k == KEY_ANT)
+                r.ant = val;
+            else
+                r.name = val;
+            r.preempt = r.preempt || (k == KEY_PREEMPT);
+            return true;
+    }
+}
+
+bool decode_requests(std::string_view msg, std::vector<ParsedRequest>& out, ParseStatus& status, size_t& failed)
+{
+    status.err = ParseError::NONE;
+    status.pos = 0;
+    status.key = std::string_view();
+    out.clear();
+    failed = 0;
+
+    if(msg.size() < WIRE_HEADER_LEN || msg[0] != 'U' || msg[1] != 'R')
+        return wire_fail(status, ParseError::SYNTAX, 0, std::string_view());
+    if(uint8_t(msg[2]) != WIRE_VERSION)
+        return wire_fail(status, ParseError::BAD_VALUE, 2, "version");
+    const size_t nreq = uint8_t(msg[3]);
+    if(nreq == 0)
+        return wire_fail(status, ParseError::EMPTY, 3, std::string_view());
+    if(nreq > MAX_BATCH_SIZE)
+        return wire_fail(status, ParseError::TOO_MANY_REQUESTS, 3, std::string_view());
+
+    size_t pos = WIRE_HEADER_LEN;
+    for(failed = 0; failed < nreq; failed++)
+    {
+        out.emplace_back();
+        ParsedRequest& r = out.back();
+        unsigned seen = 0;
+        size_t keypos[KEY_UNKNOWN] = {0};
+        init_request(r);
+
+        while(true)
+        {
+            if(pos + WIRE_FIELD_HEADER_LEN > msg.size())
+                return wire_fail(status, ParseError::SYNTAX, pos, std::string_view());
+            const uint8_t type = uint8_t(msg[pos]);
+            const size_t len = get_uint(msg.data() + pos + 1, 2);
+            if(pos + WIRE_FIELD_HEADER_LEN + len > msg.size())
+                return wire_fail(status, ParseError::SYNTAX, pos, std::string_view());
+            const size_t fieldpos = pos;
+            std::string_view val = msg.substr(pos + WIRE_FIELD_HEADER_LEN, len);
+            pos += WIRE_FIELD_HEADER_LEN + len;
+
+            if(type == WIRE_END)
+                break;
+            const RequestKey k = RequestKey(type - 1);
+            if(k >= KEY_UNKNOWN)
+                return wire_fail(status, ParseError::UNKNOWN_KEY, fieldpos, "?");
+            if(seen & KEY_BIT(k))
+                return wire_fail(status, ParseError::DUPLICATE_KEY, fieldpos, request_key_name(k));
+            seen |= KEY_BIT(k);
+            keypos[k] = fieldpos;
+
+            ParseError err;
+            if(decode_request_field(k, val, r, err) == false)
+                return wire_fail(status, err, fieldpos, request_key_name(k));
+        }
+
+        if(validate_request(r, seen, keypos, status) == false)
+            return false;
+        // same restrictions as text batches
+        if(nreq > 1 && r.kind == RequestKind::CANCEL)
+            return wire_fail(status, ParseError::CONFLICT, 0, "cancel");
+        if(nreq > 1 && r.preempt)
+            return wire_fail(status, ParseError::CONFLICT, 0, "preempt");
+    }
+
+    if(pos != msg.size())
+        return wire_fail(status, ParseError::SYNTAX, pos, std::string_view());
+    return true;
+}
+
+void encode_requests(const std::vector<ParsedRequest>& reqs, std::string& out)
+{
+    out.push_back('U');
+    out.push_back('R');
+    put_uint(out, WIRE_VERSION, 1);
+    put_uint(out, reqs.size(), 1);
+
+    for(const auto& r : reqs)
+    {
+        if(r.kind == RequestKind::CANCEL)
+        {
+            put_str(out, KEY_CANCEL + 1, r.name);
+            put_field_header(out, WIRE_END, 0);
+            continue;
+        }
+
+        if(r.req.nsteps == 1 && r.req.dwell == 0.0)
+        {
+            put_f64(out, KEY_FC + 1, r.req.fc[0]);
+        } else
+        {
+            put_f64s(out, KEY_SWEEP + 1, r.req.fc, r.req.nsteps);
+            put_f64(out, KEY_DWELL + 1, r.req.dwell);
+        }
+        put_f64(out, KEY_LO + 1, r.req.lo);
+        put_f64(out, KEY_SPS + 1, r.req.sps);
+        put_f64(out, KEY_T0 + 1, r.req.t0);
+        put_field_header(out, KEY_N + 1, 8);
+        put_uint(out, r.req.nsamp, 8);
+        if(r.req.set_bw)
+            put_f64(out, KEY_BW + 1, r.req.bw);
+        if(r.req.set_gain)
+            put_f64(out, KEY_G + 1, r.req.gain);
+        if(r.ant.empty() == false)
+            put_str(out, KEY_ANT + 1, r.ant);
+
+        if(r.kind == RequestKind::SCHEDULE)
+        {
+            put_str(out, KEY_SCHED + 1, r.name);
+            put_f64(out, KEY_PERIOD + 1, r.period);
+            put_u32(out, KEY_COUNT + 1, r.count);
+        }
+        else if(r.name.empty() == false)
+        {
+            put_str(out, (r.preempt ? KEY_PREEMPT : KEY_ID) + 1, r.name);
+        }
+        put_field_header(out, WIRE_END, 0);
+    }
+}
+
+void encode_ack(const Ack& ack, std::string& out)
+{
+    out.push_back('U');
+    out.push_back('A');
+    put_uint(out, WIRE_VERSION, 1);
+    put_uint(out, uint8_t(ack.code), 1);
+
+    put_str(out, ACK_CLIENT, ack.client_id);
+    if(ack.name.empty() == false)
+        put_str(out, ACK_NAME, ack.name);
+    if(ack.recurring)
+    {
+        put_field_header(out, ACK_RECURRING, 1);
+        put_uint(out, 1, 1);
+    }
+    if(ack.occurrence >= 0)
+        put_u32(out, ACK_OCCURRENCE, ack.occurrence);
+    if(ack.batch >= 0)
+        put_u32(out, ACK_BATCH, ack.batch);
+    if(ack.t0 != 0.0)
+        put_f64(out, ACK_T0, ack.t0);
+    if(ack.earliest != 0.0)
+        put_f64(out, ACK_EARLIEST, ack.earliest);
+    if(ack.count != 0)
+        put_u32(out, ACK_COUNT, ack.count);
+    if(ack.reason.empty() == false)
+        put_str(out, ACK_REASON, ack.reason);
+    if(ack.by.empty() == false)
+        put_str(out, ACK_BY, ack.by);
+    for(const auto& f : ack.files)
+        put_str(out, ACK_FILE, f);
+    for(const auto& v : ack.values)
+        put_f64(out, ACK_VALUE, v);
+    if(ack.stages.any())
+    {
+        const AckStages& st = ack.stages;
+        const double stages[] = {st.arrived, st.dequeued, st.setup_done, st.first_sample, st.last_sample, st.closed};
+        put_f64s(out, ACK_STAGES, stages, 6);
+    }
+}
+
+bool decode_ack(std::string_view msg, Ack& ack)
+{
+    if(msg.size() < WIRE_HEADER_LEN || msg[0] != 'U' || msg[1] != 'A' || uint8_t(msg[2]) != WIRE_VERSION)
+        return false;
+    ack = make_ack(AckCode(uint8_t(msg[3])), "");
+
+    size_t pos = WIRE_HEADER_LEN;
+    while(pos < msg.size())
+    {
+        if(pos + WIRE_FIELD_HEADER_LEN > msg.size())
+            return false;
+        const uint8_t type = uint8_t(msg[pos]);
+        const size_t len = get_uint(msg.data() + pos + 1, 2);
+        if(pos + WIRE_FIELD_HEADER_LEN + len > msg.size())
+            return false;
+        const char* val = msg.data() + pos + WIRE_FIELD_HEADER_LEN;
+        pos += WIRE_FIELD_HEADER_LEN + len;
+
+        const bool is_u32 = (type == ACK_OCCURRENCE || type == ACK_BATCH || type == ACK_COUNT);
+        const bool is_f64 = (type == ACK_T0 || type == ACK_EARLIEST || type == ACK_VALUE);
+        if((is_u32 && len != 4) || (is_f64 && len != 8) || (type == ACK_RECURRING && len != 1))
+            return false;
+        // later versions may add stages at the end
+        if(type == ACK_STAGES && len < 6 * 8)
+            return false;
+
+        switch(type)
+        {
+            case ACK_CLIENT:        ack.client_id.assign(val, len); break;
+            case ACK_NAME:          ack.name.assign(val, len); break;
+            case ACK_RECURRING:     ack.recurring = (val[0] != 0); break;
+            case ACK_OCCURRENCE:    ack.occurrence = int(get_uint(val, 4)); break;
+            case ACK_BATCH:         ack.batch = int(get_uint(val, 4)); break;
+            case ACK_T0:            ack.t0 = get_f64(val); break;
+            case ACK_EARLIEST:      ack.earliest = get_f64(val); break;
+            case ACK_COUNT:         ack.count = unsigned(get_uint(val, 4)); break;
+            case ACK_REASON:        ack.reason.assign(val, len); break;
+            case ACK_BY:            ack.by.assign(val, len); break;
+            case ACK_FILE:          ack.files.emplace_back(val, len); break;
+            case ACK_VALUE:         ack.values.push_back(get_f64(val)); break;
+            case ACK_STAGES:
+                ack.stages = AckStages{get_f64(val), get_f64(val + 8), get_f64(val + 16),
+                                       get_f64(val + 24), get_f64(val + 32), get_f64(val + 40)};
+                break;
+            default:                break;  // fields added by later versions
+        }
+    }
+    return true;
+}
+
+void encode_chunk(const UploadChunk& chunk, std::string& out)
+{
+    out.push_back('U');
+    out.push_back('C');
+    out.push_back(char(WIRE_VERSION));
+    out.push_back(0);
+    put_str(out, CHUNK_FILE, chunk.file);
+    put_u64(out, CHUNK_OFFSET, chunk.offset);
+    put_u64(out, CHUNK_SIZE, chunk.size);
+    out.push_back(char(WIRE_END));
+    out.append(chunk.data.data(), chunk.data.size());
+}
+
+bool decode_chunk(std::string_view msg, UploadChunk& chunk)
+{
+    if(msg.size() < WIRE_HEADER_LEN || msg[0] != 'U' || msg[1] != 'C' || uint8_t(msg[2]) != WIRE_VERSION)
+        return false;
+    chunk = UploadChunk();
+
+    size_t pos = WIRE_HEADER_LEN;
+    while(pos < msg.size() && uint8_t(msg[pos]) != WIRE_END)
+    {
+        if(pos + WIRE_FIELD_HEADER_LEN > msg.size())
+            return false;
+        const uint8_t type = uint8_t(msg[pos]);
+        const size_t len = get_uint(msg.data() + pos + 1, 2);
+        if(pos + WIRE_FIELD_HEADER_LEN + len > msg.size())
+            return false;
+        const char* val = msg.data() + pos + WIRE_FIELD_HEADER_LEN;
+        pos += WIRE_FIELD_HEADER_LEN + len;
+
+        if((type == CHUNK_OFFSET || type == CHUNK_SIZE) && len != 8)
+            return false;
+        switch(type)
+        {
+            case CHUNK_FILE:    chunk.file.assign(val, len); break;
+            case CHUNK_OFFSET:  chunk.offset = get_uint(val, 8); break;
+            case CHUNK_SIZE:    chunk.size = get_uint(val, 8); break;
+            default:            break;  // fields added by later versions
+        }
+    }
+    if(pos >= msg.size())
+        return false;
+    chunk.data = msg.substr(pos + 1);
+    // both are 64 bit values off the wire, compared so that nothing wraps
+    return chunk.file.empty() == false && chunk.offset <= chunk.size && chunk.data.size() <= chunk.size - chunk.offset;
+}
+
+void encode_preview(const CapturePreview& preview, std::string& out)
+{
+    out.push_back('U');
+    out.push_back('P');
+    out.push_back(char(WIRE_VERSION));
+    out.push_back(0);
+    put_str(out, PREVIEW_CLIENT, preview.client_id);
+    if(preview.name.empty() == false)
+        put_str(out, PREVIEW_NAME, preview.name);
+    put_str(out, PREVIEW_FILE, preview.file);
+    put_f64(out, PREVIEW_T0, preview.t0);
+    put_f64(out, PREVIEW_FC, preview.fc);
+    put_f64(out, PREVIEW_SPS, preview.sps);
+    put_u64(out, PREVIEW_NSAMP, preview.nsamp);
+    put_u32(out, PREVIEW_ENV_STEP, preview.env_step);
+    put_f32s(out, PREVIEW_ENVELOPE, preview.envelope);
+    put_u64(out, PREVIEW_BURST_INDEX, preview.burst_index);
+    put_u32(out, PREVIEW_BURST_DECIM, preview.burst_decim);
+    put_f32s(out, PREVIEW_BURST, preview.burst);
+    if(preview.dropped != 0)
+        put_u64(out, PREVIEW_DROPPED, preview.dropped);
+}
+
+bool decode_preview(std::string_view msg, CapturePreview& preview)
+{
+    if(msg.size() < WIRE_HEADER_LEN || msg[0] != 'U' || msg[1] != 'P' || uint8_t(msg[2]) != WIRE_VERSION)
+        return false;
+    preview = CapturePreview();
+
+    size_t pos = WIRE_HEADER_LEN;
+    while(pos < msg.size())
+    {
+        if(pos + WIRE_FIELD_HEADER_LEN > msg.size())
+            return false;
+        const uint8_t type = uint8_t(msg[pos]);
+        const size_t len = get_uint(msg.data() + pos + 1, 2);
+        if(pos + WIRE_FIELD_HEADER_LEN + len > msg.size())
+            return false;
+        const char* val = msg.data() + pos + WIRE_FIELD_HEADER_LEN;
+        pos += WIRE_FIELD_HEADER_LEN + len;
+
+        const bool is_u32 = (type == PREVIEW_ENV_STEP || type == PREVIEW_BURST_DECIM);
+        const bool is_64 = (type == PREVIEW_T0 || type == PREVIEW_FC || type == PREVIEW_SPS
+                            || type == PREVIEW_NSAMP || type == PREVIEW_BURST_INDEX || type == PREVIEW_DROPPED);
+        const bool is_f32s = (type == PREVIEW_ENVELOPE || type == PREVIEW_BURST);
+        if((is_u32 && len != 4) || (is_64 && len != 8) || (is_f32s && len % 4 != 0))
+            return false;
+
+        switch(type)
+        {
+            case PREVIEW_CLIENT:        preview.client_id.assign(val, len); break;
+            case PREVIEW_NAME:          preview.name.assign(val, len); break;
+            case PREVIEW_FILE:          preview.file.assign(val, len); break;
+            case PREVIEW_T0:            preview.t0 = get_f64(val); break;
+            case PREVIEW_FC:            preview.fc = get_f64(val); break;
+            case PREVIEW_SPS:           preview.sps = get_f64(val); break;
+            case PREVIEW_NSAMP:         preview.nsamp = get_uint(val, 8); break;
+            case PREVIEW_ENV_STEP:      preview.env_step = uint32_t(get_uint(val, 4)); break;
+            case PREVIEW_ENVELOPE:      get_f32s(val, len, preview.envelope); break;
+            case PREVIEW_BURST_INDEX:   preview.burst_index = get_uint(val, 8); break;
+            case PREVIEW_BURST_DECIM:   preview.burst_decim = uint32_t(get_uint(val, 4)); break;
+            case PREVIEW_BURST:         get_f32s(val, len, preview.burst); break;
+            case PREVIEW_DROPPED:       preview.dropped = get_uint(val, 8); break;
+            default:                    break;  // fields added by later versions
+        }
+    }
+    return true;
+}
@@ -0,0 +1,194 @@
+/*
+ * Binary encoding of requests and acks, used on the topics ending in
+ * BINARY_TOPIC_SUFFIX. The text format stays on the plain topics.
+ *
+ * Every message starts with a 4 byte header
+ *   'U', type ('R' request, 'A' ack), WIRE_VERSION, n
+ * followed by fields
+ *   type (u8), length (u16), value
+ * All numbers are little endian, doubles as IEEE 754 binary64.
+ *
+ * The point of the encoding is what it costs to parse and format, not its
+ * size: every field keeps its length so a decoder can skip types it does
+ * not know, and a number is 8 bytes however few digits it has in text. A
+ * typical request is about a quarter larger than its text form (see
+ * codec_bench), acks come out a little smaller.
+ *
+ * Requests: n is the number of requests (more than one is a batch). Each
+ * request is a list of fields ended by a WIRE_END field. Field types are
+ * RequestKey + 1, values are f64 for fc, lo, sps, bw, g, t0, dwell and
+ * period, an array of f64 for sweep, u64 for n, u32 for count and
+ * characters for ant, id, preempt, sched and cancel. Fields may come in
+ * any order and are validated like the text format.
+ *
+ * Acks: n is the AckCode, followed by AckField fields up to the end of
+ * the message. Fields at their default value are left out, files and
+ * values repeat. ACK_STAGES is the six AckStages times in their order,
+ * sent if any of them is set.
+ *
+ * Upload chunks: n is 0, followed by ChunkField fields, a WIRE_END byte
+ * and the chunk's bytes up to the end of the message. file is the
+ * capture's file name without its directory, offset the position of the
+ * bytes in it and size the length of the whole file, so a receiver can put
+ * chunks in place in any order and tell when it has all of them.
+ *
+ * Capture previews: n is 0, followed by PreviewField fields up to the end
+ * of the message. Envelope and burst are arrays of f32.
+ */
+
+#ifndef WIRE_CODEC_HPP
+#define WIRE_CODEC_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "request_parser.hpp"
+#include "ack.hpp"
+
+const uint8_t WIRE_VERSION = 1;
+const size_t WIRE_HEADER_LEN = 4;
+const uint8_t WIRE_END = 0;
+const std::string BINARY_TOPIC_SUFFIX = "/bin";
+
+enum AckField : uint8_t
+{
+    ACK_CLIENT = 1,     // characters
+    ACK_NAME,           // characters
+    ACK_RECURRING,      // u8
+    ACK_OCCURRENCE,     // u32
+    ACK_BATCH,          // u32
+    ACK_T0,             // f64
+    ACK_EARLIEST,       // f64
+    ACK_COUNT,          // u32
+    ACK_REASON,         // characters
+    ACK_BY,             // characters
+    ACK_FILE,           // characters
+    ACK_VALUE,          // f64
+    ACK_STAGES          // f64 array
+};
+
+enum ChunkField : uint8_t
+{
+    CHUNK_FILE = 1,     // characters
+    CHUNK_OFFSET,       // u64
+    CHUNK_SIZE          // u64
+};
+
+enum PreviewField : uint8_t
+{
+    PREVIEW_CLIENT = 1,     // characters
+    PREVIEW_NAME,           // characters
+    PREVIEW_FILE,           // characters
+    PREVIEW_T0,             // f64
+    PREVIEW_FC,             // f64
+    PREVIEW_SPS,            // f64
+    PREVIEW_NSAMP,          // u64
+    PREVIEW_ENV_STEP,       // u32
+    PREVIEW_ENVELOPE,       // f32 array
+    PREVIEW_BURST_INDEX,    // u64
+    PREVIEW_BURST_DECIM,    // u32
+    PREVIEW_BURST,          // f32 array
+    PREVIEW_DROPPED         // u64
+};
+
+/*
+ * small summary of a capture for dashboards: a coarse magnitude envelope
+ * over the whole capture and a decimated IQ excerpt of its strongest part
+ */
+struct CapturePreview
+{
+    std::string client_id;
+    std::string name;               // request id, may be empty
+    std::string file;
+    double t0;
+    double fc;
+    double sps;
+    uint64_t nsamp;
+    uint32_t env_step;              // samples per envelope point
+    std::vector<float> envelope;    // RMS magnitude per point, 1 is full scale,
+                                    // -1 where all samples were dropped
+    uint64_t burst_index;           // sample the excerpt starts at
+    uint32_t burst_decim;           // samples averaged per excerpt sample
+    std::vector<float> burst;       // I and Q interleaved
+    uint64_t dropped;               // samples the preview did not see
+};
+
+/*
+ * a piece of a capture file being uploaded. data refers to memory owned
+ * by the caller, or into the message it was decoded from
+ */
+struct UploadChunk
+{
+    std::string file;
+    uint64_t offset;
+    uint64_t size;
+    std::string_view data;
+
+    // without offset + data.size(), which a decoded offset near 2^64 wraps
+    bool last() const { return offset >= size || data.size() >= size - offset; }
+};
+
+/*
+ * true if a topic carries the binary encoding
+ */
+inline bool is_binary_topic(const std::string& topic)
+{
+    return topic.size() >= BINARY_TOPIC_SUFFIX.size()
+        && topic.compare(topic.size() - BINARY_TOPIC_SUFFIX.size(), BINARY_TOPIC_SUFFIX.size(), BINARY_TOPIC_SUFFIX) == 0;
+}
+
+/*
+ * true if a binary request message holds more than one request, i.e. is a
+ * batch. Only looks at the header, the message may still not decode
+ */
+inline bool is_binary_batch(std::string_view msg)
+{
+    return msg.size() >= WIRE_HEADER_LEN && msg[0] == 'U' && msg[1] == 'R' && uint8_t(msg[3]) > 1;
+}
+
+/*
+ * decode a binary request message into out, one entry per request. On
+ * failure, failed is the index of the request that did not decode and
+ * status.pos the byte offset in the message
+ */
+bool decode_requests(std::string_view msg, std::vector<ParsedRequest>& out, ParseStatus& status, size_t& failed);
+
+/*
+ * append the binary encoding of reqs to out
+ */
+void encode_requests(const std::vector<ParsedRequest>& reqs, std::string& out);
+
+/*
+ * append the binary encoding of an ack to out
+ */
+void encode_ack(const Ack& ack, std::string& out);
+
+/*
+ * decode a binary ack. Returns false if the message is malformed
+ */
+bool decode_ack(std::string_view msg, Ack& ack);
+
+/*
+ * append the encoding of a capture preview to out. Arrays are cut to what
+ * fits in a field
+ */
+void encode_preview(const CapturePreview& preview, std::string& out);
+
+/*
+ * decode a capture preview. Returns false if the message is malformed
+ */
+bool decode_preview(std::string_view msg, CapturePreview& preview);
+
+/*
+ * append the encoding of an upload chunk to out
+ */
+void encode_chunk(const UploadChunk& chunk, std::string& out);
+
+/*
+ * decode an upload chunk. chunk.data refers into msg. Returns false if the
+ * message is malformed
+ */
+bool decode_chunk(std::string_view msg, UploadChunk& chunk);
+
+#endif // WIRE_CODEC_HPP
@@ -0,0 +1,19 @@
+#!/usr/bin/env sh
+mqttserv=$1
+pubtop="usrp/command"
+
+# sched=%[^,],period=%lf,count=%u,<capture or sweep request>
+# cancel with: mosquitto_pub -h $mqttserv -t $pubtop -m "cancel=$name"
+tnow=$(date +%s)
+name="sched434"
+period="60"
+count="10"
+fc="433.75e6"
+lo="0"
+sps="1e6"
+ifbw="5e6"
+gain="10"
+trequest=$((tnow+5))
+nsamp="5000000"
+ant="RX2"
+mosquitto_pub -h $mqttserv -t $pubtop -m "sched=$name,period=$period,count=$count,fc=$fc,lo=$lo,sps=$sps,bw=$ifbw,g=$gain,t0=$trequest,n=$nsamp,ant=$ant"
@@ -22,6 +22,5 @@ trequest2=$((tnow+15))
 nsamp2="5000000"
 ant2="RX2"
 
-mosquitto_pub -h $mqttserv -t $pubtop -m "fc=$fc,lo=$lo,sps=$sps,bw=$ifbw,g=$gain,t0=$trequest,n=$nsamp,ant=$ant"
-
-mosquitto_pub -h $mqttserv -t $pubtop -m "fc=$fc2,lo=$lo2,sps=$sps2,bw=$ifbw2,g=$gain2,t0=$trequest2,n=$nsamp2,ant=$ant2"
+# both captures in one message, admitted together with a single ack
+mosquitto_pub -h $mqttserv -t $pubtop -m "fc=$fc,lo=$lo,sps=$sps,bw=$ifbw,g=$gain,t0=$trequest,n=$nsamp,ant=$ant;fc=$fc2,lo=$lo2,sps=$sps2,bw=$ifbw2,g=$gain2,t0=$trequest2,n=$nsamp2,ant=$ant2"
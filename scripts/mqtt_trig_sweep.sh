@@ -0,0 +1,16 @@
+#!/usr/bin/env sh
+mqttserv=$1
+pubtop="usrp/command"
+
+# sweep=%lf:%lf:...,lo=%lf,sps=%lf,bw=%lf,g=%lf,t0=%lf,n=%llu,dwell=%lf,ant=%[^,]
+tnow=$(date +%s)
+fclist="902.3e6:902.5e6:902.7e6:902.9e6:903.1e6:903.3e6:903.5e6:903.7e6"
+lo="0"
+sps="1e6"
+ifbw="5e6"
+gain="10"
+trequest=$((tnow+5))
+nsamp="200000"
+dwell="0.25"
+ant="TX/RX"
+mosquitto_pub -h $mqttserv -t $pubtop -m "sweep=$fclist,lo=$lo,sps=$sps,bw=$ifbw,g=$gain,t0=$trequest,n=$nsamp,dwell=$dwell,ant=$ant"
@@ -0,0 +1,181 @@
+/*
+ * Fuzz target for everything a gateway decodes off the network: text requests
+ * and batches, binary requests, binary acks and upload chunks. Built with -DLIBFUZZER=ON
+ * (clang) it is a libFuzzer target, otherwise main() below runs it over
+ * mutations of a few seed messages so that ctest covers it too.
+ *
+ * Besides not crashing, every request a decoder accepts must only hold finite
+ * numbers, the agenda cannot order or wait for anything else
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "request_parser.hpp"
+#include "wire_codec.hpp"
+#include "ack.hpp"
+
+static void check_finite(const ParsedRequest& r, const char* decoder)
+{
+    // a cancel only carries a name
+    if(r.kind == RequestKind::CANCEL)
+        return;
+    bool finite = std::isfinite(r.req.lo) && std::isfinite(r.req.sps) && std::isfinite(r.req.bw) &&
+                  std::isfinite(r.req.gain) && std::isfinite(r.req.t0) && std::isfinite(r.req.dwell) &&
+                  std::isfinite(r.period) && r.req.nsteps <= MAX_SWEEP_STEPS;
+    for(size_t i = 0; finite && i < r.req.nsteps; i++)
+        finite = std::isfinite(r.req.fc[i]);
+    if(!finite)
+    {
+        fprintf(stderr, "%s accepted a request with a non-finite number\n", decoder);
+        abort();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    const std::string_view msg(reinterpret_cast<const char*>(data), size);
+    ParseStatus status;
+
+    ParsedRequest req;
+    if(parse_request(msg, req, status))
+        check_finite(req, "parse_request");
+
+    std::vector<ParsedRequest> reqs;
+    size_t failed;
+    if(parse_batch(msg, reqs, status, failed))
+    {
+        for(const auto& r : reqs)
+            check_finite(r, "parse_batch");
+    }
+
+    if(decode_requests(msg, reqs, status, failed))
+    {
+        for(const auto& r : reqs)
+            check_finite(r, "decode_requests");
+    }
+
+    // acks carry no schedule, only check that they decode without running off
+    Ack ack;
+    if(decode_ack(msg, ack))
+        ack_text(ack);
+
+    // an upload sink writes a chunk at its offset, it has to lie in the file
+    UploadChunk chunk;
+    if(decode_chunk(msg, chunk) && (chunk.offset > chunk.size || chunk.data.size() > chunk.size - chunk.offset))
+    {
+        fprintf(stderr, "decode_chunk accepted a chunk past the end of its file\n");
+        abort();
+    }
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+static const char* seed_text[] = {
+    "fc=915e6,sps=1e6,t0=1700000000.5,n=1000,id=a,ant=RX2,g=10,bw=2e6,lo=1e6",
+    "sched=s,period=10,count=3,fc=915e6,sps=1e6,t0=1700000000,n=1000",
+    "sweep=900e6:910e6:920e6,dwell=0.1,sps=1e6,t0=1700000000,n=1000",
+    "preempt=p,fc=915e6,sps=1e6,t0=1700000000,n=10",
+    "fc=1e6,sps=1e6,t0=1,n=10;fc=2e6,sps=1e6,t0=2,n=10;cancel=a",
+    "cancel=s",
+};
+
+// tokens the mutator splices in, the ones a number parser has to get right
+static const char* dictionary[] = {"nan", "inf", "-inf", "1e308", "1e-320", "0", "-0", ",", ";", "=", ":", "e", "."};
+
+struct Rng
+{
+    uint64_t s;
+    uint64_t next()
+    {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return s;
+    }
+    size_t below(size_t n) { return n ? size_t(next() % n) : 0; }
+};
+
+// replaces the value of the text field after pos, a bare insert rarely makes a whole number
+static void replace_value(std::string& m, size_t pos, const char* value)
+{
+    const size_t begin = m.find('=', pos);
+    if(begin == std::string::npos)
+        return;
+    const size_t end = m.find_first_of(",;", begin);
+    m.replace(begin + 1, (end == std::string::npos) ? std::string::npos : end - begin - 1, value);
+}
+
+static void mutate(std::string& m, Rng& rng)
+{
+    const size_t edits = 1 + rng.below(4);
+    for(size_t i = 0; i < edits; i++)
+    {
+        const size_t pos = rng.below(m.size() + 1);
+        switch(rng.below(6))
+        {
+            case 0: if(pos < m.size()) m[pos] = char(rng.next()); break;
+            case 1: if(pos < m.size()) m.erase(pos, 1 + rng.below(8)); break;
+            case 2: m.insert(pos, dictionary[rng.below(sizeof(dictionary) / sizeof(dictionary[0]))]); break;
+            case 3: m.resize(pos); break;
+            case 4: m.insert(pos, 1, char(rng.next())); break;
+            case 5: replace_value(m, pos, dictionary[rng.below(sizeof(dictionary) / sizeof(dictionary[0]))]); break;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const unsigned long runs = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 200000;
+
+    std::vector<std::string> seeds(std::begin(seed_text), std::end(seed_text));
+    std::vector<ParsedRequest> reqs;
+    ParseStatus status;
+    size_t failed;
+    for(const char* text : seed_text)
+    {
+        if(parse_batch(text, reqs, status, failed))
+        {
+            std::string bin;
+            encode_requests(reqs, bin);
+            seeds.push_back(bin);
+        }
+    }
+    Ack ack = make_ack(AckCode::REJECTED, "gw");
+    ack.name = "a";
+    ack.t0 = 1700000000.5;
+    ack.earliest = 1700000001.0;
+    ack.reason = "late";
+    ack.files = {"f.dat"};
+    ack.values = {1.0, 2.0};
+    ack.stages.arrived = 1700000000.1;
+    std::string bin;
+    encode_ack(ack, bin);
+    seeds.push_back(bin);
+    UploadChunk chunk;
+    chunk.file = "f.dat";
+    chunk.offset = 4;
+    chunk.size = 8;
+    chunk.data = "data";
+    bin.clear();
+    encode_chunk(chunk, bin);
+    seeds.push_back(bin);
+
+    Rng rng{0x9e3779b97f4a7c15ull};
+    for(unsigned long i = 0; i < runs; i++)
+    {
+        std::string m = seeds[i % seeds.size()];
+        if(i >= seeds.size())
+            mutate(m, rng);
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(m.data()), m.size());
+    }
+    printf("%lu inputs\n", runs);
+    return 0;
+}
+
+#endif // LIBFUZZER
@@ -0,0 +1,115 @@
+/*
+ * A gateway with its MQTT and request threads as in timed_rx_file_mqtt, and
+ * a stand-in for the USRP thread that takes the admitted occurrences out of
+ * the agenda and pretends to capture them: it waits until the capture would
+ * have ended and answers as usrp_ops does. No USRP is involved.
+ */
+
+#ifndef SIM_GATEWAY_HPP
+#define SIM_GATEWAY_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include "protected_queue.hpp"
+#include "ops_helper.hpp"
+#include "time_helper.hpp"
+#include "topics.hpp"
+
+// poll pred until it holds, at most secs
+inline bool wait_until(std::function<bool()> pred, double secs = 5.0)
+{
+    using namespace std::chrono;
+    const steady_clock::time_point tend = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(secs));
+    while(pred() == false)
+    {
+        if(steady_clock::now() >= tend)
+            return false;
+        std::this_thread::sleep_for(milliseconds(5));
+    }
+    return true;
+}
+
+class SimGateway
+{
+    private:
+        static std::string own_topic(const std::string& base, const std::string& id, bool addressed)
+        {
+            return addressed ? gateway_topic(base, id) : base;
+        }
+
+        std::thread mqtt_thread;
+        std::thread request_thread;
+        std::thread device_thread;
+
+        void device()
+        {
+            using namespace std::chrono;
+            AgendaEntry occ;
+            while(agenda.popNext(occ, 0.05))
+            {
+                occ.tdequeued = systime_now_double();
+                const double tend = occ.req.t0 + rx_request_duration(occ.req);
+                while(systime_now_double() < tend && agenda.abortFlag() == false)
+                    std::this_thread::sleep_for(milliseconds(5));
+
+                Ack ack = entry_ack(agenda.abortFlag() ? AckCode::ABORTED : AckCode::SAVED, usrp.client_id, occ);
+                if(ack.code == AckCode::SAVED)
+                    ack.files.push_back(usrp.file_prefix + occ.name + ".dat");
+                send_response(&toNetwork, ack);
+                agenda.finished();
+
+                if(occ.recurring && occ.nextPending(occ.next + 1) == occ.count)
+                {
+                    Ack done = entry_ack(AckCode::SCHED_DONE, usrp.client_id, occ);
+                    done.occurrence = -1;
+                    done.t0 = 0.0;
+                    send_response(&toNetwork, done);
+                }
+            }
+        }
+
+    public:
+        ProtectedQ<NetMsg> toNetwork;
+        ProtectedQ<NetRequest> fromNetwork;
+        MqttParams mqtt;
+        UsrpParams usrp;
+        CaptureAgenda agenda;
+
+        // subtopics as topics.hpp lays them out, addressed to answer on
+        // the gateway's own topics like --topics addressed. persist_dir
+        // empty for a clean session
+        SimGateway(const std::string& server, const std::string& id, const std::vector<std::string>& subtopics,
+                   const std::string& persist_dir = "", bool addressed = false)
+            : toNetwork(), fromNetwork(),
+              mqtt(MqttParams{server, id, own_topic("response", id, addressed), subtopics,
+                              own_topic("status", id, addressed), own_topic("telemetry", id, addressed),
+                              own_topic("preview", id, addressed), true, true, 32, 0, persist_dir}),
+              usrp(UsrpParams()),
+              agenda(AgendaLimits{0.02, 0.01, 0.0, 0.0, 4, "."})
+        {
+            usrp.client_id = id;
+            usrp.file_prefix = "sim_";
+            usrp.tslack = 0.01;
+            usrp.ntpslack = 0.01;
+            usrp.datafmt = "short";
+            mqtt_thread = std::thread(&mqtt_pubsub_ops, &mqtt, &toNetwork, &fromNetwork);
+            request_thread = std::thread(&request_ops, &usrp, &agenda, &toNetwork, &fromNetwork);
+            device_thread = std::thread(&SimGateway::device, this);
+        }
+
+        // shut down like a signal would
+        ~SimGateway()
+        {
+            fromNetwork.close();
+            agenda.close();
+            request_thread.join();
+            device_thread.join();
+            toNetwork.close();
+            mqtt_thread.join();
+        }
+};
+
+#endif // SIM_GATEWAY_HPP
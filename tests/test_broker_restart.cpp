@@ -0,0 +1,142 @@
+/*
+ * A gateway whose broker goes away in the middle of a capture: the capture
+ * still completes, its response reaches the client once the broker is
+ * back, and the gateway takes new requests afterwards
+ */
+
+#define BOOST_TEST_MODULE broker_restart
+#include <boost/test/included/unit_test.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include "sim_gateway.hpp"
+#include "wire_codec.hpp"
+#include "transport.hpp"
+#include "loopback_broker.hpp"
+
+const int QOS = 1;
+
+// client with a persistent session, keeping the binary responses by name
+class Client : public TransportListener
+{
+    private:
+        mutable std::mutex m;
+        std::map<std::string, std::vector<AckCode>> acks;
+        std::unique_ptr<Transport> cli;
+
+        void connected() override {}
+        void connectFailed() override {}
+        void connectionLost(const std::string& cause) override {}
+        void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) override
+        {
+            Ack ack;
+            if(decode_ack(*payload, ack) == false)
+                return;
+            std::lock_guard<std::mutex> lock(m);
+            acks[ack.name].push_back(ack.code);
+        }
+
+    public:
+        explicit Client(const std::string& server)
+        {
+            TransportOptions opts = TransportOptions();
+            opts.clean_session = false;
+            cli = make_transport(server, "client", opts);
+            cli->setListener(this);
+            connect();
+            cli->subscribe("response" + BINARY_TOPIC_SUFFIX, QOS);
+        }
+
+        ~Client() { cli->disconnect(); }
+
+        bool connect() { return cli->connect()->waitFor(std::chrono::seconds(1)) && cli->isConnected(); }
+
+        // a capture of nsamp at 1 Msps starting in lead seconds
+        void request(const std::string& id, double lead, unsigned long nsamp)
+        {
+            const std::string msg = (boost::format("id=%s,t0=%.6lf,fc=915e6,sps=1e6,n=%lu") % id % (systime_now_double() + lead) % nsamp).str();
+            cli->publish("command", msg, QOS, false);
+        }
+
+        std::vector<AckCode> received(const std::string& id) const
+        {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = acks.find(id);
+            return (it == acks.end()) ? std::vector<AckCode>() : it->second;
+        }
+
+        bool got(const std::string& id, AckCode code, double secs = 10.0) const
+        {
+            return wait_until([&]{
+                const std::vector<AckCode> r = received(id);
+                return std::find(r.begin(), r.end(), code) != r.end();
+            }, secs);
+        }
+};
+
+struct PersistDir
+{
+    std::string path;
+    PersistDir() : path((boost::format("/tmp/test_broker_restart_%d") % getpid()).str()) {}
+    ~PersistDir() { boost::filesystem::remove_all(path); }
+};
+
+BOOST_AUTO_TEST_CASE(outage_during_capture)
+{
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create("restart");
+    const std::string server = LOOPBACK_SCHEME + "restart";
+    PersistDir dir;
+    Client client(server);
+    SimGateway gw(server, "gw", {"command"}, dir.path);
+    // the gateway listens once it subscribed, after the client
+    BOOST_TEST_REQUIRE(wait_until([&]{ return broker->stats().subscribes >= 2; }));
+
+    // a 1 s capture, and the broker down from its middle until after it ended
+    client.request("r1", 0.5, 1000000);
+    BOOST_TEST_REQUIRE(client.got("r1", AckCode::ACCEPTED));
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    broker->setOnline(false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    broker->setOnline(true);
+    BOOST_TEST_REQUIRE(client.connect());
+
+    BOOST_TEST(client.got("r1", AckCode::SAVED));
+    BOOST_TEST(client.received("r1").size() == 2u);
+    BOOST_TEST(broker->stats().lost >= 2u);
+
+    // and the gateway goes on taking requests
+    client.request("r2", 0.3, 100000);
+    BOOST_TEST(client.got("r2", AckCode::ACCEPTED));
+    BOOST_TEST(client.got("r2", AckCode::SAVED));
+}
+
+BOOST_AUTO_TEST_CASE(dropped_connection_during_capture)
+{
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create("drop");
+    const std::string server = LOOPBACK_SCHEME + "drop";
+    PersistDir dir;
+    Client client(server);
+    SimGateway gw(server, "gw", {"command"}, dir.path);
+    // the gateway listens once it subscribed, after the client
+    BOOST_TEST_REQUIRE(wait_until([&]{ return broker->stats().subscribes >= 2; }));
+
+    client.request("r1", 0.3, 500000);
+    BOOST_TEST_REQUIRE(client.got("r1", AckCode::ACCEPTED));
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    broker->dropClient("gw");
+    // kept by the broker for the gateway's session until it is back
+    client.request("r2", 2.0, 100000);
+
+    BOOST_TEST(client.got("r1", AckCode::SAVED));
+    BOOST_TEST(client.got("r2", AckCode::ACCEPTED));
+    BOOST_TEST(client.got("r2", AckCode::SAVED));
+    BOOST_TEST(client.received("r1").size() == 2u);
+    BOOST_TEST(client.received("r2").size() == 2u);
+}
@@ -0,0 +1,197 @@
+/*
+ * Admission checks of the capture agenda
+ */
+
+#define BOOST_TEST_MODULE capture_agenda
+#include <boost/test/included/unit_test.hpp>
+#include <string>
+#include "capture_agenda.hpp"
+#include "time_helper.hpp"
+
+// device time of an occurrence is [t0 - setup, t0 + n/sps + END]
+static const double SETUP = 0.2;
+static const double END = 0.05;
+static const double TNOW = 1000.0;
+
+static AgendaLimits limits()
+{
+    return AgendaLimits{SETUP, END, 0.0, 0.0, 4, "/tmp"};
+}
+
+// 0.1 s captures at fc, a schedule if count > 1
+static AgendaEntry entry(const std::string& name, double fc, double t0, double period = 0.0, unsigned count = 1)
+{
+    AgendaEntry e;
+    e.name = name;
+    e.recurring = count > 1;
+    e.req.nsteps = 1;
+    e.req.fc[0] = fc;
+    e.req.lo = 0.0;
+    e.req.sps = 1e6;
+    e.req.bw = 0.0;
+    e.req.gain = 0.0;
+    e.req.set_bw = false;
+    e.req.set_gain = false;
+    e.req.t0 = t0;
+    e.req.dwell = 0.0;
+    e.req.nsamp = 100000;
+    e.period = period;
+    e.count = count;
+    e.next = 0;
+    e.setup_margin = 0.0;
+    e.tarrived = 0.0;
+    e.tdequeued = 0.0;
+    return e;
+}
+
+BOOST_AUTO_TEST_CASE(one_off_conflicts)
+{
+    CaptureAgenda agenda(limits());
+    BOOST_TEST(agenda.admit(entry("a", 915e6, 2000.0), TNOW).ok);
+
+    Admission ret = agenda.admit(entry("b", 915e6, 2000.1), TNOW);
+    BOOST_TEST(ret.ok == false);
+    BOOST_TEST(ret.reason == "busy");
+    BOOST_TEST(ret.earliest == 2000.0 + 0.1 + END + SETUP, boost::test_tools::tolerance(1e-9));
+
+    BOOST_TEST(agenda.admit(entry("b", 915e6, ret.earliest), TNOW).ok);
+    BOOST_TEST(agenda.admit(entry("b", 915e6, 3000.0), TNOW).reason == "exists");
+    BOOST_TEST(agenda.admit(entry("c", 915e6, TNOW + 0.1), TNOW).reason == "late");
+}
+
+// the name of the running capture is taken until it ended
+BOOST_AUTO_TEST_CASE(running_name_exists)
+{
+    CaptureAgenda agenda(limits());
+    const double base = systime_now_double() + 100.0;
+    BOOST_TEST(agenda.admit(entry("run", 915e6, base), TNOW).ok);
+    AgendaEntry occ;
+    BOOST_TEST_REQUIRE(agenda.popNext(occ, 200.0));
+
+    BOOST_TEST(agenda.admit(entry("run", 915e6, base + 10.0), TNOW).reason == "exists");
+    agenda.finished();
+    BOOST_TEST(agenda.admit(entry("run", 915e6, base + 10.0), TNOW).ok);
+    agenda.close();
+}
+
+// the bytes of a request are 2^64 here, which an integer estimate wraps to 0
+BOOST_AUTO_TEST_CASE(huge_request_needs_disk)
+{
+    CaptureAgenda agenda(limits());
+    AgendaEntry e = entry("a", 915e6, 2000.0);
+    e.req.nsamp = 1ull << 62;
+    BOOST_TEST(agenda.admit(e, TNOW).reason == "disk");
+
+    AgendaEntry s = entry("s", 915e6, 2000.0, 1.0, 10000);
+    s.req.nsamp = 1ull << 50;
+    BOOST_TEST(agenda.admit(s, TNOW).reason == "disk");
+}
+
+// admission only looks at the occurrences around the new request, so this
+// has to be quick even for the longest schedule
+BOOST_AUTO_TEST_CASE(long_schedule)
+{
+    CaptureAgenda agenda(limits());
+    BOOST_TEST(agenda.admit(entry("s", 915e6, 2000.0, 1.0, 10000), TNOW).ok);
+
+    // in between two late occurrences
+    BOOST_TEST(agenda.admit(entry("a", 915e6, 2000.0 + 9000.5), TNOW).ok);
+
+    // on one of them
+    Admission ret = agenda.admit(entry("b", 915e6, 2000.0 + 9001.0), TNOW);
+    BOOST_TEST(ret.ok == false);
+    BOOST_TEST(ret.earliest == 2000.0 + 9001.0 + 0.1 + END + SETUP, boost::test_tools::tolerance(1e-6));
+
+    // a capture that fits in no gap until the schedule ends gives up
+    // without a start time rather than walking every occurrence
+    AgendaEntry longer = entry("c", 915e6, 2500.5);
+    longer.req.nsamp = 2000000;
+    ret = agenda.admit(longer, TNOW);
+    BOOST_TEST(ret.ok == false);
+    BOOST_TEST(ret.reason == "busy");
+    BOOST_TEST(ret.earliest == 0.0);
+
+    BOOST_TEST(agenda.deviceIdle(2000.0 + 9500.3, 2000.0 + 9500.7));
+    BOOST_TEST(agenda.deviceIdle(2000.0 + 9500.3, 2000.0 + 9501.0) == false);
+    BOOST_TEST(agenda.deviceIdle(2000.0 + 10000.3, 1e9));
+}
+
+// the shorter margin only applies right after an occurrence on the same
+// frequency, including later occurrences of a schedule
+BOOST_AUTO_TEST_CASE(setup_margins)
+{
+    CaptureAgenda agenda(limits());
+    agenda.setSetupMargins(0.05, 0.5);
+    BOOST_TEST(agenda.admit(entry("s", 915e6, 2000.0, 2.0, 100), TNOW).ok);
+
+    BOOST_TEST(agenda.admit(entry("a", 915e6, 2100.25), TNOW).ok);
+    BOOST_TEST(agenda.admit(entry("b", 433e6, 2120.25), TNOW).ok == false);
+    BOOST_TEST(agenda.admit(entry("b", 433e6, 2120.7), TNOW).ok);
+}
+
+// a preempting request only drops the occurrences of a schedule it overlaps
+BOOST_AUTO_TEST_CASE(preempt_occurrences)
+{
+    CaptureAgenda agenda(limits());
+    BOOST_TEST(agenda.admit(entry("s", 915e6, 2000.0, 1.0, 10), TNOW).ok);
+
+    // 1 s from 2004.5 only overlaps the occurrence at 2005
+    AgendaEntry p = entry("p", 915e6, 2004.5);
+    p.req.nsamp = 1000000;
+    std::vector<AgendaEntry> preempted;
+    BOOST_TEST(agenda.admit(p, TNOW, true, &preempted).ok);
+    BOOST_TEST_REQUIRE(preempted.size() == 1u);
+    BOOST_TEST(preempted[0].name == "s");
+    BOOST_TEST(preempted[0].next == 5u);
+    BOOST_TEST(preempted[0].occurrence(preempted[0].next) == 2005.0);
+    BOOST_TEST(agenda.abortFlag() == false);
+
+    BOOST_TEST(agenda.deviceIdle(2003.9, 2004.0) == false);
+    BOOST_TEST(agenda.deviceIdle(2005.9, 2006.0) == false);
+
+    // the last two go as well, the schedule then ends at 2007
+    AgendaEntry q = entry("q", 915e6, 2008.0);
+    q.req.nsamp = 1500000;
+    preempted.clear();
+    BOOST_TEST(agenda.admit(q, TNOW, true, &preempted).ok);
+    BOOST_TEST(preempted.size() == 2u);
+    BOOST_TEST(agenda.deviceIdle(2006.9, 2007.0) == false);
+}
+
+// nothing is dropped or stopped for a preempting request that does not fit
+BOOST_AUTO_TEST_CASE(preempt_all_or_nothing)
+{
+    CaptureAgenda agenda(limits());
+    const double base = systime_now_double() + 100.0;
+    BOOST_TEST(agenda.admit(entry("run", 915e6, base), TNOW).ok);
+    BOOST_TEST(agenda.admit(entry("s", 915e6, base + 1.0, 1.0, 3), TNOW).ok);
+
+    AgendaEntry occ;
+    BOOST_TEST_REQUIRE(agenda.popNext(occ, 200.0));
+    BOOST_TEST(occ.name == "run");
+    // already stopping, so its device time is taken until it ends
+    BOOST_TEST(agenda.cancel("run"));
+
+    AgendaEntry p = entry("p", 915e6, base + 0.05);
+    p.req.nsamp = 1500000;
+    std::vector<AgendaEntry> preempted;
+    BOOST_TEST(agenda.admit(p, TNOW, true, &preempted).ok == false);
+    BOOST_TEST(preempted.empty());
+    BOOST_TEST(agenda.deviceIdle(base + 0.9, base + 1.0) == false);
+
+    // once it ended, only the first occurrence of s is in the way
+    agenda.finished();
+    BOOST_TEST(agenda.admit(p, TNOW, true, &preempted).ok);
+    BOOST_TEST_REQUIRE(preempted.size() == 1u);
+    BOOST_TEST(preempted[0].next == 0u);
+
+    BOOST_TEST_REQUIRE(agenda.popNext(occ, 200.0));
+    BOOST_TEST(occ.name == "p");
+    agenda.finished();
+    BOOST_TEST_REQUIRE(agenda.popNext(occ, 200.0));
+    BOOST_TEST(occ.name == "s");
+    BOOST_TEST(occ.next == 1u);
+    BOOST_TEST(occ.req.t0 == base + 2.0);
+    BOOST_TEST(occ.nextPending(occ.next + 1) == 2u);
+    agenda.close();
+}
@@ -0,0 +1,130 @@
+/*
+ * The fleet controller against several gateways with simulated devices on
+ * an in-process broker: a common t0, moving it when a gateway is busy, and
+ * gateways that don't answer
+ */
+
+#define BOOST_TEST_MODULE fleet_controller
+#include <boost/test/included/unit_test.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <boost/format.hpp>
+#include "sim_gateway.hpp"
+#include "fleet.hpp"
+#include "topics.hpp"
+#include "loopback_broker.hpp"
+
+// 0.1 s captures, with short timeouts so the cases don't take long
+static FleetParams fleet_params(const std::vector<std::string>& gateways, bool addressed)
+{
+    FleetParams params;
+    params.gateways = gateways;
+    params.cmdtopic = "command";
+    params.resptopic = "response";
+    params.stattopic = "status";
+    params.addressed = addressed;
+    params.group = "";
+    params.request = "fc=915e6,sps=1e6,n=100000";
+    params.name = "fleet";
+    params.lead = 0.2;
+    params.listen = 0.0;
+    params.slack = 0.1;
+    params.attempts = 3;
+    params.answer_timeout = 0.5;
+    params.deadline = 1.0;
+    return params;
+}
+
+// subscriptions of a gateway with addressed topics in groups
+static std::vector<std::string> addressed_topics(const std::string& id, const std::vector<std::string>& groups)
+{
+    std::vector<std::string> topics = {"command", gateway_topic("command", id)};
+    for(const auto& g : groups)
+        topics.push_back(group_topic("command", g));
+    return topics;
+}
+
+struct Controller
+{
+    ProtectedQ<RxAck> acks;
+    AckListener listener;
+    std::unique_ptr<Transport> client;
+
+    explicit Controller(const std::string& server)
+        : listener(&acks), client(connect_ack_client(server, "fleetctl", &listener, std::chrono::seconds(1))) {}
+
+    ~Controller() { client->disconnect(); }
+};
+
+// every gateway captures at the same t0, one that isn't running is
+// reported without holding up the others
+BOOST_AUTO_TEST_CASE(common_t0_shared_topics)
+{
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create("fleet-shared");
+    const std::string server = LOOPBACK_SCHEME + "fleet-shared";
+    SimGateway a(server, "a", {"command"}), b(server, "b", {"command"}), c(server, "c", {"command"});
+    BOOST_TEST_REQUIRE(wait_until([&]{ return broker->stats().subscribes >= 3; }));
+    Controller ctl(server);
+
+    FleetOutcome fleet;
+    BOOST_TEST_REQUIRE(run_fleet(ctl.client.get(), &ctl.acks, fleet_params({"a", "b", "c", "ghost"}, false), fleet));
+    BOOST_TEST(fleet.id == "fleet-1");
+    BOOST_TEST(fleet.nok == 3u);
+    for(const std::string gw : {"a", "b", "c"})
+    {
+        const GatewayResult& r = fleet.results[gw];
+        BOOST_TEST(r.accepted);
+        BOOST_TEST(r.done);
+        BOOST_TEST(r.outcome == "saved");
+        BOOST_TEST(r.file == "sim_" + fleet.id + ".dat");
+    }
+    BOOST_TEST(fleet.results["ghost"].answered == false);
+}
+
+// a gateway that is busy at the first t0 names a later one, which the
+// whole fleet moves to
+BOOST_AUTO_TEST_CASE(busy_gateway_moves_t0)
+{
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create("fleet-busy");
+    const std::string server = LOOPBACK_SCHEME + "fleet-busy";
+    SimGateway a(server, "a", addressed_topics("a", {}), "", true);
+    SimGateway b(server, "b", addressed_topics("b", {}), "", true);
+    SimGateway c(server, "c", addressed_topics("c", {}), "", true);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return broker->stats().subscribes >= 6; }));
+    Controller ctl(server);
+
+    // 1 s on b alone, from right away
+    const double tbusy = systime_now_double() + 0.1;
+    ctl.client->publish(gateway_topic("command", "b"),
+                        (boost::format("id=busy,t0=%.6lf,fc=915e6,sps=1e6,n=1000000") % tbusy).str(), 1, false);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return b.agenda.deviceIdle(tbusy, tbusy + 0.5) == false; }));
+
+    FleetOutcome fleet;
+    BOOST_TEST_REQUIRE(run_fleet(ctl.client.get(), &ctl.acks, fleet_params({"a", "b", "c"}, true), fleet));
+    BOOST_TEST(fleet.id == "fleet-2");
+    BOOST_TEST(fleet.t0 >= tbusy + 1.0);
+    BOOST_TEST(fleet.nok == 3u);
+    for(const std::string gw : {"a", "b", "c"})
+        BOOST_TEST(fleet.results[gw].outcome == "saved");
+}
+
+// a request for a group only reaches the gateways in it
+BOOST_AUTO_TEST_CASE(group_of_gateways)
+{
+    std::shared_ptr<LoopbackBroker> broker = LoopbackBroker::create("fleet-group");
+    const std::string server = LOOPBACK_SCHEME + "fleet-group";
+    SimGateway a(server, "a", addressed_topics("a", {"north"}), "", true);
+    SimGateway b(server, "b", addressed_topics("b", {"north"}), "", true);
+    SimGateway c(server, "c", addressed_topics("c", {"south"}), "", true);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return broker->stats().subscribes >= 9; }));
+    Controller ctl(server);
+
+    FleetParams params = fleet_params({"a", "b"}, true);
+    params.group = "north";
+    FleetOutcome fleet;
+    BOOST_TEST_REQUIRE(run_fleet(ctl.client.get(), &ctl.acks, params, fleet));
+    BOOST_TEST(fleet.nok == 2u);
+    BOOST_TEST(c.agenda.deviceIdle(fleet.t0 - 1.0, fleet.t0 + 1.0));
+}
@@ -0,0 +1,282 @@
+/*
+ * The live sample stream over a Unix socket: the frames a client reads,
+ * clients dropped for falling more than max_queued behind, and clients
+ * that disconnect while the others keep streaming
+ */
+
+#define BOOST_TEST_MODULE live_stream
+#include <boost/test/included/unit_test.hpp>
+#include <complex>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <boost/format.hpp>
+#include "live_stream.hpp"
+
+typedef std::complex<short> samp_type;
+const size_t SPB = 1000;
+
+struct Frame
+{
+    char kind;
+    unsigned long long index;
+    int64_t secs;
+    double frac;
+    double sps;
+    double fc;
+    uint8_t format;
+    uint8_t flags;
+    uint16_t samp_size;
+    std::string payload;
+};
+
+static uint64_t get_uint(const char* p, size_t nbytes)
+{
+    uint64_t v = 0;
+    for(size_t i = 0; i < nbytes; i++)
+        v |= uint64_t(uint8_t(p[i])) << (8 * i);
+    return v;
+}
+
+static double get_f64(const char* p)
+{
+    const uint64_t bits = get_uint(p, 8);
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// samples that tell their index
+static std::vector<samp_type> samples(unsigned long long index, size_t n)
+{
+    std::vector<samp_type> v(n);
+    for(size_t i = 0; i < n; i++)
+        v[i] = samp_type(short((index + i) & 0x7fff), short((index + i) >> 15));
+    return v;
+}
+
+static bool same_samples(const Frame& f)
+{
+    const std::vector<samp_type> v = samples(f.index, f.payload.size() / sizeof(samp_type));
+    return f.payload.size() % sizeof(samp_type) == 0
+        && std::memcmp(f.payload.data(), v.data(), f.payload.size()) == 0;
+}
+
+// a stream on a Unix socket of its own
+struct Stream
+{
+    std::string path;
+    std::unique_ptr<LiveStream> live;
+
+    Stream(size_t max_queued) : path((boost::format("/tmp/test_live_stream_%d.sock") % getpid()).str())
+    {
+        live = make_live_stream("unix:" + path, max_queued);
+        BOOST_TEST_REQUIRE(bool(live));
+    }
+
+    // a client, reads time out after 5 s
+    int connect() const
+    {
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        std::strncpy(sa.sun_path, path.c_str(), sizeof(sa.sun_path) - 1);
+        BOOST_TEST_REQUIRE(::connect(fd, reinterpret_cast<struct sockaddr*>(&sa), sizeof(sa)) == 0);
+        struct timeval tv = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        return fd;
+    }
+};
+
+static bool read_all(int fd, char* buf, size_t n)
+{
+    while(n > 0)
+    {
+        const ssize_t r = ::read(fd, buf, n);
+        if(r <= 0)
+            return false;
+        buf += r;
+        n -= size_t(r);
+    }
+    return true;
+}
+
+// the next frame, false at the end of the stream, on a timeout or if the
+// header is malformed. No checks here, it also runs on a reader thread
+static bool read_frame(int fd, Frame& f)
+{
+    char h[LIVE_HEADER_SIZE];
+    if(read_all(fd, h, sizeof(h)) == false)
+        return false;
+    if(h[0] != 'U' || h[1] != 'L' || h[2] != char(LIVE_VERSION) || get_uint(h + 52, 4) != 0)
+        return false;
+    f.kind = h[3];
+    f.index = get_uint(h + 8, 8);
+    f.secs = int64_t(get_uint(h + 16, 8));
+    f.frac = get_f64(h + 24);
+    f.sps = get_f64(h + 32);
+    f.fc = get_f64(h + 40);
+    f.format = uint8_t(h[48]);
+    f.flags = uint8_t(h[49]);
+    f.samp_size = uint16_t(get_uint(h + 50, 2));
+    f.payload.resize(get_uint(h + 4, 4));
+    return read_all(fd, &f.payload[0], f.payload.size());
+}
+
+static CaptureInfo capture_info(unsigned long long nsamp)
+{
+    return CaptureInfo{"r1", "/tmp/r1.dat", 1000.25, 915e6, 1e6, nsamp, "short", sizeof(samp_type)};
+}
+
+// one buffer as the recv loop hands it over, received into the buffer the
+// stream lends if it does
+static void write_buffer(LiveStream& live, unsigned long long index, size_t n = SPB)
+{
+    const std::vector<samp_type> v = samples(index, n);
+    void* buf = live.recvBuffer(SPB * sizeof(samp_type));
+    if(buf != nullptr)
+        std::memcpy(buf, v.data(), n * sizeof(samp_type));
+    live.write(buf != nullptr ? buf : v.data(), n, index, DeviceTime{1000, 0.25 + index / 1e6});
+}
+
+BOOST_AUTO_TEST_CASE(frames)
+{
+    Stream s(1000000);
+    // nothing to lend without a client
+    s.live->begin(capture_info(3 * SPB));
+    BOOST_TEST(s.live->recvBuffer(SPB * sizeof(samp_type)) == nullptr);
+
+    const int fd = s.connect();
+    Frame f;
+    BOOST_TEST_REQUIRE(read_frame(fd, f));
+    BOOST_TEST(f.kind == 'B');
+    BOOST_TEST(f.index == 3 * SPB);
+    BOOST_TEST(f.secs == 1000);
+    BOOST_TEST(f.frac == 0.25);
+    BOOST_TEST(f.sps == 1e6);
+    BOOST_TEST(f.fc == 915e6);
+    BOOST_TEST(f.format == SAMPLE_SC16);
+    BOOST_TEST(f.samp_size == sizeof(samp_type));
+    std::string body;
+    body += char(2);
+    body += char(0);
+    body += "r1";
+    body += char(11);
+    body += char(0);
+    body += "/tmp/r1.dat";
+    BOOST_TEST(f.payload == body);
+
+    // in place, copied from another buffer, and a short one in place
+    BOOST_TEST(s.live->recvBuffer(SPB * sizeof(samp_type)) != nullptr);
+    write_buffer(*s.live, 0);
+    const std::vector<samp_type> v = samples(SPB, SPB);
+    s.live->write(v.data(), SPB, SPB, DeviceTime{1000, 0.25 + SPB / 1e6});
+    write_buffer(*s.live, 2 * SPB, SPB / 2);
+    s.live->end(false);
+
+    const size_t lens[] = {SPB, SPB, SPB / 2};
+    for(unsigned i = 0; i < 3; i++)
+    {
+        BOOST_TEST_REQUIRE(read_frame(fd, f));
+        BOOST_TEST(f.kind == 'S');
+        BOOST_TEST(f.index == i * SPB);
+        BOOST_TEST(f.secs == 1000);
+        BOOST_TEST(f.frac == 0.25 + i * SPB / 1e6, boost::test_tools::tolerance(1e-12));
+        BOOST_TEST(f.payload.size() == lens[i] * sizeof(samp_type));
+        BOOST_TEST(same_samples(f));
+    }
+    BOOST_TEST_REQUIRE(read_frame(fd, f));
+    BOOST_TEST(f.kind == 'E');
+    BOOST_TEST(f.index == 2 * SPB + SPB / 2);
+    BOOST_TEST(f.flags == 0u);
+    BOOST_TEST(f.payload.empty());
+    ::close(fd);
+}
+
+// a client that doesn't read is dropped once max_queued bytes wait for it,
+// what it got up to then is whole frames in order
+BOOST_AUTO_TEST_CASE(slow_client_dropped)
+{
+    const size_t NBUF = 2000;
+    Stream s(256 * 1024);
+    s.live->begin(capture_info(NBUF * SPB));
+    const int slow = s.connect();
+    Frame f;
+    BOOST_TEST_REQUIRE(read_frame(slow, f));
+    BOOST_TEST(f.kind == 'B');
+
+    for(size_t i = 0; i < NBUF; i++)
+        write_buffer(*s.live, i * SPB);
+    s.live->end(true);
+
+    size_t nframes = 0;
+    unsigned long long next = 0;
+    bool in_order = true;
+    while(read_frame(slow, f))
+    {
+        in_order = in_order && f.kind == 'S' && f.index == next && same_samples(f);
+        next = f.index + SPB;
+        nframes++;
+    }
+    BOOST_TEST(in_order);
+    BOOST_TEST(nframes > 0u);
+    BOOST_TEST(nframes < NBUF);
+    // the stream closed it rather than timing out
+    char c;
+    BOOST_TEST(::read(slow, &c, 1) == 0);
+    ::close(slow);
+}
+
+// a client going away leaves the others streaming. The one left gets every
+// frame intact, while the pool buffers are reused for frame after frame
+BOOST_AUTO_TEST_CASE(client_disconnects)
+{
+    const size_t NBUF = 4000;
+    // room for all of them, however far the reader falls behind
+    Stream s(NBUF * (LIVE_HEADER_SIZE + SPB * sizeof(samp_type)));
+    s.live->begin(capture_info(NBUF * SPB));
+    const int leaving = s.connect();
+    const int staying = s.connect();
+    Frame f;
+    BOOST_TEST_REQUIRE(read_frame(leaving, f));
+    BOOST_TEST_REQUIRE(read_frame(staying, f));
+
+    size_t nframes = 0, nbad = 0;
+    bool ended = false;
+    std::thread reader([&]() {
+        Frame g;
+        unsigned long long next = 0;
+        while(read_frame(staying, g))
+        {
+            if(g.kind == 'E')
+            {
+                ended = (g.index == NBUF * SPB && g.flags == LIVE_FLAG_COMPLETE);
+                break;
+            }
+            nbad += (g.index != next || same_samples(g) == false);
+            next = g.index + SPB;
+            nframes++;
+        }
+    });
+
+    for(size_t i = 0; i < NBUF; i++)
+    {
+        write_buffer(*s.live, i * SPB);
+        if(i == 10)
+            ::close(leaving);
+        if(i % 50 == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    s.live->end(true);
+    reader.join();
+    BOOST_TEST(nframes == NBUF);
+    BOOST_TEST(nbad == 0u);
+    BOOST_TEST(ended);
+    ::close(staying);
+}
@@ -0,0 +1,145 @@
+/*
+ * The gateway's publisher against an in-process broker that holds back or
+ * refuses its acks: window bounds, retries and order of the responses
+ */
+
+#define BOOST_TEST_MODULE mqtt_publisher
+#include <boost/test/included/unit_test.hpp>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <boost/format.hpp>
+#include "sim_gateway.hpp"
+#include "transport.hpp"
+#include "loopback_broker.hpp"
+
+const size_t WINDOW = 4;
+
+// responses as a client subscribed to them sees them
+class Subscriber : public TransportListener
+{
+    private:
+        mutable std::mutex m;
+        std::vector<std::string> msgs;
+
+        void connected() override {}
+        void connectFailed() override {}
+        void connectionLost(const std::string& cause) override {}
+        void messageArrived(const std::string& topic, std::shared_ptr<const std::string> payload) override
+        {
+            // the gateway's goodbye and will
+            if(payload->compare(0, 3, "<<<") == 0)
+                return;
+            std::lock_guard<std::mutex> lock(m);
+            msgs.push_back(*payload);
+        }
+
+    public:
+        std::vector<std::string> received() const
+        {
+            std::lock_guard<std::mutex> lock(m);
+            return msgs;
+        }
+};
+
+// MQTT thread of a gateway and a client subscribed to its responses
+struct Gateway
+{
+    std::shared_ptr<LoopbackBroker> broker;
+    ProtectedQ<NetMsg> toNetwork;
+    ProtectedQ<NetRequest> fromNetwork;
+    MqttParams params;
+    std::thread mqtt_thread;
+    Subscriber sub;
+    std::unique_ptr<Transport> client;
+
+    explicit Gateway(const std::string& name)
+        : broker(LoopbackBroker::create(name))
+    {
+        params = MqttParams{LOOPBACK_SCHEME + name, "gw", "response", {"command"}, "status", "telemetry", "preview",
+                            true, false, WINDOW, 0, ""};
+        client = make_transport(params.server, "sub", TransportOptions());
+        client->setListener(&sub);
+        client->connect()->waitFor(std::chrono::seconds(1));
+        client->subscribe(params.pubtopic, 1);
+        mqtt_thread = std::thread(&mqtt_pubsub_ops, &params, &toNetwork, &fromNetwork);
+        // connected once it announced itself and published its link status
+        BOOST_TEST_REQUIRE(wait_until([this]{ return broker->stats().published >= 2; }));
+    }
+
+    ~Gateway()
+    {
+        broker->holdAcks(false);
+        toNetwork.close();
+        mqtt_thread.join();
+        client->disconnect();
+    }
+
+    // responses m<first> ... as text, in the order they are queued
+    std::vector<std::string> send(size_t n, size_t first = 0)
+    {
+        std::vector<std::string> texts;
+        for(size_t i = first; i < first + n; i++)
+        {
+            Ack ack = make_ack(AckCode::SAVED, params.userid);
+            ack.name = (boost::format("m%lu") % i).str();
+            texts.push_back(ack_text(ack));
+            send_response(&toNetwork, ack);
+        }
+        return texts;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(window_bounds_unacked_publishes)
+{
+    Gateway gw("pub-window");
+    gw.broker->holdAcks(true);
+    const std::vector<std::string> texts = gw.send(20);
+
+    // the window fills up and then nothing more goes out
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.broker->stats().held == WINDOW; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_TEST(gw.broker->stats().held == WINDOW);
+    BOOST_TEST(gw.sub.received().empty());
+
+    gw.broker->holdAcks(false);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.sub.received().size() == texts.size(); }));
+    BOOST_TEST(gw.sub.received() == texts, boost::test_tools::per_element());
+    BOOST_TEST(gw.broker->stats().max_held == WINDOW);
+}
+
+// publishes the broker refuses are sent again, ahead of the newer ones and
+// in the order they were queued
+BOOST_AUTO_TEST_CASE(retries_keep_order)
+{
+    Gateway gw("pub-retry");
+    const unsigned long long before = gw.broker->stats().published;
+    gw.broker->holdAcks(true);
+    const std::vector<std::string> texts = gw.send(10);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.broker->stats().held == WINDOW; }));
+
+    gw.broker->refuseAcks(WINDOW);
+    gw.broker->holdAcks(false);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.sub.received().size() == texts.size(); }));
+    BOOST_TEST(gw.sub.received() == texts, boost::test_tools::per_element());
+    BOOST_TEST(gw.broker->stats().refused == WINDOW);
+    BOOST_TEST(gw.broker->stats().published - before == 10 + WINDOW);
+}
+
+// a publish refused over and over is given up on, the next ones still go out
+BOOST_AUTO_TEST_CASE(gives_up_after_attempts)
+{
+    Gateway gw("pub-give-up");
+    const unsigned long long before = gw.broker->stats().published;
+    gw.broker->refuseAcks(5);
+    gw.send(1);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.broker->stats().refused == 5u; }));
+
+    const std::vector<std::string> texts = gw.send(3, 1);
+    BOOST_TEST_REQUIRE(wait_until([&]{ return gw.sub.received().size() == texts.size(); }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_TEST(gw.sub.received() == texts, boost::test_tools::per_element());
+    BOOST_TEST(gw.broker->stats().published - before == 5u + 3u);
+}
@@ -0,0 +1,140 @@
+/*
+ * Capture previews: the envelope, which block the burst excerpt is taken
+ * from, and how samples and captures the preview did not see are counted
+ */
+
+#define BOOST_TEST_MODULE preview
+#include <boost/test/included/unit_test.hpp>
+#include <complex>
+#include <memory>
+#include <string>
+#include <vector>
+#include "preview.hpp"
+
+typedef std::complex<short> samp_type;
+// 512 envelope points of 100 samples, excerpts are not decimated
+const size_t STEP = 100;
+const unsigned long long NSAMP = PREVIEW_POINTS * STEP;
+
+static CaptureInfo capture_info(const std::string& name)
+{
+    return CaptureInfo{name, "/tmp/" + name + ".dat", 1000.0, 915e6, 1e6, NSAMP, "short", sizeof(samp_type)};
+}
+
+// writes a capture in buffers of len samples, the samples of point p at
+// amplitude amp(p) (full scale 1). skip(index) leaves a buffer out. Up to
+// PREVIEW_POOL buffers the worker sees all of them however slow it is
+template <typename Amp, typename Skip>
+static void write_capture(PreviewStage& stage, const std::string& name, size_t len, Amp amp, Skip skip)
+{
+    stage.begin(capture_info(name));
+    std::vector<samp_type> buf(len);
+    for(unsigned long long index = 0; index < NSAMP; index += len)
+    {
+        const size_t n = size_t(std::min<unsigned long long>(len, NSAMP - index));
+        for(size_t i = 0; i < n; i++)
+            buf[i] = samp_type(short(amp((index + i) / STEP) * 32767), 0);
+        if(skip(index) == false)
+            stage.write(buf.data(), n, index, DeviceTime{1000, 0.0});
+    }
+    stage.end(true);
+}
+
+static bool next_preview(ProtectedQ<NetMsg>& toNetwork, CapturePreview& preview)
+{
+    NetMsg msg;
+    if(toNetwork.popItemFor(msg, std::chrono::seconds(5)) == false)
+        return false;
+    BOOST_TEST((msg.channel == NetChannel::PREVIEW));
+    return decode_preview(msg.payload, preview);
+}
+
+BOOST_AUTO_TEST_CASE(envelope_and_burst)
+{
+    ProtectedQ<NetMsg> toNetwork;
+    PreviewStage stage("gw", &toNetwork);
+    // quiet at 0.1, two loud points of which 300 is the loudest
+    write_capture(stage, "r1", 1000,
+                  [](size_t p) { return p == 300 ? 0.5 : p == 301 ? 0.4 : 0.1; },
+                  [](unsigned long long) { return false; });
+
+    CapturePreview preview;
+    BOOST_TEST_REQUIRE(next_preview(toNetwork, preview));
+    BOOST_TEST(preview.client_id == "gw");
+    BOOST_TEST(preview.name == "r1");
+    BOOST_TEST(preview.nsamp == NSAMP);
+    BOOST_TEST(preview.env_step == STEP);
+    BOOST_TEST(preview.dropped == 0u);
+    BOOST_TEST_REQUIRE(preview.envelope.size() == PREVIEW_POINTS);
+    BOOST_TEST(preview.envelope[0] == 0.1, boost::test_tools::tolerance(1e-3));
+    BOOST_TEST(preview.envelope[299] == 0.1, boost::test_tools::tolerance(1e-3));
+    BOOST_TEST(preview.envelope[300] == 0.5, boost::test_tools::tolerance(1e-3));
+    BOOST_TEST(preview.envelope[301] == 0.4, boost::test_tools::tolerance(1e-3));
+    BOOST_TEST(preview.envelope[PREVIEW_POINTS - 1] == 0.1, boost::test_tools::tolerance(1e-3));
+
+    // the excerpt is the loudest point, I and Q of every sample
+    BOOST_TEST(preview.burst_decim == 1u);
+    BOOST_TEST(preview.burst_index == 300 * STEP);
+    BOOST_TEST_REQUIRE(preview.burst.size() == 2 * STEP);
+    BOOST_TEST(preview.burst[0] == 0.5, boost::test_tools::tolerance(1e-3));
+    BOOST_TEST(preview.burst[1] == 0.0);
+}
+
+// samples write() was not given show as -1 in the envelope. Those before
+// the last one received are counted as dropped, those after it were never
+// received
+BOOST_AUTO_TEST_CASE(skipped_buffers_are_dropped)
+{
+    ProtectedQ<NetMsg> toNetwork;
+    PreviewStage stage("gw", &toNetwork);
+    // points 10 to 19 and the last 2 points are left out
+    write_capture(stage, "r2", 1000,
+                  [](size_t p) { return p == 100 ? 0.8 : 0.2; },
+                  [](unsigned long long index) { return (index >= 1000 && index < 2000) || index >= NSAMP - 200; });
+
+    CapturePreview preview;
+    BOOST_TEST_REQUIRE(next_preview(toNetwork, preview));
+    BOOST_TEST(preview.dropped == 1000u);
+    BOOST_TEST_REQUIRE(preview.envelope.size() == PREVIEW_POINTS);
+    for(size_t p = 0; p < PREVIEW_POINTS; p++)
+    {
+        const bool skipped = (p >= 10 && p < 20) || p >= PREVIEW_POINTS - 2;
+        BOOST_TEST((preview.envelope[p] < 0) == skipped, "point " << p);
+    }
+    BOOST_TEST(preview.burst_index == 100 * STEP);
+}
+
+// every point the preview saw was seen whole, whatever the worker could
+// keep up with, and a capture that couldn't be queued has no preview
+BOOST_AUTO_TEST_CASE(flood_accounting)
+{
+    const unsigned NCAPTURES = 40;
+    ProtectedQ<NetMsg> toNetwork;
+    std::unique_ptr<PreviewStage> stage(new PreviewStage("gw", &toNetwork));
+    for(unsigned c = 0; c < NCAPTURES; c++)
+        write_capture(*stage, "f" + std::to_string(c), STEP,
+                      [](size_t) { return 0.3; },
+                      [](unsigned long long) { return false; });
+    const unsigned long long dropped_captures = stage->droppedCaptures();
+    // waits for the worker to finish what was queued
+    stage.reset();
+
+    unsigned npreviews = 0;
+    NetMsg msg;
+    while(toNetwork.tryPopItem(msg))
+    {
+        CapturePreview preview;
+        BOOST_TEST_REQUIRE(decode_preview(msg.payload, preview));
+        size_t unseen = 0;
+        for(float e : preview.envelope)
+        {
+            if(e < 0)
+                unseen++;
+            else
+                BOOST_TEST(e == 0.3, boost::test_tools::tolerance(1e-3));
+        }
+        BOOST_TEST(preview.dropped == unseen * STEP);
+        npreviews++;
+    }
+    BOOST_TEST(npreviews + dropped_captures == NCAPTURES);
+}
@@ -0,0 +1,197 @@
+/*
+ * Request parser and the binary wire decoding
+ */
+
+#define BOOST_TEST_MODULE request_parser
+#include <boost/test/included/unit_test.hpp>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include "request_parser.hpp"
+#include "wire_codec.hpp"
+
+static bool parses(const std::string& msg, ParsedRequest& out, ParseStatus& status)
+{
+    return parse_request(msg, out, status);
+}
+
+static void check_rejected(const std::string& msg, ParseError err, const std::string& key)
+{
+    ParsedRequest out;
+    ParseStatus status;
+    BOOST_TEST_CONTEXT(msg)
+    {
+        BOOST_TEST(parses(msg, out, status) == false);
+        BOOST_TEST(int(status.err) == int(err));
+        BOOST_TEST(std::string(status.key) == key);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(capture_in_any_order)
+{
+    ParsedRequest out;
+    ParseStatus status;
+    BOOST_TEST(parses("n=1000,t0=1700000000.5,sps=1e6,fc=915e6,ant=RX2", out, status));
+    BOOST_TEST(int(out.kind) == int(RequestKind::CAPTURE));
+    BOOST_TEST(out.req.nsteps == 1u);
+    BOOST_TEST(out.req.fc[0] == 915e6);
+    BOOST_TEST(out.req.sps == 1e6);
+    BOOST_TEST(out.req.t0 == 1700000000.5);
+    BOOST_TEST(out.req.nsamp == 1000u);
+    BOOST_TEST(std::string(out.ant) == "RX2");
+    BOOST_TEST(out.req.set_gain == false);
+}
+
+BOOST_AUTO_TEST_CASE(schedule_and_sweep)
+{
+    ParsedRequest out;
+    ParseStatus status;
+    BOOST_TEST(parses("sched=s,period=10,count=3,fc=915e6,sps=1e6,t0=1700000000,n=1000", out, status));
+    BOOST_TEST(int(out.kind) == int(RequestKind::SCHEDULE));
+    BOOST_TEST(out.count == 3u);
+    BOOST_TEST(parses("sweep=900e6:910e6:920e6,dwell=0.1,sps=1e6,t0=1700000000,n=1000", out, status));
+    BOOST_TEST(out.req.nsteps == 3u);
+    BOOST_TEST(out.req.fc[2] == 920e6);
+}
+
+BOOST_AUTO_TEST_CASE(schedule_bounds)
+{
+    ParsedRequest out;
+    ParseStatus status;
+    BOOST_TEST(parses("sched=s,period=1,count=10000,fc=915e6,sps=1e6,t0=1700000000,n=1000", out, status));
+    check_rejected("sched=s,period=1,count=10001,fc=915e6,sps=1e6,t0=1700000000,n=1000", ParseError::OUT_OF_RANGE, "count");
+    check_rejected("sched=s,period=1,count=0,fc=915e6,sps=1e6,t0=1700000000,n=1000", ParseError::OUT_OF_RANGE, "count");
+    check_rejected("sched=s,period=1e305,count=10000,fc=915e6,sps=1e6,t0=1700000000,n=1000", ParseError::OUT_OF_RANGE, "period");
+}
+
+BOOST_AUTO_TEST_CASE(malformed)
+{
+    check_rejected("", ParseError::EMPTY, "");
+    check_rejected("fc=915e6,sps=1e6,t0=1,n=10,fc=1", ParseError::DUPLICATE_KEY, "fc");
+    check_rejected("fc=915e6,sps=1e6,t0=1,freq=10", ParseError::UNKNOWN_KEY, "freq");
+    check_rejected("fc=915e6,sps=1e6,t0=1", ParseError::MISSING_KEY, "n");
+    check_rejected("fc=915e6,sps=0,t0=1,n=10", ParseError::OUT_OF_RANGE, "sps");
+    check_rejected("fc=915e6,sps=1e6,t0=1,n=10x", ParseError::BAD_VALUE, "n");
+}
+
+// from_chars takes these, and every comparison against NaN is false
+BOOST_AUTO_TEST_CASE(non_finite_numbers)
+{
+    const std::string base = "fc=915e6,sps=1e6,t0=1700000000,n=10";
+    for(const char* v : {"nan", "inf", "-inf", "NaN", "infinity"})
+    {
+        const std::string val(v);
+        check_rejected("fc=" + val + ",sps=1e6,t0=1700000000,n=10", ParseError::BAD_VALUE, "fc");
+        check_rejected("fc=915e6,sps=" + val + ",t0=1700000000,n=10", ParseError::BAD_VALUE, "sps");
+        check_rejected("fc=915e6,sps=1e6,t0=" + val + ",n=10", ParseError::BAD_VALUE, "t0");
+        check_rejected(base + ",lo=" + val, ParseError::BAD_VALUE, "lo");
+        check_rejected(base + ",bw=" + val, ParseError::BAD_VALUE, "bw");
+        check_rejected(base + ",g=" + val, ParseError::BAD_VALUE, "g");
+        check_rejected("sweep=900e6:" + val + ",dwell=0.1,sps=1e6,t0=1700000000,n=10", ParseError::BAD_VALUE, "sweep");
+        check_rejected("sweep=900e6:910e6,dwell=" + val + ",sps=1e6,t0=1700000000,n=10", ParseError::BAD_VALUE, "dwell");
+        check_rejected("sched=s,period=" + val + ",count=2," + base, ParseError::BAD_VALUE, "period");
+    }
+    // the example from the report
+    check_rejected("fc=915e6,sps=nan,t0=nan,n=10", ParseError::BAD_VALUE, "sps");
+}
+
+BOOST_AUTO_TEST_CASE(non_finite_binary)
+{
+    ParsedRequest r;
+    ParseStatus status;
+    BOOST_TEST_REQUIRE(parses("fc=915e6,sps=1e6,t0=1700000000,n=10,id=a", r, status));
+
+    std::vector<ParsedRequest> out;
+    size_t failed;
+    std::string bin;
+    encode_requests({r}, bin);
+    BOOST_TEST(decode_requests(bin, out, status, failed));
+
+    const double bad[] = {std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity()};
+    for(double v : bad)
+    {
+        ParsedRequest p = r;
+        p.req.t0 = v;
+        bin.clear();
+        encode_requests({r, p}, bin);
+        BOOST_TEST(decode_requests(bin, out, status, failed) == false);
+        BOOST_TEST(int(status.err) == int(ParseError::BAD_VALUE));
+        BOOST_TEST(std::string(status.key) == "t0");
+        BOOST_TEST(failed == 1u);
+
+        p = r;
+        p.req.sps = v;
+        bin.clear();
+        encode_requests({p}, bin);
+        BOOST_TEST(decode_requests(bin, out, status, failed) == false);
+        BOOST_TEST(std::string(status.key) == "sps");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(batch)
+{
+    std::vector<ParsedRequest> out;
+    ParseStatus status;
+    size_t failed;
+    BOOST_TEST(parse_batch("fc=1e6,sps=1e6,t0=1,n=10;fc=2e6,sps=1e6,t0=2,n=10;", out, status, failed));
+    BOOST_TEST(out.size() == 2u);
+    BOOST_TEST(parse_batch("fc=1e6,sps=1e6,t0=1,n=10;fc=2e6,sps=inf,t0=2,n=10", out, status, failed) == false);
+    BOOST_TEST(failed == 1u);
+    BOOST_TEST(parse_batch("fc=1e6,sps=1e6,t0=1,n=10;cancel=a", out, status, failed) == false);
+
+    ParsedRequest r;
+    std::string bin;
+    BOOST_TEST_REQUIRE(parses("fc=915e6,sps=1e6,t0=1700000000,n=10", r, status));
+    encode_requests({r}, bin);
+    BOOST_TEST(is_binary_batch(bin) == false);
+    bin.clear();
+    encode_requests({r, r}, bin);
+    BOOST_TEST(is_binary_batch(bin));
+    BOOST_TEST(is_binary_batch(bin.substr(0, 3)) == false);
+    BOOST_TEST(is_binary_batch("fc=1e6;fc=2e6") == false);
+}
+
+// offsets and sizes off the wire are 64 bit, a chunk must lie within its
+// file even where offset + length wraps
+BOOST_AUTO_TEST_CASE(upload_chunks)
+{
+    const std::string payload(100, 'x');
+    UploadChunk chunk;
+    chunk.file = "a.dat";
+    chunk.offset = 900;
+    chunk.size = 1000;
+    chunk.data = payload;
+    std::string bin;
+    encode_chunk(chunk, bin);
+    UploadChunk out;
+    BOOST_TEST_REQUIRE(decode_chunk(bin, out));
+    BOOST_TEST(out.file == "a.dat");
+    BOOST_TEST(out.data == payload);
+    BOOST_TEST(out.last());
+
+    chunk.offset = 800;
+    bin.clear();
+    encode_chunk(chunk, bin);
+    BOOST_TEST_REQUIRE(decode_chunk(bin, out));
+    BOOST_TEST(out.last() == false);
+
+    const uint64_t wraps[][2] = {{901, 1000}, {1001, 1000}, {UINT64_MAX - 50, 1000}, {UINT64_MAX - 50, UINT64_MAX}};
+    for(const auto& w : wraps)
+    {
+        chunk.offset = w[0];
+        chunk.size = w[1];
+        bin.clear();
+        encode_chunk(chunk, bin);
+        BOOST_TEST_CONTEXT(w[0] << " of " << w[1])
+            BOOST_TEST(decode_chunk(bin, out) == false);
+    }
+
+    // the end of a file of the largest size, and one built past its end
+    chunk.offset = UINT64_MAX - 50;
+    chunk.size = UINT64_MAX;
+    BOOST_TEST(chunk.last());
+    chunk.size = 1000;
+    BOOST_TEST(chunk.last());
+}
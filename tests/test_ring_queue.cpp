@@ -0,0 +1,236 @@
+/*
+ * RingQ: order and counts with one and several producers under contention,
+ * the full and empty boundaries over many laps of the ring, blocked
+ * producers and consumers waking up, timeouts and close()
+ */
+
+#define BOOST_TEST_MODULE ring_queue
+#include <boost/test/included/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ring_queue.hpp"
+
+using namespace std::chrono;
+
+// producer p's i-th item
+static uint64_t item(unsigned p, uint64_t i)
+{
+    return (uint64_t(p) << 40) | i;
+}
+
+static double secs_since(steady_clock::time_point t)
+{
+    return duration<double>(steady_clock::now() - t).count();
+}
+
+BOOST_AUTO_TEST_CASE(spsc_order)
+{
+    const uint64_t N = 1000000;
+    RingQ<uint64_t> q(64);
+    std::thread producer([&]() {
+        for(uint64_t i = 0; i < N; i++)
+            q.addItem(i);
+    });
+    uint64_t wrong = 0;
+    for(uint64_t i = 0; i < N; i++)
+        wrong += (q.popItem() != i);
+    producer.join();
+    BOOST_TEST(wrong == 0u);
+    BOOST_TEST(q.size() == 0u);
+}
+
+// every item arrives exactly once, each producer's in the order pushed
+BOOST_AUTO_TEST_CASE(mpsc_order_and_count)
+{
+    const unsigned NPROD = 4;
+    const uint64_t N = 250000;
+    RingQ<uint64_t, true> q(64);
+    std::vector<std::thread> producers;
+    for(unsigned p = 0; p < NPROD; p++)
+    {
+        producers.emplace_back([&q, p, N]() {
+            for(uint64_t i = 0; i < N; i++)
+            {
+                // half of them spin on the non-blocking push
+                uint64_t v = item(p, i);
+                if(i % 2 == 0)
+                    q.addItem(v);
+                else
+                    while(q.tryAddItem(v) == false)
+                        std::this_thread::yield();
+            }
+        });
+    }
+    std::vector<uint64_t> next(NPROD, 0);
+    uint64_t wrong = 0;
+    for(uint64_t n = 0; n < NPROD * N; n++)
+    {
+        const uint64_t v = q.popItem();
+        const unsigned p = unsigned(v >> 40);
+        if(p >= NPROD || (v & ((uint64_t(1) << 40) - 1)) != next[p])
+        {
+            wrong++;
+            continue;
+        }
+        next[p]++;
+    }
+    for(auto& t : producers)
+        t.join();
+    BOOST_TEST(wrong == 0u);
+    for(unsigned p = 0; p < NPROD; p++)
+        BOOST_TEST(next[p] == N);
+    uint64_t extra;
+    BOOST_TEST(q.tryPopItem(extra) == false);
+}
+
+BOOST_AUTO_TEST_CASE(full_and_empty_over_laps)
+{
+    RingQ<std::unique_ptr<int>> q(3);
+    BOOST_TEST(q.capacity() == 4u);
+    std::unique_ptr<int> v;
+    BOOST_TEST(q.tryPopItem(v) == false);
+
+    int next_in = 0, next_out = 0;
+    for(unsigned lap = 0; lap < 100; lap++)
+    {
+        // fill it up, the item that doesn't fit stays with the caller
+        while(q.size() < q.capacity())
+        {
+            std::unique_ptr<int> in(new int(next_in++));
+            BOOST_TEST_REQUIRE(q.tryAddItem(in));
+            BOOST_TEST(!in);
+        }
+        std::unique_ptr<int> in(new int(next_in));
+        BOOST_TEST(q.tryAddItem(in) == false);
+        BOOST_TEST_REQUIRE(bool(in));
+        BOOST_TEST(*in == next_in);
+
+        // take out 1 to 4 items, so the ends meet at every slot
+        const unsigned ntake = 1 + lap % 4;
+        for(unsigned i = 0; i < ntake; i++)
+        {
+            BOOST_TEST_REQUIRE(q.tryPopItem(v));
+            BOOST_TEST(*v == next_out++);
+        }
+        BOOST_TEST(q.size() == q.capacity() - ntake);
+    }
+    while(q.tryPopItem(v))
+        BOOST_TEST(*v == next_out++);
+    BOOST_TEST(next_out == next_in);
+    BOOST_TEST(q.size() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(blocked_consumer_wakes)
+{
+    RingQ<int> q(4);
+    std::atomic<bool> done(false);
+    int got = -1;
+    const auto t0 = steady_clock::now();
+    std::thread consumer([&]() {
+        got = q.popItem();
+        done = true;
+    });
+    std::this_thread::sleep_for(milliseconds(50));
+    BOOST_TEST(done == false);
+    q.addItem(7);
+    consumer.join();
+    BOOST_TEST(got == 7);
+    BOOST_TEST(secs_since(t0) >= 0.05);
+}
+
+// a producer waiting on a full queue is let go once it is half empty
+BOOST_AUTO_TEST_CASE(blocked_producer_wakes)
+{
+    RingQ<int> q(4);
+    for(int i = 0; i < 4; i++)
+        q.addItem(i);
+    std::atomic<bool> done(false);
+    bool added = false;
+    std::thread producer([&]() {
+        added = q.addItem(4);
+        done = true;
+    });
+    std::this_thread::sleep_for(milliseconds(50));
+    BOOST_TEST(done == false);
+    BOOST_TEST(q.popItem() == 0);
+    BOOST_TEST(q.popItem() == 1);
+    producer.join();
+    BOOST_TEST(added);
+    for(int i = 2; i <= 4; i++)
+        BOOST_TEST(q.popItem() == i);
+}
+
+BOOST_AUTO_TEST_CASE(pop_timeout)
+{
+    RingQ<int> q(4);
+    int v = -1;
+    auto t0 = steady_clock::now();
+    BOOST_TEST(q.popItemFor(v, milliseconds(30)) == false);
+    BOOST_TEST(secs_since(t0) >= 0.03);
+
+    q.addItem(1);
+    t0 = steady_clock::now();
+    BOOST_TEST(q.popItemFor(v, seconds(5)));
+    BOOST_TEST(v == 1);
+    BOOST_TEST(secs_since(t0) < 1.0);
+
+    // an item showing up while it waits
+    std::thread producer([&]() {
+        std::this_thread::sleep_for(milliseconds(30));
+        q.addItem(2);
+    });
+    t0 = steady_clock::now();
+    BOOST_TEST(q.popItemFor(v, seconds(5)));
+    producer.join();
+    BOOST_TEST(v == 2);
+    BOOST_TEST(secs_since(t0) < 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(close_wakes_consumer)
+{
+    RingQ<std::string> q(4);
+    std::string v;
+    bool got = true;
+    std::thread consumer([&]() { got = q.popItem(v); });
+    std::this_thread::sleep_for(milliseconds(30));
+    q.close();
+    consumer.join();
+    BOOST_TEST(got == false);
+    BOOST_TEST(q.isClosed());
+
+    const auto t0 = steady_clock::now();
+    BOOST_TEST(q.popItemFor(v, seconds(5)) == false);
+    BOOST_TEST(secs_since(t0) < 1.0);
+    BOOST_TEST(q.popItem() == "");
+}
+
+// items queued before close() can still be taken, nothing can be added
+BOOST_AUTO_TEST_CASE(close_keeps_queued_items)
+{
+    RingQ<std::string, true> q(2);
+    q.addItem("a");
+    q.addItem("b");
+    std::atomic<bool> done(false);
+    bool added = true;
+    std::thread producer([&]() {
+        added = q.addItem("c");
+        done = true;
+    });
+    std::this_thread::sleep_for(milliseconds(30));
+    BOOST_TEST(done == false);
+    q.close();
+    producer.join();
+    BOOST_TEST(added == false);
+
+    std::string v = "x";
+    BOOST_TEST(q.tryAddItem(v) == false);
+    BOOST_TEST(v == "x");
+    BOOST_TEST(q.popItem() == "a");
+    BOOST_TEST(q.popItemFor(v, seconds(5)));
+    BOOST_TEST(v == "b");
+    BOOST_TEST(q.popItem(v) == false);
+}
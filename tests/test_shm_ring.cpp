@@ -0,0 +1,176 @@
+/*
+ * The shared memory ring from both ends: what a ShmRingReader sees of the
+ * captures a ShmRing publishes, when the writer laps it and when a slot is
+ * overwritten while the reader uses it
+ */
+
+#define BOOST_TEST_MODULE shm_ring
+#include <boost/test/included/unit_test.hpp>
+#include <complex>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include "shm_ring.hpp"
+
+typedef std::complex<short> samp_type;
+const size_t NSLOTS = 8;
+const size_t SPB = 64;     // samples per slot
+
+// a ring of NSLOTS slots of SPB samples and a reader following it
+struct Ring
+{
+    std::string name;
+    std::unique_ptr<ShmRing> writer;
+    std::unique_ptr<ShmRingReader> reader;
+
+    Ring() : name((boost::format("test_shm_ring_%d") % getpid()).str())
+    {
+        writer = make_shm_ring(name, NSLOTS, SPB * sizeof(samp_type), "short");
+        BOOST_TEST_REQUIRE(bool(writer));
+        reader = ShmRingReader::open(name);
+        BOOST_TEST_REQUIRE(bool(reader));
+    }
+};
+
+static CaptureInfo capture_info(unsigned long long nsamp)
+{
+    return CaptureInfo{"r1", "/tmp/r1.dat", 1000.0, 915e6, 1e6, nsamp, "short", sizeof(samp_type)};
+}
+
+// samples that tell their index
+static std::vector<samp_type> samples(unsigned long long index, size_t n)
+{
+    std::vector<samp_type> v(n);
+    for(size_t i = 0; i < n; i++)
+    {
+        const short x = short((index + i) & 0x7fff);
+        v[i] = samp_type(x, short(-x));
+    }
+    return v;
+}
+
+// one buffer received into the slot the ring lends
+static void recv_in_place(ShmRing& ring, unsigned long long index)
+{
+    void* buf = ring.recvBuffer(SPB * sizeof(samp_type));
+    BOOST_TEST_REQUIRE(buf != nullptr);
+    const std::vector<samp_type> v = samples(index, SPB);
+    std::memcpy(buf, v.data(), SPB * sizeof(samp_type));
+    ring.write(buf, SPB, index, DeviceTime{1000, index / 1e6});
+}
+
+static bool same_samples(const ShmBlock& b)
+{
+    const std::vector<samp_type> v = samples(b.index, b.nsamps);
+    return std::memcmp(b.samples, v.data(), b.nsamps * sizeof(samp_type)) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+    Ring r;
+    BOOST_TEST(r.reader->header().nslots == NSLOTS);
+    BOOST_TEST(r.reader->header().samp_size == sizeof(samp_type));
+    ShmBlock b;
+    BOOST_TEST(r.reader->next(b) == false);
+
+    // two buffers in place, then one from another buffer over two slots
+    const unsigned long long nsamp = 4 * SPB;
+    r.writer->begin(capture_info(nsamp));
+    recv_in_place(*r.writer, 0);
+    recv_in_place(*r.writer, SPB);
+    const std::vector<samp_type> big = samples(2 * SPB, 2 * SPB);
+    r.writer->write(big.data(), big.size(), 2 * SPB, DeviceTime{1000, 2 * SPB / 1e6});
+    r.writer->end(true);
+
+    uint64_t capture;
+    CaptureInfo info;
+    BOOST_TEST_REQUIRE(r.reader->currentCapture(capture, info));
+    BOOST_TEST(capture == 1u);
+    BOOST_TEST(info.name == "r1");
+    BOOST_TEST(info.nsamp == nsamp);
+
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.seq == 0u);
+    BOOST_TEST(b.flags == SHM_FIRST);
+    BOOST_TEST(b.nsamps == 0u);
+    for(unsigned i = 0; i < 4; i++)
+    {
+        BOOST_TEST_REQUIRE(r.reader->next(b));
+        BOOST_TEST(b.seq == i + 1);
+        BOOST_TEST(b.capture == 1u);
+        BOOST_TEST(b.flags == 0u);
+        BOOST_TEST(b.index == i * SPB);
+        BOOST_TEST(b.nsamps == SPB);
+        BOOST_TEST(b.fc == 915e6);
+        BOOST_TEST(b.t.real() == 1000.0 + i * SPB / 1e6, boost::test_tools::tolerance(1e-9));
+        BOOST_TEST(same_samples(b));
+        BOOST_TEST(r.reader->stillValid(b));
+    }
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.flags == (SHM_LAST | SHM_COMPLETE));
+    BOOST_TEST(b.index == nsamp);
+    BOOST_TEST(r.reader->next(b) == false);
+    BOOST_TEST(r.reader->lost() == 0u);
+}
+
+// a reader more than the ring behind gets the last NSLOTS blocks
+BOOST_AUTO_TEST_CASE(reader_lapped)
+{
+    Ring r;
+    r.writer->begin(capture_info(20 * SPB));
+    for(unsigned i = 0; i < 20; i++)
+        recv_in_place(*r.writer, i * SPB);
+
+    // 21 blocks published, the first 13 are gone
+    ShmBlock b;
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.seq == 21u - NSLOTS);
+    BOOST_TEST(r.reader->lost() == 21u - NSLOTS);
+    BOOST_TEST(b.index == (b.seq - 1) * SPB);
+    BOOST_TEST(same_samples(b));
+    unsigned n = 1;
+    while(r.reader->next(b))
+    {
+        BOOST_TEST(same_samples(b));
+        n++;
+    }
+    BOOST_TEST(n == NSLOTS);
+    BOOST_TEST(b.seq == 20u);
+
+    // and keeps up from there
+    r.writer->end(false);
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.flags == SHM_LAST);
+    BOOST_TEST(b.index == 20 * SPB);
+    BOOST_TEST(r.reader->lost() == 21u - NSLOTS);
+}
+
+// the writer takes a slot over while the reader still uses the block in it
+BOOST_AUTO_TEST_CASE(torn_read)
+{
+    Ring r;
+    r.writer->begin(capture_info(100 * SPB));
+    for(unsigned i = 0; i < NSLOTS - 1; i++)
+        recv_in_place(*r.writer, i * SPB);
+
+    // the ring is full, lending the next buffer claims the slot of block 0
+    ShmBlock b;
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.seq == 0u);
+    BOOST_TEST(r.reader->stillValid(b));
+    BOOST_TEST_REQUIRE(r.writer->recvBuffer(SPB * sizeof(samp_type)) != nullptr);
+    BOOST_TEST(r.reader->stillValid(b) == false);
+    recv_in_place(*r.writer, (NSLOTS - 1) * SPB);
+    BOOST_TEST(r.reader->stillValid(b) == false);
+
+    // a block being written over when the reader gets to it is skipped
+    BOOST_TEST_REQUIRE(r.writer->recvBuffer(SPB * sizeof(samp_type)) != nullptr);
+    BOOST_TEST_REQUIRE(r.reader->next(b));
+    BOOST_TEST(b.seq == 2u);
+    BOOST_TEST(r.reader->lost() == 1u);
+    BOOST_TEST(same_samples(b));
+    BOOST_TEST(r.reader->stillValid(b));
+}
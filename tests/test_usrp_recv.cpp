@@ -0,0 +1,182 @@
+/*
+ * The recv loops of timed_rx_file_mqtt against a streamer that plays back a
+ * script of buffers and errors: how a capture and a sweep end, and that the
+ * streamer is stopped and drained whenever they end early
+ */
+
+#define BOOST_TEST_MODULE usrp_recv
+#include <boost/test/included/unit_test.hpp>
+#include <complex>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include "usrp_recv.hpp"
+
+typedef std::complex<short> samp_type;
+const size_t SPB = 500;
+const unsigned long long NSAMP = 1000;
+
+class ScriptedStream
+{
+    public:
+        struct Event
+        {
+            size_t nsamps;
+            uhd::rx_metadata_t::error_code_t error;
+        };
+        std::deque<Event> script;
+        std::vector<uhd::stream_cmd_t> cmds;
+        size_t nrecv = 0;
+
+        void issue_stream_cmd(const uhd::stream_cmd_t& cmd) { cmds.push_back(cmd); }
+
+        // the next event of the script, a timeout once it ran out
+        size_t recv(void* buff, size_t nsamps, uhd::rx_metadata_t& md, double timeout, bool one_packet = false)
+        {
+            nrecv++;
+            md = uhd::rx_metadata_t();
+            if(script.empty())
+            {
+                md.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+                return 0;
+            }
+            const Event e = script.front();
+            script.pop_front();
+            md.error_code = e.error;
+            md.time_spec = uhd::time_spec_t(1000.0);
+            return std::min(e.nsamps, nsamps);
+        }
+
+        void data(size_t n) { script.push_back(Event{n, uhd::rx_metadata_t::ERROR_CODE_NONE}); }
+        void error(uhd::rx_metadata_t::error_code_t code) { script.push_back(Event{0, code}); }
+};
+
+class ScriptedUsrp
+{
+    public:
+        std::shared_ptr<ScriptedStream> stream = std::make_shared<ScriptedStream>();
+        std::vector<double> tunes;
+
+        std::shared_ptr<ScriptedStream> get_rx_stream(const uhd::stream_args_t& args) { return stream; }
+        double get_rx_rate(size_t channel) const { return 1e6; }
+        void set_command_time(const uhd::time_spec_t& t) {}
+        void clear_command_time() {}
+        void set_rx_freq(const uhd::tune_request_t& req, size_t channel) { tunes.push_back(req.target_freq); }
+};
+
+class RecordingSink : public CaptureSink
+{
+    public:
+        unsigned begins = 0;
+        std::vector<bool> ends;
+
+        void begin(const CaptureInfo& info) override { begins++; }
+        void write(const void* samples, size_t nsamps, unsigned long long index, const DeviceTime& tdev) override {}
+        void end(bool ok) override { ends.push_back(ok); }
+};
+
+struct TempDir
+{
+    std::string path;
+    TempDir() : path((boost::format("/tmp/test_usrp_recv_%d") % getpid()).str()) { boost::filesystem::create_directories(path); }
+    ~TempDir() { boost::filesystem::remove_all(path); }
+};
+
+static CaptureInfo capture_info()
+{
+    return CaptureInfo{"r", "", 0.0, 915e6, 1e6, NSAMP, "short", 0};
+}
+
+static bool capture(ScriptedUsrp& usrp, const std::string& file, RecordingSink& sink, CaptureStats& cstats)
+{
+    std::atomic<bool> abort(false);
+    SetupTimings timings = SetupTimings();
+    return timed_recv_to_file<samp_type>(&usrp, "sc16", "sc16", 0, file, SPB, NSAMP,
+                                         systime_now_double(), 1.0, abort, timings, {&sink}, capture_info(), cstats);
+}
+
+BOOST_AUTO_TEST_CASE(complete_capture)
+{
+    TempDir dir;
+    ScriptedUsrp usrp;
+    usrp.stream->data(SPB);
+    usrp.stream->data(SPB);
+    RecordingSink sink;
+    CaptureStats cstats;
+    BOOST_TEST(capture(usrp, dir.path + "/a.dat", sink, cstats));
+
+    BOOST_TEST(cstats.received == NSAMP);
+    BOOST_TEST(cstats.error.empty());
+    BOOST_TEST(boost::filesystem::file_size(dir.path + "/a.dat") == NSAMP * sizeof(samp_type));
+    BOOST_TEST_REQUIRE(usrp.stream->cmds.size() == 2u);
+    BOOST_TEST(usrp.stream->cmds.back().stream_mode == uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+    // nothing left to drain
+    BOOST_TEST(usrp.stream->nrecv == 2u);
+    BOOST_TEST(sink.ends == std::vector<bool>({true}), boost::test_tools::per_element());
+}
+
+// a receiver error ends the capture like an overflow: the stream is stopped
+// at once and what was still in flight is dropped
+BOOST_AUTO_TEST_CASE(receiver_error_ends_capture)
+{
+    TempDir dir;
+    ScriptedUsrp usrp;
+    usrp.stream->data(SPB);
+    usrp.stream->error(uhd::rx_metadata_t::ERROR_CODE_BAD_PACKET);
+    usrp.stream->data(SPB);
+    RecordingSink sink;
+    CaptureStats cstats;
+    BOOST_TEST(capture(usrp, dir.path + "/a.dat", sink, cstats) == false);
+
+    BOOST_TEST(cstats.error.find("Receiver error") == 0u);
+    BOOST_TEST(cstats.received == SPB);
+    BOOST_TEST(boost::filesystem::file_size(dir.path + "/a.dat") == SPB * sizeof(samp_type));
+    BOOST_TEST_REQUIRE(usrp.stream->cmds.size() == 2u);
+    BOOST_TEST(usrp.stream->cmds.back().stream_mode == uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+    BOOST_TEST(usrp.stream->cmds.back().stream_now);
+    BOOST_TEST(usrp.stream->script.empty());
+    BOOST_TEST(sink.ends == std::vector<bool>({false}), boost::test_tools::per_element());
+}
+
+// a receiver error in a step removes its file, skips the steps after it and
+// drains what the next step's queued stream command brought in
+BOOST_AUTO_TEST_CASE(receiver_error_ends_sweep)
+{
+    TempDir dir;
+    ScriptedUsrp usrp;
+    usrp.stream->data(SPB);
+    usrp.stream->data(SPB);
+    usrp.stream->data(SPB);
+    usrp.stream->error(uhd::rx_metadata_t::ERROR_CODE_BAD_PACKET);
+    usrp.stream->data(SPB);
+    usrp.stream->data(SPB);
+    const std::vector<std::string> files = {dir.path + "/s0.dat", dir.path + "/s1.dat", dir.path + "/s2.dat"};
+    const double freqs[] = {915e6, 916e6, 917e6};
+    std::atomic<bool> abort(false);
+    SetupTimings timings = SetupTimings();
+    RecordingSink sink;
+    std::vector<CaptureStats> step_stats;
+    const size_t nsaved = timed_sweep_to_files<samp_type>(&usrp, "sc16", "sc16", 0, files, SPB, NSAMP, freqs, 0.0, 1e6,
+                                                          systime_now_double(), 0.01, 1.0, false, abort, false,
+                                                          timings, {&sink}, capture_info(), step_stats);
+
+    BOOST_TEST(nsaved == 1u);
+    BOOST_TEST(boost::filesystem::file_size(files[0]) == NSAMP * sizeof(samp_type));
+    BOOST_TEST(boost::filesystem::exists(files[1]) == false);
+    BOOST_TEST(boost::filesystem::exists(files[2]) == false);
+    BOOST_TEST_REQUIRE(step_stats.size() == 2u);
+    BOOST_TEST(step_stats[0].error.empty());
+    BOOST_TEST(step_stats[1].error.find("Receiver error") == 0u);
+    BOOST_TEST(step_stats[1].received == SPB);
+
+    // three steps queued, then the stop
+    BOOST_TEST_REQUIRE(usrp.stream->cmds.size() == 4u);
+    BOOST_TEST(usrp.stream->cmds.back().stream_mode == uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+    BOOST_TEST(usrp.tunes.size() == 2u);
+    BOOST_TEST(usrp.stream->script.empty());
+    BOOST_TEST(sink.ends == std::vector<bool>({true, false}), boost::test_tools::per_element());
+}